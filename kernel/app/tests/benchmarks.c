@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <app/tests.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
 #include <kernel/thread.h>
 #include <platform.h>
 #include <arch/ops.h>
@@ -158,6 +160,137 @@ __NO_INLINE static void bench_memcpy(void)
     free(buf);
 }
 
+// Total number of bytes moved for each size in the sweep below.  Kept small
+// enough that the 32 bit cycle counter does not wrap on slow paths.
+#define SIZE_SWEEP_BYTES (16u * 1024 * 1024)
+#define SIZE_SWEEP_MIN 8u
+#define SIZE_SWEEP_MAX (1024u * 1024)
+
+__NO_INLINE static void bench_memcpy_sizes(void)
+{
+    uint8_t *src = memalign(PAGE_SIZE, SIZE_SWEEP_MAX);
+    uint8_t *dst = memalign(PAGE_SIZE, SIZE_SWEEP_MAX);
+    if (!src || !dst) {
+        printf("failed to allocate buffers\n");
+        goto out;
+    }
+    memset(src, 0x5a, SIZE_SWEEP_MAX);
+
+    for (size_t size = SIZE_SWEEP_MIN; size <= SIZE_SWEEP_MAX; size <<= 1) {
+        uint iter = SIZE_SWEEP_BYTES / size;
+
+        uint count = arch_cycle_count();
+        for (uint i = 0; i < iter; i++) {
+            memcpy(dst, src, size);
+        }
+        count = arch_cycle_count() - count;
+
+        uint64_t bytes_cycle = (SIZE_SWEEP_BYTES * 1000ULL) / count;
+        printf("memcpy %7zu bytes x %7u: %10u cycles, %llu.%03llu bytes/cycle\n",
+               size, iter, count, bytes_cycle / 1000, bytes_cycle % 1000);
+    }
+
+out:
+    free(src);
+    free(dst);
+}
+
+__NO_INLINE static void bench_memset_sizes(void)
+{
+    uint8_t *buf = memalign(PAGE_SIZE, SIZE_SWEEP_MAX);
+    if (!buf) {
+        printf("failed to allocate buffer\n");
+        return;
+    }
+
+    for (size_t size = SIZE_SWEEP_MIN; size <= SIZE_SWEEP_MAX; size <<= 1) {
+        uint iter = SIZE_SWEEP_BYTES / size;
+
+        uint count = arch_cycle_count();
+        for (uint i = 0; i < iter; i++) {
+            memset(buf, 0, size);
+        }
+        count = arch_cycle_count() - count;
+
+        uint64_t bytes_cycle = (SIZE_SWEEP_BYTES * 1000ULL) / count;
+        printf("memset %7zu bytes x %7u: %10u cycles, %llu.%03llu bytes/cycle\n",
+               size, iter, count, bytes_cycle / 1000, bytes_cycle % 1000);
+    }
+
+    free(buf);
+}
+
+/* contend on a mutex with a short critical section from one thread per cpu */
+#define MUTEX_BENCH_THREADS 4
+#define MUTEX_BENCH_ITER 100000
+
+static mutex_t bench_mutex = MUTEX_INITIAL_VALUE(bench_mutex);
+static volatile int bench_mutex_go;
+static uint64_t bench_mutex_counter;
+
+static int bench_mutex_thread(void *arg)
+{
+    while (!bench_mutex_go)
+        arch_spinloop_pause();
+
+    for (uint i = 0; i < MUTEX_BENCH_ITER; i++) {
+        mutex_acquire(&bench_mutex);
+        bench_mutex_counter++;
+        for (int j = 0; j < 16; j++)
+            arch_spinloop_pause();
+        mutex_release(&bench_mutex);
+    }
+    return 0;
+}
+
+static ulong bench_context_switches(void)
+{
+    ulong total = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        total += thread_stats[i].context_switches;
+    return total;
+}
+
+__NO_INLINE static void bench_mutex_contention(bool spin)
+{
+    thread_t *threads[MUTEX_BENCH_THREADS];
+    uint count = 0;
+
+    mp_cpu_mask_t online = mp_get_online_mask();
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS && count < MUTEX_BENCH_THREADS; cpu++) {
+        if (!(online & (1u << cpu)))
+            continue;
+        threads[count] = thread_create("mutex bench", bench_mutex_thread, NULL,
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[count], cpu);
+        count++;
+    }
+
+    bool saved_spin = mutex_spin_enabled;
+    mutex_spin_enabled = spin;
+    bench_mutex_go = 0;
+    bench_mutex_counter = 0;
+
+    for (uint i = 0; i < count; i++)
+        thread_resume(threads[i]);
+
+    ulong switches = bench_context_switches();
+    lk_bigtime_t t = current_time_hires();
+    bench_mutex_go = 1;
+    for (uint i = 0; i < count; i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    t = current_time_hires() - t;
+    switches = bench_context_switches() - switches;
+
+    mutex_spin_enabled = saved_spin;
+
+    uint64_t ops = (uint64_t)count * MUTEX_BENCH_ITER;
+    printf("mutex %s: %u threads, %llu acquisitions in %llu us, %llu ns/op, %lu context switches\n",
+           spin ? "spin " : "block", count, ops, t / 1000, t / ops, switches);
+    if (bench_mutex_counter != ops)
+        printf("counter mismatch %llu\n", bench_mutex_counter);
+}
+
 #if WITH_LIB_LIBM && !WITH_NO_FP
 #include <math.h>
 
@@ -219,3 +352,14 @@ void benchmarks(void)
 #endif
 }
 
+void copy_benchmarks(void)
+{
+    bench_memcpy_sizes();
+    bench_memset_sizes();
+}
+
+void mutex_benchmarks(void)
+{
+    bench_mutex_contention(false);
+    bench_mutex_contention(true);
+}
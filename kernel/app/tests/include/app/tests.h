@@ -20,6 +20,8 @@ void printf_tests(void);
 void clock_tests(void);
 void timer_tests(void);
 void benchmarks(void);
+void copy_benchmarks(void);
+void mutex_benchmarks(void);
 int fibo(int argc, const cmd_args *argv);
 int spinner(int argc, const cmd_args *argv);
 int ref_counted_tests(int argc, const cmd_args *argv);
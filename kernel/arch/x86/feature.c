@@ -23,6 +23,8 @@ uint32_t max_ext_cpuid = 0;
 
 enum x86_vendor_list x86_vendor;
 
+bool x86_use_erms;
+
 static struct x86_model_info model_info;
 
 static int initialized = 0;
@@ -95,6 +97,9 @@ void x86_feature_init(void)
             model_info.display_model += BITS_SHIFT(leaf->a, 19, 16) << 4;
         }
     }
+
+    /* select the bulk copy strategy used by memcpy/memset and user copies */
+    x86_use_erms = x86_feature_test(X86_FEATURE_ERMS);
 }
 
 bool x86_get_cpuid_subleaf(
@@ -156,6 +161,7 @@ void x86_feature_debug(void)
         { X86_FEATURE_TSC_ADJUST, "tsc_adj" },
         { X86_FEATURE_SMEP, "smep" },
         { X86_FEATURE_SMAP, "smap" },
+        { X86_FEATURE_ERMS, "erms" },
         { X86_FEATURE_RDRAND, "rdrand" },
         { X86_FEATURE_RDSEED, "rdseed" },
         { X86_FEATURE_PKU, "pku" },
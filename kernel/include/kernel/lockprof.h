@@ -0,0 +1,62 @@
+// Copyright 2017 The Fuchsia Authors
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <magenta/compiler.h>
+#include <arch/spinlock.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* Lock contention profiling.
+ *
+ * While enabled, every mutex and spinlock acquisition is attributed to the
+ * code address it was made from (its "site") and counted, along with whether
+ * it had to wait, how long it waited and how long the lock was then held.
+ * While disabled the only cost is a load and a predicted branch in
+ * spin_lock()/spin_unlock() and mutex_acquire()/mutex_release().
+ */
+
+enum lockprof_type {
+    LOCKPROF_TYPE_MUTEX     = 1,
+    LOCKPROF_TYPE_SPINLOCK  = 2,
+};
+
+typedef struct lockprof_stats {
+    uintptr_t site;
+    uint32_t type;
+    uint64_t acquisitions;
+    uint64_t contentions;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t total_hold_ns;
+    uint64_t max_hold_ns;
+} lockprof_stats_t;
+
+extern volatile int lockprof_enabled;
+
+void lockprof_start(void);
+void lockprof_stop(void);
+
+/* Clear all collected statistics.  Fails with ERR_BAD_STATE while profiling
+ * is running. */
+status_t lockprof_reset(void);
+
+/* Copy out the statistics for the index'th site slot.  Returns false if the
+ * slot is empty.  Slots run from 0 to lockprof_max_sites() - 1. */
+bool lockprof_get_site(size_t index, lockprof_stats_t *stats);
+size_t lockprof_max_sites(void);
+
+/* Hooks called from the lock implementations, do not call directly. */
+void lockprof_spin_lock(spin_lock_t *lock);
+void lockprof_spin_unlock(spin_lock_t *lock);
+void lockprof_record_acquire(uintptr_t site, uint32_t type, bool contended, lk_bigtime_t wait);
+void lockprof_record_hold(uintptr_t site, uint32_t type, lk_bigtime_t hold);
+
+__END_CDECLS
@@ -22,16 +22,23 @@ __BEGIN_CDECLS;
 typedef struct TA_CAP("mutex") mutex {
     uint32_t magic;
     thread_t *holder;
+    uint holder_cpu; /* cpu the holder acquired the mutex on */
     int count;
     wait_queue_t wait;
+    /* only maintained while lock profiling is enabled */
+    uintptr_t lockprof_site;
+    lk_bigtime_t lockprof_acquire_time;
 } mutex_t;
 
 #define MUTEX_INITIAL_VALUE(m) \
 { \
     .magic = MUTEX_MAGIC, \
     .holder = NULL, \
+    .holder_cpu = 0, \
     .count = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+    .lockprof_site = 0, \
+    .lockprof_acquire_time = 0, \
 }
 
 /* Rules for Mutexes:
@@ -39,6 +46,14 @@ typedef struct TA_CAP("mutex") mutex {
  * - Mutexes are non-recursive.
 */
 
+/* If a mutex is contended while its holder is running on another cpu,
+ * mutex_acquire() spins for up to this long waiting for it to be released
+ * before blocking. */
+#define MUTEX_SPIN_MAX_NS (50 * 1000)
+
+/* adaptive spinning can be switched off, mostly for benchmarking */
+extern bool mutex_spin_enabled;
+
 void mutex_init(mutex_t *);
 void mutex_destroy(mutex_t *);
 status_t mutex_acquire(mutex_t *m) TA_ACQ(m);
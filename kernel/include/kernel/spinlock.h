@@ -10,12 +10,17 @@
 #include <magenta/compiler.h>
 #include <magenta/thread_annotations.h>
 #include <arch/spinlock.h>
+#include <kernel/lockprof.h>
 
 __BEGIN_CDECLS
 
 /* interrupts should already be disabled */
 static inline void spin_lock(spin_lock_t *lock)
 {
+    if (unlikely(lockprof_enabled)) {
+        lockprof_spin_lock(lock);
+        return;
+    }
     arch_spin_lock(lock);
 }
 
@@ -28,6 +33,10 @@ static inline int spin_trylock(spin_lock_t *lock)
 /* interrupts should already be disabled */
 static inline void spin_unlock(spin_lock_t *lock)
 {
+    if (unlikely(lockprof_enabled)) {
+        lockprof_spin_unlock(lock);
+        return;
+    }
     arch_spin_unlock(lock);
 }
 
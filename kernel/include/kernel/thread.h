@@ -240,6 +240,17 @@ void set_current_thread(thread_t *);
 /* the idle thread(s) (statically allocated) */
 extern thread_t idle_threads[SMP_MAX_CPUS];
 
+/* the thread each cpu is running right now, updated on every context switch.
+ * Meant for lockless peeking (e.g. is a lock owner still on a cpu), the
+ * pointer may be stale by the time it is looked at and must not be
+ * dereferenced without holding the thread lock. */
+extern thread_t * volatile cpu_running_thread[SMP_MAX_CPUS];
+
+static inline bool thread_running_on_cpu(const thread_t *t, uint cpu)
+{
+    return cpu < SMP_MAX_CPUS && cpu_running_thread[cpu] == t;
+}
+
 /* scheduler lock */
 extern spin_lock_t thread_lock;
 
@@ -0,0 +1,309 @@
+// Copyright 2017 The Fuchsia Authors
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#include <kernel/lockprof.h>
+
+#include <assert.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <magenta/atomic.h>
+#include <kernel/spinlock.h>
+#include <platform.h>
+
+// Everything in here runs from inside spin_lock()/spin_unlock(), so it must
+// not take any lock itself.  Statistics live in a fixed size open addressed
+// table keyed by acquisition site; slots are claimed with compare-and-swap
+// and counters are updated with atomics.
+
+#define LOCKPROF_MAX_SITES 1024u
+#define LOCKPROF_HELD_DEPTH 8u
+
+static_assert((LOCKPROF_MAX_SITES & (LOCKPROF_MAX_SITES - 1)) == 0, "must be power of two");
+
+struct lockprof_site {
+    volatile uint64_t site;
+    volatile int type;
+    volatile uint64_t acquisitions;
+    volatile uint64_t contentions;
+    volatile uint64_t total_wait_ns;
+    volatile uint64_t max_wait_ns;
+    volatile uint64_t total_hold_ns;
+    volatile uint64_t max_hold_ns;
+};
+
+static struct lockprof_site sites[LOCKPROF_MAX_SITES];
+
+// number of acquisitions that could not be recorded because the table was full
+static volatile uint64_t dropped;
+
+// Spinlocks have no room to remember when they were taken, so each cpu
+// keeps a small stack of the spinlocks it currently holds.
+struct lockprof_held {
+    uint depth;
+    struct {
+        spin_lock_t *lock;
+        uintptr_t site;
+        lk_bigtime_t acquire_time;
+    } locks[LOCKPROF_HELD_DEPTH];
+} __CPU_ALIGN;
+
+static struct lockprof_held held[SMP_MAX_CPUS];
+
+volatile int lockprof_enabled;
+
+static struct lockprof_site *lockprof_find_site(uintptr_t site, uint32_t type)
+{
+    // fold the address down, code addresses share most of their high bits
+    uint32_t hash = (uint32_t)((site >> 2) ^ (site >> 14)) * 0x9E3779B1u;
+
+    for (uint i = 0; i < LOCKPROF_MAX_SITES; i++) {
+        struct lockprof_site *s = &sites[(hash + i) & (LOCKPROF_MAX_SITES - 1)];
+
+        uint64_t cur = atomic_load_u64(&s->site);
+        if (cur == site)
+            return s;
+
+        if (cur == 0) {
+            if (atomic_cmpxchg_u64(&s->site, &cur, site)) {
+                atomic_store(&s->type, (int)type);
+                return s;
+            }
+            // somebody else claimed it, maybe for the same site
+            if (cur == site)
+                return s;
+        }
+    }
+
+    atomic_add_u64(&dropped, 1);
+    return NULL;
+}
+
+static void lockprof_update_max(volatile uint64_t *max, uint64_t val)
+{
+    uint64_t cur = atomic_load_u64(max);
+    while (val > cur) {
+        if (atomic_cmpxchg_u64(max, &cur, val))
+            break;
+    }
+}
+
+void lockprof_record_acquire(uintptr_t site, uint32_t type, bool contended, lk_bigtime_t wait)
+{
+    struct lockprof_site *s = lockprof_find_site(site, type);
+    if (!s)
+        return;
+
+    atomic_add_u64(&s->acquisitions, 1);
+    if (contended) {
+        atomic_add_u64(&s->contentions, 1);
+        atomic_add_u64(&s->total_wait_ns, wait);
+        lockprof_update_max(&s->max_wait_ns, wait);
+    }
+}
+
+void lockprof_record_hold(uintptr_t site, uint32_t type, lk_bigtime_t hold)
+{
+    struct lockprof_site *s = lockprof_find_site(site, type);
+    if (!s)
+        return;
+
+    atomic_add_u64(&s->total_hold_ns, hold);
+    lockprof_update_max(&s->max_hold_ns, hold);
+}
+
+__NO_INLINE void lockprof_spin_lock(spin_lock_t *lock)
+{
+    // we are called straight from the inlined spin_lock(), so our return
+    // address is the acquisition site
+    uintptr_t site = (uintptr_t)__builtin_return_address(0);
+
+    lk_bigtime_t wait = 0;
+    bool contended = false;
+    if (arch_spin_trylock(lock)) {
+        contended = true;
+        lk_bigtime_t start = current_time_hires();
+        arch_spin_lock(lock);
+        wait = current_time_hires() - start;
+    }
+
+    lockprof_record_acquire(site, LOCKPROF_TYPE_SPINLOCK, contended, wait);
+
+    // callers should already have interrupts off, but not all do
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct lockprof_held *h = &held[arch_curr_cpu_num()];
+    if (h->depth < LOCKPROF_HELD_DEPTH) {
+        h->locks[h->depth].lock = lock;
+        h->locks[h->depth].site = site;
+        h->locks[h->depth].acquire_time = current_time_hires();
+        h->depth++;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+__NO_INLINE void lockprof_spin_unlock(spin_lock_t *lock)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    // Locks are usually released in reverse order, so search from the top.
+    // A lock taken before profiling started or on another cpu (by a caller
+    // that did not disable interrupts) is not found and just not timed.
+    struct lockprof_held *h = &held[arch_curr_cpu_num()];
+    for (uint i = h->depth; i > 0; i--) {
+        if (h->locks[i - 1].lock == lock) {
+            lockprof_record_hold(h->locks[i - 1].site, LOCKPROF_TYPE_SPINLOCK,
+                                 current_time_hires() - h->locks[i - 1].acquire_time);
+            memmove(&h->locks[i - 1], &h->locks[i], (h->depth - i) * sizeof(h->locks[0]));
+            h->depth--;
+            break;
+        }
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    arch_spin_unlock(lock);
+}
+
+void lockprof_start(void)
+{
+    atomic_store(&lockprof_enabled, 1);
+}
+
+void lockprof_stop(void)
+{
+    atomic_store(&lockprof_enabled, 0);
+}
+
+status_t lockprof_reset(void)
+{
+    if (atomic_load(&lockprof_enabled))
+        return ERR_BAD_STATE;
+
+    memset((void *)sites, 0, sizeof(sites));
+    atomic_store_u64(&dropped, 0);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        held[i].depth = 0;
+    }
+    return NO_ERROR;
+}
+
+size_t lockprof_max_sites(void)
+{
+    return LOCKPROF_MAX_SITES;
+}
+
+bool lockprof_get_site(size_t index, lockprof_stats_t *stats)
+{
+    if (index >= LOCKPROF_MAX_SITES)
+        return false;
+
+    struct lockprof_site *s = &sites[index];
+    uint64_t site = atomic_load_u64(&s->site);
+    if (site == 0)
+        return false;
+
+    stats->site = (uintptr_t)site;
+    stats->type = (uint32_t)atomic_load(&s->type);
+    stats->acquisitions = atomic_load_u64(&s->acquisitions);
+    stats->contentions = atomic_load_u64(&s->contentions);
+    stats->total_wait_ns = atomic_load_u64(&s->total_wait_ns);
+    stats->max_wait_ns = atomic_load_u64(&s->max_wait_ns);
+    stats->total_hold_ns = atomic_load_u64(&s->total_hold_ns);
+    stats->max_hold_ns = atomic_load_u64(&s->max_hold_ns);
+    return true;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int lockprof_compare(const void *a, const void *b)
+{
+    const lockprof_stats_t *sa = a;
+    const lockprof_stats_t *sb = b;
+
+    // most total wait first
+    if (sa->total_wait_ns != sb->total_wait_ns)
+        return (sa->total_wait_ns < sb->total_wait_ns) ? 1 : -1;
+    if (sa->contentions != sb->contentions)
+        return (sa->contentions < sb->contentions) ? 1 : -1;
+    return 0;
+}
+
+static void lockprof_dump(size_t max)
+{
+    lockprof_stats_t *stats = malloc(LOCKPROF_MAX_SITES * sizeof(*stats));
+    if (!stats) {
+        printf("out of memory\n");
+        return;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < LOCKPROF_MAX_SITES; i++) {
+        if (lockprof_get_site(i, &stats[count]))
+            count++;
+    }
+    qsort(stats, count, sizeof(*stats), lockprof_compare);
+
+    printf("%18s %4s %12s %12s %14s %12s %14s %12s\n",
+           "site", "type", "acquired", "contended", "wait ns", "max wait", "hold ns", "max hold");
+    for (size_t i = 0; i < count && i < max; i++) {
+        const lockprof_stats_t *s = &stats[i];
+        printf("%#18" PRIxPTR " %4s %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12" PRIu64
+               " %14" PRIu64 " %12" PRIu64 "\n",
+               s->site, (s->type == LOCKPROF_TYPE_MUTEX) ? "mtx" : "spin",
+               s->acquisitions, s->contentions, s->total_wait_ns, s->max_wait_ns,
+               s->total_hold_ns, s->max_hold_ns);
+    }
+    printf("%zu sites, %" PRIu64 " acquisitions dropped (table full)\n",
+           count, atomic_load_u64(&dropped));
+
+    free(stats);
+}
+
+static int cmd_lockprof(int argc, const cmd_args *argv, uint32_t flags)
+{
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s start       : start recording lock statistics\n", argv[0].str);
+        printf("%s stop        : stop recording\n", argv[0].str);
+        printf("%s reset       : clear statistics (while stopped)\n", argv[0].str);
+        printf("%s dump [n]    : show the n most contended sites\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "start")) {
+        lockprof_start();
+    } else if (!strcmp(argv[1].str, "stop")) {
+        lockprof_stop();
+    } else if (!strcmp(argv[1].str, "reset")) {
+        if (lockprof_reset() != NO_ERROR) {
+            printf("stop profiling first\n");
+            return ERR_BAD_STATE;
+        }
+    } else if (!strcmp(argv[1].str, "dump")) {
+        lockprof_dump((argc > 2) ? argv[2].u : 20);
+    } else {
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("lockprof", "lock contention profiling", &cmd_lockprof)
+STATIC_COMMAND_END(lockprof);
+
+#endif // WITH_LIB_CONSOLE
@@ -20,6 +20,7 @@
 #include <kernel/mutex.h>
 #include <kernel/spinlock.h>
 #include <kernel/timer.h>
+#include <lib/dpc.h>
 
 #define LOCAL_TRACE 0
 
@@ -310,8 +311,10 @@ status_t mp_unplug_cpu(uint cpu_id) {
         status = event_wait(&unplug_done);
     } while (status < 0);
 
-    /* Now that the CPU is no longer processing tasks, move all of its timers */
+    /* Now that the CPU is no longer processing tasks, move all of its timers
+     * and pending dpcs */
     timer_transition_off_cpu(cpu_id);
+    dpc_transition_off_cpu(cpu_id);
 
     status = platform_mp_cpu_unplug(cpu_id);
     if (status != NO_ERROR) {
@@ -19,7 +19,11 @@
 #include <debug.h>
 #include <assert.h>
 #include <err.h>
+#include <kernel/lockprof.h>
 #include <kernel/thread.h>
+#include <platform.h>
+
+bool mutex_spin_enabled = true;
 
 /**
  * @brief  Initialize a mutex_t
@@ -73,10 +77,49 @@ status_t mutex_acquire_internal(mutex_t *m) TA_NO_THREAD_SAFETY_ANALYSIS
     }
 
     m->holder = get_current_thread();
+    m->holder_cpu = arch_curr_cpu_num();
 
     return NO_ERROR;
 }
 
+/* Spin while the mutex is held by a thread that is running on another cpu,
+ * on the theory that it will release it sooner than it would take us to
+ * block and be woken up again.  Only spins while nobody is queued on the
+ * mutex, since a release with waiters hands it straight to one of them.
+ * Returns once the mutex looks free or spinning stops looking worthwhile;
+ * the caller still has to acquire it the normal way.
+ */
+static void mutex_spin(mutex_t *m)
+{
+    lk_bigtime_t deadline = 0;
+
+    for (;;) {
+        if (__atomic_load_n(&m->count, __ATOMIC_RELAXED) != 1)
+            return;
+
+        thread_t *holder = __atomic_load_n(&m->holder, __ATOMIC_RELAXED);
+        uint holder_cpu = __atomic_load_n(&m->holder_cpu, __ATOMIC_RELAXED);
+
+        /* released, or in the middle of being handed over */
+        if (holder == NULL)
+            return;
+
+        /* the holder is blocked or preempted, we may be waiting a while */
+        if (!thread_running_on_cpu(holder, holder_cpu))
+            return;
+
+        /* only look at the clock every so often */
+        if (deadline == 0) {
+            deadline = current_time_hires() + MUTEX_SPIN_MAX_NS;
+        } else if (current_time_hires() > deadline) {
+            return;
+        }
+
+        for (int i = 0; i < 32; i++)
+            arch_spinloop_pause();
+    }
+}
+
 /**
  * @brief  Acquire the mutex
  *
@@ -93,9 +136,29 @@ status_t mutex_acquire(mutex_t *m)
               get_current_thread(), get_current_thread()->name, m);
 #endif
 
+    uintptr_t site = 0;
+    lk_bigtime_t start = 0;
+    bool profile = unlikely(lockprof_enabled);
+    if (profile) {
+        site = (uintptr_t)__builtin_return_address(0);
+        start = current_time_hires();
+    }
+
+    bool contended = unlikely(__atomic_load_n(&m->count, __ATOMIC_RELAXED) > 0);
+    if (contended && mutex_spin_enabled)
+        mutex_spin(m);
+
     THREAD_LOCK(state);
+    contended = contended || (m->count > 0);
     status_t ret = mutex_acquire_internal(m);
     THREAD_UNLOCK(state);
+
+    if (profile) {
+        lk_bigtime_t now = current_time_hires();
+        lockprof_record_acquire(site, LOCKPROF_TYPE_MUTEX, contended, contended ? now - start : 0);
+        m->lockprof_site = site;
+        m->lockprof_acquire_time = now;
+    }
     return ret;
 }
 
@@ -107,6 +170,13 @@ void mutex_release_internal(mutex_t *m, bool reschedule) TA_NO_THREAD_SAFETY_ANA
 
     m->holder = 0;
 
+    /* only set if the mutex was taken with mutex_acquire() while profiling */
+    if (unlikely(m->lockprof_acquire_time != 0)) {
+        lockprof_record_hold(m->lockprof_site, LOCKPROF_TYPE_MUTEX,
+                             current_time_hires() - m->lockprof_acquire_time);
+        m->lockprof_acquire_time = 0;
+    }
+
     if (unlikely(--m->count >= 1)) {
         /* release a thread */
         wait_queue_wake_one(&m->wait, reschedule, NO_ERROR);
@@ -11,6 +11,7 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
 	lib/debug \
+	lib/dpc \
 	lib/heap \
 	lib/libc \
 	lib/mxtl \
@@ -20,6 +21,7 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
 	$(LOCAL_DIR)/init.c \
+	$(LOCAL_DIR)/lockprof.c \
 	$(LOCAL_DIR)/mutex.c \
 	$(LOCAL_DIR)/sched.c \
 	$(LOCAL_DIR)/thread.c \
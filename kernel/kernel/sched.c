@@ -59,12 +59,18 @@ static mp_cpu_mask_t find_cpu(thread_t *t)
 #if BROADCAST_RESCHEDULE
     return MP_CPU_ALL_BUT_LOCAL;
 #elif WITH_SMP
-    /* get the last cpu the thread ran on */
-    mp_cpu_mask_t last_ran_cpu_mask = (1u << thread_last_cpu(t));
-
     /* the current cpu */
     mp_cpu_mask_t curr_cpu_mask = (1u << arch_curr_cpu_num());
 
+    /* a pinned thread can only run on its cpu, so that is the one to kick */
+    if (thread_pinned_cpu(t) >= 0) {
+        mp_cpu_mask_t pinned_cpu_mask = (1u << thread_pinned_cpu(t));
+        return (pinned_cpu_mask == curr_cpu_mask) ? 0 : pinned_cpu_mask;
+    }
+
+    /* get the last cpu the thread ran on */
+    mp_cpu_mask_t last_ran_cpu_mask = (1u << thread_last_cpu(t));
+
     /* get a list of idle cpus */
     mp_cpu_mask_t idle_cpu_mask = mp_get_idle_mask();
     if (idle_cpu_mask != 0) {
@@ -39,6 +39,8 @@
 
 struct thread_stats thread_stats[SMP_MAX_CPUS];
 
+thread_t * volatile cpu_running_thread[SMP_MAX_CPUS];
+
 #define STACK_DEBUG_BYTE (0x99)
 #define STACK_DEBUG_WORD (0x99999999)
 
@@ -613,6 +615,7 @@ void thread_resched(void)
 
     /* do the switch */
     set_current_thread(newthread);
+    cpu_running_thread[cpu] = newthread;
 
     TRACE_CONTEXT_SWITCH("cpu %u, old %p (%s, pri %d, flags 0x%x), new %p (%s, pri %d, flags 0x%x)\n",
             cpu, oldthread, oldthread->name, oldthread->priority,
@@ -860,6 +863,7 @@ void thread_construct_first(thread_t *t, const char *name)
     THREAD_LOCK(state);
     list_add_head(&thread_list, &t->thread_list_node);
     set_current_thread(t);
+    cpu_running_thread[cpu] = t;
     THREAD_UNLOCK(state);
 }
 
@@ -6,14 +6,17 @@
 
 #include <lib/debuglog.h>
 
+#include <arch/ops.h>
 #include <err.h>
 #include <dev/udisplay.h>
+#include <kernel/mp.h>
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
 #include <lib/user_copy.h>
 #include <lib/io.h>
 #include <lk/init.h>
 #include <platform.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "git-version.h"
@@ -28,7 +31,7 @@ static_assert((DLOG_MAX_RECORD & 3) == 0, "E_DONT_DO_THAT");
 static uint8_t DLOG_DATA[DLOG_SIZE];
 
 static dlog_t DLOG = {
-    .lock = SPIN_LOCK_INITIAL_VALUE,
+    .reserve = 0,
     .head = 0,
     .tail = 0,
     .data = DLOG_DATA,
@@ -38,6 +41,15 @@ static dlog_t DLOG = {
     .readers = LIST_INITIAL_VALUE(DLOG.readers),
 };
 
+// Records are assembled in a per-cpu staging buffer (with interrupts
+// disabled, so the buffer belongs to the current writer) and then
+// copied into the ring with at most two memcpys.
+typedef struct {
+    uint8_t data[DLOG_MAX_RECORD];
+} __CPU_ALIGN dlog_staging_t;
+
+static dlog_staging_t dlog_staging[SMP_MAX_CPUS];
+
 // The debug log maintains a circular buffer of debug log records,
 // consisting of a common header (dlog_header_t) followed by up
 // to 224 bytes of textual log message.  Records are aligned on
@@ -47,29 +59,65 @@ static dlog_t DLOG = {
 // or body may wrap but the initial header word never does).
 //
 // The ring buffer position is maintained by continuously incrementing
-// head and tail pointers (type size_t, so uint64_t on 64bit systems),
+// reserve, head and tail counters (uint64_t, so they never wrap).
 //
 // This allows readers to trivial compute if their local tail
 // pointer has "fallen out" of the fifo (an entire fifo's worth
 // of messages were written since they last tried to read) and then
 // they can snap their tail to the global tail and restart
 //
-//
 // Tail indicates the oldest message in the debug log to read
-// from, Head indicates the next space in the debug log to write
-// a new message to.  They are clipped to the actual buffer by
-// DLOG_MASK.
+// from, Head indicates the end of the last published message and
+// Reserve the next space in the debug log to hand to a writer.
+// They are clipped to the actual buffer by DLOG_MASK.
 //
 //       T                     T
 //  [....XXXX....]  [XX........XX]
 //           H         H
+//
+// Writers do not take a lock.  A writer:
+//   1. reserves [start, start + wiresize) with a fetch-and-add on reserve,
+//   2. moves tail (with compare-and-swap) past every record its slice
+//      of the ring is about to overwrite,
+//   3. copies its record in, in parallel with other writers,
+//   4. publishes by advancing head from start to start + wiresize, which
+//      happens in reservation order so head never covers a hole.
+// Interrupts are disabled from 1 through 4, so a writer waiting in step 4
+// only ever waits for earlier writers to finish a copy of at most
+// DLOG_MAX_RECORD bytes.
+//
+// Readers never block writers.  Since tail always moves past a record
+// before that record is overwritten, a reader that copies a record out
+// and then still finds tail at or before it knows the copy is intact;
+// otherwise it was lapped mid-copy and retries from the new tail.
 
 
 #define ALIGN4(n) (((n) + 3) & (~3))
 
-status_t dlog_write(uint32_t flags, const void* ptr, size_t len) {
-    dlog_t* log = &DLOG;
+// Move the tail forward until it is at or beyond target.
+static void dlog_advance_tail(dlog_t* log, uint64_t target) {
+    uint64_t tail = atomic_load_u64(&log->tail);
+
+    while (tail < target) {
+        // The record at tail was reserved a full ring ago, but make
+        // sure its writer has published it before reading its header.
+        while (atomic_load_u64(&log->head) <= tail) {
+            arch_spinloop_pause();
+        }
 
+        uint32_t header = *((volatile uint32_t*) (log->data + (tail & DLOG_MASK)));
+        uint64_t next = tail + DLOG_HDR_GET_FIFOLEN(header);
+
+        // If another writer moved the tail first, the header we read may
+        // already be overwritten; the failed exchange reloads tail and we
+        // start over from wherever it is now.
+        if (atomic_cmpxchg_u64(&log->tail, &tail, next)) {
+            tail = next;
+        }
+    }
+}
+
+static status_t dlog_write_etc(dlog_t* log, uint32_t flags, const void* ptr, size_t len) {
     if (len > DLOG_MAX_DATA) {
         return ERR_OUT_OF_RANGE;
     }
@@ -82,62 +130,72 @@ status_t dlog_write(uint32_t flags, const void* ptr, size_t len) {
     // that worst case there will be room for a header skipping
     // the last n bytes when the fifo wraps
     size_t wiresize = DLOG_MIN_RECORD + ALIGN4(len);
+    size_t recsize = DLOG_MIN_RECORD + len;
 
-    // Prepare the record header before taking the lock
-    dlog_header_t hdr;
-    hdr.header = DLOG_HDR_SET(wiresize, DLOG_MIN_RECORD + len);
-    hdr.datalen = len;
-    hdr.flags = flags;
-    hdr.timestamp = current_time_hires();
+    lk_bigtime_t timestamp = current_time_hires();
     thread_t *t = get_current_thread();
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    // Assemble the record in this cpu's staging buffer
+    uint8_t* rec = dlog_staging[arch_curr_cpu_num()].data;
+    dlog_header_t* hdr = (dlog_header_t*) rec;
+    hdr->header = DLOG_HDR_SET(wiresize, recsize);
+    hdr->datalen = len;
+    hdr->flags = flags;
+    hdr->timestamp = timestamp;
     if (t) {
-        hdr.pid = t->user_pid;
-        hdr.tid = t->user_tid;
+        hdr->pid = t->user_pid;
+        hdr->tid = t->user_tid;
     } else {
-        hdr.pid = 0;
-        hdr.tid = 0;
+        hdr->pid = 0;
+        hdr->tid = 0;
     }
-
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&log->lock, state);
-
-    // Discard records at tail until there is enough
-    // space for the new record.
-    while ((log->head - log->tail) > (DLOG_SIZE - wiresize)) {
-        uint32_t header = *((uint32_t*) (log->data + (log->tail & DLOG_MASK)));
-        log->tail += DLOG_HDR_GET_FIFOLEN(header);
+    memcpy(rec + sizeof(dlog_header_t), ptr, len);
+
+    // Claim our slice of the ring
+    uint64_t start = atomic_add_u64(&log->reserve, wiresize);
+    uint64_t end = start + wiresize;
+
+    // Discard records at tail until our slice no longer overlaps them
+    if (end > DLOG_SIZE) {
+        dlog_advance_tail(log, end - DLOG_SIZE);
+        // As in the writer of a seqlock: the new tail must be visible
+        // before any of the bytes we are about to overwrite change, or a
+        // reader could accept a torn record (see dlog_read).
+        atomic_fence();
     }
 
-    size_t offset = (log->head & DLOG_MASK);
-
+    size_t offset = (start & DLOG_MASK);
     size_t fifospace = DLOG_SIZE - offset;
 
-    if (fifospace >= wiresize) {
+    if (fifospace >= recsize) {
         // everything fits in one write, simple case!
-        memcpy(log->data + offset, &hdr, sizeof(hdr));
-        memcpy(log->data + offset + sizeof(hdr), ptr, len);
-    } else if (fifospace < sizeof(hdr)) {
-        // the wrap happens in the header
-        memcpy(log->data + offset, &hdr, fifospace);
-        memcpy(log->data, ((void*) &hdr) + fifospace, sizeof(hdr) - fifospace);
-        memcpy(log->data + (sizeof(hdr) - fifospace), ptr, len);
+        memcpy(log->data + offset, rec, recsize);
     } else {
-        // the wrap happens in the data
-        memcpy(log->data + offset, &hdr, sizeof(hdr));
-        offset += sizeof(hdr);
-        fifospace -= sizeof(hdr);
-        memcpy(log->data + offset, ptr, fifospace);
-        memcpy(log->data, ptr + fifospace, len - fifospace);
+        // the record wraps (the header word never does, see above)
+        memcpy(log->data + offset, rec, fifospace);
+        memcpy(log->data, rec + fifospace, recsize - fifospace);
     }
-    log->head += wiresize;
+
+    // Publish once every earlier reservation has been published
+    while (atomic_load_u64(&log->head) != start) {
+        arch_spinloop_pause();
+    }
+    atomic_store_u64(&log->head, end);
 
     event_signal(&log->event, false);
 
-    spin_unlock_irqrestore(&log->lock, state);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
     return NO_ERROR;
 }
 
+status_t dlog_write(uint32_t flags, const void* ptr, size_t len) {
+    return dlog_write_etc(&DLOG, flags, ptr, len);
+}
+
 // TODO: support reading multiple messages at a time
 // TODO: filter with flags
 status_t dlog_read(dlog_reader_t* rdr, uint32_t flags, void* ptr, size_t len, size_t* _actual) {
@@ -147,46 +205,53 @@ status_t dlog_read(dlog_reader_t* rdr, uint32_t flags, void* ptr, size_t len, si
     }
 
     dlog_t* log = rdr->log;
-    status_t status = ERR_SHOULD_WAIT;
-
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&log->lock, state);
 
-    size_t rtail = rdr->tail;
+    for (;;) {
+        uint64_t head = atomic_load_u64(&log->head);
+        uint64_t tail = atomic_load_u64(&log->tail);
+        uint64_t rtail = rdr->tail;
+
+        // If the read-tail is not within the range of log-tail..log-head
+        // this reader has been lapped by a writer and we reset our read-tail
+        // to the current log-tail.
+        //
+        if ((head - tail) < (head - rtail)) {
+            rtail = tail;
+        }
 
-    // If the read-tail is not within the range of log-tail..log-head
-    // this reader has been lapped by a writer and we reset our read-tail
-    // to the current log-tail.
-    //
-    if ((log->head - log->tail) < (log->head - rtail)) {
-        rtail = log->tail;
-    }
+        if (rtail == head) {
+            rdr->tail = rtail;
+            return ERR_SHOULD_WAIT;
+        }
 
-    if (rtail != log->head) {
         size_t offset = (rtail & DLOG_MASK);
-        uint32_t header = *((uint32_t*) (log->data + offset));
+        uint32_t header = *((volatile uint32_t*) (log->data + offset));
 
         size_t actual = DLOG_HDR_GET_READLEN(header);
         size_t fifospace = DLOG_SIZE - offset;
 
-        if (fifospace >= actual) {
-            memcpy(ptr, log->data + offset, actual);
-        } else {
-            memcpy(ptr, log->data + offset, fifospace);
-            memcpy(ptr + fifospace, log->data, actual - fifospace);
+        // a torn header can only come from a record that is being
+        // overwritten, which the tail check below catches
+        if (actual <= DLOG_MAX_RECORD) {
+            if (fifospace >= actual) {
+                memcpy(ptr, log->data + offset, actual);
+            } else {
+                memcpy(ptr, log->data + offset, fifospace);
+                memcpy(ptr + fifospace, log->data, actual - fifospace);
+            }
         }
 
-        *_actual = actual;
-        status = NO_ERROR;
+        // Order the copy above before re-checking the tail.  If a writer
+        // has not moved the tail past this record, nothing overwrote it.
+        atomic_fence_acquire();
+        if (atomic_load_u64(&log->tail) > rtail) {
+            continue;
+        }
 
-        rtail += DLOG_HDR_GET_FIFOLEN(header);
+        *_actual = actual;
+        rdr->tail = rtail + DLOG_HDR_GET_FIFOLEN(header);
+        return NO_ERROR;
     }
-
-    rdr->tail = rtail;
-
-    spin_unlock_irqrestore(&log->lock, state);
-
-    return status;
 }
 
 void dlog_reader_init(dlog_reader_t* rdr, void (*notify)(void*), void* cookie) {
@@ -199,13 +264,9 @@ void dlog_reader_init(dlog_reader_t* rdr, void (*notify)(void*), void* cookie) {
     mutex_acquire(&log->readers_lock);
     list_add_tail(&log->readers, &rdr->node);
 
-    bool do_notify = false;
-
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&log->lock, state);
-    rdr->tail = log->tail;
-    do_notify = (log->tail != log->head);
-    spin_unlock_irqrestore(&log->lock, state);
+    uint64_t tail = atomic_load_u64(&log->tail);
+    rdr->tail = tail;
+    bool do_notify = (tail != atomic_load_u64(&log->head));
 
     // simulate notify callback for events that arrived
     // before we were initialized
@@ -325,3 +386,109 @@ static void dlog_init_hook(uint level) {
 }
 
 LK_INIT_HOOK(debuglog, dlog_init_hook, LK_INIT_LEVEL_THREADING - 1);
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+#define DLOG_BENCH_RECORDS (64u * 1024u)
+#define DLOG_BENCH_MSGLEN (64u)
+
+struct dlog_bench_args {
+    dlog_t* log;
+    event_t* start;
+};
+
+static int dlog_bench_thread(void* arg) {
+    struct dlog_bench_args* args = arg;
+
+    char msg[DLOG_BENCH_MSGLEN];
+    memset(msg, 'x', sizeof(msg));
+
+    event_wait(args->start);
+    for (uint i = 0; i < DLOG_BENCH_RECORDS; i++) {
+        dlog_write_etc(args->log, DLOG_FLAG_KERNEL, msg, sizeof(msg));
+    }
+    return 0;
+}
+
+// Hammer a private log (so the console is not flooded) from one thread
+// per cpu and report the aggregate write rate.
+static int dlog_bench(uint nthreads) {
+    dlog_t log = {
+        .reserve = 0,
+        .head = 0,
+        .tail = 0,
+        .data = malloc(DLOG_SIZE),
+        .event = EVENT_INITIAL_VALUE(log.event, 0, EVENT_FLAG_AUTOUNSIGNAL),
+
+        .readers_lock = MUTEX_INITIAL_VALUE(log.readers_lock),
+        .readers = LIST_INITIAL_VALUE(log.readers),
+    };
+    if (!log.data) {
+        printf("failed to allocate log buffer\n");
+        return ERR_NO_MEMORY;
+    }
+
+    event_t start = EVENT_INITIAL_VALUE(start, 0, 0);
+    struct dlog_bench_args args = {
+        .log = &log,
+        .start = &start,
+    };
+
+    thread_t* threads[SMP_MAX_CPUS];
+    uint created = 0;
+    for (uint i = 0; i < nthreads; i++) {
+        threads[i] = thread_create("dlog-bench", dlog_bench_thread, &args,
+                                   DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!threads[i]) {
+            break;
+        }
+        if (mp_is_cpu_online(i)) {
+            thread_set_pinned_cpu(threads[i], i);
+        }
+        thread_resume(threads[i]);
+        created++;
+    }
+
+    lk_bigtime_t t0 = current_time_hires();
+    event_signal(&start, true);
+    for (uint i = 0; i < created; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+    lk_bigtime_t elapsed = current_time_hires() - t0;
+
+    uint64_t records = (uint64_t)created * DLOG_BENCH_RECORDS;
+    printf("%u threads wrote %" PRIu64 " records of %u bytes in %" PRIu64 " us, "
+           "%" PRIu64 " records/sec\n",
+           created, records, DLOG_BENCH_MSGLEN, elapsed / 1000,
+           elapsed ? records * UINT64_C(1000000000) / elapsed : 0);
+
+    free(log.data);
+    return NO_ERROR;
+}
+
+static int cmd_dlog(int argc, const cmd_args* argv, uint32_t flags) {
+    if (argc < 2) {
+    usage:
+        printf("usage:\n");
+        printf("%s bench [threads]   : measure concurrent write throughput\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "bench")) {
+        uint nthreads = (argc > 2) ? (uint)argv[2].u : (uint)__builtin_popcount(mp_get_online_mask());
+        if (nthreads < 1 || nthreads > SMP_MAX_CPUS) {
+            printf("thread count must be between 1 and %d\n", SMP_MAX_CPUS);
+            return ERR_INVALID_ARGS;
+        }
+        return dlog_bench(nthreads);
+    }
+
+    goto usage;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("dlog", "debuglog commands", &cmd_dlog)
+STATIC_COMMAND_END(debuglog);
+
+#endif // WITH_LIB_CONSOLE
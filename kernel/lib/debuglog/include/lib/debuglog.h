@@ -36,10 +36,10 @@ typedef struct dlog_record dlog_record_t;
 typedef struct dlog_reader dlog_reader_t;
 
 struct dlog {
-    spin_lock_t lock;
-
-    size_t head;
-    size_t tail;
+    // ring positions, see debuglog.c for how writers and readers use them
+    volatile uint64_t reserve;
+    volatile uint64_t head;
+    volatile uint64_t tail;
 
     void* data;
 
@@ -55,7 +55,7 @@ struct dlog_reader {
     struct list_node node;
 
     dlog_t* log;
-    size_t tail;
+    uint64_t tail;
 
     void (*notify)(void* cookie);
     void *cookie;
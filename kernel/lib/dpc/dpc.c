@@ -8,32 +8,66 @@
 #include <assert.h>
 #include <err.h>
 #include <list.h>
+#include <stdio.h>
 #include <trace.h>
 
+#include <arch/ops.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <kernel/spinlock.h>
+#include <kernel/thread.h>
 #include <lk/init.h>
 
-static spin_lock_t dpc_lock = SPIN_LOCK_INITIAL_VALUE;
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event = EVENT_INITIAL_VALUE(dpc_event, false, 0);
+// each cpu has its own queue of pending dpcs, serviced by a worker thread
+// pinned to that cpu
+struct dpc_state {
+    spin_lock_t lock;
+    struct list_node list;
+    event_t event;
+    thread_t *thread;
+} __CPU_ALIGN;
 
-status_t dpc_queue(dpc_t *dpc, bool reschedule)
+static struct dpc_state dpc_states[SMP_MAX_CPUS];
+
+// cpu < 0 means the cpu we are currently running on
+static status_t dpc_queue_internal(dpc_t *dpc, int cpu, bool reschedule)
 {
     DEBUG_ASSERT(dpc);
     DEBUG_ASSERT(dpc->func);
 
-    if (list_in_list(&dpc->node))
+    // claim the dpc. if it is already sitting in a queue there is nothing to do,
+    // it will run once no matter how many times it was queued.
+    int expected = 0;
+    if (!atomic_cmpxchg(&dpc->queued, &expected, 1))
         return NO_ERROR;
 
+    // disable interrupts before looking at the current cpu number so we cannot
+    // migrate between picking the queue and putting the dpc on it
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&dpc_lock, state);
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct dpc_state *dpc_state;
+    for (;;) {
+        if (cpu < 0 || !mp_is_cpu_online(cpu))
+            cpu = arch_curr_cpu_num();
+
+        dpc_state = &dpc_states[cpu];
+
+        spin_lock(&dpc_state->lock);
+
+        // the cpu may have gone offline since we looked, and had its queue
+        // emptied by dpc_transition_off_cpu(), so check again under the lock
+        if (mp_is_cpu_online(cpu))
+            break;
+        spin_unlock(&dpc_state->lock);
+    }
 
     // put the dpc at the tail of the list and signal the worker
-    list_add_tail(&dpc_list, &dpc->node);
-    event_signal(&dpc_event, false);
+    list_add_tail(&dpc_state->list, &dpc->node);
+    event_signal(&dpc_state->event, false);
 
-    spin_unlock_irqrestore(&dpc_lock, state);
+    spin_unlock(&dpc_state->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
     // reschedule here if asked to
     if (reschedule)
@@ -42,38 +76,109 @@ status_t dpc_queue(dpc_t *dpc, bool reschedule)
     return NO_ERROR;
 }
 
+status_t dpc_queue(dpc_t *dpc, bool reschedule)
+{
+    return dpc_queue_internal(dpc, -1, reschedule);
+}
+
+status_t dpc_queue_on_cpu(dpc_t *dpc, uint cpu, bool reschedule)
+{
+    if (cpu >= SMP_MAX_CPUS)
+        return ERR_INVALID_ARGS;
+
+    return dpc_queue_internal(dpc, (int)cpu, reschedule);
+}
+
+void dpc_transition_off_cpu(uint old_cpu)
+{
+    DEBUG_ASSERT(old_cpu < SMP_MAX_CPUS);
+    DEBUG_ASSERT(!mp_is_cpu_online(old_cpu));
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct dpc_state *old_state = &dpc_states[old_cpu];
+    struct dpc_state *dpc_state = &dpc_states[arch_curr_cpu_num()];
+
+    // the two locks are never held together anywhere else
+    spin_lock(&old_state->lock);
+    spin_lock(&dpc_state->lock);
+
+    // move everything pending on the old cpu to the tail of our queue
+    dpc_t *dpc;
+    while ((dpc = list_remove_head_type(&old_state->list, dpc_t, node)) != NULL)
+        list_add_tail(&dpc_state->list, &dpc->node);
+    if (!list_is_empty(&dpc_state->list))
+        event_signal(&dpc_state->event, false);
+    event_unsignal(&old_state->event);
+
+    spin_unlock(&dpc_state->lock);
+    spin_unlock(&old_state->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
 static int dpc_thread(void *arg)
 {
+    struct dpc_state *dpc_state = arg;
+
     for (;;) {
         // wait for a dpc to fire
-        __UNUSED status_t err = event_wait(&dpc_event);
+        __UNUSED status_t err = event_wait(&dpc_state->event);
         DEBUG_ASSERT(err == NO_ERROR);
 
         spin_lock_saved_state_t state;
-        spin_lock_irqsave(&dpc_lock, state);
+        spin_lock_irqsave(&dpc_state->lock, state);
 
         // pop a dpc off the list
-        dpc_t *dpc = list_remove_head_type(&dpc_list, dpc_t, node);
+        dpc_t *dpc = list_remove_head_type(&dpc_state->list, dpc_t, node);
 
         // if the list is now empty, unsignal the event so we block until it is
         if (!dpc)
-            event_unsignal(&dpc_event);
+            event_unsignal(&dpc_state->event);
+        else
+            atomic_store(&dpc->queued, 0);
 
-        spin_unlock_irqrestore(&dpc_lock, state);
+        spin_unlock_irqrestore(&dpc_state->lock, state);
 
         // call the dpc
         if (dpc && dpc->func)
             dpc->func(dpc);
     }
 
-
     return 0;
 }
 
-static void dpc_init(unsigned int level)
+static void dpc_init_early(unsigned int level)
 {
-    thread_t *t = thread_create("dpc", &dpc_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct dpc_state *dpc_state = &dpc_states[i];
+
+        spin_lock_init(&dpc_state->lock);
+        list_initialize(&dpc_state->list);
+        event_init(&dpc_state->event, false, 0);
+    }
+}
+
+// runs on every cpu as it comes up, including each time a cpu is hotplugged
+// again, when its worker is still around from the last time
+static void dpc_init_percpu(unsigned int level)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct dpc_state *dpc_state = &dpc_states[cpu];
+    if (dpc_state->thread)
+        return;
+
+    char name[THREAD_NAME_LENGTH];
+    snprintf(name, sizeof(name), "dpc-%u", cpu);
+
+    thread_t *t = thread_create(name, &dpc_thread, dpc_state, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t) {
+        panic("failed to create dpc thread for cpu %u\n", cpu);
+    }
+    thread_set_pinned_cpu(t, cpu);
+    dpc_state->thread = t;
     thread_detach_and_resume(t);
 }
 
-LK_INIT_HOOK(dpc, dpc_init, LK_INIT_LEVEL_THREADING);
+LK_INIT_HOOK(dpc_early, dpc_init_early, LK_INIT_LEVEL_THREADING - 1);
+LK_INIT_HOOK_FLAGS(dpc, dpc_init_percpu, LK_INIT_LEVEL_THREADING, LK_INIT_FLAG_ALL_CPUS);
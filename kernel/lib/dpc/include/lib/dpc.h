@@ -19,9 +19,30 @@ typedef struct dpc {
 
     dpc_func_t func;
     void *arg;
+
+    // nonzero while the dpc sits on a cpu's queue, owned by the dpc code
+    volatile int queued;
 } dpc_t;
 
+/* Queue a dpc on the current cpu's dpc queue.
+ *
+ * Safe to call from interrupt context.  Each cpu has its own queue and worker
+ * thread, so work deferred from an interrupt runs on the cpu that took it.
+ * Queuing a dpc that is already pending is a no-op.  Once the worker has
+ * pulled a dpc off its queue the dpc may be queued again, so a dpc that is
+ * requeued (possibly on another cpu) while its callback is running can run
+ * concurrently with itself.
+ */
 status_t dpc_queue(dpc_t *dpc, bool reschedule);
 
-__END_CDECLS
+/* Same as dpc_queue(), but targets a specific cpu.  If the cpu is not online
+ * the dpc is queued on the current cpu instead.
+ */
+status_t dpc_queue_on_cpu(dpc_t *dpc, uint cpu, bool reschedule);
 
+/* Moves the dpcs still pending on |old_cpu|, which has gone offline, to the
+ * current cpu's queue.  Called while unplugging a cpu.
+ */
+void dpc_transition_off_cpu(uint old_cpu);
+
+__END_CDECLS
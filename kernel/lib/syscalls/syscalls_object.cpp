@@ -8,6 +8,8 @@
 #include <inttypes.h>
 #include <trace.h>
 
+#include <kernel/lockprof.h>
+
 #include <magenta/handle_owner.h>
 #include <magenta/job_dispatcher.h>
 #include <magenta/magenta.h>
@@ -323,6 +325,50 @@ mx_status_t sys_object_get_info(mx_handle_t handle, uint32_t topic,
                 return ERR_BUFFER_TOO_SMALL;
             return NO_ERROR;
         }
+        case MX_INFO_LOCK_STATS: {
+            mx_status_t status = validate_resource_handle(handle);
+            if (status < 0)
+                return status;
+
+            static_assert(LOCKPROF_TYPE_MUTEX == MX_LOCK_TYPE_MUTEX, "");
+            static_assert(LOCKPROF_TYPE_SPINLOCK == MX_LOCK_TYPE_SPINLOCK, "");
+
+            // the table is updated without locks, so this is a best effort
+            // snapshot of a live profile
+            auto records = _buffer.reinterpret<mx_info_lock_stats_t>();
+            size_t count = buffer_size / sizeof(mx_info_lock_stats_t);
+            size_t actual = 0;
+            size_t avail = 0;
+            for (size_t i = 0; i < lockprof_max_sites(); i++) {
+                lockprof_stats_t stats;
+                if (!lockprof_get_site(i, &stats))
+                    continue;
+
+                if (actual < count) {
+                    mx_info_lock_stats_t info = {
+                        .site = stats.site,
+                        .type = stats.type,
+                        .reserved = 0,
+                        .acquisitions = stats.acquisitions,
+                        .contentions = stats.contentions,
+                        .total_wait_ns = stats.total_wait_ns,
+                        .max_wait_ns = stats.max_wait_ns,
+                        .total_hold_ns = stats.total_hold_ns,
+                        .max_hold_ns = stats.max_hold_ns,
+                    };
+                    if (records.element_offset(actual).copy_to_user(info) != NO_ERROR)
+                        return ERR_INVALID_ARGS;
+                    actual++;
+                }
+                avail++;
+            }
+
+            if (_actual && (_actual.copy_to_user(actual) != NO_ERROR))
+                return ERR_INVALID_ARGS;
+            if (_avail && (_avail.copy_to_user(avail) != NO_ERROR))
+                return ERR_INVALID_ARGS;
+            return NO_ERROR;
+        }
         default:
             return ERR_NOT_SUPPORTED;
     }
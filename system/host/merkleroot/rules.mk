@@ -20,6 +20,8 @@ MODULE_COMPILEFLAGS += \
 
 MODULE_SRCS += \
 	system/ulib/merkle/digest.cpp \
+	system/ulib/merkle/sha256-arm64.cpp \
+	system/ulib/merkle/sha256-x86-64.cpp \
 	system/ulib/merkle/tree.cpp \
 	system/ulib/mxcpp/new.cpp \
 	$(LOCAL_DIR)/merkleroot.cpp
@@ -32,4 +34,6 @@ MODULE_COMPILEFLAGS += -Ithird_party/ulib/cryptolib/include
 MODULE_SRCS += third_party/ulib/cryptolib/cryptolib.c
 endif
 
+MODULE_HOST_LIBS += -lpthread
+
 include make/module.mk
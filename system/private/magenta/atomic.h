@@ -95,6 +95,11 @@ static inline void atomic_fence_acquire(void)
     __atomic_thread_fence(__ATOMIC_ACQUIRE);
 }
 
+static inline void atomic_fence(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
 // 64-bit versions. Assumes the compiler/platform is LLP so int is 32 bits.
 static inline int64_t atomic_swap_64(volatile int64_t *ptr, int64_t val)
 {
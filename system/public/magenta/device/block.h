@@ -45,6 +45,24 @@
 // otherwise, closing the client fifo is sufficient to shut down the server.
 #define IOCTL_BLOCK_FIFO_CLOSE \
     IOCTL(IOCTL_KIND_DEFAULT, IOCTL_FAMILY_BLOCK, 11)
+// Get the I/O scheduling statistics of the currently running FIFO server
+#define IOCTL_BLOCK_GET_STATS \
+    IOCTL(IOCTL_KIND_DEFAULT, IOCTL_FAMILY_BLOCK, 12)
+// Add another FIFO, served by its own thread, to the currently running FIFO server
+#define IOCTL_BLOCK_ADD_FIFO \
+    IOCTL(IOCTL_KIND_GET_HANDLE, IOCTL_FAMILY_BLOCK, 13)
+// Set the size of a block cache, dropping its contents
+#define IOCTL_BLOCK_CACHE_CONFIG \
+    IOCTL(IOCTL_KIND_DEFAULT, IOCTL_FAMILY_BLOCK, 14)
+// Get the hit rate of a block cache
+#define IOCTL_BLOCK_CACHE_GET_STATS \
+    IOCTL(IOCTL_KIND_DEFAULT, IOCTL_FAMILY_BLOCK, 15)
+// Get the latency histograms of the currently running FIFO server
+#define IOCTL_BLOCK_GET_LATENCY \
+    IOCTL(IOCTL_KIND_DEFAULT, IOCTL_FAMILY_BLOCK, 16)
+// Start or stop writing ktrace probes along the block I/O path
+#define IOCTL_BLOCK_SET_TRACE \
+    IOCTL(IOCTL_KIND_DEFAULT, IOCTL_FAMILY_BLOCK, 17)
 
 // Block Core ioctls (specific to each block device):
 
@@ -66,6 +84,29 @@ IOCTL_WRAPPER_VAROUT(ioctl_block_get_name, IOCTL_BLOCK_GET_NAME, char);
 // ssize_t ioctl_block_rr_part(int fd);
 IOCTL_WRAPPER(ioctl_block_rr_part, IOCTL_BLOCK_RR_PART);
 
+// The "block-cache" driver may be bound (with ioctl_device_bind) over any block
+// device, and keeps the most recently used blocks of it in memory.
+
+typedef struct {
+    uint64_t size; // Bytes of memory given to cached blocks
+} block_cache_config_t;
+
+// Counts are in device blocks.
+typedef struct {
+    uint64_t size;          // Bytes of memory given to cached blocks
+    uint64_t hits;          // Blocks read from the cache
+    uint64_t misses;        // Blocks read from the device
+    uint64_t fills;         // Blocks added to the cache
+    uint64_t evictions;     // Blocks dropped from the cache to make room for others
+    uint64_t invalidations; // Blocks dropped from the cache as they were written or trimmed
+} block_cache_stats_t;
+
+// ssize_t ioctl_block_cache_config(int fd, const block_cache_config_t* in);
+IOCTL_WRAPPER_IN(ioctl_block_cache_config, IOCTL_BLOCK_CACHE_CONFIG, block_cache_config_t);
+
+// ssize_t ioctl_block_cache_get_stats(int fd, block_cache_stats_t* out);
+IOCTL_WRAPPER_OUT(ioctl_block_cache_get_stats, IOCTL_BLOCK_CACHE_GET_STATS, block_cache_stats_t);
+
 // TODO(smklein): Move these to a separate file
 // Block Device ioctls (shared between all block devices):
 
@@ -78,19 +119,86 @@ typedef uint16_t vmoid_t;
 IOCTL_WRAPPER_INOUT(ioctl_block_attach_vmo, IOCTL_BLOCK_ATTACH_VMO, mx_handle_t, vmoid_t);
 
 #define MAX_TXN_MESSAGES 16
-#define MAX_TXN_COUNT    256
+#define MAX_TXN_COUNT    256  // Per FIFO
+#define MAX_FIFO_COUNT   16   // Per device
 
 typedef uint16_t txnid_t;
 
 // ssize_t ioctl_block_alloc_txn(int fd, txnid_t* out_txnid);
+// Allocates a txn for use on the FIFO returned by ioctl_block_get_fifos.
 IOCTL_WRAPPER_OUT(ioctl_block_alloc_txn, IOCTL_BLOCK_ALLOC_TXN, txnid_t);
 
+// ssize_t ioctl_block_alloc_fifo_txn(int fd, const uint32_t* fifo_index, txnid_t* out_txnid);
+// Allocates a txn for use on the given FIFO; txns may only be used on the FIFO
+// they were allocated for.
+IOCTL_WRAPPER_INOUT(ioctl_block_alloc_fifo_txn, IOCTL_BLOCK_ALLOC_TXN, uint32_t, txnid_t);
+
 // ssize_t ioctl_block_free_txn(int fd, const size_t* in_txnid);
 IOCTL_WRAPPER_IN(ioctl_block_free_txn, IOCTL_BLOCK_FREE_TXN, txnid_t);
 
 // ssize_t ioctl_block_fifo_close(int fd);
 IOCTL_WRAPPER(ioctl_block_fifo_close, IOCTL_BLOCK_FIFO_CLOSE);
 
+// Statistics are kept from the time the FIFO server is started, and reset
+// when the next one is. They are summed over all of its FIFOs.
+typedef struct {
+    uint64_t requests;        // Reads, writes and trims taken off the FIFOs
+    uint64_t merged;          // Requests merged into a contiguous neighbour
+    uint64_t ops;             // Operations issued to the device
+    uint64_t completed;       // Operations completed by the device
+    uint32_t queue_depth;     // Operations issued but not yet completed
+    uint32_t max_queue_depth; // Deepest the device queue of any one FIFO has been
+    uint64_t total_latency;   // Sum, over completed operations, of time since leaving the FIFO
+    uint64_t max_latency;
+} block_stats_t;
+
+// ssize_t ioctl_block_get_stats(int fd, block_stats_t* out);
+IOCTL_WRAPPER_OUT(ioctl_block_get_stats, IOCTL_BLOCK_GET_STATS, block_stats_t);
+
+// Latencies are counted in log2 buckets of microseconds: bucket 0 holds those
+// under 1us, bucket i those in [2^(i-1), 2^i) us, and the last bucket also
+// everything longer.
+#define BLOCK_LATENCY_BUCKETS 32
+
+// The latency of each operation the FIFO server issues is split at the point
+// it is issued to the device. Merged requests count once, from the earliest
+// of them; each range of a vectored request counts separately.
+typedef struct {
+    uint64_t queued[BLOCK_LATENCY_BUCKETS]; // From leaving the FIFO until issued
+    uint64_t device[BLOCK_LATENCY_BUCKETS]; // From being issued until completed
+} block_latency_hist_t;
+
+// Kept, and reset, like block_stats_t.
+typedef struct {
+    block_latency_hist_t read;
+    block_latency_hist_t write;
+    block_latency_hist_t trim;
+} block_latency_t;
+
+// ssize_t ioctl_block_get_latency(int fd, block_latency_t* out);
+IOCTL_WRAPPER_OUT(ioctl_block_get_latency, IOCTL_BLOCK_GET_LATENCY, block_latency_t);
+
+// The probes are named "block_fifo", "block_queue", "block_submit" and
+// "block_complete", and are written for every block device served by the
+// same driver host. Each records an id for the operation and its opcode, or
+// on completion its status.
+// ssize_t ioctl_block_set_trace(int fd, const uint32_t* enable);
+IOCTL_WRAPPER_IN(ioctl_block_set_trace, IOCTL_BLOCK_SET_TRACE, uint32_t);
+
+// The FIFO returned by ioctl_block_get_fifos is index 0. Devices which can
+// work on several requests at once from separate threads accept up to one
+// more FIFO per hardware queue (and at most MAX_FIFO_COUNT in all), each served
+// by its own thread. VMOs attached to the device may be used on any of them.
+// Closing any but the first FIFO stops only its own thread; closing the first
+// stops them all.
+typedef struct {
+    mx_handle_t fifo;
+    uint32_t index;
+} block_fifo_info_t;
+
+// ssize_t ioctl_block_add_fifo(int fd, block_fifo_info_t* out);
+IOCTL_WRAPPER_OUT(ioctl_block_add_fifo, IOCTL_BLOCK_ADD_FIFO, block_fifo_info_t);
+
 // Multiple Block IO operations may be sent at once before a response is actually sent back.
 // Block IO ops may be sent concurrently to different vmoids, and they also may be sent
 // to different transactions at any point in time. Up to MAX_TXN_COUNT transactions may
@@ -109,7 +217,8 @@ IOCTL_WRAPPER(ioctl_block_fifo_close, IOCTL_BLOCK_FIFO_CLOSE);
 //    This response is sent once all operations either complete or a single operation fails.
 //    At this point, step (1) may begin again without reallocating the txn.
 //
-// For BLOCKIO_READ and BLOCKIO_WRITE, N may be greater than 1.
+// For BLOCKIO_READ, BLOCKIO_WRITE, BLOCKIO_READV, BLOCKIO_WRITEV and BLOCKIO_TRIM, N may be
+// greater than 1.
 // Otherwise, N == 1 (skipping step (1) in the protocol above).
 //
 // Notes:
@@ -136,6 +245,9 @@ IOCTL_WRAPPER(ioctl_block_fifo_close, IOCTL_BLOCK_FIFO_CLOSE);
 #define BLOCKIO_WRITE     0x0002 // Writes to the Block device from the VMO
 #define BLOCKIO_SYNC      0x0003 // Unimplemented
 #define BLOCKIO_CLOSE_VMO 0x0004 // Detaches the VMO from the block device; closes the handle to it.
+#define BLOCKIO_READV     0x0005 // Reads into each range of a descriptor table (see below)
+#define BLOCKIO_WRITEV    0x0006 // Writes from each range of a descriptor table (see below)
+#define BLOCKIO_TRIM      0x0007 // Discards the contents of a range of the device (see below)
 #define BLOCKIO_OP_MASK   0x00FF
 
 #define BLOCKIO_TXN_END   0x0100 // Expects response after request (and all previous) have completed
@@ -164,5 +276,27 @@ typedef struct {
 static_assert(sizeof(block_fifo_request_t) == sizeof(block_fifo_response_t),
               "FIFO messages are the same size in both directions");
 
+// A BLOCKIO_READV or BLOCKIO_WRITEV request moves several ranges as a single
+// message. Its vmoid and vmo_offset locate a table of |length| of the following
+// in an attached VMO, and its dev_offset is ignored. Each entry names a range
+// of any attached VMO. The request completes once every range has, and fails if
+// any of them does; if any entry is invalid, none of them are issued.
+typedef struct {
+    vmoid_t vmoid;
+    uint16_t reserved0;
+    uint32_t reserved1;
+    uint64_t length;
+    uint64_t vmo_offset;
+    uint64_t dev_offset;
+} block_fifo_vec_t;
+
+#define BLOCK_FIFO_MAX_VECS 64
+
+// A BLOCKIO_TRIM request tells the device that the |length| bytes at
+// dev_offset no longer hold anything the client needs; its vmoid and
+// vmo_offset are ignored. Devices may free, zero or keep the discarded blocks,
+// so they read back undefined. It fails with ERR_NOT_SUPPORTED on devices
+// which cannot discard, which clients may treat as success.
+
 #define BLOCK_FIFO_ESIZE (sizeof(block_fifo_request_t))
 #define BLOCK_FIFO_MAX_DEPTH (4096 / BLOCK_FIFO_ESIZE)
@@ -24,6 +24,7 @@ typedef enum {
     MX_INFO_JOB_PROCESSES,          // mx_koid_t[n]
     MX_INFO_THREAD,                 // mx_info_thread_t[1]
     MX_INFO_THREAD_EXCEPTION_REPORT, // mx_exception_report_t[1]
+    MX_INFO_LOCK_STATS,             // mx_info_lock_stats_t[n]
 } mx_object_info_topic_t;
 
 typedef enum {
@@ -92,6 +93,24 @@ typedef struct mx_info_vmar {
     size_t len;
 } mx_info_vmar_t;
 
+#define MX_LOCK_TYPE_MUTEX      1u
+#define MX_LOCK_TYPE_SPINLOCK   2u
+
+typedef struct mx_info_lock_stats {
+    // Kernel code address the lock was acquired from.
+    uint64_t site;
+    // One of MX_LOCK_TYPE_*.
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t acquisitions;
+    // Acquisitions that found the lock already held.
+    uint64_t contentions;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t total_hold_ns;
+    uint64_t max_hold_ns;
+} mx_info_lock_stats_t;
+
 
 // Object properties.
 
@@ -7,6 +7,9 @@
 #include "blobstore.h"
 
 #include <bitmap/raw-bitmap.h>
+#include <block-client/block-txn.h>
+#include <block-client/client.h>
+#include <magenta/device/block.h>
 #include <merkle/digest.h>
 #include <mxtl/algorithm.h>
 #include <mxtl/macros.h>
@@ -21,6 +24,8 @@ namespace blobstore {
 class Blobstore;
 class VnodeBlob;
 
+using BlockTxn = block_client::BlockTxn<Blobstore, kBlobstoreBlockSize>;
+
 typedef uint32_t BlobFlags;
 
 // After Open;
@@ -39,6 +44,10 @@ constexpr BlobFlags kBlobStateMask        = 0x000000FF;
 constexpr BlobFlags kBlobFlagSync         = 0x00000100; // The blob is being written to disk
 constexpr BlobFlags kBlobFlagDeletable    = 0x00000200; // This node should be unlinked when closed
 
+// Blob data is read in and verified against the Merkle tree in aligned
+// chunks of this many blocks, the first time any part of a chunk is read.
+constexpr uint64_t kBlobChunkBlocks = 8;
+
 class Blob : public mxtl::DoublyLinkedListable<mxtl::RefPtr<Blob>>,
              public mxtl::RefCounted<Blob> {
 public:
@@ -115,19 +124,42 @@ private:
     Blob(const merkle::Digest& digest);
     void BlobCloseHandles();
 
-    // Read both VMOs into memory, if we haven't already.
+    // Creates a VMO of 'size' bytes and maps it with 'perms', registering it
+    // with the block device if the block FIFO is in use.
+    mx_status_t CreateVmo(uint64_t size, uint32_t perms, mx_handle_t* vmo_out,
+                          uintptr_t* addr_out, vmoid_t* vmoid_out);
+
+    // Reads 'nblocks' blocks, starting at block 'dev_bno' of the device, into
+    // a VMO starting at block 'vmo_bno'.
+    mx_status_t FillBlocks(mx_handle_t vmo, vmoid_t vmoid, uint64_t vmo_bno, uint64_t dev_bno,
+                           uint64_t nblocks);
+
+    // Create both VMOs, if we haven't already. They are filled as the blob
+    // is read, by LoadVerified().
     //
     // TODO(smklein): When we have can register the Blob Store as a pager
     // service, and it can properly handle pages faults on a vnode's contents,
-    // then we can avoid reading the entire blob up-front. Until then, read
-    // the contents of a VMO into memory when it is opened.
+    // then the VMOs could be handed out and filled on demand as well.
     mx_status_t InitVmos();
 
+    // Size the maps of what the VMOs hold, marking everything as present
+    // (but not verified) if 'loaded'.
+    mx_status_t ResetMaps(bool loaded);
+
+    // Make sure bytes [off, off + len) of the blob are in its VMO and have
+    // been verified, reading in and verifying whole chunks as needed.
+    mx_status_t LoadVerified(uint64_t off, uint64_t len);
+
+    // Read blocks [start, end) of the Merkle tree into its VMO, skipping
+    // those which are there already.
+    mx_status_t LoadTree(uint64_t start, uint64_t end);
+
     mx_status_t WriteShared(const void** data, size_t* len, size_t* actual,
                             uint64_t maxlen, mx_handle_t vmo, uint64_t start_block);
 
     // Called by Blob once the last write has completed, updating the
-    // on-disk metadata.
+    // on-disk metadata. When the block FIFO is in use, this also writes out
+    // the Merkle tree and data, which WriteShared() left in the VMOs.
     mx_status_t WriteMetadata();
 
     NodeState type_list_state_;
@@ -135,8 +167,17 @@ private:
 
     mx_handle_t vmo_merkle_tree_;
     uintptr_t   vmo_merkle_tree_addr_;
+    vmoid_t     vmoid_merkle_tree_;
     mx_handle_t vmo_blob_;
     uintptr_t   vmo_blob_addr_;
+    vmoid_t     vmoid_blob_;
+
+    // Blocks of the Merkle tree and chunks of data present in the VMOs, and
+    // chunks of data which have been verified.
+    using ChunkMap = bitmap::RawBitmapGeneric<bitmap::DefaultStorage>;
+    ChunkMap tree_loaded_;
+    ChunkMap data_loaded_;
+    ChunkMap data_verified_;
 
     mx_handle_t readable_event_;
     uint64_t bytes_written_;
@@ -194,12 +235,31 @@ public:
     // Deletes the blob if requested.
     mx_status_t ReleaseBlob(mxtl::RefPtr<Blob> blob);
 
+    // True if the underlying device speaks the block FIFO protocol, in which
+    // case blocks move directly between the device and registered VMOs.
+    bool FifoEnabled() const { return fifo_client_ != nullptr; }
+
+    // Registers a duplicate of 'vmo' with the block device so that it can be
+    // the target of block FIFO transactions.
+    mx_status_t AttachVmo(mx_handle_t vmo, vmoid_t* out);
+    mx_status_t DetachVmo(vmoid_t vmoid);
+
+    // Issues up to MAX_TXN_MESSAGES requests as a single transaction and waits
+    // for it to complete.  Fills in the txnid of each request.
+    mx_status_t Txn(block_fifo_request_t* requests, size_t count);
+
     int blockfd_;
     blobstore_info_t info_;
 private:
     Blobstore(int fd, const blobstore_info_t* info);
     mx_status_t LoadBitmaps();
 
+    // Maps the node map and connects to the block device's FIFO, registering
+    // both maps with it.  Leaves the fifo disabled if the device does not
+    // support it.
+    mx_status_t InitNodeMap();
+    void ConnectFifo();
+
     // Acquire a dummy vnode that acts like a root directory, allowing access
     // to other vnodes.
     static mx_status_t RootVnodeNew(mxtl::RefPtr<Blobstore> bs, VnodeBlob** out);
@@ -224,10 +284,16 @@ private:
     // Given a contiguous number of blocks after a starting block,
     // write out the bitmap to disk for the corresponding blocks.
     mx_status_t WriteBitmap(uint64_t nblocks, uint64_t start_block);
+    // As above, adding the bitmap blocks to a pending transaction.
+    mx_status_t EnqueueBitmap(BlockTxn* txn, uint64_t nblocks, uint64_t start_block);
 
     // Given a node within the node map at an index, write it to disk.
     mx_status_t WriteNode(size_t map_index);
 
+    // Tells the device it may discard blocks which nothing on disk refers to
+    // any more. Does nothing if the device cannot.
+    void DiscardBlocks(uint64_t nblocks, uint64_t start_block);
+
     using WAVLTreeByMerkle = mxtl::WAVLTree<const uint8_t*,
                                             mxtl::RefPtr<Blob>,
                                             MerkleRootTraits,
@@ -235,7 +301,14 @@ private:
     WAVLTreeByMerkle hash_; // Map of all 'in use' blobs
 
     RawBitmap block_map_;
-    mxtl::unique_ptr<blobstore_inode_t[]> node_map_;
+    mx_handle_t node_map_vmo_;
+    blobstore_inode_t* node_map_; // Mapping of node_map_vmo_
+
+    fifo_client_t* fifo_client_;
+    txnid_t txnid_;
+    vmoid_t block_map_vmoid_;
+    vmoid_t node_map_vmoid_;
+    bool discard_enabled_; // Cleared if the device turns out not to support it
 };
 
 int blobstore_mkfs(int fd);
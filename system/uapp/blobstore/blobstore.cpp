@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include <magenta/device/block.h>
 #include <magenta/new.h>
 #include <magenta/process.h>
 #include <magenta/syscalls.h>
@@ -141,7 +142,7 @@ void* Blobstore::GetBlockmapData(uint64_t n) const {
 // Get a pointer to the nth block of the node map.
 void* Blobstore::GetNodemapData(uint64_t n) const {
     assert(n < NodeMapBlocks(info_));
-    return (void*)((uintptr_t)(node_map_.get()) + (uintptr_t)(kBlobstoreBlockSize * n));
+    return (void*)((uintptr_t)(node_map_) + (uintptr_t)(kBlobstoreBlockSize * n));
 }
 
 mx_status_t readblk(int fd, uint64_t bno, void* data) {
@@ -176,57 +177,160 @@ mx_status_t Blob::InitVmos() {
     }
 
     mx_status_t status;
-    int fd = vn->blobstore->blockfd_;
     blobstore_inode_t* inode = &vn->blobstore->node_map_[map_index_];
     uint64_t merkle_vmo_size = MerkleTreeBlocks(*inode) * kBlobstoreBlockSize;
     uint64_t data_vmo_size = BlobDataBlocks(*inode) * kBlobstoreBlockSize;
 
     if (merkle_vmo_size != 0) {
-        if ((status = mx_vmo_create(merkle_vmo_size, 0, &vmo_merkle_tree_)) != NO_ERROR) {
+        if ((status = CreateVmo(merkle_vmo_size, MX_VM_FLAG_PERM_READ, &vmo_merkle_tree_,
+                                &vmo_merkle_tree_addr_, &vmoid_merkle_tree_)) != NO_ERROR) {
             error("Failed to initialize vmo; error: %d\n", status);
             goto fail;
         }
+    }
 
-        for (uint64_t n = 0; n < MerkleTreeBlocks(*inode); n++) {
-            uint64_t bno = inode->start_block + n;
-            if ((status = vn_fill_block(fd, vmo_merkle_tree_, n, bno)) != NO_ERROR) {
-                error("Failed to fill bno\n");
-                goto fail;
-            }
-        }
+    if ((status = CreateVmo(data_vmo_size, MX_VM_FLAG_PERM_READ, &vmo_blob_,
+                            &vmo_blob_addr_, &vmoid_blob_)) != NO_ERROR) {
+        error("Failed to initialize vmo; error: %d\n", status);
+        goto fail;
+    }
 
-        if ((status = mx_vmar_map(mx_vmar_root_self(), 0, vmo_merkle_tree_, 0,
-                                  merkle_vmo_size,
-                                  MX_VM_FLAG_PERM_READ,
-                                  &vmo_merkle_tree_addr_)) != NO_ERROR) {
-            goto fail;
+    if ((status = ResetMaps(false)) != NO_ERROR) {
+        goto fail;
+    }
+    return NO_ERROR;
+fail:
+    BlobCloseHandles();
+    return status;
+}
+
+mx_status_t Blob::CreateVmo(uint64_t size, uint32_t perms, mx_handle_t* vmo_out,
+                            uintptr_t* addr_out, vmoid_t* vmoid_out) {
+    mx_handle_t vmo;
+    mx_status_t status;
+    if ((status = mx_vmo_create(size, 0, &vmo)) != NO_ERROR) {
+        return status;
+    }
+    uintptr_t addr;
+    if ((status = mx_vmar_map(mx_vmar_root_self(), 0, vmo, 0, size, perms, &addr)) != NO_ERROR) {
+        mx_handle_close(vmo);
+        return status;
+    }
+    if (vn->blobstore->FifoEnabled() &&
+        ((status = vn->blobstore->AttachVmo(vmo, vmoid_out)) != NO_ERROR)) {
+        mx_vmar_unmap(mx_vmar_root_self(), addr, size);
+        mx_handle_close(vmo);
+        return status;
+    }
+    *vmo_out = vmo;
+    *addr_out = addr;
+    return NO_ERROR;
+}
+
+mx_status_t Blob::FillBlocks(mx_handle_t vmo, vmoid_t vmoid, uint64_t vmo_bno, uint64_t dev_bno,
+                             uint64_t nblocks) {
+    Blobstore* bs = vn->blobstore.get();
+    mx_status_t status;
+    if (bs->FifoEnabled()) {
+        BlockTxn txn(bs, BLOCKIO_READ);
+        if ((status = txn.Enqueue(vmoid, vmo_bno, dev_bno, nblocks)) != NO_ERROR) {
+            return status;
         }
+        return txn.Flush();
     }
+    for (uint64_t n = 0; n < nblocks; n++) {
+        if ((status = vn_fill_block(bs->blockfd_, vmo, vmo_bno + n, dev_bno + n)) != NO_ERROR) {
+            return status;
+        }
+    }
+    return NO_ERROR;
+}
 
-    if ((status = mx_vmo_create(data_vmo_size, 0, &vmo_blob_)) != NO_ERROR) {
-        error("Failed to initialize vmo; error: %d\n", status);
-        goto fail;
+mx_status_t Blob::ResetMaps(bool loaded) {
+    blobstore_inode_t* inode = &vn->blobstore->node_map_[map_index_];
+    uint64_t tree_blocks = MerkleTreeBlocks(*inode);
+    uint64_t chunks = mxtl::roundup(BlobDataBlocks(*inode), kBlobChunkBlocks) / kBlobChunkBlocks;
+    mx_status_t status;
+    if (((status = tree_loaded_.Reset(tree_blocks)) != NO_ERROR) ||
+        ((status = data_loaded_.Reset(chunks)) != NO_ERROR) ||
+        ((status = data_verified_.Reset(chunks)) != NO_ERROR)) {
+        return status;
+    }
+    if (loaded) {
+        tree_loaded_.Set(0, tree_blocks);
+        data_loaded_.Set(0, chunks);
     }
+    return NO_ERROR;
+}
 
-    for (uint64_t n = 0; n < BlobDataBlocks(*inode); n++) {
-        uint64_t bno = inode->start_block + n + MerkleTreeBlocks(*inode);
-        if ((status = vn_fill_block(fd, vmo_blob_, n, bno)) != NO_ERROR) {
+mx_status_t Blob::LoadTree(uint64_t start, uint64_t end) {
+    blobstore_inode_t* inode = &vn->blobstore->node_map_[map_index_];
+    // Each run of missing blocks is read at once
+    uint64_t n = start;
+    while ((n = tree_loaded_.Scan(n, end, true)) < end) {
+        uint64_t run_end = tree_loaded_.Scan(n, end, false);
+        mx_status_t status = FillBlocks(vmo_merkle_tree_, vmoid_merkle_tree_, n,
+                                        inode->start_block + n, run_end - n);
+        if (status != NO_ERROR) {
             error("Failed to fill bno\n");
-            goto fail;
+            return status;
         }
+        tree_loaded_.Set(n, run_end);
+        n = run_end;
     }
+    return NO_ERROR;
+}
 
-    if ((status = mx_vmar_map(mx_vmar_root_self(), 0, vmo_blob_, 0,
-                              data_vmo_size,
-                              MX_VM_FLAG_PERM_READ,
-                              &vmo_blob_addr_)) != NO_ERROR) {
-        goto fail;
-    }
+mx_status_t Blob::LoadVerified(uint64_t off, uint64_t len) {
+    blobstore_inode_t* inode = &vn->blobstore->node_map_[map_index_];
+    uint64_t size_merkle = merkle::Tree::GetTreeLength(inode->blob_size);
+    uint64_t data_start = inode->start_block + MerkleTreeBlocks(*inode);
+    uint64_t data_blocks = BlobDataBlocks(*inode);
+    constexpr uint64_t kChunkSize = kBlobChunkBlocks * kBlobstoreBlockSize;
 
+    merkle::Tree mt;
+    merkle::Digest d;
+    d = ((const uint8_t*) &digest_[0]);
+    mx_status_t status;
+    for (uint64_t c = off / kChunkSize; c * kChunkSize < off + len; c++) {
+        if (data_verified_.Get(c, c + 1)) {
+            continue;
+        }
+        if (!data_loaded_.Get(c, c + 1)) {
+            uint64_t n = c * kBlobChunkBlocks;
+            uint64_t end = mxtl::min(n + kBlobChunkBlocks, data_blocks);
+            if ((status = FillBlocks(vmo_blob_, vmoid_blob_, n, data_start + n,
+                                     end - n)) != NO_ERROR) {
+                error("Failed to fill bno\n");
+                return status;
+            }
+            data_loaded_.Set(c, c + 1);
+        }
+
+        // Only the parts of the tree between this chunk and the root are needed
+        uint64_t chunk_off = c * kChunkSize;
+        uint64_t chunk_len = mxtl::min(kChunkSize, inode->blob_size - chunk_off);
+        if ((status = mt.SetRanges(inode->blob_size, chunk_off, chunk_len)) != NO_ERROR) {
+            return status;
+        }
+        for (size_t i = 0; i < mt.ranges().size(); i++) {
+            const merkle::Tree::Range& range = mt.ranges()[i];
+            uint64_t end = mxtl::roundup(range.offset + range.length, kBlobstoreBlockSize);
+            if ((status = LoadTree(range.offset / kBlobstoreBlockSize,
+                                   end / kBlobstoreBlockSize)) != NO_ERROR) {
+                return status;
+            }
+        }
+
+        status = mt.Verify((const void*)vmo_blob_addr_, inode->blob_size,
+                           (const void*)vmo_merkle_tree_addr_, size_merkle,
+                           chunk_off, chunk_len, d);
+        if (status != NO_ERROR) {
+            return status;
+        }
+        data_verified_.Set(c, c + 1);
+    }
     return NO_ERROR;
-fail:
-    BlobCloseHandles();
-    return status;
 }
 
 uint64_t Blob::SizeData() const {
@@ -240,8 +344,10 @@ uint64_t Blob::SizeData() const {
 Blob::Blob(const merkle::Digest& digest) :
     vmo_merkle_tree_(MX_HANDLE_INVALID),
     vmo_merkle_tree_addr_(0),
+    vmoid_merkle_tree_(0),
     vmo_blob_(MX_HANDLE_INVALID),
     vmo_blob_addr_(0),
+    vmoid_blob_(0),
     readable_event_(MX_HANDLE_INVALID),
     bytes_written_(0),
     flags_(kBlobStateEmpty) {
@@ -252,16 +358,23 @@ Blob::Blob(const merkle::Digest& digest) :
 void Blob::BlobCloseHandles() {
     auto inode = &vn->blobstore->node_map_[map_index_];
     if (vmo_merkle_tree_addr_ != 0) {
-        uint64_t size_merkle = merkle::Tree::GetTreeLength(inode->blob_size);
-        mx_vmar_unmap(mx_vmar_root_self(), vmo_merkle_tree_addr_, size_merkle);
+        mx_vmar_unmap(mx_vmar_root_self(), vmo_merkle_tree_addr_,
+                      MerkleTreeBlocks(*inode) * kBlobstoreBlockSize);
     }
     if (vmo_blob_addr_ != 0) {
-        mx_vmar_unmap(mx_vmar_root_self(), vmo_blob_addr_, inode->blob_size);
+        mx_vmar_unmap(mx_vmar_root_self(), vmo_blob_addr_,
+                      BlobDataBlocks(*inode) * kBlobstoreBlockSize);
     }
     if (vmo_merkle_tree_ != MX_HANDLE_INVALID) {
+        if (vn->blobstore->FifoEnabled()) {
+            vn->blobstore->DetachVmo(vmoid_merkle_tree_);
+        }
         mx_handle_close(vmo_merkle_tree_);
     }
     if (vmo_blob_ != MX_HANDLE_INVALID) {
+        if (vn->blobstore->FifoEnabled()) {
+            vn->blobstore->DetachVmo(vmoid_blob_);
+        }
         mx_handle_close(vmo_blob_);
     }
     if (readable_event_ != MX_HANDLE_INVALID) {
@@ -307,24 +420,24 @@ mx_status_t Blob::SpaceAllocate(uint64_t size_data) {
     inode->blob_size = size_data;
     inode->num_blocks = MerkleTreeBlocks(*inode) + BlobDataBlocks(*inode);
 
-    // Open VMOs, so we can begin writing after allocate succeeds.
+    // Open VMOs, so we can begin writing after allocate succeeds. They span
+    // whole blocks, so that they can be written out directly.
     uint64_t size_merkle = merkle::Tree::GetTreeLength(size_data);
     if (size_merkle != 0) {
-        if ((status = mx_vmo_create(size_merkle, 0, &vmo_merkle_tree_)) != NO_ERROR) {
-            goto fail;
-        } else if ((status = mx_vmar_map(mx_vmar_root_self(), 0, vmo_merkle_tree_, 0,
-                                         size_merkle,
-                                         MX_VM_FLAG_PERM_READ | MX_VM_FLAG_PERM_WRITE,
-                                         &vmo_merkle_tree_addr_)) != NO_ERROR) {
+        if ((status = CreateVmo(MerkleTreeBlocks(*inode) * kBlobstoreBlockSize,
+                                MX_VM_FLAG_PERM_READ | MX_VM_FLAG_PERM_WRITE,
+                                &vmo_merkle_tree_, &vmo_merkle_tree_addr_,
+                                &vmoid_merkle_tree_)) != NO_ERROR) {
             goto fail;
         }
     }
-    if ((status = mx_vmo_create(size_data, 0, &vmo_blob_)) != NO_ERROR) {
+    if ((status = CreateVmo(BlobDataBlocks(*inode) * kBlobstoreBlockSize,
+                            MX_VM_FLAG_PERM_READ | MX_VM_FLAG_PERM_WRITE,
+                            &vmo_blob_, &vmo_blob_addr_, &vmoid_blob_)) != NO_ERROR) {
         goto fail;
-    } else if ((status = mx_vmar_map(mx_vmar_root_self(), 0, vmo_blob_, 0,
-                                     size_data,
-                                     MX_VM_FLAG_PERM_READ | MX_VM_FLAG_PERM_WRITE,
-                                     &vmo_blob_addr_)) != NO_ERROR) {
+    }
+    // Everything will have been written through the VMOs before it can be read
+    if ((status = ResetMaps(true)) != NO_ERROR) {
         goto fail;
     }
 
@@ -343,7 +456,8 @@ fail:
 }
 
 // A helper function for dumping either the Merkle Tree or the actual blob data
-// to both (1) The containing VMO, and (2) disk.
+// to both (1) The containing VMO, and (2) disk. With the block FIFO, the disk
+// write is left to WriteMetadata(), which sends the whole blob at once.
 mx_status_t Blob::WriteShared(const void** data, size_t* len, size_t* actual,
                               uint64_t maxlen, mx_handle_t vmo, uint64_t start_block) {
     size_t to_write = mxtl::min(*len, maxlen - bytes_written_);
@@ -351,25 +465,26 @@ mx_status_t Blob::WriteShared(const void** data, size_t* len, size_t* actual,
     if (status != NO_ERROR) {
         return status;
     }
-
-    // Write as many 'entire blocks' as possible
-    uint64_t n = bytes_written_ / kBlobstoreBlockSize;
-    uint64_t n_end = (bytes_written_ + to_write) / kBlobstoreBlockSize;
-    while (n < n_end) {
-        status = vn_dump_block(vn->blobstore->blockfd_, vmo, n, n + start_block, false);
-        if (status != NO_ERROR) {
-            return status;
+    if (!vn->blobstore->FifoEnabled()) {
+        // Write as many 'entire blocks' as possible
+        uint64_t n = bytes_written_ / kBlobstoreBlockSize;
+        uint64_t n_end = (bytes_written_ + to_write) / kBlobstoreBlockSize;
+        while (n < n_end) {
+            status = vn_dump_block(vn->blobstore->blockfd_, vmo, n, n + start_block, false);
+            if (status != NO_ERROR) {
+                return status;
+            }
+            n++;
         }
-        n++;
-    }
 
-    // Special case: We've written all the 'whole blocks', but we're missing
-    // a partial block at the very end.
-    if ((bytes_written_ + to_write == maxlen) &&
-        (maxlen % kBlobstoreBlockSize != 0)) {
-        status = vn_dump_block(vn->blobstore->blockfd_, vmo, n, n + start_block, true);
-        if (status != NO_ERROR) {
-            return status;
+        // Special case: We've written all the 'whole blocks', but we're missing
+        // a partial block at the very end.
+        if ((bytes_written_ + to_write == maxlen) &&
+            (maxlen % kBlobstoreBlockSize != 0)) {
+            status = vn_dump_block(vn->blobstore->blockfd_, vmo, n, n + start_block, true);
+            if (status != NO_ERROR) {
+                return status;
+            }
         }
     }
 
@@ -401,21 +516,41 @@ mx_status_t Blob::WriteMetadata() {
     // This 'kBlobFlagSync' is currently not used, but it indicates when the sync is
     // complete.
     flags_ |= kBlobFlagSync;
-    auto inode = &vn->blobstore->node_map_[map_index_];
-
-    // Write block allocation bitmap
-    if (vn->blobstore->WriteBitmap(inode->num_blocks, inode->start_block) != NO_ERROR) {
+    Blobstore* bs = vn->blobstore.get();
+    auto inode = &bs->node_map_[map_index_];
+
+    if (bs->FifoEnabled()) {
+        // Write the Merkle tree, the data and the block allocation bitmap
+        // in one transaction
+        BlockTxn txn(bs, BLOCKIO_WRITE);
+        uint64_t tree_blocks = MerkleTreeBlocks(*inode);
+        mx_status_t status = NO_ERROR;
+        if (tree_blocks != 0) {
+            status = txn.Enqueue(vmoid_merkle_tree_, 0, inode->start_block, tree_blocks);
+        }
+        if (status == NO_ERROR) {
+            status = txn.Enqueue(vmoid_blob_, 0, inode->start_block + tree_blocks,
+                                 BlobDataBlocks(*inode));
+        }
+        if (status == NO_ERROR) {
+            status = bs->EnqueueBitmap(&txn, inode->num_blocks, inode->start_block);
+        }
+        if ((status != NO_ERROR) || (txn.Flush() != NO_ERROR)) {
+            return ERR_IO;
+        }
+    } else if (bs->WriteBitmap(inode->num_blocks, inode->start_block) != NO_ERROR) {
+        // Write block allocation bitmap
         return ERR_IO;
     }
 
     // Flush the block allocation bitmap to disk
-    fsync(vn->blobstore->blockfd_);
+    fsync(bs->blockfd_);
 
     // Update the on-disk hash
     memcpy(inode->merkle_root_hash, &digest_[0], merkle::Digest::kLength);
 
     // Write back the blob node
-    if (vn->blobstore->WriteNode(map_index_)) {
+    if (bs->WriteNode(map_index_)) {
         return ERR_IO;
     }
 
@@ -504,15 +639,13 @@ mx_status_t Blob::Read(void* data, size_t len, size_t off, size_t* actual) {
         return status;
     }
 
-    merkle::Tree mt;
-    merkle::Digest d;
-    d = ((const uint8_t*) &digest_[0]);
     auto inode = &vn->blobstore->node_map_[map_index_];
-    uint64_t size_merkle = merkle::Tree::GetTreeLength(inode->blob_size);
-    status = mt.Verify((const void*)vmo_blob_addr_, inode->blob_size,
-                       (const void*)vmo_merkle_tree_addr_, size_merkle,
-                       off, len, d);
-    if (status != NO_ERROR) {
+    if (off >= inode->blob_size) {
+        *actual = 0;
+        return NO_ERROR;
+    }
+    len = mxtl::min(len, static_cast<size_t>(inode->blob_size - off));
+    if ((status = LoadVerified(off, len)) != NO_ERROR) {
         return status;
     }
 
@@ -561,11 +694,62 @@ void Blobstore::FreeNode(size_t node_index) {
 }
 
 mx_status_t Blobstore::Unmount() {
+    if (FifoEnabled()) {
+        DetachVmo(block_map_vmoid_);
+        DetachVmo(node_map_vmoid_);
+        block_fifo_release_client(fifo_client_);
+        fifo_client_ = nullptr;
+        ioctl_block_fifo_close(blockfd_);
+    }
     close(blockfd_);
     return NO_ERROR;
 }
 
+mx_status_t Blobstore::AttachVmo(mx_handle_t vmo, vmoid_t* out) {
+    mx_handle_t vmo_dup;
+    mx_status_t status;
+    if ((status = mx_handle_duplicate(vmo, MX_RIGHT_SAME_RIGHTS, &vmo_dup)) != NO_ERROR) {
+        return status;
+    }
+    ssize_t r = ioctl_block_attach_vmo(blockfd_, &vmo_dup, out);
+    if (r != sizeof(vmoid_t)) {
+        return (r < 0) ? static_cast<mx_status_t>(r) : ERR_IO;
+    }
+    return NO_ERROR;
+}
+
+mx_status_t Blobstore::DetachVmo(vmoid_t vmoid) {
+    block_fifo_request_t request;
+    request.vmoid = vmoid;
+    request.opcode = BLOCKIO_CLOSE_VMO;
+    return Txn(&request, 1);
+}
+
+mx_status_t Blobstore::Txn(block_fifo_request_t* requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        requests[i].txnid = txnid_;
+    }
+    return block_fifo_txn(fifo_client_, requests, count);
+}
+
+mx_status_t Blobstore::EnqueueBitmap(BlockTxn* txn, uint64_t nblocks, uint64_t start_block) {
+    uint64_t bbm_start_block = (start_block) / kBlobstoreBlockBits;
+    uint64_t bbm_end_block = mxtl::roundup(start_block + nblocks, kBlobstoreBlockBits) /
+            kBlobstoreBlockBits;
+    return txn->Enqueue(block_map_vmoid_, bbm_start_block, BlockMapStartBlock() + bbm_start_block,
+                        bbm_end_block - bbm_start_block);
+}
+
 mx_status_t Blobstore::WriteBitmap(uint64_t nblocks, uint64_t start_block) {
+    if (FifoEnabled()) {
+        BlockTxn txn(this, BLOCKIO_WRITE);
+        mx_status_t status = EnqueueBitmap(&txn, nblocks, start_block);
+        if ((status != NO_ERROR) || (txn.Flush() != NO_ERROR)) {
+            return ERR_IO;
+        }
+        return NO_ERROR;
+    }
+
     uint64_t bbm_start_block = (start_block) / kBlobstoreBlockBits;
     uint64_t bbm_end_block = mxtl::roundup(start_block + nblocks, kBlobstoreBlockBits) /
             kBlobstoreBlockBits;
@@ -582,6 +766,15 @@ mx_status_t Blobstore::WriteBitmap(uint64_t nblocks, uint64_t start_block) {
 
 mx_status_t Blobstore::WriteNode(size_t map_index) {
     uint64_t b = (map_index * sizeof(blobstore_inode_t)) / kBlobstoreBlockSize;
+    if (FifoEnabled()) {
+        BlockTxn txn(this, BLOCKIO_WRITE);
+        mx_status_t status = txn.Enqueue(node_map_vmoid_, b, NodeMapStartBlock(info_) + b, 1);
+        if ((status != NO_ERROR) || (txn.Flush() != NO_ERROR)) {
+            return ERR_IO;
+        }
+        return NO_ERROR;
+    }
+
     void* data = GetNodemapData(b);
     if (writeblk(blockfd_, NodeMapStartBlock(info_) + b, data) != NO_ERROR) {
         return ERR_IO;
@@ -589,6 +782,26 @@ mx_status_t Blobstore::WriteNode(size_t map_index) {
     return NO_ERROR;
 }
 
+void Blobstore::DiscardBlocks(uint64_t nblocks, uint64_t start_block) {
+    if (!FifoEnabled() || !discard_enabled_) {
+        return;
+    }
+    // The node which gave up the blocks must be stable before they are
+    // discarded, or a crash could bring back a blob with lost contents
+    if (fsync(blockfd_) < 0) {
+        return;
+    }
+    block_fifo_request_t request;
+    request.vmoid = 0; // Ignored by trims
+    request.opcode = BLOCKIO_TRIM;
+    request.length = nblocks * kBlobstoreBlockSize;
+    request.vmo_offset = 0;
+    request.dev_offset = start_block * kBlobstoreBlockSize;
+    if (Txn(&request, 1) == ERR_NOT_SUPPORTED) {
+        discard_enabled_ = false;
+    }
+}
+
 mx_status_t Blobstore::VnodeNew(mxtl::RefPtr<Blobstore> bs, mxtl::RefPtr<Blob> blob,
                                 VnodeBlob** out) {
     AllocChecker ac;
@@ -662,8 +875,10 @@ mx_status_t Blobstore::ReleaseBlob(mxtl::RefPtr<Blob> blob) {
             uint64_t nblocks = node_map_[node_index].num_blocks;
             FreeNode(node_index);
             FreeBlocks(nblocks, start_block);
-            WriteNode(node_index);
-            WriteBitmap(nblocks, start_block);
+            mx_status_t status = WriteNode(node_index);
+            if ((WriteBitmap(nblocks, start_block) == NO_ERROR) && (status == NO_ERROR)) {
+                DiscardBlocks(nblocks, start_block);
+            }
             hash_.erase(*blob);
             return NO_ERROR;
         }
@@ -713,11 +928,63 @@ mx_status_t Blobstore::LookupBlob(mxtl::RefPtr<Blobstore> bs, const merkle::Dige
     return ERR_NOT_FOUND;
 }
 
-Blobstore::Blobstore(int fd, const blobstore_info_t* info) : blockfd_(fd) {
+Blobstore::Blobstore(int fd, const blobstore_info_t* info) :
+    blockfd_(fd), node_map_vmo_(MX_HANDLE_INVALID), node_map_(nullptr),
+    fifo_client_(nullptr), txnid_(0), block_map_vmoid_(0), node_map_vmoid_(0),
+    discard_enabled_(true) {
     memcpy(&info_, info, sizeof(blobstore_info_t));
 }
 
-Blobstore::~Blobstore() {}
+Blobstore::~Blobstore() {
+    if (node_map_ != nullptr) {
+        mx_vmar_unmap(mx_vmar_root_self(), reinterpret_cast<uintptr_t>(node_map_),
+                      NodeMapBlocks(info_) * kBlobstoreBlockSize);
+    }
+    if (node_map_vmo_ != MX_HANDLE_INVALID) {
+        mx_handle_close(node_map_vmo_);
+    }
+}
+
+mx_status_t Blobstore::InitNodeMap() {
+    uint64_t size = NodeMapBlocks(info_) * kBlobstoreBlockSize;
+    mx_status_t status;
+    if ((status = mx_vmo_create(size, 0, &node_map_vmo_)) != NO_ERROR) {
+        return status;
+    }
+    uintptr_t addr;
+    if ((status = mx_vmar_map(mx_vmar_root_self(), 0, node_map_vmo_, 0, size,
+                              MX_VM_FLAG_PERM_READ | MX_VM_FLAG_PERM_WRITE,
+                              &addr)) != NO_ERROR) {
+        return status;
+    }
+    node_map_ = reinterpret_cast<blobstore_inode_t*>(addr);
+    return NO_ERROR;
+}
+
+void Blobstore::ConnectFifo() {
+    mx_handle_t fifo;
+    if (ioctl_block_get_fifos(blockfd_, &fifo) != sizeof(fifo)) {
+        // Not a block device (or somebody else owns its fifo), use plain I/O
+        return;
+    }
+    if (ioctl_block_alloc_txn(blockfd_, &txnid_) != sizeof(txnid_)) {
+        goto fail;
+    }
+    if (AttachVmo(block_map_.StorageUnsafe()->GetVmo(), &block_map_vmoid_) != NO_ERROR) {
+        goto fail;
+    }
+    if (AttachVmo(node_map_vmo_, &node_map_vmoid_) != NO_ERROR) {
+        goto fail;
+    }
+    if (block_fifo_create_client(fifo, &fifo_client_) != NO_ERROR) {
+        goto fail;
+    }
+    return;
+fail:
+    error("blobstore: cannot set up block fifo, falling back to read/write\n");
+    mx_handle_close(fifo);
+    ioctl_block_fifo_close(blockfd_);
+}
 
 mx_status_t Blobstore::Create(int fd, const blobstore_info_t* info, VnodeBlob** out) {
     uint64_t blocks = info->block_count;
@@ -743,11 +1010,11 @@ mx_status_t Blobstore::Create(int fd, const blobstore_info_t* info, VnodeBlob**
         return status;
     }
 
-    auto nodemap = new (&ac) blobstore_inode_t[fs->info_.inode_count];
-    if (!ac.check()) {
-        return ERR_NO_MEMORY;
+    if ((status = fs->InitNodeMap()) != NO_ERROR) {
+        fprintf(stderr, "blobstore: Could not map node map\n");
+        return status;
     }
-    fs->node_map_.reset(mxtl::move(nodemap));
+    fs->ConnectFifo();
 
     if ((status = fs->LoadBitmaps()) < 0) {
         fprintf(stderr, "blobstore: Failed to load bitmaps\n");
@@ -763,6 +1030,19 @@ mx_status_t Blobstore::LoadBitmaps() {
     uint64_t bbm_blocks = BlockMapBlocks(info_);
     uint64_t nbm_blocks = NodeMapBlocks(info_);
 
+    if (FifoEnabled()) {
+        BlockTxn txn(this, BLOCKIO_READ);
+        mx_status_t status = txn.Enqueue(block_map_vmoid_, 0, BlockMapStartBlock(), bbm_blocks);
+        if (status == NO_ERROR) {
+            status = txn.Enqueue(node_map_vmoid_, 0, NodeMapStartBlock(info_), nbm_blocks);
+        }
+        if ((status != NO_ERROR) || (txn.Flush() != NO_ERROR)) {
+            fprintf(stderr, "blobstore: failed reading bitmaps\n");
+            return ERR_IO;
+        }
+        return NO_ERROR;
+    }
+
     for (uint64_t n = 0; n < bbm_blocks; n++) {
         if (readblk(blockfd_, BlockMapStartBlock() + n, GetBlockmapData(n))) {
             fprintf(stderr, "blobstore: failed reading alloc bitmap\n");
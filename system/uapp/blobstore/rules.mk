@@ -19,6 +19,7 @@ MODULE_SRCS := \
 
 MODULE_STATIC_LIBS := \
     ulib/fs \
+    ulib/block-client \
     ulib/merkle \
     ulib/cryptolib \
 
@@ -162,6 +162,76 @@ out:
     return rc;
 }
 
+static void print_latency(const char* op, const block_latency_hist_t* hist) {
+    uint64_t total = 0;
+    for (int i = 0; i < BLOCK_LATENCY_BUCKETS; i++) {
+        total += hist->device[i];
+    }
+    if (total == 0) {
+        return;
+    }
+    printf("%s (%" PRIu64 " ops)\n", op, total);
+    printf("  %-12s %12s %12s\n", "latency", "queued", "device");
+    for (int i = 0; i < BLOCK_LATENCY_BUCKETS; i++) {
+        if (hist->queued[i] == 0 && hist->device[i] == 0) {
+            continue;
+        }
+        char label[16];
+        if (i == BLOCK_LATENCY_BUCKETS - 1) {
+            snprintf(label, sizeof(label), ">=%" PRIu64 "us", (uint64_t)1 << (i - 1));
+        } else {
+            snprintf(label, sizeof(label), "<%" PRIu64 "us", (uint64_t)1 << i);
+        }
+        printf("  %-12s %12" PRIu64 " %12" PRIu64 "\n", label, hist->queued[i], hist->device[i]);
+    }
+}
+
+static int cmd_latency_blk(const char* dev) {
+    int fd = open(dev, O_RDONLY);
+    if (fd < 0) {
+        printf("Error opening %s\n", dev);
+        return fd;
+    }
+
+    block_latency_t latency;
+    ssize_t rc = ioctl_block_get_latency(fd, &latency);
+    if (rc < 0) {
+        printf("Error getting latency for %s (is a FIFO server running?)\n", dev);
+        goto out;
+    }
+    print_latency("read", &latency.read);
+    print_latency("write", &latency.write);
+    print_latency("trim", &latency.trim);
+    rc = 0;
+out:
+    close(fd);
+    return rc;
+}
+
+static int cmd_trace_blk(const char* dev, const char* state) {
+    uint32_t enable;
+    if (!strcmp(state, "on")) {
+        enable = 1;
+    } else if (!strcmp(state, "off")) {
+        enable = 0;
+    } else {
+        printf("Expected on or off, not %s\n", state);
+        return -1;
+    }
+
+    int fd = open(dev, O_RDONLY);
+    if (fd < 0) {
+        printf("Error opening %s\n", dev);
+        return fd;
+    }
+    ssize_t rc = ioctl_block_set_trace(fd, &enable);
+    if (rc < 0) {
+        printf("Error %zd setting block tracing for %s\n", rc, dev);
+    }
+    close(fd);
+    return rc;
+}
+
 int main(int argc, const char** argv) {
     int rc = 0;
     const char *cmd = argc > 1 ? argv[1] : NULL;
@@ -171,6 +241,12 @@ int main(int argc, const char** argv) {
         } else if (!strcmp(cmd, "read")) {
             if (argc < 5) goto usage;
             rc = cmd_read_blk(argv[2], strtoul(argv[3], NULL, 10), strtoull(argv[4], NULL, 10));
+        } else if (!strcmp(cmd, "latency")) {
+            if (argc < 3) goto usage;
+            rc = cmd_latency_blk(argv[2]);
+        } else if (!strcmp(cmd, "trace")) {
+            if (argc < 4) goto usage;
+            rc = cmd_trace_blk(argv[2], argv[3]);
         } else {
             printf("Unrecognized command %s!\n", cmd);
             goto usage;
@@ -183,5 +259,7 @@ usage:
     printf("Usage:\n");
     printf("%s\n", argv[0]);
     printf("%s read <blkdev> <offset> <count>\n", argv[0]);
+    printf("%s latency <blkdev>\n", argv[0]);
+    printf("%s trace <blkdev> on|off\n", argv[0]);
     return 0;
 }
@@ -5,11 +5,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs/trace.h>
 
+#ifdef __Fuchsia__
+#include <magenta/device/block.h>
+#include <magenta/process.h>
+#include <magenta/syscalls.h>
+#include <mxtl/auto_lock.h>
+#endif
+
 #include <magenta/new.h>
+#include <mxtl/algorithm.h>
 #include <mxtl/ref_ptr.h>
 #include <mxtl/unique_ptr.h>
 
@@ -18,9 +27,43 @@
 
 namespace minfs {
 
-mx_status_t Bcache::Readblk(uint32_t bno, void* data) {
+#ifdef __Fuchsia__
+// Seconds a dirty block may sit in the cache before the flusher writes it
+constexpr time_t kMinfsFlushInterval = 1;
+
+mx_status_t Bcache::FifoBlockTxn(uint16_t opcode, uint32_t bno, uintptr_t buffer_offset) {
+    block_fifo_request_t request;
+    request.txnid = txnid_;
+    request.vmoid = buffer_vmoid_;
+    request.opcode = opcode;
+    request.length = blocksize_;
+    request.vmo_offset = buffer_offset;
+    request.dev_offset = static_cast<uint64_t>(bno) * blocksize_;
+    return block_fifo_txn(fifo_client_, &request, 1);
+}
+#endif
+
+mx_status_t Bcache::ReadblkRaw(uint32_t bno, void* data) {
     off_t off = bno * kMinfsBlockSize;
     trace(IO, "readblk() bno=%u off=%#llx\n", bno, (unsigned long long)off);
+#ifdef __Fuchsia__
+    if (FifoEnabled()) {
+        // Blocks of the cache itself are read in place, anything else goes
+        // through the first staging block.
+        uintptr_t addr = reinterpret_cast<uintptr_t>(data);
+        bool in_cache = (addr >= buffer_) && (addr < buffer_ + cache_blocks_ * blocksize_);
+        uintptr_t offset = in_cache ? addr - buffer_ : cache_blocks_ * blocksize_;
+        mx_status_t status = FifoBlockTxn(BLOCKIO_READ, bno, offset);
+        if (status != NO_ERROR) {
+            error("minfs: cannot read block %u: %d\n", bno, status);
+            return ERR_IO;
+        }
+        if (!in_cache) {
+            memcpy(data, BufferBlock(cache_blocks_), blocksize_);
+        }
+        return NO_ERROR;
+    }
+#endif
     if (lseek(fd_, off, SEEK_SET) < 0) {
         error("minfs: cannot seek to block %u\n", bno);
         return ERR_IO;
@@ -32,19 +75,457 @@ mx_status_t Bcache::Readblk(uint32_t bno, void* data) {
     return NO_ERROR;
 }
 
+mx_status_t Bcache::Readblk(uint32_t bno, void* data) {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    auto blk = hash_.find(bno);
+    if (blk.IsValid()) {
+        memcpy(data, blk->data(), blocksize_);
+        return NO_ERROR;
+    }
+    return ReadblkRaw(bno, data);
+}
+
+mx_status_t Bcache::WriteblkFlags(uint32_t bno, const void* data, uint32_t flags) {
+    trace(IO, "writeblk() bno=%u\n", bno);
+    mxtl::RefPtr<BlockNode> blk = GetZero(bno);
+    if (blk == nullptr) {
+        return ERR_IO;
+    }
+    memcpy(blk->data(), data, blocksize_);
+    Put(mxtl::move(blk), flags);
+    return NO_ERROR;
+}
+
 mx_status_t Bcache::Writeblk(uint32_t bno, const void* data) {
-    off_t off = bno * kMinfsBlockSize;
-    trace(IO, "writeblk() bno=%u off=%#llx\n", bno, (unsigned long long)off);
-    if (lseek(fd_, off, SEEK_SET) < 0) {
+    return WriteblkFlags(bno, data, kBlockDirty);
+}
+
+mx_status_t Bcache::WriteData(uint32_t bno, const void* data) {
+    return WriteblkFlags(bno, data, kBlockDirty | kBlockData);
+}
+
+mx_status_t Bcache::WriteRunLocked(uint32_t bno, uint32_t staged, uint32_t count) {
+    uintptr_t offset = (cache_blocks_ + staged) * blocksize_;
+    size_t length = count * blocksize_;
+#ifdef __Fuchsia__
+    if (FifoEnabled()) {
+        block_fifo_request_t request;
+        request.txnid = txnid_;
+        request.vmoid = buffer_vmoid_;
+        request.opcode = BLOCKIO_WRITE;
+        request.length = length;
+        request.vmo_offset = offset;
+        request.dev_offset = static_cast<uint64_t>(bno) * blocksize_;
+        return block_fifo_txn(fifo_client_, &request, 1);
+    }
+#endif
+    if (lseek(fd_, static_cast<off_t>(bno) * blocksize_, SEEK_SET) < 0) {
         error("minfs: cannot seek to block %u\n", bno);
         return ERR_IO;
     }
-    if (write(fd_, data, kMinfsBlockSize) != kMinfsBlockSize) {
-        error("minfs: cannot write block %u\n", bno);
+    if (write(fd_, reinterpret_cast<void*>(buffer_ + offset), length) !=
+        static_cast<ssize_t>(length)) {
+        error("minfs: cannot write blocks %u-%u\n", bno, bno + count - 1);
+        return ERR_IO;
+    }
+    return NO_ERROR;
+}
+
+mx_status_t Bcache::SyncLocked() {
+    if (fsync(fd_) < 0) {
+        error("minfs: cannot sync device\n");
+        return ERR_IO;
+    }
+    return NO_ERROR;
+}
+
+mx_status_t Bcache::WriteStagedLocked(BlockNode* const* blocks, size_t count) {
+#ifdef __Fuchsia__
+    block_fifo_request_t requests[MAX_TXN_MESSAGES];
+    size_t nreq = 0;
+#endif
+    size_t run = 0;
+    for (size_t i = 1; i <= count; i++) {
+        if ((i < count) && (blocks[i]->bno_ == blocks[i - 1]->bno_ + 1)) {
+            continue;
+        }
+
+        // blocks[run] through blocks[i - 1] are consecutive on disk
+        uint32_t bno = blocks[run]->bno_;
+        uint32_t staged = static_cast<uint32_t>(run);
+        uint32_t nblocks = static_cast<uint32_t>(i - run);
+        trace(IO, "writeback bno=%u count=%u\n", bno, nblocks);
+        run = i;
+
+#ifdef __Fuchsia__
+        if (FifoEnabled()) {
+            if (nreq == countof(requests)) {
+                mx_status_t status = block_fifo_txn(fifo_client_, requests, nreq);
+                if (status != NO_ERROR) {
+                    return status;
+                }
+                nreq = 0;
+            }
+            block_fifo_request_t* request = &requests[nreq++];
+            request->txnid = txnid_;
+            request->vmoid = buffer_vmoid_;
+            request->opcode = BLOCKIO_WRITE;
+            request->length = nblocks * blocksize_;
+            request->vmo_offset = (cache_blocks_ + staged) * blocksize_;
+            request->dev_offset = static_cast<uint64_t>(bno) * blocksize_;
+            continue;
+        }
+#endif
+        mx_status_t status = WriteRunLocked(bno, staged, nblocks);
+        if (status != NO_ERROR) {
+            return status;
+        }
+    }
+#ifdef __Fuchsia__
+    if (nreq > 0) {
+        return block_fifo_txn(fifo_client_, requests, nreq);
+    }
+#endif
+    return NO_ERROR;
+}
+
+static int bno_compare(const void* a, const void* b) {
+    uint32_t bno_a = (*static_cast<BlockNode* const*>(a))->GetKey();
+    uint32_t bno_b = (*static_cast<BlockNode* const*>(b))->GetKey();
+    return (bno_a > bno_b) - (bno_a < bno_b);
+}
+
+size_t Bcache::CollectDirtyLocked(BlockNode** out, bool in_place) {
+    // Busy blocks may still be changing, they are written once put back
+    size_t count = 0;
+    for (auto& blk : hash_) {
+        if ((blk.flags_ & kBlockDirty) && (blk.flags_ & kBlockLRU) &&
+            (InPlace(blk) == in_place)) {
+            out[count++] = &blk;
+        }
+    }
+    qsort(out, count, sizeof(out[0]), bno_compare);
+    return count;
+}
+
+mx_status_t Bcache::WriteBackLocked(BlockNode* const* blocks, size_t count) {
+    for (size_t start = 0; start < count; start += kMinfsFlushBatch) {
+        size_t batch = mxtl::min(count - start, static_cast<size_t>(kMinfsFlushBatch));
+        for (size_t i = 0; i < batch; i++) {
+            memcpy(BufferBlock(cache_blocks_ + static_cast<uint32_t>(i)),
+                   blocks[start + i]->data(), blocksize_);
+        }
+        mx_status_t status;
+        if ((status = WriteStagedLocked(&blocks[start], batch)) != NO_ERROR) {
+            error("minfs: block write back failed: %d\n", status);
+            return ERR_IO;
+        }
+        for (size_t i = 0; i < batch; i++) {
+            MarkClean(blocks[start + i]);
+        }
+    }
+    return NO_ERROR;
+}
+
+// Should the blocks be written in place only partially, the journal still
+// holds all of them, and they are written again at the next mount. The
+// device may reorder writes, so it is synced before the blocks are written
+// in place, and again before the header which covers them is cleared.
+mx_status_t Bcache::CommitLocked(BlockNode* const* blocks, size_t count) {
+    trace(BCACHE, "bcache_commit() %zu blocks\n", count);
+    minfs_journal_t* header = static_cast<minfs_journal_t*>(BufferBlock(cache_blocks_));
+    memset(header, 0, blocksize_);
+    header->magic = kMinfsJournalMagic;
+    header->count = static_cast<uint32_t>(count);
+    for (size_t i = 0; i < count; i++) {
+        header->bno[i] = blocks[i]->bno_;
+    }
+    uint32_t sum = minfs_journal_checksum(FNV32_OFFSET_BASIS, header->bno,
+                                          count * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        sum = minfs_journal_checksum(sum, blocks[i]->data(), blocksize_);
+    }
+    header->checksum = sum;
+
+    // The header and the blocks go out as one sequential run, a staging
+    // area at a time
+    mx_status_t status;
+    uint32_t bno = jnl_block_;
+    uint32_t staged = 1;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(BufferBlock(cache_blocks_ + staged), blocks[i]->data(), blocksize_);
+        if (++staged == kMinfsFlushBatch) {
+            if ((status = WriteRunLocked(bno, 0, staged)) != NO_ERROR) {
+                return status;
+            }
+            bno += staged;
+            staged = 0;
+        }
+    }
+    if ((staged > 0) && (status = WriteRunLocked(bno, 0, staged)) != NO_ERROR) {
+        return status;
+    }
+
+    if (((status = SyncLocked()) != NO_ERROR) ||
+        ((status = WriteBackLocked(blocks, count)) != NO_ERROR) ||
+        ((status = SyncLocked()) != NO_ERROR)) {
+        return status;
+    }
+    memset(header, 0, blocksize_);
+    return WriteRunLocked(jnl_block_, 0, 1);
+}
+
+mx_status_t Bcache::FlushDataLocked() {
+    BlockNode* dirty[kMinfsBlockCacheSize];
+    size_t count = CollectDirtyLocked(dirty, true);
+    trace(BCACHE, "bcache_flush() %zu of %u dirty blocks in place\n", count, dirty_count_);
+    return WriteBackLocked(dirty, count);
+}
+
+// File contents go out first, and the device is synced before the journal
+// is written, so that committed metadata never refers to blocks which have
+// yet to reach the disk. A block freed by an update may be rewritten as file
+// data before that update commits; after a crash, the file which had it may
+// show the new contents, but metadata stays sound.
+mx_status_t Bcache::FlushLocked() {
+    commit_pending_ = false;
+    if (dirty_count_ == 0) {
+        DiscardLocked();
+        return NO_ERROR;
+    }
+    BlockNode* dirty[kMinfsBlockCacheSize];
+    size_t count = CollectDirtyLocked(dirty, true);
+    trace(BCACHE, "bcache_flush() %zu of %u dirty blocks in place\n", count, dirty_count_);
+    mx_status_t status;
+    if ((status = WriteBackLocked(dirty, count)) != NO_ERROR) {
+        return status;
+    }
+    if (jnl_blocks_ == 0) {
+        DiscardLocked();
+        return NO_ERROR;
+    }
+
+    bool data_written = (count > 0);
+    count = CollectDirtyLocked(dirty, false);
+    // minfs_check_info() only accepts journals which hold the whole cache
+    assert(count <= mxtl::min(jnl_blocks_ - 1, kMinfsJournalMaxEntries));
+    if (count == 0) {
+        DiscardLocked();
+        return NO_ERROR;
+    }
+    if ((data_written && (status = SyncLocked()) != NO_ERROR) ||
+        (status = CommitLocked(dirty, count)) != NO_ERROR) {
+        error("minfs: journal commit failed: %d\n", status);
         return ERR_IO;
     }
+    DiscardLocked();
+    return NO_ERROR;
+}
+
+mx_status_t Bcache::FlushAllowedLocked() {
+    if (updates_active_ == 0) {
+        return FlushLocked();
+    }
+    commit_pending_ = true;
+    return FlushDataLocked();
+}
+
+mx_status_t Bcache::Flush() {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    return FlushLocked();
+}
+
+mx_status_t Bcache::FlushData() {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    return FlushDataLocked();
+}
+
+void Bcache::SetJournal(uint32_t start, uint32_t count) {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    // Whatever was dirtied before goes in place, as it would have
+    FlushLocked();
+    jnl_block_ = start;
+    jnl_blocks_ = count;
+}
+
+void Bcache::BeginUpdate() {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    // An update cannot commit until it ends, so it must find room in the
+    // cache for all the metadata it dirties
+    if ((updates_active_ == 0) && (dirty_count_ >= kMinfsDirtyHighWater) &&
+        (FlushLocked() != NO_ERROR)) {
+        error("minfs: cannot commit before update\n");
+    }
+    updates_active_++;
+}
+
+void Bcache::EndUpdate() {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    assert(updates_active_ > 0);
+    if ((--updates_active_ == 0) && commit_pending_ && (FlushLocked() != NO_ERROR)) {
+        error("minfs: cannot commit update\n");
+    }
+}
+
+void Bcache::Discard(uint32_t start, uint32_t count) {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    if (!discard_enabled_ || (count == 0)) {
+        return;
+    }
+    if (discard_count_ > 0) {
+        DiscardRange* last = &discards_[discard_count_ - 1];
+        if (last->start + last->count == start) {
+            last->count += count;
+            return;
+        } else if (start + count == last->start) {
+            last->start = start;
+            last->count += count;
+            return;
+        }
+    }
+    // Discards only spare the device work, so once too many are pending,
+    // further ones are dropped
+    if (discard_count_ < kMinfsMaxDiscards) {
+        discards_[discard_count_++] = {start, count};
+    }
+}
+
+void Bcache::Reuse(uint32_t start, uint32_t count) {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    uint32_t end = start + count;
+    size_t i = 0;
+    while (i < discard_count_) {
+        DiscardRange* range = &discards_[i];
+        uint32_t range_end = range->start + range->count;
+        if ((end <= range->start) || (range_end <= start)) {
+            i++;
+        } else if ((range->start >= start) && (range_end <= end)) {
+            *range = discards_[--discard_count_];
+        } else {
+            // Keep whatever lies on either side of the reused blocks
+            if ((range->start < start) && (range_end > end) &&
+                (discard_count_ < kMinfsMaxDiscards)) {
+                discards_[discard_count_++] = {end, range_end - end};
+            }
+            if (range->start < start) {
+                range->count = start - range->start;
+            } else {
+                range->count = range_end - end;
+                range->start = end;
+            }
+            i++;
+        }
+    }
+}
+
+void Bcache::DiscardLocked() {
+    // An update under way may not yet have dropped every reference to the
+    // blocks it freed; they wait for a commit made outside of one
+    if ((updates_active_ > 0) || (discard_count_ == 0)) {
+        return;
+    }
+#ifdef __Fuchsia__
+    // The metadata which freed the blocks must be stable before they are
+    // discarded, or a crash could bring back references to lost contents
+    if (SyncLocked() != NO_ERROR) {
+        discard_count_ = 0;
+        return;
+    }
+    block_fifo_request_t requests[MAX_TXN_MESSAGES];
+    for (size_t i = 0; i < discard_count_; i += countof(requests)) {
+        size_t count = mxtl::min(discard_count_ - i, countof(requests));
+        for (size_t n = 0; n < count; n++) {
+            requests[n].txnid = txnid_;
+            requests[n].vmoid = buffer_vmoid_;
+            requests[n].opcode = BLOCKIO_TRIM;
+            requests[n].length = static_cast<uint64_t>(discards_[i + n].count) * blocksize_;
+            requests[n].vmo_offset = 0;
+            requests[n].dev_offset = static_cast<uint64_t>(discards_[i + n].start) * blocksize_;
+        }
+        mx_status_t status = block_fifo_txn(fifo_client_, requests, count);
+        if (status == ERR_NOT_SUPPORTED) {
+            discard_enabled_ = false;
+            break;
+        } else if (status != NO_ERROR) {
+            error("minfs: discard failed: %d\n", status);
+            break;
+        }
+    }
+#endif
+    discard_count_ = 0;
+}
+
+#ifdef __Fuchsia__
+mx_status_t Bcache::AttachVmo(mx_handle_t vmo, vmoid_t* out) {
+    if (!FifoEnabled()) {
+        mx_handle_close(vmo);
+        return ERR_NOT_SUPPORTED;
+    }
+    ssize_t r = ioctl_block_attach_vmo(fd_, &vmo, out);
+    if (r != sizeof(vmoid_t)) {
+        return (r < 0) ? static_cast<mx_status_t>(r) : ERR_IO;
+    }
+    return NO_ERROR;
+}
+
+mx_status_t Bcache::DetachVmo(vmoid_t vmoid) {
+    block_fifo_request_t request;
+    request.vmoid = vmoid;
+    request.opcode = BLOCKIO_CLOSE_VMO;
+    return Txn(&request, 1);
+}
+
+mx_status_t Bcache::Txn(block_fifo_request_t* requests, size_t count) {
+    mxtl::AutoLock lock(&lock_);
+    for (size_t i = 0; i < count; i++) {
+        requests[i].txnid = txnid_;
+    }
+    return block_fifo_txn(fifo_client_, requests, count);
+}
+
+int Bcache::FlusherThread(void* arg) {
+    Bcache* bc = static_cast<Bcache*>(arg);
+    mxtl::AutoLock lock(&bc->lock_);
+    while (!bc->flusher_stop_) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += kMinfsFlushInterval;
+        cnd_timedwait(&bc->flusher_wake_, bc->lock_.GetInternal(), &deadline);
+        if (!bc->flusher_stop_) {
+            bc->FlushAllowedLocked();
+        }
+    }
+    return 0;
+}
+
+mx_status_t Bcache::StartFlusher() {
+    mxtl::AutoLock lock(&lock_);
+    if (flusher_running_) {
+        return ERR_BAD_STATE;
+    }
+    if (thrd_create(&flusher_thread_, FlusherThread, this) != thrd_success) {
+        return ERR_NO_RESOURCES;
+    }
+    flusher_running_ = true;
     return NO_ERROR;
 }
+#endif
 
 constexpr uint32_t kModeFind = 0;
 constexpr uint32_t kModeLoad = 1;
@@ -59,17 +540,30 @@ static const char* modestr(uint32_t mode) {
     }
 }
 
-void Bcache::Invalidate() {
-    mxtl::RefPtr<BlockNode> blk;
+mx_status_t Bcache::Invalidate() {
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
+    // Blocks which could not be written stay cached (and dirty), so that
+    // a later flush may still succeed
+    mx_status_t status = FlushLocked();
+    BlockNode* blk;
     uint32_t n = 0;
-    while ((blk = lists_.PopFront(kBlockLRU)) != nullptr) {
+    while ((blk = lists_.FindFirst(kBlockLRU, [](const BlockNode& b) {
+                return !(b.flags_ & kBlockDirty);
+            })) != nullptr) {
         // remove from hash, bno to be reassigned
         assert(!(blk->flags_ & kBlockBusy));
-        hash_.erase(*blk);
-        lists_.PushBack(mxtl::move(blk), kBlockFree);
+        mxtl::RefPtr<BlockNode> ref = lists_.Erase(mxtl::RefPtr<BlockNode>(blk), kBlockLRU);
+        hash_.erase(*ref);
+        lists_.PushBack(mxtl::move(ref), kBlockFree);
         n++;
     }
     trace(BCACHE, "[ %d blocks dropped ]\n", n);
+    if (status != NO_ERROR) {
+        error("minfs: cannot drop dirty blocks which could not be written\n");
+    }
+    return status;
 }
 
 mxtl::RefPtr<BlockNode> Bcache::Get(uint32_t bno, uint32_t mode) {
@@ -77,6 +571,9 @@ mxtl::RefPtr<BlockNode> Bcache::Get(uint32_t bno, uint32_t mode) {
     if (bno >= blockmax_) {
         return nullptr;
     }
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
     mxtl::RefPtr<BlockNode> blk = hash_.find(bno).CopyPointer();
     if (blk != nullptr) {
         // remove from lru
@@ -84,7 +581,7 @@ mxtl::RefPtr<BlockNode> Bcache::Get(uint32_t bno, uint32_t mode) {
         assert(!(blk->flags_ & kBlockBusy));
         lists_.Erase(blk, kBlockLRU);
         if (mode == kModeZero) {
-            blk->flags_ |= kBlockDirty;
+            MarkDirty(blk.get());
             memset(blk->data(), 0, blocksize_);
         }
         goto done;
@@ -94,19 +591,39 @@ mxtl::RefPtr<BlockNode> Bcache::Get(uint32_t bno, uint32_t mode) {
     } else {
         if ((blk = lists_.PopFront(kBlockFree)) != nullptr) {
             // nothing extra to do
-        } else if ((blk = lists_.PopFront(kBlockLRU)) != nullptr) {
+        } else {
+            // Reuse the least recently used block which may be written back
+            // right away, taking everything else like it along. Metadata
+            // waits for its update to commit; committing half an update
+            // would break the journal's promise, so it fails instead.
+            BlockNode* victim = lists_.FindFirst(kBlockLRU, [this](const BlockNode& b) {
+                return !(b.flags_ & kBlockDirty) || InPlace(b);
+            });
+            if ((victim == nullptr) && (updates_active_ > 0)) {
+                error("minfs: update too large for the block cache\n");
+                return nullptr;
+            } else if (victim == nullptr) {
+                if (FlushLocked() != NO_ERROR) {
+                    panic("bcache: cannot commit metadata\n");
+                }
+                victim = lists_.Front(kBlockLRU);
+            } else if ((victim->flags_ & kBlockDirty) && (FlushDataLocked() != NO_ERROR)) {
+                panic("bcache: cannot write back bno %u\n", victim->bno_);
+            }
+            if (victim == nullptr) {
+                panic("bcache: out of blocks\n");
+            }
             // remove from hash, bno to be reassigned
+            blk = lists_.Erase(mxtl::RefPtr<BlockNode>(victim), kBlockLRU);
             hash_.erase(*blk);
-        } else {
-            panic("bcache: out of blocks\n");
         }
         blk->bno_ = bno;
         hash_.insert(blk);
         assert(hash_.size() <= kMinfsBlockCacheSize);
         if (mode == kModeZero) {
-            blk->flags_ |= kBlockDirty;
+            MarkDirty(blk.get());
             memset(blk->data(), 0, blocksize_);
-        } else if (Readblk(bno, blk->data()) < 0) {
+        } else if (ReadblkRaw(bno, blk->data()) < 0) {
             panic("bcache: bno %u read error!\n", bno);
         }
     }
@@ -128,16 +645,29 @@ mxtl::RefPtr<BlockNode> Bcache::GetZero(uint32_t bno) {
 
 void Bcache::Put(mxtl::RefPtr<BlockNode> blk, uint32_t flags) {
     trace(BCACHE, "bcache_put() bno=%u%s\n", blk->bno_, (flags & kBlockDirty) ? " DIRTY" : "");
+#ifdef __Fuchsia__
+    mxtl::AutoLock lock(&lock_);
+#endif
     assert(blk->flags_ & kBlockBusy);
     // remove from busy list
     lists_.Erase(blk, kBlockBusy);
-    if ((flags | blk->flags_) & kBlockDirty) {
-        if (Writeblk(blk->bno_, blk->data()) < 0) {
+    if (flags & kBlockDirty) {
+        MarkDirty(blk.get());
+        blk->flags_ = (blk->flags_ & ~kBlockData) | (flags & kBlockData);
+    }
+    lists_.PushBack(mxtl::move(blk), kBlockLRU);
+
+    if (dirty_count_ >= kMinfsDirtyHighWater) {
+#ifdef __Fuchsia__
+        if (flusher_running_) {
+            cnd_signal(&flusher_wake_);
+            return;
+        }
+#endif
+        if (FlushAllowedLocked() != NO_ERROR) {
             error("block write error!\n");
         }
-        blk->flags_ &= ~kBlockDirty;
     }
-    lists_.PushBack(mxtl::move(blk), kBlockLRU);
 }
 
 mx_status_t Bcache::Read(uint32_t bno, void* data, uint32_t off, uint32_t len) {
@@ -157,9 +687,65 @@ mx_status_t Bcache::Read(uint32_t bno, void* data, uint32_t off, uint32_t len) {
 }
 
 int Bcache::Sync() {
+    if (Flush() != NO_ERROR) {
+        return ERR_IO;
+    }
     return fsync(fd_);
 }
 
+mx_status_t Bcache::AllocBuffer(uint32_t num) {
+    cache_blocks_ = num;
+    buffer_blocks_ = num + kMinfsFlushBatch;
+    size_t size = static_cast<size_t>(buffer_blocks_) * blocksize_;
+#ifdef __Fuchsia__
+    mx_status_t status;
+    if ((status = mx_vmo_create(size, 0, &buffer_vmo_)) != NO_ERROR) {
+        return status;
+    }
+    if ((status = mx_vmar_map(mx_vmar_root_self(), 0, buffer_vmo_, 0, size,
+                              MX_VM_FLAG_PERM_READ | MX_VM_FLAG_PERM_WRITE,
+                              &buffer_)) != NO_ERROR) {
+        buffer_ = 0;
+        return status;
+    }
+#else
+    if ((buffer_ = reinterpret_cast<uintptr_t>(malloc(size))) == 0) {
+        return ERR_NO_MEMORY;
+    }
+#endif
+    return NO_ERROR;
+}
+
+#ifdef __Fuchsia__
+void Bcache::ConnectFifo() {
+    mx_handle_t fifo;
+    if (ioctl_block_get_fifos(fd_, &fifo) != sizeof(fifo)) {
+        // Not a block device (or somebody else owns its fifo), use plain I/O
+        return;
+    }
+    mx_handle_t vmo;
+    if (ioctl_block_alloc_txn(fd_, &txnid_) != sizeof(txnid_)) {
+        goto fail;
+    }
+    if (mx_handle_duplicate(buffer_vmo_, MX_RIGHT_SAME_RIGHTS, &vmo) != NO_ERROR) {
+        goto fail;
+    }
+    if (ioctl_block_attach_vmo(fd_, &vmo, &buffer_vmoid_) != sizeof(buffer_vmoid_)) {
+        goto fail;
+    }
+    if (block_fifo_create_client(fifo, &fifo_client_) != NO_ERROR) {
+        goto fail;
+    }
+    trace(IO, "minfs: using block fifo\n");
+    discard_enabled_ = true;
+    return;
+fail:
+    error("minfs: cannot set up block fifo, falling back to read/write\n");
+    mx_handle_close(fifo);
+    ioctl_block_fifo_close(fd_);
+}
+#endif
+
 mx_status_t Bcache::Create(Bcache** out, int fd, uint32_t blockmax, uint32_t blocksize,
                            uint32_t num) {
     AllocChecker ac;
@@ -167,24 +753,76 @@ mx_status_t Bcache::Create(Bcache** out, int fd, uint32_t blockmax, uint32_t blo
     if (!ac.check()) {
         return ERR_NO_MEMORY;
     }
-    while (num > 0) {
-        mx_status_t status;
-        if ((status = BlockNode::Create(bc.get())) != NO_ERROR) {
+    mx_status_t status;
+    if ((status = bc->AllocBuffer(num)) != NO_ERROR) {
+        return status;
+    }
+#ifdef __Fuchsia__
+    bc->ConnectFifo();
+#endif
+    for (uint32_t n = 0; n < num; n++) {
+        if ((status = BlockNode::Create(bc.get(), bc->BufferBlock(n))) != NO_ERROR) {
             return status;
         }
-        num--;
     }
     *out = bc.release();
     return NO_ERROR;
 }
 
 int Bcache::Close() {
+#ifdef __Fuchsia__
+    {
+        mxtl::AutoLock lock(&lock_);
+        flusher_stop_ = true;
+        cnd_signal(&flusher_wake_);
+    }
+    if (flusher_running_) {
+        thrd_join(flusher_thread_, nullptr);
+        flusher_running_ = false;
+    }
+#endif
+    if (Flush() != NO_ERROR) {
+        error("minfs: failed to write back dirty blocks on close\n");
+    }
+#ifdef __Fuchsia__
+    if (fifo_client_ != nullptr) {
+        ioctl_block_free_txn(fd_, &txnid_);
+        block_fifo_release_client(fifo_client_);
+        ioctl_block_fifo_close(fd_);
+        fifo_client_ = nullptr;
+    }
+#endif
     return close(fd_);
 }
 
 Bcache::Bcache(int fd, uint32_t blockmax, uint32_t blocksize) :
-    fd_(fd), blockmax_(blockmax), blocksize_(blocksize) {}
-Bcache::~Bcache() {}
+    fd_(fd), blockmax_(blockmax), blocksize_(blocksize), cache_blocks_(0), buffer_blocks_(0),
+    buffer_(0), dirty_count_(0), jnl_block_(0), jnl_blocks_(0), updates_active_(0),
+    commit_pending_(false), discard_count_(0), discard_enabled_(false)
+#ifdef __Fuchsia__
+    , buffer_vmo_(MX_HANDLE_INVALID), fifo_client_(nullptr), txnid_(0), buffer_vmoid_(0),
+    flusher_running_(false), flusher_stop_(false)
+#endif
+    {
+#ifdef __Fuchsia__
+    cnd_init(&flusher_wake_);
+#endif
+}
+
+Bcache::~Bcache() {
+#ifdef __Fuchsia__
+    if (buffer_ != 0) {
+        mx_vmar_unmap(mx_vmar_root_self(), buffer_,
+                      static_cast<size_t>(buffer_blocks_) * blocksize_);
+    }
+    if (buffer_vmo_ != MX_HANDLE_INVALID) {
+        mx_handle_close(buffer_vmo_);
+    }
+    cnd_destroy(&flusher_wake_);
+#else
+    free(reinterpret_cast<void*>(buffer_));
+#endif
+}
 
 size_t BcacheLists::SizeAllSlow() const {
     return list_busy_.size_slow() + list_lru_.size_slow() + list_free_.size_slow();
@@ -218,6 +856,11 @@ mxtl::RefPtr<BlockNode> BcacheLists::Erase(mxtl::RefPtr<BlockNode> blk, uint32_t
     return ptr;
 }
 
+BlockNode* BcacheLists::Front(uint32_t block_type) {
+    auto ll = GetList(block_type & kBlockLLFlags);
+    return ll->is_empty() ? nullptr : &ll->front();
+}
+
 BcacheLists::LinkedList* BcacheLists::GetList(uint32_t block_type) {
     switch (block_type) {
         case kBlockBusy : return &list_busy_;
@@ -228,21 +871,18 @@ BcacheLists::LinkedList* BcacheLists::GetList(uint32_t block_type) {
     return nullptr;
 }
 
-mx_status_t BlockNode::Create(Bcache* bc) {
+mx_status_t BlockNode::Create(Bcache* bc, void* data) {
     AllocChecker ac;
     mxtl::RefPtr<BlockNode> blk = mxtl::AdoptRef(new (&ac) BlockNode());
     if (!ac.check()) {
         return ERR_NO_MEMORY;
     }
-    blk->data_.reset(static_cast<char*>(malloc(bc->blocksize_)));
-    if (blk->data_ == nullptr) {
-        return ERR_NO_MEMORY;
-    }
+    blk->data_ = data;
     bc->lists_.PushBack(mxtl::move(blk), kBlockFree);
     return NO_ERROR;
 }
 
-BlockNode::BlockNode() : flags_(kBlockFree) {}
+BlockNode::BlockNode() : flags_(kBlockFree), data_(nullptr) {}
 BlockNode::~BlockNode() {}
 
 #ifndef __Fuchsia__
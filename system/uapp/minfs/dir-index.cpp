@@ -0,0 +1,156 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <magenta/new.h>
+#include <mxtl/unique_ptr.h>
+
+#include "minfs-private.h"
+
+namespace minfs {
+
+namespace {
+
+// Records with less room than the smallest possible dirent cannot take a new entry
+constexpr uint32_t kMinSlack = DirentSize(1);
+
+constexpr size_t kInitialBuckets = 256;
+
+} // namespace
+
+DirectoryIndex::DirectoryIndex() : bucket_count_(0), live_count_(0) {}
+
+DirectoryIndex::~DirectoryIndex() {
+    by_slack_.clear();
+    by_offset_.clear();
+}
+
+void DirectoryIndex::Detach(Record* r) {
+    if (r->slack_ns.InContainer()) {
+        by_slack_.erase(*r);
+    }
+    if (r->live) {
+        Record** link = &buckets_[r->hash % bucket_count_];
+        while (*link != r) {
+            link = &(*link)->hash_next;
+        }
+        *link = r->hash_next;
+        r->hash_next = nullptr;
+        r->live = false;
+        live_count_--;
+    }
+}
+
+mx_status_t DirectoryIndex::GrowBuckets() {
+    size_t count = bucket_count_ ? bucket_count_ * 2 : kInitialBuckets;
+    AllocChecker ac;
+    mxtl::unique_ptr<Record*[]> buckets(new (&ac) Record*[count]);
+    if (!ac.check()) {
+        return ERR_NO_MEMORY;
+    }
+    memset(buckets.get(), 0, count * sizeof(Record*));
+    for (size_t i = 0; i < bucket_count_; i++) {
+        Record* r = buckets_[i];
+        while (r != nullptr) {
+            Record* next = r->hash_next;
+            r->hash_next = buckets[r->hash % count];
+            buckets[r->hash % count] = r;
+            r = next;
+        }
+    }
+    buckets_ = mxtl::move(buckets);
+    bucket_count_ = count;
+    return NO_ERROR;
+}
+
+mx_status_t DirectoryIndex::Update(size_t off, minfs_dirent_t* de) {
+    if ((de->ino != 0) && (live_count_ >= bucket_count_ * 2)) {
+        mx_status_t status = GrowBuckets();
+        if (status != NO_ERROR) {
+            return status;
+        }
+    }
+
+    Record* r;
+    auto iter = by_offset_.find(static_cast<uint32_t>(off));
+    if (iter.IsValid()) {
+        r = &*iter;
+        Detach(r);
+    } else {
+        AllocChecker ac;
+        mxtl::unique_ptr<Record> rec(new (&ac) Record());
+        if (!ac.check()) {
+            return ERR_NO_MEMORY;
+        }
+        r = rec.get();
+        r->off = static_cast<uint32_t>(off);
+        r->live = false;
+        r->hash_next = nullptr;
+        by_offset_.insert(mxtl::move(rec));
+    }
+
+    uint32_t reclen = MinfsReclen(de, off);
+    if (de->ino != 0) {
+        r->slack = reclen - DirentSize(de->namelen);
+        r->hash = Hash(de->name, de->namelen);
+        r->live = true;
+        Record** bucket = &buckets_[r->hash % bucket_count_];
+        r->hash_next = *bucket;
+        *bucket = r;
+        live_count_++;
+    } else {
+        r->slack = reclen;
+    }
+    if (r->slack >= kMinSlack) {
+        by_slack_.insert(r);
+    }
+    return NO_ERROR;
+}
+
+void DirectoryIndex::Erase(size_t off) {
+    auto iter = by_offset_.find(static_cast<uint32_t>(off));
+    if (iter.IsValid()) {
+        Detach(&*iter);
+        by_offset_.erase(iter);
+    }
+}
+
+size_t DirectoryIndex::Prev(size_t off) const {
+    auto iter = by_offset_.find(static_cast<uint32_t>(off));
+    if (!iter.IsValid() || (iter == by_offset_.begin())) {
+        return off;
+    }
+    --iter;
+    return iter->off;
+}
+
+mx_status_t DirectoryIndex::FindSpace(uint32_t reclen, size_t* off) const {
+    auto iter = by_slack_.lower_bound(SlackKey{reclen, 0});
+    if (!iter.IsValid()) {
+        return ERR_NOT_FOUND;
+    }
+    *off = iter->off;
+    return NO_ERROR;
+}
+
+bool DirectoryIndex::FindName(uint32_t hash, const void** cookie, size_t* off) const {
+    if (bucket_count_ == 0) {
+        return false;
+    }
+    const Record* r = (*cookie == nullptr) ? buckets_[hash % bucket_count_] :
+                      static_cast<const Record*>(*cookie)->hash_next;
+    while ((r != nullptr) && (r->hash != hash)) {
+        r = r->hash_next;
+    }
+    if (r == nullptr) {
+        return false;
+    }
+    *cookie = r;
+    *off = r->off;
+    return true;
+}
+
+} // namespace minfs
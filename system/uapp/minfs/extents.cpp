@@ -0,0 +1,310 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <magenta/new.h>
+#include <mxtl/algorithm.h>
+#include <mxtl/unique_ptr.h>
+
+#include "minfs-private.h"
+
+namespace minfs {
+
+namespace {
+
+// Number of extents held by leaf 'n' of a table of 'count' extents
+uint32_t LeafExtents(uint32_t count, uint32_t n) {
+    return mxtl::min(count - n * kMinfsExtentsPerBlock, kMinfsExtentsPerBlock);
+}
+
+} // namespace
+
+mx_status_t minfs_read_extents(Bcache* bc, const minfs_inode_t* inode, minfs_extent_t* extents) {
+    uint32_t count = inode->extent_count;
+    uint32_t leaves = MinfsExtentLeaves(count);
+    if (leaves == 0) {
+        memcpy(extents, inode->extents, count * sizeof(minfs_extent_t));
+        return NO_ERROR;
+    }
+    if (count > kMinfsMaxExtents) {
+        return ERR_IO_DATA_INTEGRITY;
+    }
+    for (uint32_t n = 0; n < leaves; n++) {
+        uint32_t len = LeafExtents(count, n);
+        if (inode->extents[n].length != len) {
+            return ERR_IO_DATA_INTEGRITY;
+        }
+        mx_status_t status = bc->Read(inode->extents[n].start, extents + n * kMinfsExtentsPerBlock,
+                                      0, len * static_cast<uint32_t>(sizeof(minfs_extent_t)));
+        if (status != NO_ERROR) {
+            return status;
+        }
+    }
+    return NO_ERROR;
+}
+
+mx_status_t VnodeMinfs::ExtentsLoad() {
+    if (extents_ != nullptr) {
+        return NO_ERROR;
+    }
+    uint32_t count = inode_.extent_count;
+    if (count > kMinfsMaxExtents) {
+        return ERR_IO_DATA_INTEGRITY;
+    }
+    uint32_t cap = mxtl::max(mxtl::roundup(count, kMinfsInlineExtents), kMinfsInlineExtents);
+    AllocChecker ac;
+    mxtl::unique_ptr<minfs_extent_t[]> extents(new (&ac) minfs_extent_t[cap]);
+    if (!ac.check()) {
+        return ERR_NO_MEMORY;
+    }
+    mx_status_t status = minfs_read_extents(fs_->bc_, &inode_, extents.get());
+    if (status != NO_ERROR) {
+        return status;
+    }
+    extents_ = mxtl::move(extents);
+    extent_count_ = count;
+    extent_cap_ = cap;
+    return NO_ERROR;
+}
+
+// Leaves keep their blocks for as long as they are needed, so an append
+// only ever rewrites the last one. New leaves are allocated before anything
+// is written, leaving the inode as it was if there is no room for them.
+mx_status_t VnodeMinfs::ExtentsSync(uint32_t first) {
+    uint32_t old_leaves = MinfsExtentLeaves(inode_.extent_count);
+    uint32_t new_leaves = MinfsExtentLeaves(extent_count_);
+    minfs_extent_t index[kMinfsInlineExtents];
+    memcpy(index, inode_.extents, sizeof(index));
+
+    mx_status_t status = NO_ERROR;
+    uint32_t n;
+    for (n = old_leaves; n < new_leaves; n++) {
+        uint32_t hint = (n > 0) ? index[n - 1].start : 0;
+        if ((status = fs_->BlockNew(hint, &index[n].start, nullptr)) != NO_ERROR) {
+            break;
+        }
+    }
+    if ((status == NO_ERROR) && (new_leaves > 0)) {
+        // Leaves which did not exist before are written in full
+        uint32_t first_leaf = (old_leaves == 0) ? 0 :
+                              mxtl::min(first / kMinfsExtentsPerBlock, old_leaves);
+        for (uint32_t l = first_leaf; l < new_leaves; l++) {
+            uint32_t len = LeafExtents(extent_count_, l);
+            const minfs_extent_t* leaf = &extents_[l * kMinfsExtentsPerBlock];
+            mxtl::RefPtr<BlockNode> blk;
+            if ((blk = fs_->bc_->GetZero(index[l].start)) == nullptr) {
+                status = ERR_IO;
+                break;
+            }
+            memcpy(blk->data(), leaf, len * sizeof(minfs_extent_t));
+            fs_->bc_->Put(blk, kBlockDirty);
+            index[l].lblk = leaf[0].lblk;
+            index[l].length = len;
+        }
+    }
+
+    // Release the leaves allocated above if they went unused, or else the
+    // ones which are no longer needed
+    uint32_t release_start = (status != NO_ERROR) ? old_leaves : new_leaves;
+    uint32_t release_end = (status != NO_ERROR) ? n : old_leaves;
+    if (release_start < release_end) {
+        mxtl::RefPtr<BlockNode> bitmap_blk;
+        for (uint32_t l = release_start; l < release_end; l++) {
+            fs_->BlocksFree(&bitmap_blk, index[l].start, 1);
+        }
+        fs_->BitmapBlockPut(bitmap_blk);
+    }
+    if (status != NO_ERROR) {
+        return status;
+    }
+
+    if (new_leaves == 0) {
+        memcpy(index, extents_.get(), extent_count_ * sizeof(minfs_extent_t));
+    }
+    uint32_t used = (new_leaves == 0) ? extent_count_ : new_leaves;
+    memset(&index[used], 0, (kMinfsInlineExtents - used) * sizeof(minfs_extent_t));
+    memcpy(inode_.extents, index, sizeof(index));
+    inode_.block_count = inode_.block_count + new_leaves - old_leaves;
+    inode_.extent_count = extent_count_;
+    InodeSync(kMxFsSyncDefault);
+    return NO_ERROR;
+}
+
+uint32_t VnodeMinfs::ExtentSearch(uint32_t n) const {
+    uint32_t lo = 0;
+    uint32_t hi = extent_count_;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (extents_[mid].lblk + extents_[mid].length <= n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+mx_status_t VnodeMinfs::ExtentInsert(uint32_t i, uint32_t lblk, uint32_t start, uint32_t length,
+                                     uint32_t* first) {
+    minfs_extent_t* prev = (i > 0) ? &extents_[i - 1] : nullptr;
+    minfs_extent_t* next = (i < extent_count_) ? &extents_[i] : nullptr;
+    bool join_prev = (prev != nullptr) && (prev->lblk + prev->length == lblk) &&
+                     (prev->start + prev->length == start);
+    bool join_next = (next != nullptr) && (lblk + length == next->lblk) &&
+                     (start + length == next->start);
+
+    if (join_prev) {
+        prev->length += length;
+        if (join_next) {
+            // The new blocks fill the gap between two extents
+            prev->length += next->length;
+            memmove(next, next + 1, (extent_count_ - i - 1) * sizeof(minfs_extent_t));
+            extent_count_--;
+        }
+        *first = i - 1;
+        return NO_ERROR;
+    } else if (join_next) {
+        next->lblk = lblk;
+        next->start = start;
+        next->length += length;
+        *first = i;
+        return NO_ERROR;
+    }
+
+    if (extent_count_ == extent_cap_) {
+        if (extent_cap_ == kMinfsMaxExtents) {
+            return ERR_NO_SPACE;
+        }
+        uint32_t cap = mxtl::min(extent_cap_ * 2, kMinfsMaxExtents);
+        AllocChecker ac;
+        mxtl::unique_ptr<minfs_extent_t[]> extents(new (&ac) minfs_extent_t[cap]);
+        if (!ac.check()) {
+            return ERR_NO_MEMORY;
+        }
+        memcpy(extents.get(), extents_.get(), extent_count_ * sizeof(minfs_extent_t));
+        extents_ = mxtl::move(extents);
+        extent_cap_ = cap;
+    }
+    memmove(&extents_[i + 1], &extents_[i], (extent_count_ - i) * sizeof(minfs_extent_t));
+    extents_[i].lblk = lblk;
+    extents_[i].start = start;
+    extents_[i].length = length;
+    extent_count_++;
+    *first = i;
+    return NO_ERROR;
+}
+
+mx_status_t VnodeMinfs::ExtentGetBno(uint32_t n, uint32_t* bno, bool alloc) {
+    mx_status_t status;
+    if ((status = ExtentsLoad()) != NO_ERROR) {
+        return status;
+    }
+    if (n >= MaxFileBlock()) {
+        return ERR_OUT_OF_RANGE;
+    }
+
+    uint32_t i = ExtentSearch(n);
+    if ((i == extent_count_) || (extents_[i].lblk > n)) {
+        if (!alloc) {
+            *bno = 0;
+            return NO_ERROR;
+        }
+        if ((status = ExtentsAlloc(n, n + 1)) != NO_ERROR) {
+            return status;
+        }
+        i = ExtentSearch(n);
+    }
+    *bno = extents_[i].start + (n - extents_[i].lblk);
+    return NO_ERROR;
+}
+
+// Each run is recorded on disk as soon as it is allocated. Should that fail,
+// the run is released again and the in-memory table dropped, to be reloaded
+// from the (unchanged) inode.
+mx_status_t VnodeMinfs::ExtentsAlloc(uint32_t start, uint32_t end) {
+    mx_status_t status;
+    if ((status = ExtentsLoad()) != NO_ERROR) {
+        return status;
+    }
+
+    uint32_t n = start;
+    uint32_t i = ExtentSearch(n);
+    while (n < end) {
+        if ((i < extent_count_) && (extents_[i].lblk <= n)) {
+            // already mapped
+            n = extents_[i].lblk + extents_[i].length;
+            i++;
+            continue;
+        }
+        uint32_t hole_end = (i < extent_count_) ? mxtl::min(end, extents_[i].lblk) : end;
+
+        // Place the run where the previous extent would have continued
+        uint32_t hint = 0;
+        if (i > 0) {
+            hint = extents_[i - 1].start + (n - extents_[i - 1].lblk);
+        }
+        uint32_t bno;
+        uint32_t count;
+        if ((status = fs_->BlocksNew(hint, hole_end - n, &bno, &count)) != NO_ERROR) {
+            return status;
+        }
+
+        uint32_t first;
+        if ((status = ExtentInsert(i, n, bno, count, &first)) == NO_ERROR) {
+            inode_.block_count += count;
+            if ((status = ExtentsSync(first)) != NO_ERROR) {
+                inode_.block_count -= count;
+                extents_.reset();
+            }
+        }
+        if (status != NO_ERROR) {
+            mxtl::RefPtr<BlockNode> bitmap_blk;
+            fs_->BlocksFree(&bitmap_blk, bno, count);
+            fs_->BitmapBlockPut(bitmap_blk);
+            return status;
+        }
+
+        n += count;
+        i = ExtentSearch(n);
+    }
+    return NO_ERROR;
+}
+
+mx_status_t VnodeMinfs::ExtentsShrink(uint32_t start) {
+    mx_status_t status;
+    if ((status = ExtentsLoad()) != NO_ERROR) {
+        return status;
+    }
+
+    uint32_t first = ExtentSearch(start);
+    uint32_t n;
+    mxtl::RefPtr<BlockNode> bitmap_blk;
+    for (n = first; n < extent_count_; n++) {
+        minfs_extent_t* extent = &extents_[n];
+        // The extent straddling 'start' only loses its tail
+        uint32_t keep = (extent->lblk < start) ? start - extent->lblk : 0;
+        if ((status = fs_->BlocksFree(&bitmap_blk, extent->start + keep,
+                                      extent->length - keep)) != NO_ERROR) {
+            break;
+        }
+        inode_.block_count -= extent->length - keep;
+        extent->length = keep;
+    }
+    fs_->BitmapBlockPut(bitmap_blk);
+    if (n == first) {
+        return status;
+    }
+
+    // Drop the extents which were released entirely, keeping any an error
+    // left in place
+    uint32_t kept = first + ((extents_[first].length != 0) ? 1 : 0);
+    memmove(&extents_[kept], &extents_[n], (extent_count_ - n) * sizeof(minfs_extent_t));
+    extent_count_ = kept + (extent_count_ - n);
+    mx_status_t sync_status = ExtentsSync(first);
+    return (status != NO_ERROR) ? status : sync_status;
+}
+
+} // namespace minfs
@@ -26,6 +26,7 @@ static minfs::Bcache* the_block_cache;
 extern minfs::VnodeMinfs* fake_root;
 
 int run_fs_tests(int argc, char** argv);
+int test_journal_replay(minfs::Bcache* bc);
 void drop_cache() {
     the_block_cache->Invalidate();
 }
@@ -44,6 +45,9 @@ int do_minfs_mount(minfs::Bcache* bc, int argc, char** argv) {
     if (minfs_mount(&vn, bc) < 0) {
         return -1;
     }
+    if (bc->StartFlusher() != NO_ERROR) {
+        fprintf(stderr, "minfs: cannot start write back, flushing inline\n");
+    }
     vfs_rpc_server(vn);
     return 0;
 }
@@ -59,6 +63,10 @@ int io_setup(minfs::Bcache* bc) {
 }
 
 int do_minfs_test(minfs::Bcache* bc, int argc, char** argv) {
+    // Replay is tested on the image as it is, so the test mounts it itself
+    if ((argc > 0) && !strcmp(argv[0], "journal")) {
+        return test_journal_replay(bc);
+    }
     if (io_setup(bc)) {
         return -1;
     }
@@ -230,8 +238,9 @@ struct {
 } CMDS[] = {
     {"create", do_minfs_mkfs, O_RDWR | O_CREAT, "initialize filesystem"},
     {"mkfs", do_minfs_mkfs, O_RDWR | O_CREAT, "initialize filesystem"},
-    {"check", do_minfs_check, O_RDONLY, "check filesystem integrity"},
-    {"fsck", do_minfs_check, O_RDONLY, "check filesystem integrity"},
+    // Checking replays the journal first, which may write to the device
+    {"check", do_minfs_check, O_RDWR, "check filesystem integrity"},
+    {"fsck", do_minfs_check, O_RDWR, "check filesystem integrity"},
 #ifdef __Fuchsia__
     {"mount", do_minfs_mount, O_RDWR, "mount filesystem"},
 #else
@@ -377,7 +386,13 @@ found:
 
     for (unsigned i = 0; i < countof(CMDS); i++) {
         if (!strcmp(cmd, CMDS[i].name)) {
-            return CMDS[i].func(bc, argc - 3, argv + 3);
+            int r = CMDS[i].func(bc, argc - 3, argv + 3);
+            // Blocks are written back lazily, push out whatever is left
+            if (bc->Flush() != NO_ERROR) {
+                fprintf(stderr, "error: cannot write back block cache\n");
+                return -1;
+            }
+            return r;
         }
     }
     return -1;
@@ -7,6 +7,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <magenta/new.h>
+
 #include "minfs.h"
 #include "minfs-private.h"
 
@@ -37,8 +39,45 @@ mx_status_t get_inode(const Minfs* fs, minfs_inode_t* inode, uint32_t ino) {
 #define CD_DUMP 1
 #define CD_RECURSE 2
 
+mx_status_t get_extent_nth_bno(const Minfs* fs, minfs_inode_t* inode, uint32_t n,
+                               uint32_t* bno_out) {
+    if (n >= kMinfsMaxExtentFileBlock) {
+        return ERR_OUT_OF_RANGE;
+    }
+    const minfs_extent_t* extent = inode->extents;
+    uint32_t count = inode->extent_count;
+    mxtl::RefPtr<BlockNode> blk;
+    uint32_t leaves = MinfsExtentLeaves(count);
+    if (leaves > 0) {
+        // find the last leaf starting at or before 'n'
+        uint32_t l = 0;
+        while ((l + 1 < mxtl::min(leaves, kMinfsInlineExtents)) && (extent[l + 1].lblk <= n)) {
+            l++;
+        }
+        count = mxtl::min(extent[l].length, kMinfsExtentsPerBlock);
+        if ((blk = fs->bc_->Get(extent[l].start)) == nullptr) {
+            return ERR_NOT_FOUND;
+        }
+        extent = static_cast<const minfs_extent_t*>(blk->data());
+    }
+    *bno_out = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((extent[i].lblk <= n) && (n - extent[i].lblk < extent[i].length)) {
+            *bno_out = extent[i].start + (n - extent[i].lblk);
+            break;
+        }
+    }
+    if (blk != nullptr) {
+        fs->bc_->Put(mxtl::move(blk), 0);
+    }
+    return NO_ERROR;
+}
+
 mx_status_t get_inode_nth_bno(const Minfs* fs, minfs_inode_t* inode, uint32_t n,
                               uint32_t* bno_out) {
+    if (inode->flags & kMinfsInodeFlagExtents) {
+        return get_extent_nth_bno(fs, inode, n, bno_out);
+    }
     if (n < kMinfsDirect) {
         *bno_out = inode->dnum[n];
         return NO_ERROR;
@@ -79,8 +118,10 @@ mx_status_t file_read(const Minfs* fs, minfs_inode_t* inode, void* data, size_t
     void* start = data;
     uint32_t n = static_cast<uint32_t>(off / kMinfsBlockSize);
     uint32_t adjust = off % kMinfsBlockSize;
+    uint64_t max = (inode->flags & kMinfsInodeFlagExtents) ? kMinfsMaxExtentFileBlock :
+                                                              kMinfsMaxFileBlock;
 
-    while ((len > 0) && (n < kMinfsMaxFileBlock)) {
+    while ((len > 0) && (n < max)) {
         uint32_t xfer;
         if (len > (kMinfsBlockSize - adjust)) {
             xfer = kMinfsBlockSize - adjust;
@@ -206,8 +247,100 @@ const char* check_data_block(CheckMaps* chk, const Minfs* fs, uint32_t bno) {
     return nullptr;
 }
 
+mx_status_t check_size(minfs_inode_t* inode, uint32_t ino, uint32_t blocks, uint32_t max) {
+    if (max) {
+        unsigned sizeblocks = inode->size / kMinfsBlockSize;
+        if (sizeblocks > max) {
+            warn("check: ino#%u: filesize too large\n", ino);
+        } else if (sizeblocks < (max - 1)) {
+            warn("check: ino#%u: filesize too small\n", ino);
+        }
+    } else {
+        if (inode->size) {
+            warn("check: ino#%u: filesize too large\n", ino);
+        }
+    }
+    if (blocks != inode->block_count) {
+        warn("check: ino#%u: block count %u, actual blocks %u\n",
+             ino, inode->block_count, blocks);
+    }
+    return NO_ERROR;
+}
+
+// Count and sanity-check the leaf and data blocks of an extent-mapped file,
+// returning the number of blocks it maps up to in '*max'.
+mx_status_t check_extents(CheckMaps* chk, const Minfs* fs, minfs_inode_t* inode,
+                          uint32_t ino, uint32_t* blocks, uint32_t* max) {
+    uint32_t count = inode->extent_count;
+    if (count > kMinfsMaxExtents) {
+        error("check: ino#%u: %u extents is too many\n", ino, count);
+        return ERR_IO_DATA_INTEGRITY;
+    }
+    uint32_t leaves = MinfsExtentLeaves(count);
+    for (unsigned n = 0; n < leaves; n++) {
+        const char* msg;
+        if ((msg = check_data_block(chk, fs, inode->extents[n].start)) != nullptr) {
+            warn("check: ino#%u: extent leaf %u(@%u): %s\n",
+                 ino, n, inode->extents[n].start, msg);
+        }
+        (*blocks)++;
+    }
+
+    AllocChecker ac;
+    mxtl::unique_ptr<minfs_extent_t[]> extents(new (&ac) minfs_extent_t[count + 1]);
+    if (!ac.check()) {
+        return ERR_NO_MEMORY;
+    }
+    mx_status_t status;
+    if ((status = minfs_read_extents(fs->bc_, inode, extents.get())) != NO_ERROR) {
+        error("check: ino#%u: cannot read extents\n", ino);
+        return status;
+    }
+
+    uint64_t end = 0;
+    for (unsigned n = 0; n < count; n++) {
+        const minfs_extent_t& e = extents[n];
+#if VERBOSE
+        info("[%u, +%u) @%u, ", e.lblk, e.length, e.start);
+#endif
+        if ((e.length == 0) || (e.lblk < end) ||
+            (uint64_t{e.lblk} + e.length > kMinfsMaxExtentFileBlock)) {
+            warn("check: ino#%u: extent %u [%u, +%u) is misplaced\n", ino, n, e.lblk, e.length);
+        }
+        if (uint64_t{e.start} + e.length > fs->info_.block_count) {
+            warn("check: ino#%u: extent %u(@%u, +%u): out of range\n",
+                 ino, n, e.start, e.length);
+            continue;
+        }
+        for (unsigned b = 0; b < e.length; b++) {
+            const char* msg;
+            if ((msg = check_data_block(chk, fs, e.start + b)) != nullptr) {
+                warn("check: ino#%u: block %u(@%u): %s\n", ino, e.lblk + b, e.start + b, msg);
+            }
+        }
+        *blocks += e.length;
+        end = uint64_t{e.lblk} + e.length;
+    }
+#if VERBOSE
+    info("...\n");
+#endif
+    *max = static_cast<uint32_t>(end);
+    return NO_ERROR;
+}
+
 mx_status_t check_file(CheckMaps* chk, const Minfs* fs,
                        minfs_inode_t* inode, uint32_t ino) {
+    uint32_t blocks = 0;
+    unsigned max = 0;
+
+    if (inode->flags & kMinfsInodeFlagExtents) {
+        mx_status_t status;
+        if ((status = check_extents(chk, fs, inode, ino, &blocks, &max)) != NO_ERROR) {
+            return status;
+        }
+        return check_size(inode, ino, blocks, max);
+    }
+
 #if VERBOSE
     for (unsigned n = 0; n < kMinfsDirect; n++) {
         info("%d, ", inode->dnum[n]);
@@ -215,8 +348,6 @@ mx_status_t check_file(CheckMaps* chk, const Minfs* fs,
     info("...\n");
 #endif
 
-    uint32_t blocks = 0;
-
     // count and sanity-check indirect blocks
     for (unsigned n = 0; n < kMinfsIndirect; n++) {
         if (inode->inum[n]) {
@@ -231,7 +362,6 @@ mx_status_t check_file(CheckMaps* chk, const Minfs* fs,
 
     // count and sanity-check data blocks
 
-    unsigned max = 0;
     for (unsigned n = 0;;n++) {
         mx_status_t status;
         uint32_t bno;
@@ -251,23 +381,7 @@ mx_status_t check_file(CheckMaps* chk, const Minfs* fs,
             max = n + 1;
         }
     }
-    if (max) {
-        unsigned sizeblocks = inode->size / kMinfsBlockSize;
-        if (sizeblocks > max) {
-            warn("check: ino#%u: filesize too large\n", ino);
-        } else if (sizeblocks < (max - 1)) {
-            warn("check: ino#%u: filesize too small\n", ino);
-        }
-    } else {
-        if (inode->size) {
-            warn("check: ino#%u: filesize too large\n", ino);
-        }
-    }
-    if (blocks != inode->block_count) {
-        warn("check: ino#%u: block count %u, actual blocks %u\n",
-             ino, inode->block_count, blocks);
-    }
-    return NO_ERROR;
+    return check_size(inode, ino, blocks, max);
 }
 
 } // namespace anonymous
@@ -341,7 +455,19 @@ mx_status_t minfs_check(Bcache* bc) {
         return status;
     }
 
+    // Everything before the data area, the journal included, is reserved
     unsigned missing = 0;
+    for (unsigned n = 0; n < info.dat_block; n++) {
+        if (!fs->block_map_.Get(n, n + 1)) {
+            missing++;
+        }
+    }
+    if (missing) {
+        error("check: %u metadata block%s not marked allocated\n",
+              missing, missing > 1 ? "s" : "");
+    }
+
+    missing = 0;
     for (unsigned n = info.dat_block; n < info.block_count; n++) {
         if (fs->block_map_.Get(n, n + 1)) {
             if (!chk.checked_blocks.Get(n, n + 1)) {
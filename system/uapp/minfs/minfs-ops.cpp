@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 
 #include <mxtl/algorithm.h>
+#include <mxtl/auto_call.h>
 #include <magenta/device/devmgr.h>
 
 #ifdef __Fuchsia__
@@ -135,6 +136,10 @@ void VnodeMinfs::InodeSync(uint32_t flags) {
 // Delete all blocks (relative to a file) from "start" (inclusive) to the end of
 // the file. Does not update mtime/atime.
 mx_status_t VnodeMinfs::BlocksShrink(uint32_t start) {
+    if (IsExtentMapped()) {
+        return ExtentsShrink(start);
+    }
+
     mxtl::RefPtr<BlockNode> bitmap_blk = nullptr;
 
     // release direct blocks
@@ -147,6 +152,7 @@ mx_status_t VnodeMinfs::BlocksShrink(uint32_t start) {
         }
 
         fs_->block_map_.Clear(inode_.dnum[bno], inode_.dnum[bno] + 1);
+        fs_->bc_->Discard(inode_.dnum[bno], 1);
         inode_.dnum[bno] = 0;
         inode_.block_count--;
         InodeSync(kMxFsSyncDefault);
@@ -190,6 +196,7 @@ mx_status_t VnodeMinfs::BlocksShrink(uint32_t start) {
                 return ERR_IO;
             }
             fs_->block_map_.Clear(entry[direct], entry[direct] + 1);
+            fs_->bc_->Discard(entry[direct], 1);
             entry[direct] = 0;
             iflags = kBlockDirty;
             inode_.block_count--;
@@ -207,6 +214,7 @@ mx_status_t VnodeMinfs::BlocksShrink(uint32_t start) {
                 return ERR_IO;
             }
             fs_->block_map_.Clear(inode_.inum[indirect], inode_.inum[indirect] + 1);
+            fs_->bc_->Discard(inode_.inum[indirect], 1);
             inode_.inum[indirect] = 0;
             inode_.block_count--;
             InodeSync(kMxFsSyncDefault);
@@ -217,6 +225,10 @@ mx_status_t VnodeMinfs::BlocksShrink(uint32_t start) {
     return NO_ERROR;
 }
 
+mx_status_t VnodeMinfs::WriteBlock(uint32_t bno, const void* data) {
+    return IsDirectory() ? fs_->bc_->Writeblk(bno, data) : fs_->bc_->WriteData(bno, data);
+}
+
 #ifdef __Fuchsia__
 // Read data from disk at block 'bno', into the 'nth' logical block of the file.
 mx_status_t VnodeMinfs::FillBlock(uint32_t n, uint32_t bno) {
@@ -234,65 +246,148 @@ mx_status_t VnodeMinfs::FillBlock(uint32_t n, uint32_t bno) {
 }
 
 // Since we cannot yet register the filesystem as a paging service (and cleanly
-// fault on pages when they are actually needed), we currently read an entire
-// file to a VMO when a file's data block are accessed.
+// fault on pages when they are actually needed), file data is read into a VMO
+// as it is accessed. A bitmap tracks which blocks of the VMO hold file data.
 //
-// TODO(smklein): Even this hack can be optimized; a bitmap could be used to
-// track all 'empty/read/dirty' blocks for each vnode, rather than reading
-// the entire file.
+// TODO(smklein): Even this hack can be optimized; dirty blocks could be
+// tracked in the same way and written back from the VMO directly.
 mx_status_t VnodeMinfs::InitVmo() {
     if (vmo_ != MX_HANDLE_INVALID) {
         return NO_ERROR;
     }
 
     mx_status_t status;
+    uint32_t blocks = static_cast<uint32_t>(mxtl::roundup(inode_.size, kMinfsBlockSize) /
+                                            kMinfsBlockSize);
+    vmo_loaded_.reset();
+    if ((status = VmoLoadedReserve(blocks)) != NO_ERROR) {
+        error("Failed to initialize vmo bitmap; error: %d\n", status);
+        return status;
+    }
     if ((status = mx_vmo_create(mxtl::roundup(inode_.size, kMinfsBlockSize), 0, &vmo_)) != NO_ERROR) {
         error("Failed to initialize vmo; error: %d\n", status);
         return status;
     }
+    // Directory blocks may be waiting for the journal, so they are always
+    // read through the cache; file blocks are read into the VMO directly.
+    mx_handle_t vmo_dup;
+    if (!IsDirectory() && fs_->bc_->FifoEnabled() &&
+        (mx_handle_duplicate(vmo_, MX_RIGHT_SAME_RIGHTS, &vmo_dup) == NO_ERROR) &&
+        (fs_->bc_->AttachVmo(vmo_dup, &vmoid_) == NO_ERROR)) {
+        vmo_attached_ = true;
+    }
+    ra_next_ = 0;
+    ra_window_ = 0;
+    return NO_ERROR;
+}
 
-    // Initialize all direct blocks
-    uint32_t bno;
-    for (uint32_t d = 0; d < kMinfsDirect; d++) {
-        if ((bno = inode_.dnum[d]) != 0) {
-            if ((status = FillBlock(d, bno)) != NO_ERROR) {
+mx_status_t VnodeMinfs::VmoLoadedReserve(uint32_t blocks) {
+    size_t size = (vmo_loaded_ != nullptr) ? vmo_loaded_->size() : 0;
+    if ((vmo_loaded_ != nullptr) && (blocks <= size)) {
+        return NO_ERROR;
+    }
+    size_t new_size = mxtl::min(mxtl::max(size * 2, size_t{kMinfsReadaheadMax}),
+                                size_t{MaxFileBlock()});
+    new_size = mxtl::max(new_size, size_t{blocks});
+
+    AllocChecker ac;
+    mxtl::unique_ptr<LoadedMap> loaded(new (&ac) LoadedMap());
+    if (!ac.check()) {
+        return ERR_NO_MEMORY;
+    }
+    mx_status_t status;
+    if ((status = loaded->Reset(new_size)) != NO_ERROR) {
+        return status;
+    }
+    // Carry over each run of loaded blocks
+    for (size_t n = 0; n < size;) {
+        size_t start = vmo_loaded_->Scan(n, size, false);
+        n = vmo_loaded_->Scan(start, size, true);
+        loaded->Set(start, n);
+    }
+    vmo_loaded_ = mxtl::move(loaded);
+    return NO_ERROR;
+}
+
+// When the VMO is registered with the block server, it is filled with a few
+// multi-block FIFO transactions rather than one read per block.
+mx_status_t VnodeMinfs::LoadVmo(uint32_t start, uint32_t end) {
+    start = static_cast<uint32_t>(vmo_loaded_->Scan(start, end, true));
+    if (start == end) {
+        return NO_ERROR;
+    }
+
+    // The device is read directly, so it must not be behind the cache.
+    bool use_fifo = vmo_attached_ && (fs_->bc_->FlushData() == NO_ERROR);
+    BlockTxn txn(fs_->bc_, BLOCKIO_READ);
+    auto cleanup = mxtl::MakeAutoCall([&]() {
+        if (use_fifo) {
+            txn.Flush();
+        }
+    });
+
+    mx_status_t status;
+    for (uint32_t n = start; n < end; n++) {
+        if (vmo_loaded_->Get(n, n + 1)) {
+            continue;
+        }
+        uint32_t bno;
+        if ((status = GetBno(n, &bno, false)) != NO_ERROR) {
+            return status;
+        }
+        // Holes read as zero, which the VMO already holds
+        if (bno != 0) {
+            status = use_fifo ? txn.Enqueue(vmoid_, n, bno, 1) : FillBlock(n, bno);
+            if (status != NO_ERROR) {
                 error("Failed to fill bno %u; error: %d\n", bno, status);
                 return status;
             }
         }
     }
 
-    // Initialize all indirect blocks
-    for (uint32_t i = 0; i < kMinfsIndirect; i++) {
-        uint32_t ibno;
-        mxtl::RefPtr<BlockNode> iblk;
-        if ((ibno = inode_.inum[i]) != 0) {
-            // TODO(smklein): Should there be a separate vmo for indirect blocks?
-            if ((iblk = fs_->bc_->Get(ibno)) == nullptr) {
-                return ERR_IO;
-            }
-            uint32_t* ientry = static_cast<uint32_t*>(iblk->data());
-
-            const uint32_t direct_per_indirect = kMinfsBlockSize / sizeof(uint32_t);
-            for (uint32_t j = 0; j < direct_per_indirect; j++) {
-                if ((bno = ientry[j]) != 0) {
-                    uint32_t n = kMinfsDirect + i * direct_per_indirect + j;
-                    if ((status = FillBlock(n, bno)) != NO_ERROR) {
-                        fs_->bc_->Put(iblk, 0);
-                        return status;
-                    }
-                }
-            }
-            fs_->bc_->Put(iblk, 0);
-        }
+    status = NO_ERROR;
+    if (use_fifo) {
+        cleanup.cancel();
+        status = txn.Flush();
+    }
+    if (status == NO_ERROR) {
+        vmo_loaded_->Set(start, end);
     }
+    return status;
+}
 
-    return NO_ERROR;
+mx_status_t VnodeMinfs::Readahead(size_t off, size_t len) {
+    uint32_t start = static_cast<uint32_t>(off / kMinfsBlockSize);
+    uint32_t end = static_cast<uint32_t>(mxtl::roundup(off + len, kMinfsBlockSize) / kMinfsBlockSize);
+    uint32_t file_blocks = static_cast<uint32_t>(mxtl::roundup(inode_.size, kMinfsBlockSize) /
+                                                 kMinfsBlockSize);
+
+    // Grow the window while reads pick up where the last one stopped, and
+    // drop it as soon as they do not.
+    if ((start == ra_next_) || (start + 1 == ra_next_)) {
+        ra_window_ = mxtl::min(mxtl::max(ra_window_ * 2, kMinfsReadaheadMin), kMinfsReadaheadMax);
+    } else {
+        ra_window_ = 0;
+    }
+    ra_next_ = end;
+
+    uint32_t limit = mxtl::min(end + ra_window_, file_blocks);
+    uint32_t missing = static_cast<uint32_t>(vmo_loaded_->Scan(start, limit, true));
+    // Nothing is needed now; wait until half the window has been consumed so
+    // that the next read is a large one.
+    if ((missing >= end) && (missing - end >= ra_window_ / 2)) {
+        return NO_ERROR;
+    }
+    return LoadVmo(missing, limit);
 }
 #endif
 
 // Get the bno corresponding to the nth logical block within the file.
 mx_status_t VnodeMinfs::GetBno(uint32_t n, uint32_t* bno, bool alloc) {
+    if (IsExtentMapped()) {
+        return ExtentGetBno(n, bno, alloc);
+    }
+
     uint32_t hint = 0;
     // direct blocks are simple... is there an entry in dnum[]?
     if (n < kMinfsDirect) {
@@ -462,6 +557,7 @@ mx_status_t VnodeMinfs::UnlinkChild(VnodeMinfs* childvn, minfs_dirent_t* de, Dir
     // Read the direntries we're considering merging with.
     // Verify they are free and small enough to merge.
     size_t coalesced_size = MinfsReclen(de, off);
+    bool merged_next = false;
     // Coalesce with "next" first, so the kMinfsReclenLast bit can easily flow
     // back to "de" and "de_prev".
     if (!(de->reclen & kMinfsReclenLast)) {
@@ -474,6 +570,7 @@ mx_status_t VnodeMinfs::UnlinkChild(VnodeMinfs* childvn, minfs_dirent_t* de, Dir
             goto fail;
         }
         if (de_next.ino == 0) {
+            merged_next = true;
             coalesced_size += MinfsReclen(&de_next, off_next);
             // If the next entry *was* last, then 'de' is now last.
             de->reclen |= (de_next.reclen & kMinfsReclenLast);
@@ -506,6 +603,13 @@ mx_status_t VnodeMinfs::UnlinkChild(VnodeMinfs* childvn, minfs_dirent_t* de, Dir
     if ((status = WriteExactInternal(de, MINFS_DIRENT_SIZE, off)) != NO_ERROR) {
         goto fail;
     }
+    if (merged_next) {
+        DirIndexErase(off_next);
+    }
+    if (off != offs->off) {
+        DirIndexErase(offs->off);
+    }
+    DirIndexUpdate(off, de);
 
     if (de->reclen & kMinfsReclenLast) {
         // Truncating the directory merely removed unused space; if it fails,
@@ -648,6 +752,7 @@ static mx_status_t add_dirent(VnodeMinfs* vndir, minfs_dirent_t* de, DirArgs* ar
     if (status != NO_ERROR) {
         return status;
     }
+    vndir->DirIndexUpdate(off, de);
     vndir->inode_.dirent_count++;
     if (args->type == kMinfsTypeDir) {
         // Child directory has '..' which will point to parent directory
@@ -683,6 +788,7 @@ static mx_status_t cb_dir_append(VnodeMinfs* vndir, minfs_dirent_t* de,
         if (status != NO_ERROR) {
             return status;
         }
+        vndir->DirIndexUpdate(offs->off, de);
         offs->off += size;
         // create new entry in the remaining space
         de = (minfs_dirent_t*) ((uintptr_t)de + size);
@@ -705,40 +811,131 @@ static mx_status_t cb_dir_append(VnodeMinfs* vndir, minfs_dirent_t* de,
 //  'offs': Offset info about where in the directory this direntry is located.
 //          Since 'func' may create / remove surrounding dirents, it is responsible for
 //          updating the offset information to access the next dirent.
-mx_status_t VnodeMinfs::ForEachDirent(DirArgs* args,
-                                      mx_status_t (*func)(VnodeMinfs*, minfs_dirent_t*, DirArgs*,
-                                                          DirectoryOffset*)) {
-    char data[kMinfsMaxDirentSize];
-    minfs_dirent_t* de = (minfs_dirent_t*) data;
+mx_status_t VnodeMinfs::ScanDirents(DirArgs* args,
+                                    mx_status_t (*func)(VnodeMinfs*, minfs_dirent_t*, DirArgs*,
+                                                        DirectoryOffset*)) {
     DirectoryOffset offs = {
         .off = 0,
         .off_prev = 0,
     };
     while (offs.off + MINFS_DIRENT_SIZE < kMinfsMaxDirectorySize) {
-        trace(MINFS, "Reading dirent at offset %zd\n", offs.off);
-        size_t r;
-        mx_status_t status = ReadInternal(data, kMinfsMaxDirentSize, offs.off, &r);
-        if (status != NO_ERROR) {
-            return status;
-        } else if ((status = validate_dirent(de, r, offs.off)) != NO_ERROR) {
+        mx_status_t status = DirentAt(args, &offs, func);
+        if (status != DIR_CB_NEXT) {
             return status;
         }
+    }
+    return ERR_NOT_FOUND;
+}
 
-        switch ((status = func(this, de, args, &offs))) {
-        case DIR_CB_NEXT:
-            break;
-        case DIR_CB_SAVE_SYNC:
-            inode_.seq_num++;
-            InodeSync(kMxFsSyncMtime);
-            return NO_ERROR;
-        case DIR_CB_DONE:
-        default:
+// Reads the dirent at 'offs->off' and calls 'func' on it. Returns DIR_CB_NEXT
+// if the callback moved on, and the result of the operation otherwise.
+mx_status_t VnodeMinfs::DirentAt(DirArgs* args, DirectoryOffset* offs,
+                                 mx_status_t (*func)(VnodeMinfs*, minfs_dirent_t*, DirArgs*,
+                                                     DirectoryOffset*)) {
+    char data[kMinfsMaxDirentSize];
+    minfs_dirent_t* de = (minfs_dirent_t*) data;
+    trace(MINFS, "Reading dirent at offset %zd\n", offs->off);
+    size_t r;
+    mx_status_t status = ReadInternal(data, kMinfsMaxDirentSize, offs->off, &r);
+    if (status != NO_ERROR) {
+        return status;
+    } else if ((status = validate_dirent(de, r, offs->off)) != NO_ERROR) {
+        return status;
+    }
+
+    switch ((status = func(this, de, args, offs))) {
+    case DIR_CB_SAVE_SYNC:
+        inode_.seq_num++;
+        InodeSync(kMxFsSyncMtime);
+        return NO_ERROR;
+    case DIR_CB_NEXT:
+    case DIR_CB_DONE:
+    default:
+        return status;
+    }
+}
+
+// Like ScanDirents, for callbacks which only act on the entry named by 'args'.
+// Indexed directories visit just the entries whose name hash matches.
+mx_status_t VnodeMinfs::ForEachDirent(DirArgs* args,
+                                      mx_status_t (*func)(VnodeMinfs*, minfs_dirent_t*, DirArgs*,
+                                                          DirectoryOffset*)) {
+    if (!DirIndexReady()) {
+        return ScanDirents(args, func);
+    }
+
+    uint32_t hash = DirectoryIndex::Hash(args->name, args->len);
+    const void* cookie = nullptr;
+    DirectoryOffset offs;
+    while (dir_index_->FindName(hash, &cookie, &offs.off)) {
+        offs.off_prev = dir_index_->Prev(offs.off);
+        mx_status_t status = DirentAt(args, &offs, func);
+        if (status != DIR_CB_NEXT) {
             return status;
         }
     }
     return ERR_NOT_FOUND;
 }
 
+mx_status_t VnodeMinfs::AppendDirent(DirArgs* args) {
+    if (DirIndexReady()) {
+        DirectoryOffset offs;
+        if (dir_index_->FindSpace(args->reclen, &offs.off) != NO_ERROR) {
+            return ERR_NOT_FOUND;
+        }
+        offs.off_prev = dir_index_->Prev(offs.off);
+        mx_status_t status = DirentAt(args, &offs, cb_dir_append);
+        if (status != DIR_CB_NEXT) {
+            return status;
+        }
+        // The index disagrees with the directory; stop trusting it
+        error("minfs: directory #%u index out of date\n", ino_);
+        dir_index_.reset();
+    }
+    return ScanDirents(args, cb_dir_append);
+}
+
+bool VnodeMinfs::DirIndexReady() {
+    if (dir_index_ != nullptr) {
+        return true;
+    } else if (inode_.dirent_count < kMinfsDirIndexMinEntries) {
+        return false;
+    }
+
+    AllocChecker ac;
+    mxtl::unique_ptr<DirectoryIndex> index(new (&ac) DirectoryIndex());
+    if (!ac.check()) {
+        return false;
+    }
+    char data[kMinfsMaxDirentSize];
+    minfs_dirent_t* de = (minfs_dirent_t*) data;
+    size_t off = 0;
+    while (off + MINFS_DIRENT_SIZE < kMinfsMaxDirectorySize) {
+        size_t r;
+        if ((ReadInternal(data, kMinfsMaxDirentSize, off, &r) != NO_ERROR) ||
+            (validate_dirent(de, r, off) != NO_ERROR) ||
+            (index->Update(off, de) != NO_ERROR)) {
+            // Lookups still work without the index, just more slowly
+            return false;
+        }
+        off += MinfsReclen(de, off);
+    }
+    dir_index_ = mxtl::move(index);
+    return true;
+}
+
+void VnodeMinfs::DirIndexUpdate(size_t off, minfs_dirent_t* de) {
+    if ((dir_index_ != nullptr) && (dir_index_->Update(off, de) != NO_ERROR)) {
+        dir_index_.reset();
+    }
+}
+
+void VnodeMinfs::DirIndexErase(size_t off) {
+    if (dir_index_ != nullptr) {
+        dir_index_->Erase(off);
+    }
+}
+
 void VnodeMinfs::Release() {
     trace(MINFS, "minfs_release() vn=%p(#%u)%s\n", this, ino_,
           inode_.link_count ? "" : " link-count is zero");
@@ -748,6 +945,9 @@ void VnodeMinfs::Release() {
 
     fs_->VnodeRelease(this);
 #ifdef __Fuchsia__
+    if (vmo_attached_) {
+        fs_->bc_->DetachVmo(vmoid_);
+    }
     mx_handle_close(vmo_);
 #endif
     delete this;
@@ -796,6 +996,8 @@ mx_status_t VnodeMinfs::ReadInternal(void* data, size_t len, size_t off, size_t*
 #ifdef __Fuchsia__
     if ((status = InitVmo()) != NO_ERROR) {
         return status;
+    } else if ((status = Readahead(off, len)) != NO_ERROR) {
+        return status;
     } else if ((status = mx_vmo_read(vmo_, data, off, len, actual)) != NO_ERROR) {
         return status;
     }
@@ -804,7 +1006,7 @@ mx_status_t VnodeMinfs::ReadInternal(void* data, size_t len, size_t off, size_t*
     uint32_t n = off / kMinfsBlockSize;
     size_t adjust = off % kMinfsBlockSize;
 
-    while ((len > 0) && (n < kMinfsMaxFileBlock)) {
+    while ((len > 0) && (n < MaxFileBlock())) {
         size_t xfer;
         if (len > (kMinfsBlockSize - adjust)) {
             xfer = kMinfsBlockSize - adjust;
@@ -867,7 +1069,18 @@ mx_status_t VnodeMinfs::WriteInternal(const void* data, size_t len, size_t off,
     uint32_t n = static_cast<uint32_t>(off / kMinfsBlockSize);
     size_t adjust = off % kMinfsBlockSize;
 
-    while ((len > 0) && (n < kMinfsMaxFileBlock)) {
+    if (IsExtentMapped()) {
+        // Map the whole range up front, so that it lands in as few runs of
+        // blocks as possible. The loop below allocates (and reports the
+        // failure to allocate) anything this leaves unmapped.
+        size_t end = mxtl::min(mxtl::roundup(off + len, size_t{kMinfsBlockSize}) / kMinfsBlockSize,
+                               size_t{MaxFileBlock()});
+        if (n < end) {
+            ExtentsAlloc(n, static_cast<uint32_t>(end));
+        }
+    }
+
+    while ((len > 0) && (n < MaxFileBlock())) {
         size_t xfer;
         if (len > (kMinfsBlockSize - adjust)) {
             xfer = kMinfsBlockSize - adjust;
@@ -882,6 +1095,9 @@ mx_status_t VnodeMinfs::WriteInternal(const void* data, size_t len, size_t off,
             if ((status = mx_vmo_set_size(vmo_, mxtl::roundup(new_size, kMinfsBlockSize))) != NO_ERROR) {
                 goto done;
             }
+            if ((status = VmoLoadedReserve(n + 1)) != NO_ERROR) {
+                goto done;
+            }
             inode_.size = static_cast<uint32_t>(new_size);
         }
 
@@ -891,10 +1107,17 @@ mx_status_t VnodeMinfs::WriteInternal(const void* data, size_t len, size_t off,
         // the file. As a consequence, an error is returned (ERR_IO) rather than
         // doing a partial read.
 
+        // A partial write merges with the rest of the block, which must be
+        // present in the VMO first
+        if ((xfer != kMinfsBlockSize) && ((status = LoadVmo(n, n + 1)) != NO_ERROR)) {
+            return ERR_IO;
+        }
+
         // Update this block of the in-memory VMO
         if ((status = vmo_write_exact(vmo_, data, xfer_off, xfer)) != NO_ERROR) {
             return ERR_IO;
         }
+        vmo_loaded_->Set(n, n + 1);
 
         // Update this block on-disk
         char bdata[kMinfsBlockSize];
@@ -911,7 +1134,7 @@ mx_status_t VnodeMinfs::WriteInternal(const void* data, size_t len, size_t off,
             return status;
         }
         assert(bno != 0);
-        if (fs_->bc_->Writeblk(bno, wdata)) {
+        if (WriteBlock(bno, wdata)) {
             return ERR_IO;
         }
 #else
@@ -925,7 +1148,7 @@ mx_status_t VnodeMinfs::WriteInternal(const void* data, size_t len, size_t off,
             return ERR_IO;
         }
         memcpy(wdata + adjust, data, xfer);
-        if (fs_->bc_->Writeblk(bno, wdata)) {
+        if (WriteBlock(bno, wdata)) {
             return ERR_IO;
         }
 #endif
@@ -941,7 +1164,7 @@ done:
     if (len == 0) {
         // If more than zero bytes were requested, but zero bytes were written,
         // return an error explicitly (rather than zero).
-        if (off >= kMinfsMaxFileSize) {
+        if (off >= MaxFileSize()) {
             return ERR_FILE_BIG;
         }
 
@@ -1090,9 +1313,10 @@ fail:
 }
 
 #ifdef __Fuchsia__
-VnodeMinfs::VnodeMinfs(Minfs* fs) : fs_(fs), vmo_(MX_HANDLE_INVALID) {}
+VnodeMinfs::VnodeMinfs(Minfs* fs) : fs_(fs), vmo_(MX_HANDLE_INVALID), vmoid_(0),
+    vmo_attached_(false), ra_next_(0), ra_window_(0), extent_count_(0), extent_cap_(0) {}
 #else
-VnodeMinfs::VnodeMinfs(Minfs* fs) : fs_(fs) {}
+VnodeMinfs::VnodeMinfs(Minfs* fs) : fs_(fs), extent_count_(0), extent_cap_(0) {}
 #endif
 
 mx_status_t VnodeMinfs::Allocate(Minfs* fs, uint32_t type, VnodeMinfs** out) {
@@ -1104,6 +1328,10 @@ mx_status_t VnodeMinfs::Allocate(Minfs* fs, uint32_t type, VnodeMinfs** out) {
     (*out)->inode_.magic = MinfsMagic(type);
     (*out)->inode_.create_time = (*out)->inode_.modify_time = minfs_gettime_utc();
     (*out)->inode_.link_count = (type == kMinfsTypeDir ? 2 : 1);
+    // Directories are small, and stay with block pointers
+    if (type == kMinfsTypeFile) {
+        (*out)->inode_.flags = kMinfsInodeFlagExtents;
+    }
     return NO_ERROR;
 }
 
@@ -1160,7 +1388,7 @@ mx_status_t VnodeMinfs::Create(fs::Vnode** out, const char* name, size_t len, ui
     args.ino = vn->ino_;
     args.type = type;
     args.reclen = static_cast<uint32_t>(DirentSize(static_cast<uint8_t>(len)));
-    if ((status = ForEachDirent(&args, cb_dir_append)) < 0) {
+    if ((status = AppendDirent(&args)) < 0) {
         vn->Release(); // vn refcount +0
         return status;
     }
@@ -1250,6 +1478,10 @@ mx_status_t VnodeMinfs::TruncateInternal(size_t len) {
             if (bno != 0) {
                 size_t adjust = len % kMinfsBlockSize;
 #ifdef __Fuchsia__
+                uint32_t n = static_cast<uint32_t>(len / kMinfsBlockSize);
+                if ((r = LoadVmo(n, n + 1)) != NO_ERROR) {
+                    return ERR_IO;
+                }
                 if ((r = vmo_read_exact(vmo_, bdata, len - adjust, adjust)) != NO_ERROR) {
                     return ERR_IO;
                 }
@@ -1267,7 +1499,7 @@ mx_status_t VnodeMinfs::TruncateInternal(size_t len) {
                 memset(bdata + adjust, 0, kMinfsBlockSize - adjust);
 #endif
 
-                if (fs_->bc_->Writeblk(bno, bdata)) {
+                if (WriteBlock(bno, bdata)) {
                     return ERR_IO;
                 }
             }
@@ -1276,7 +1508,7 @@ mx_status_t VnodeMinfs::TruncateInternal(size_t len) {
         InodeSync(kMxFsSyncMtime);
     } else if (len > inode_.size) {
         // Truncate should make the file longer, filled with zeroes.
-        if (kMinfsMaxFileSize < len) {
+        if (MaxFileSize() < len) {
             return ERR_INVALID_ARGS;
         }
         char zero = 0;
@@ -1289,6 +1521,9 @@ mx_status_t VnodeMinfs::TruncateInternal(size_t len) {
     if ((r = mx_vmo_set_size(vmo_, mxtl::roundup(len, kMinfsBlockSize))) != NO_ERROR) {
         return r;
     }
+    // Blocks past the end were released along with their pages
+    size_t blocks = mxtl::roundup(len, kMinfsBlockSize) / kMinfsBlockSize;
+    vmo_loaded_->Clear(blocks, vmo_loaded_->size());
 #endif
 
     return NO_ERROR;
@@ -1373,7 +1608,7 @@ mx_status_t VnodeMinfs::Rename(fs::Vnode* _newdir, const char* oldname, size_t o
     if (status == ERR_NOT_FOUND) {
         // if 'newname' does not exist, create it
         args.reclen = static_cast<uint32_t>(DirentSize(static_cast<uint8_t>(newlen)));
-        if ((status = newdir->ForEachDirent(&args, cb_dir_append)) < 0) {
+        if ((status = newdir->AppendDirent(&args)) < 0) {
             goto done;
         }
         status = NO_ERROR;
@@ -1444,7 +1679,7 @@ mx_status_t VnodeMinfs::Link(const char* name, size_t len, fs::Vnode* _target) {
     args.ino = target->ino_;
     args.type = kMinfsTypeFile; // We can't hard link directories
     args.reclen = static_cast<uint32_t>(DirentSize(static_cast<uint8_t>(len)));
-    if ((status = ForEachDirent(&args, cb_dir_append)) < 0) {
+    if ((status = AppendDirent(&args)) < 0) {
         return status;
     }
 
@@ -10,9 +10,11 @@
 #include <mxtl/algorithm.h>
 #include <mxtl/intrusive_hash_table.h>
 #include <mxtl/intrusive_single_list.h>
+#include <mxtl/intrusive_wavl_tree.h>
 #include <mxtl/macros.h>
 #include <mxtl/ref_counted.h>
 #include <mxtl/ref_ptr.h>
+#include <mxtl/unique_ptr.h>
 
 #include <fs/vfs.h>
 
@@ -25,7 +27,23 @@ constexpr uint32_t kMxFsSyncDefault = 0;     // default: no implicit time update
 constexpr uint32_t kMxFsSyncMtime   = (1<<0);
 constexpr uint32_t kMxFsSyncCtime   = (1<<1);
 
-constexpr uint32_t kMinfsBlockCacheSize = 64;
+constexpr uint32_t kMinfsBlockCacheSize = 256;
+// Dirty blocks are written back once this many accumulate
+constexpr uint32_t kMinfsDirtyHighWater = kMinfsBlockCacheSize / 2;
+// Largest number of blocks written back in one batch
+constexpr uint32_t kMinfsFlushBatch = 64;
+
+// Every dirty block in the cache must fit in a single journal commit
+constexpr uint32_t kMinfsJournalMinBlocks = kMinfsBlockCacheSize + 1;
+static_assert(kMinfsBlockCacheSize <= kMinfsJournalMaxEntries, "journal header too small");
+static_assert(kMinfsJournalMinBlocks <= kMinfsJournalBlocks, "journal too small");
+
+// Bounds of the window of file blocks read ahead of a sequential reader
+constexpr uint32_t kMinfsReadaheadMin = 4;
+constexpr uint32_t kMinfsReadaheadMax = 128;
+
+// Directories holding at least this many entries are indexed in memory
+constexpr uint32_t kMinfsDirIndexMinEntries = 128;
 
 // Used by fsck
 struct CheckMaps {
@@ -57,6 +75,16 @@ public:
     // Acquires the block if out_block is not null.
     mx_status_t BlockNew(uint32_t hint, uint32_t* out_bno, mxtl::RefPtr<BlockNode>* out_block);
 
+    // Allocate a run of up to 'want' contiguous data blocks, which are not
+    // cleared. Prefers extending the run which starts at 'hint', then the
+    // first free run of 'want' blocks, and only settles for shorter runs
+    // when there is none. '*out_count' is at least one on success.
+    mx_status_t BlocksNew(uint32_t hint, uint32_t want, uint32_t* out_start, uint32_t* out_count);
+
+    // Release data blocks [start, start + count), using 'bitmap_blk' as
+    // described for BitmapBlockGet below.
+    mx_status_t BlocksFree(mxtl::RefPtr<BlockNode>* bitmap_blk, uint32_t start, uint32_t count);
+
     // free ino in inode bitmap, release all blocks held by inode
     mx_status_t InoFree(const minfs_inode_t& inode, uint32_t ino);
 
@@ -81,6 +109,7 @@ private:
     friend mx_status_t minfs_check(Bcache*);
     Minfs(Bcache* bc_, minfs_info_t* info_);
     mx_status_t InoNew(const minfs_inode_t* inode, uint32_t* ino_out);
+    mx_status_t ExtentsFree(const minfs_inode_t& inode);
     mx_status_t LoadBitmaps();
 
     uint32_t abmblks_;
@@ -90,6 +119,86 @@ private:
     HashTable vnode_hash_;
 };
 
+// An in-memory index of the records of a large directory. Each record is
+// kept in directory order (to find the neighbour unlink coalesces with), by
+// unused space (to place new entries) and, if in use, by name hash (to find
+// candidates for lookup). Names themselves are not kept; a candidate is
+// checked against its dirent, which is read through the vnode's VMO.
+class DirectoryIndex {
+public:
+    DISALLOW_COPY_ASSIGN_AND_MOVE(DirectoryIndex);
+    DirectoryIndex();
+    ~DirectoryIndex();
+
+    static uint32_t Hash(const char* name, size_t len) { return fnv1a32(name, len); }
+
+    // Record the dirent 'de' found at 'off', replacing what was there.
+    mx_status_t Update(size_t off, minfs_dirent_t* de);
+    // Forget the record at 'off', which has been merged into a neighbour.
+    void Erase(size_t off);
+
+    // Offset of the record before the one at 'off', or 'off' for the first.
+    size_t Prev(size_t off) const;
+    // Find a record with room for a dirent of 'reclen' bytes.
+    mx_status_t FindSpace(uint32_t reclen, size_t* off) const;
+    // Step through the records in use whose name hashes to 'hash'.
+    // Start with '*cookie' set to nullptr; returns false when there are no more.
+    bool FindName(uint32_t hash, const void** cookie, size_t* off) const;
+
+private:
+    struct SlackKey {
+        uint32_t slack;
+        uint32_t off;
+    };
+
+    struct Record {
+        uint32_t GetKey() const { return off; }
+
+        uint32_t off;
+        uint32_t slack;
+        uint32_t hash;
+        bool live;
+        Record* hash_next;
+        mxtl::WAVLTreeNodeState<mxtl::unique_ptr<Record>> offset_ns;
+        mxtl::WAVLTreeNodeState<Record*> slack_ns;
+    };
+
+    struct OffsetNodeTraits {
+        static mxtl::WAVLTreeNodeState<mxtl::unique_ptr<Record>>& node_state(Record& r) {
+            return r.offset_ns;
+        }
+    };
+
+    struct SlackNodeTraits {
+        static mxtl::WAVLTreeNodeState<Record*>& node_state(Record& r) { return r.slack_ns; }
+    };
+
+    struct SlackKeyTraits {
+        static SlackKey GetKey(const Record& r) { return SlackKey{r.slack, r.off}; }
+        static bool LessThan(const SlackKey& k1, const SlackKey& k2) {
+            return (k1.slack < k2.slack) || ((k1.slack == k2.slack) && (k1.off < k2.off));
+        }
+        static bool EqualTo(const SlackKey& k1, const SlackKey& k2) {
+            return (k1.slack == k2.slack) && (k1.off == k2.off);
+        }
+    };
+
+    using OffsetTree = mxtl::WAVLTree<uint32_t, mxtl::unique_ptr<Record>,
+                                      mxtl::DefaultKeyedObjectTraits<uint32_t, Record>,
+                                      OffsetNodeTraits>;
+    using SlackTree = mxtl::WAVLTree<SlackKey, Record*, SlackKeyTraits, SlackNodeTraits>;
+
+    // Take 'r' out of the slack tree and its hash chain
+    void Detach(Record* r);
+    mx_status_t GrowBuckets();
+
+    OffsetTree by_offset_;
+    SlackTree by_slack_;
+    mxtl::unique_ptr<Record*[]> buckets_;
+    size_t bucket_count_;
+    size_t live_count_;
+};
+
 struct DirArgs {
     const char* name;
     size_t len;
@@ -114,12 +223,22 @@ public:
     static mx_status_t AllocateHollow(Minfs* fs, VnodeMinfs** out);
 
     bool IsDirectory() const { return inode_.magic == kMinfsMagicDir; }
+    bool IsExtentMapped() const { return (inode_.flags & kMinfsInodeFlagExtents) != 0; }
+    uint32_t MaxFileBlock() const {
+        return static_cast<uint32_t>(IsExtentMapped() ? kMinfsMaxExtentFileBlock :
+                                                        kMinfsMaxFileBlock);
+    }
+    uint64_t MaxFileSize() const { return uint64_t{MaxFileBlock()} * kMinfsBlockSize; }
     bool CanUnlink() const;
 
     uint32_t GetKey() const { return ino_; }
     static size_t GetHash(uint32_t key) { return INO_HASH(key); }
 
     mx_status_t UnlinkChild(VnodeMinfs* child, minfs_dirent_t* de, DirectoryOffset* offs);
+    // Keep the directory index in step with a dirent written at 'off', or
+    // with a record merged away; no-ops for directories without an index.
+    void DirIndexUpdate(size_t off, minfs_dirent_t* de);
+    void DirIndexErase(size_t off);
     mx_status_t ReadInternal(void* data, size_t len, size_t off, size_t* actual);
     mx_status_t ReadExactInternal(void* data, size_t len, size_t off);
     mx_status_t WriteInternal(const void* data, size_t len, size_t off, size_t* actual);
@@ -157,10 +276,23 @@ private:
     mx_status_t Sync() final;
 
     mx_status_t InitVmo();
+    // Make sure vmo_loaded_ covers the first 'blocks' blocks of the file.
+    mx_status_t VmoLoadedReserve(uint32_t blocks);
 
     // Read data from disk at block 'bno', into the 'nth' logical block of the file.
     mx_status_t FillBlock(uint32_t n, uint32_t bno);
 
+    // Ensure logical blocks [start, end) of the file are present in the VMO.
+    mx_status_t LoadVmo(uint32_t start, uint32_t end);
+
+    // Load the blocks covering [off, off + len) before a read, along with a
+    // window of following blocks which grows while the file is read sequentially.
+    mx_status_t Readahead(size_t off, size_t len);
+
+    // Write one block of the file's contents to disk block 'bno'. Directory
+    // contents are journaled along with other metadata, file contents are not.
+    mx_status_t WriteBlock(uint32_t bno, const void* data);
+
     // Get the disk block 'bno' corresponding to the 'nth' logical block of the file.
     // Allocate the block if reqeusted.
     mx_status_t GetBno(uint32_t n, uint32_t* bno, bool alloc);
@@ -169,6 +301,25 @@ private:
     // of the file. Does not update mtime/atime.
     mx_status_t BlocksShrink(uint32_t start);
 
+    // Extent-mapped files only (extents.cpp)
+    // Read the extent table into extents_, if it is not there already.
+    mx_status_t ExtentsLoad();
+    // Write extents_ back to the inode and its leaf blocks, rewriting the
+    // leaves from the one holding extent 'first' onwards.
+    mx_status_t ExtentsSync(uint32_t first);
+    // Index of the first extent which ends after file block 'n'.
+    uint32_t ExtentSearch(uint32_t n) const;
+    // Add the mapping of blocks [lblk, lblk + length) to 'start' as extent
+    // 'i', merging it with its neighbours where they are contiguous. Returns
+    // the index of the first extent which changed in '*first'.
+    mx_status_t ExtentInsert(uint32_t i, uint32_t lblk, uint32_t start, uint32_t length,
+                             uint32_t* first);
+    mx_status_t ExtentGetBno(uint32_t n, uint32_t* bno, bool alloc);
+    // Map every hole within file blocks [start, end), with runs of disk
+    // blocks which continue the preceding extent where possible.
+    mx_status_t ExtentsAlloc(uint32_t start, uint32_t end);
+    mx_status_t ExtentsShrink(uint32_t start);
+
     // Update the vnode's inode and write it to disk
     void InodeSync(uint32_t flags);
     // Destroy the inode on disk (and free associated resources)
@@ -178,6 +329,19 @@ private:
     mx_status_t ForEachDirent(DirArgs* args,
                               mx_status_t (*func)(VnodeMinfs*, minfs_dirent_t*, DirArgs*,
                                                   DirectoryOffset*));
+    // Add the entry described by 'args' wherever there is room for it
+    mx_status_t AppendDirent(DirArgs* args);
+    // Visit every record in the directory, in order
+    mx_status_t ScanDirents(DirArgs* args,
+                            mx_status_t (*func)(VnodeMinfs*, minfs_dirent_t*, DirArgs*,
+                                                DirectoryOffset*));
+    // Call 'func' on the single record at 'offs->off'
+    mx_status_t DirentAt(DirArgs* args, DirectoryOffset* offs,
+                         mx_status_t (*func)(VnodeMinfs*, minfs_dirent_t*, DirArgs*,
+                                             DirectoryOffset*));
+
+    // Returns true if the directory is (now) indexed
+    bool DirIndexReady();
 
 #ifdef __Fuchsia__
     // The following functionality interacts with handles directly, and are not applicable outside
@@ -190,7 +354,29 @@ private:
     // avoid reading the entire file up-front. Until then, read the contents of
     // a VMO into memory when it is read/written.
     mx_handle_t vmo_;
+    // vmo_ as registered with the block server, for as long as the vnode
+    // lives, when the device speaks the block FIFO protocol.
+    vmoid_t vmoid_;
+    bool vmo_attached_;
+    // Logical blocks which have been read into (or written through) vmo_.
+    // Grown along with the file, rather than sized for the largest one.
+    using LoadedMap = bitmap::RawBitmapGeneric<bitmap::DefaultStorage>;
+    mxtl::unique_ptr<LoadedMap> vmo_loaded_;
+
+    // The block a sequential reader is expected to ask for next, and how far
+    // beyond its requests to read
+    uint32_t ra_next_;
+    uint32_t ra_window_;
 #endif
+
+    // Directories only, once they grow past kMinfsDirIndexMinEntries
+    mxtl::unique_ptr<DirectoryIndex> dir_index_;
+
+    // Extent-mapped files only, once they are first accessed. The on-disk
+    // table is kept in step with every change.
+    mxtl::unique_ptr<minfs_extent_t[]> extents_;
+    uint32_t extent_count_;
+    uint32_t extent_cap_;
 };
 
 // write the inode data of this vnode to disk (default does not update time values)
@@ -206,8 +392,16 @@ mx_status_t minfs_check(Bcache* bc);
 
 mx_status_t minfs_mount(VnodeMinfs** root_out, Bcache* bc);
 
+// Write back the blocks of a journal entry which was committed but not
+// known to be written in place, then clear the journal.
+mx_status_t minfs_journal_replay(Bcache* bc, const minfs_info_t* info);
+
 void minfs_dir_init(void* bdata, uint32_t ino_self, uint32_t ino_parent);
 
+// Copy the extent table of 'inode' into 'extents', which has room for
+// inode->extent_count entries, reading leaf blocks through 'bc'.
+mx_status_t minfs_read_extents(Bcache* bc, const minfs_inode_t* inode, minfs_extent_t* extents);
+
 // vfs dispatch
 mx_handle_t vfs_rpc_server(VnodeMinfs* vn);
 
@@ -37,6 +37,7 @@ void minfs_dump_info(minfs_info_t* info) {
     printf("minfs: inode bitmap @ %10u\n", info->ibm_block);
     printf("minfs: alloc bitmap @ %10u\n", info->abm_block);
     printf("minfs: inode table  @ %10u\n", info->ino_block);
+    printf("minfs: journal      @ %10u (%u blocks)\n", info->jnl_block, info->jnl_blocks);
     printf("minfs: data blocks  @ %10u\n", info->dat_block);
 }
 
@@ -60,6 +61,13 @@ mx_status_t minfs_check_info(minfs_info_t* info, uint32_t max) {
         error("minfs: too large for device\n");
         return ERR_INVALID_ARGS;
     }
+    if ((info->jnl_blocks != 0) &&
+        ((info->jnl_blocks < kMinfsJournalMinBlocks) || (info->jnl_block < info->ino_block) ||
+         (info->jnl_block + info->jnl_blocks > info->dat_block))) {
+        error("minfs: bad journal %u-%u\n", info->jnl_block,
+              info->jnl_block + info->jnl_blocks - 1);
+        return ERR_INVALID_ARGS;
+    }
     //TODO: validate layout
     return 0;
 }
@@ -87,6 +95,10 @@ mx_status_t Minfs::InoFree(const minfs_inode_t& inode, uint32_t ino) {
     memcpy(block_ibm->data(), bmdata, kMinfsBlockSize);
     bc_->Put(block_ibm, kBlockDirty);
 
+    if (inode.flags & kMinfsInodeFlagExtents) {
+        return ExtentsFree(inode);
+    }
+
     mxtl::RefPtr<BlockNode> bitmap_blk;
 
     // release all direct blocks
@@ -98,6 +110,7 @@ mx_status_t Minfs::InoFree(const minfs_inode_t& inode, uint32_t ino) {
             return ERR_IO;
         }
         block_map_.Clear(inode.dnum[n], inode.dnum[n] + 1);
+        bc_->Discard(inode.dnum[n], 1);
     }
 
     // release all indirect blocks
@@ -121,6 +134,7 @@ mx_status_t Minfs::InoFree(const minfs_inode_t& inode, uint32_t ino) {
                 return ERR_IO;
             }
             block_map_.Clear(entry[m], entry[m] + 1);
+            bc_->Discard(entry[m], 1);
         }
         bc_->Put(blk, 0);
         // release the direct block itself
@@ -128,12 +142,54 @@ mx_status_t Minfs::InoFree(const minfs_inode_t& inode, uint32_t ino) {
             return ERR_IO;
         }
         block_map_.Clear(inode.inum[n], inode.inum[n] + 1);
+        bc_->Discard(inode.inum[n], 1);
     }
     BitmapBlockPut(bitmap_blk);
 
     return NO_ERROR;
 }
 
+// Release the data and leaf blocks of an extent-mapped file.
+mx_status_t Minfs::ExtentsFree(const minfs_inode_t& inode) {
+    mxtl::RefPtr<BlockNode> bitmap_blk;
+    uint32_t leaves = MinfsExtentLeaves(inode.extent_count);
+    if (leaves == 0) {
+        for (unsigned n = 0; n < inode.extent_count; n++) {
+            mx_status_t status = BlocksFree(&bitmap_blk, inode.extents[n].start,
+                                            inode.extents[n].length);
+            if (status != NO_ERROR) {
+                BitmapBlockPut(bitmap_blk);
+                return status;
+            }
+        }
+        BitmapBlockPut(bitmap_blk);
+        return NO_ERROR;
+    }
+
+    for (unsigned n = 0; (n < leaves) && (n < kMinfsInlineExtents); n++) {
+        mxtl::RefPtr<BlockNode> blk;
+        if ((blk = bc_->Get(inode.extents[n].start)) == nullptr) {
+            BitmapBlockPut(bitmap_blk);
+            return ERR_IO;
+        }
+        const minfs_extent_t* extent = static_cast<const minfs_extent_t*>(blk->data());
+        uint32_t count = mxtl::min(inode.extents[n].length, kMinfsExtentsPerBlock);
+        mx_status_t status = NO_ERROR;
+        for (unsigned m = 0; (m < count) && (status == NO_ERROR); m++) {
+            status = BlocksFree(&bitmap_blk, extent[m].start, extent[m].length);
+        }
+        bc_->Put(blk, 0);
+        // release the leaf itself
+        if ((status != NO_ERROR) ||
+            ((status = BlocksFree(&bitmap_blk, inode.extents[n].start, 1)) != NO_ERROR)) {
+            BitmapBlockPut(bitmap_blk);
+            return status;
+        }
+    }
+    BitmapBlockPut(bitmap_blk);
+    return NO_ERROR;
+}
+
 mx_status_t Minfs::InoNew(const minfs_inode_t* inode, uint32_t* ino_out) {
     size_t bitoff_start;
     mx_status_t status = inode_map_.Find(false, 0, inode_map_.size(), 1, &bitoff_start);
@@ -258,6 +314,7 @@ mx_status_t Minfs::BlockNew(uint32_t hint, uint32_t* out_bno, mxtl::RefPtr<Block
     assert(status == NO_ERROR);
     uint32_t bno = static_cast<uint32_t>(bitoff_start);
     assert(bno != 0); // Cannot allocate root block
+    bc_->Reuse(bno, 1);
 
     // obtain the in-memory bitmap block
     uint32_t bmbno;
@@ -287,6 +344,64 @@ mx_status_t Minfs::BlockNew(uint32_t hint, uint32_t* out_bno, mxtl::RefPtr<Block
     return NO_ERROR;
 }
 
+mx_status_t Minfs::BlocksNew(uint32_t hint, uint32_t want, uint32_t* out_start,
+                             uint32_t* out_count) {
+    size_t max = block_map_.size();
+    if (hint >= max) {
+        hint = 0;
+    }
+    size_t start = hint;
+    size_t len = 0;
+    // Block zero is never free, so a zero hint is no hint at all
+    if (hint != 0) {
+        len = block_map_.Scan(hint, mxtl::min(max, size_t{hint} + want), false) - hint;
+    }
+    for (size_t run = want; (len == 0) && (run > 0); run /= 2) {
+        if ((block_map_.Find(false, hint, max, run, &start) == NO_ERROR) ||
+            (block_map_.Find(false, 0, hint, run, &start) == NO_ERROR)) {
+            len = run;
+        }
+    }
+    if (len == 0) {
+        return ERR_NO_SPACE;
+    }
+    mx_status_t status = block_map_.Set(start, start + len);
+    assert(status == NO_ERROR);
+    assert(start != 0); // Cannot allocate root block
+
+    // commit each block of the alloc bitmap the run touches
+    mxtl::RefPtr<BlockNode> bitmap_blk;
+    for (size_t n = start; n < start + len; n = mxtl::roundup(n + 1, size_t{kMinfsBlockBits})) {
+        if ((bitmap_blk = BitmapBlockGet(bitmap_blk, static_cast<uint32_t>(n))) == nullptr) {
+            block_map_.Clear(start, start + len);
+            return ERR_IO;
+        }
+    }
+    BitmapBlockPut(bitmap_blk);
+    bc_->Reuse(static_cast<uint32_t>(start), static_cast<uint32_t>(len));
+    *out_start = static_cast<uint32_t>(start);
+    *out_count = static_cast<uint32_t>(len);
+    return NO_ERROR;
+}
+
+mx_status_t Minfs::BlocksFree(mxtl::RefPtr<BlockNode>* bitmap_blk, uint32_t start,
+                              uint32_t count) {
+    uint32_t end = start + count;
+    if ((end < start) || (end > block_map_.size())) {
+        return ERR_IO_DATA_INTEGRITY;
+    }
+    while (start < end) {
+        uint32_t next = mxtl::min(end, mxtl::roundup(start + 1, kMinfsBlockBits));
+        if ((*bitmap_blk = BitmapBlockGet(*bitmap_blk, start)) == nullptr) {
+            return ERR_IO;
+        }
+        block_map_.Clear(start, next);
+        bc_->Discard(start, next - start);
+        start = next;
+    }
+    return NO_ERROR;
+}
+
 void minfs_dir_init(void* bdata, uint32_t ino_self, uint32_t ino_parent) {
 #define DE0_SIZE DirentSize(1)
 
@@ -308,6 +423,69 @@ void minfs_dir_init(void* bdata, uint32_t ino_self, uint32_t ino_parent) {
     de->name[1] = '.';
 }
 
+// A journal header with a valid checksum means the blocks it lists may not
+// all have been written in place; copying them again is always safe, as the
+// header is cleared before any of them change further.
+mx_status_t minfs_journal_replay(Bcache* bc, const minfs_info_t* info) {
+    if (info->jnl_blocks == 0) {
+        return NO_ERROR;
+    }
+    uint32_t hdata[kMinfsBlockSize / sizeof(uint32_t)];
+    minfs_journal_t* header = reinterpret_cast<minfs_journal_t*>(hdata);
+    mx_status_t status;
+    if ((status = bc->Readblk(info->jnl_block, header)) != NO_ERROR) {
+        return status;
+    }
+    if (header->magic != kMinfsJournalMagic) {
+        return NO_ERROR;
+    }
+
+    uint32_t count = header->count;
+    uint32_t bdata[kMinfsBlockSize / sizeof(uint32_t)];
+    bool valid = (count > 0) &&
+                 (count <= mxtl::min(info->jnl_blocks - 1, kMinfsJournalMaxEntries));
+    if (valid) {
+        uint32_t sum = minfs_journal_checksum(FNV32_OFFSET_BASIS, header->bno,
+                                              count * sizeof(uint32_t));
+        for (uint32_t n = 0; n < count; n++) {
+            if ((status = bc->Readblk(info->jnl_block + 1 + n, bdata)) != NO_ERROR) {
+                return status;
+            }
+            sum = minfs_journal_checksum(sum, bdata, kMinfsBlockSize);
+        }
+        valid = (sum == header->checksum);
+    }
+    if (!valid) {
+        // The commit was cut short, so nothing was written in place yet
+        printf("minfs: discarding incomplete journal entry\n");
+    } else {
+        for (uint32_t n = 0; n < count; n++) {
+            if ((header->bno[n] == 0) || (header->bno[n] >= info->block_count)) {
+                error("minfs: journal entry for bad block %u\n", header->bno[n]);
+                return ERR_IO_DATA_INTEGRITY;
+            }
+        }
+        printf("minfs: replaying %u journaled blocks\n", count);
+        for (uint32_t n = 0; n < count; n++) {
+            if (((status = bc->Readblk(info->jnl_block + 1 + n, bdata)) != NO_ERROR) ||
+                ((status = bc->Writeblk(header->bno[n], bdata)) != NO_ERROR)) {
+                return status;
+            }
+        }
+        if ((status = bc->Flush()) != NO_ERROR) {
+            return status;
+        }
+    }
+
+    memset(bdata, 0, sizeof(bdata));
+    if (((status = bc->Writeblk(info->jnl_block, bdata)) != NO_ERROR) ||
+        ((status = bc->Flush()) != NO_ERROR)) {
+        return status;
+    }
+    // Commits write the journal directly, so it must not linger in the cache
+    return bc->Invalidate();
+}
+
 mx_status_t Minfs::Create(Minfs** out, Bcache* bc, minfs_info_t* info) {
     uint32_t blocks = bc->Maxblk();
     uint32_t inodes = info->inode_count;
@@ -344,9 +522,14 @@ mx_status_t Minfs::Create(Minfs** out, Bcache* bc, minfs_info_t* info) {
         return status;
     }
 
+    if ((status = minfs_journal_replay(bc, info)) != NO_ERROR) {
+        error("minfs: cannot replay journal\n");
+        return status;
+    }
     if ((status = fs->LoadBitmaps()) < 0) {
         return status;
     }
+    bc->SetJournal(info->jnl_block, info->jnl_blocks);
     *out = fs.release();
     return NO_ERROR;
 }
@@ -425,7 +608,9 @@ int minfs_mkfs(Bcache* bc) {
     info.ibm_block = 8;
     info.abm_block = info.ibm_block + mxtl::roundup(ibmblks, 8u);
     info.ino_block = info.abm_block + mxtl::roundup(abmblks, 8u);
-    info.dat_block = info.ino_block + inoblks;
+    info.jnl_block = info.ino_block + inoblks;
+    info.jnl_blocks = kMinfsJournalBlocks;
+    info.dat_block = info.jnl_block + info.jnl_blocks;
     minfs_dump_info(&info);
 
     RawBitmap abm;
@@ -492,6 +677,10 @@ int minfs_mkfs(Bcache* bc) {
         bc->Put(blk, kBlockDirty);
     }
 
+    // start with an empty journal
+    blk = bc->GetZero(info.jnl_block);
+    bc->Put(blk, kBlockDirty);
+
     // setup root inode
     blk = bc->Get(info.ino_block);
     minfs_inode_t* ino = (minfs_inode_t*) blk->data();
@@ -22,6 +22,14 @@
 
 #include "misc.h"
 
+#ifdef __Fuchsia__
+#include <block-client/block-txn.h>
+#include <block-client/client.h>
+#include <magenta/device/block.h>
+#include <mxtl/mutex.h>
+#include <threads.h>
+#endif
+
 #ifdef __Fuchsia__
 using RawBitmap = bitmap::RawBitmapGeneric<bitmap::VmoStorage>;
 #else
@@ -34,7 +42,7 @@ namespace minfs {
 
 constexpr uint64_t kMinfsMagic0 = (0x002153466e694d21ULL);
 constexpr uint64_t kMinfsMagic1 = (0x385000d3d3d3d304ULL);
-constexpr uint32_t kMinfsVersion = 0x00000002;
+constexpr uint32_t kMinfsVersion = 0x00000004;
 
 constexpr uint32_t kMinfsRootIno        = 1;
 constexpr uint32_t kMinfsFlagClean      = 1;
@@ -51,6 +59,10 @@ constexpr uint32_t kMinfsIndirect = 32;
 constexpr uint64_t kMinfsMaxFileBlock = (kMinfsDirect + kMinfsIndirect * (kMinfsBlockSize / sizeof(uint32_t)));
 constexpr uint64_t kMinfsMaxFileSize  = kMinfsMaxFileBlock * kMinfsBlockSize;
 
+// extent-mapped files are only limited by the 32-bit size in the inode
+constexpr uint64_t kMinfsMaxExtentFileBlock = (UINT32_MAX / kMinfsBlockSize);
+constexpr uint64_t kMinfsMaxExtentFileSize  = kMinfsMaxExtentFileBlock * kMinfsBlockSize;
+
 constexpr uint32_t kMinfsTypeFile = 8;
 constexpr uint32_t kMinfsTypeDir  = 4;
 
@@ -59,6 +71,9 @@ constexpr uint32_t kMinfsMagicDir  = MinfsMagic(kMinfsTypeDir);
 constexpr uint32_t kMinfsMagicFile = MinfsMagic(kMinfsTypeFile);
 constexpr uint32_t MinfsMagicType(uint32_t n) { return n & 0xFF; }
 
+// inode flags
+constexpr uint32_t kMinfsInodeFlagExtents = 1;  // data is mapped by extents
+
 typedef struct {
     uint64_t magic0;
     uint64_t magic1;
@@ -72,10 +87,12 @@ typedef struct {
     uint32_t abm_block;     // first blockno of block allocation bitmap
     uint32_t ino_block;     // first blockno of inode table
     uint32_t dat_block;     // first blockno available for file data
+    uint32_t jnl_block;     // first blockno of the metadata journal
+    uint32_t jnl_blocks;    // size of the journal (0 if there is none)
 } minfs_info_t;
 
 // Notes:
-// - the ibm, abm, ino, and dat regions must be in that order
+// - the ibm, abm, ino, jnl, and dat regions must be in that order
 //   and may not overlap
 // - the abm has an entry for every block on the volume, including
 //   the info block (0), the bitmaps, etc
@@ -88,6 +105,52 @@ typedef struct {
 //   at offset: ino % kMinfsInodesPerBlock
 // - inode 0 is never used, should be marked allocated but ignored
 
+// Metadata updates are committed by writing them to the journal first: a
+// header block listing where each logged block belongs, followed by the
+// blocks themselves. Once they have also been written in place, the header
+// is cleared again. A header with a valid magic and checksum found at mount
+// means the blocks it lists must be copied in place before the filesystem
+// is used.
+constexpr uint64_t kMinfsJournalMagic  = (0x6c6e726a73666e6dULL);
+constexpr uint32_t kMinfsJournalBlocks = 512;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t count;         // number of blocks logged after the header
+    uint32_t checksum;      // of bno[0..count) and then the logged blocks
+    uint32_t bno[];         // where each logged block belongs
+} minfs_journal_t;
+
+constexpr uint32_t kMinfsJournalMaxEntries = (kMinfsBlockSize - sizeof(minfs_journal_t)) /
+                                             sizeof(uint32_t);
+
+// Running checksum of a journal entry (FNV-1a over 32-bit words, rather
+// than bytes, as it covers up to a few megabytes per commit).
+static inline uint32_t minfs_journal_checksum(uint32_t sum, const void* data, size_t len) {
+    const uint32_t* words = (const uint32_t*) data;
+    for (size_t n = 0; n < len / sizeof(uint32_t); n++) {
+        sum = (sum ^ words[n]) * FNV32_PRIME;
+    }
+    return sum;
+}
+
+typedef struct {
+    uint32_t lblk;      // first block of the file mapped
+    uint32_t start;     // first block on disk it is mapped to
+    uint32_t length;    // number of blocks
+} minfs_extent_t;
+
+constexpr uint32_t kMinfsInlineExtents   = ((kMinfsDirect + kMinfsIndirect) * sizeof(uint32_t)) /
+                                           sizeof(minfs_extent_t);
+constexpr uint32_t kMinfsExtentsPerBlock = (kMinfsBlockSize / sizeof(minfs_extent_t));
+constexpr uint32_t kMinfsMaxExtents      = kMinfsInlineExtents * kMinfsExtentsPerBlock;
+
+// Number of leaf blocks holding 'count' extents
+constexpr uint32_t MinfsExtentLeaves(uint32_t count) {
+    return (count <= kMinfsInlineExtents) ? 0 :
+           (count + kMinfsExtentsPerBlock - 1) / kMinfsExtentsPerBlock;
+}
+
 typedef struct {
     uint32_t magic;
     uint32_t size;
@@ -98,14 +161,30 @@ typedef struct {
     uint32_t seq_num;               // bumped when modified
     uint32_t gen_num;               // bumped when deleted
     uint32_t dirent_count;          // for directories
-    uint32_t rsvd[5];
-    uint32_t dnum[kMinfsDirect];    // direct blocks
-    uint32_t inum[kMinfsIndirect];  // indirect blocks
+    uint32_t flags;                 // kMinfsInodeFlag*
+    uint32_t extent_count;          // for extent-mapped files
+    uint32_t rsvd[3];
+    union {
+        struct {
+            uint32_t dnum[kMinfsDirect];    // direct blocks
+            uint32_t inum[kMinfsIndirect];  // indirect blocks
+        };
+        minfs_extent_t extents[kMinfsInlineExtents];
+    };
 } minfs_inode_t;
 
 static_assert(sizeof(minfs_inode_t) == kMinfsInodeSize,
               "minfs inode size is wrong");
 
+// Notes on extent-mapped files (kMinfsInodeFlagExtents):
+// - extents are sorted by lblk and do not overlap; blocks of the file
+//   which no extent maps are holes
+// - up to kMinfsInlineExtents extents are kept in the inode itself
+// - beyond that, they are packed kMinfsExtentsPerBlock to a leaf block, and
+//   the inode holds one entry per leaf instead: the lblk of its first
+//   extent, the leaf's block number (start) and its extent count (length)
+// - block_count includes the leaf blocks
+
 typedef struct {
     uint32_t ino;                   // inode number
     uint32_t reclen;                // Low 28 bits: Length of record
@@ -152,6 +231,7 @@ static_assert(kMinfsMaxDirectorySize <= kMinfsReclenMask,
 // blocksize   8K    16K    32K
 // 16 dir =  128K   256K   512K
 // 32 ind =  512M  1024M  2048M
+// extents:  4G (all block sizes, as size is 32 bits)
 
 //  1GB ->  128K blocks ->  16K bitmap (2K qword)
 //  4GB ->  512K blocks ->  64K bitmap (8K qword)
@@ -170,6 +250,9 @@ constexpr uint32_t kBlockLRU   = 0x04;
 constexpr uint32_t kBlockFree  = 0x08;
 
 constexpr uint32_t kBlockLLFlags = (kBlockBusy | kBlockLRU | kBlockFree);
+// Flag denoting that a dirty block holds file data, which is written in
+// place rather than through the journal
+constexpr uint32_t kBlockData  = 0x10;
 
 constexpr uint32_t kMinfsHashBits = (8);
 constexpr uint32_t kMinfsBuckets = (1 << kMinfsHashBits);
@@ -185,10 +268,10 @@ public:
         static NodeState& node_state(BlockNode& bn) { return bn.type_hash_state_; }
     };
 
-    // Create a single Block within a Block Cache
-    static mx_status_t Create(Bcache* bc);
+    // Create a single Block within a Block Cache, backed by 'data'
+    static mx_status_t Create(Bcache* bc, void* data);
 
-    void* data() const { return data_.get(); }
+    void* data() const { return data_; }
 
     // Allow BlockNode to be placed in an mxtl::HashTable
     uint32_t GetKey() const { return bno_; }
@@ -208,7 +291,7 @@ private:
     NodeState type_hash_state_;
     uint32_t flags_;
     uint32_t bno_;
-    mxtl::unique_free_ptr<char> data_;
+    void* data_; // Owned by the Bcache
 };
 
 // Contains operations that act on Bcache's linked lists, updating their flags as they move from
@@ -217,6 +300,19 @@ class BcacheLists {
 public:
     void PushBack(mxtl::RefPtr<BlockNode> blk, uint32_t block_type);
     mxtl::RefPtr<BlockNode> PopFront(uint32_t block_type);
+    // Returns the first block of a list without removing it, or nullptr.
+    BlockNode* Front(uint32_t block_type);
+    // Returns the first block of a list for which 'pred' holds, or nullptr.
+    template <typename Pred>
+    BlockNode* FindFirst(uint32_t block_type, Pred pred) {
+        LinkedList* ll = GetList(block_type & kBlockLLFlags);
+        for (auto& blk : *ll) {
+            if (pred(blk)) {
+                return &blk;
+            }
+        }
+        return nullptr;
+    }
     mxtl::RefPtr<BlockNode> Erase(mxtl::RefPtr<BlockNode> blk, uint32_t block_type);
 
 private:
@@ -229,6 +325,9 @@ private:
     LinkedList list_free_;  // Never been used. Not in hash.
 };
 
+// Ranges of freed blocks remembered for discard until the next commit
+constexpr uint32_t kMinfsMaxDiscards = 64;
+
 class Bcache {
 public:
     DISALLOW_COPY_ASSIGN_AND_MOVE(Bcache);
@@ -237,13 +336,55 @@ public:
     static mx_status_t Create(Bcache** out, int fd, uint32_t blockmax, uint32_t blocksize,
                               uint32_t num);
 
-    // Raw block read functions.
-    // These do not track blocks (or attempt to access the block cache)
+    // Single block read/write functions, for data which is not otherwise
+    // managed through Get()/Put().  They stay coherent with the cache: reads
+    // see blocks which are cached (and possibly dirty), writes go into the
+    // cache and are written back later.
     mx_status_t Readblk(uint32_t bno, void* data);
     mx_status_t Writeblk(uint32_t bno, const void* data);
+    // Like Writeblk(), for file contents, which bypass the journal.
+    mx_status_t WriteData(uint32_t bno, const void* data);
+
+    // Log dirty metadata to the 'count' blocks at 'start' before writing it
+    // in place. Until this is called, everything is written in place.
+    void SetJournal(uint32_t start, uint32_t count);
+
+    // Bracket one filesystem operation. Metadata it dirties is only
+    // committed to the journal once no operation is under way, so that
+    // each reaches the disk whole. Pairs may nest.
+    void BeginUpdate();
+    void EndUpdate();
+
+    // Notes that blocks [start, start + count) were freed. Once the update
+    // which freed them has committed, the device is told it may discard them,
+    // unless Reuse() allocated them again in the meantime. Does nothing if the
+    // device cannot discard.
+    void Discard(uint32_t start, uint32_t count);
+    void Reuse(uint32_t start, uint32_t count);
 
     uint32_t Maxblk() const { return blockmax_; };
 
+#ifdef __Fuchsia__
+    // True if the underlying device speaks the block FIFO protocol, and the
+    // following bulk transfer functions may be used.
+    bool FifoEnabled() const { return fifo_client_ != nullptr; }
+
+    // Registers a VMO with the block device so that it can be the target of
+    // block FIFO transactions.  Takes ownership of 'vmo'.
+    mx_status_t AttachVmo(mx_handle_t vmo, vmoid_t* out);
+    mx_status_t DetachVmo(vmoid_t vmoid);
+
+    // Issues up to MAX_TXN_MESSAGES requests as a single transaction and waits
+    // for it to complete.  Fills in the txnid of each request.
+    // Bulk reads bypass the cache, so Flush() before reading blocks which
+    // may have been written through it.
+    mx_status_t Txn(block_fifo_request_t* requests, size_t count);
+
+    // Starts a thread which writes dirty blocks back periodically, and
+    // whenever too many of them accumulate.
+    mx_status_t StartFlusher();
+#endif
+
     // acquire a block, reading from disk if necessary,
     // returning a handle and a pointer to the data
     mxtl::RefPtr<BlockNode> Get(uint32_t bno);
@@ -252,15 +393,27 @@ public:
     mxtl::RefPtr<BlockNode> GetZero(uint32_t bno);
 
     // release a block back to the cache
-    // flags *must* contain kBlockDirty if it was modified
+    // flags *must* contain kBlockDirty if it was modified, along with
+    // kBlockData if it holds file contents
+    // dirty blocks are not written until they are flushed
     void Put(mxtl::RefPtr<BlockNode> blk, uint32_t flags);
 
     // Helper function which combines 'Get' and 'Put'.
     mx_status_t Read(uint32_t bno, void* data, uint32_t off, uint32_t len);
 
-    // drop all non-busy, non-dirty blocks
-    void Invalidate();
+    // write back all dirty blocks, then drop all non-busy blocks; should
+    // the write back fail, dirty blocks are kept and its error returned
+    mx_status_t Invalidate();
 
+    // Writes all dirty, non-busy blocks back to disk in block order,
+    // merging runs of consecutive blocks into single writes. Metadata is
+    // committed to the journal first, in a single transaction.
+    mx_status_t Flush();
+    // Writes back only the dirty blocks which need not go through the
+    // journal, which may be done in the middle of an update.
+    mx_status_t FlushData();
+
+    // Flush() and then flush the underlying device.
     int Sync();
     int Close();
 
@@ -269,6 +422,67 @@ public:
 private:
     Bcache(int fd, uint32_t blockmax, uint32_t blocksize);
 
+    // Allocates the memory backing 'num' cache blocks, followed by
+    // kMinfsFlushBatch staging blocks used to assemble writes.
+    mx_status_t AllocBuffer(uint32_t num);
+    void* BufferBlock(uint32_t index) const {
+        return reinterpret_cast<void*>(buffer_ + index * blocksize_);
+    }
+
+    // Reads a block from disk, without looking in the cache.
+    mx_status_t ReadblkRaw(uint32_t bno, void* data);
+    mx_status_t WriteblkFlags(uint32_t bno, const void* data, uint32_t flags);
+
+    mx_status_t FlushLocked();
+    mx_status_t FlushDataLocked();
+    // Flushes everything, unless an update is under way; then only file
+    // contents are written, and the commit is left to EndUpdate().
+    mx_status_t FlushAllowedLocked();
+    // Collects the dirty, non-busy blocks which are (or are not) written in
+    // place into 'out', sorted by bno.
+    size_t CollectDirtyLocked(BlockNode** out, bool in_place);
+    // Writes 'count' sorted blocks in place and marks them clean.
+    mx_status_t WriteBackLocked(BlockNode* const* blocks, size_t count);
+    // Logs 'count' sorted blocks to the journal, writes them in place and
+    // then clears the journal again.
+    mx_status_t CommitLocked(BlockNode* const* blocks, size_t count);
+    // Writes 'count' blocks, sorted by bno and already copied to the staging
+    // area, with one request per run of consecutive blocks.
+    mx_status_t WriteStagedLocked(BlockNode* const* blocks, size_t count);
+    // Writes staging blocks [staged, staged + count) to disk at 'bno'.
+    mx_status_t WriteRunLocked(uint32_t bno, uint32_t staged, uint32_t count);
+    // Waits until everything written so far is stable on the device.
+    mx_status_t SyncLocked();
+    // Issues the pending discards, once nothing on disk refers to their blocks.
+    void DiscardLocked();
+
+    bool InPlace(const BlockNode& blk) const {
+        return (jnl_blocks_ == 0) || (blk.flags_ & kBlockData);
+    }
+    void MarkDirty(BlockNode* blk) {
+        if (!(blk->flags_ & kBlockDirty)) {
+            blk->flags_ |= kBlockDirty;
+            dirty_count_++;
+        }
+    }
+    void MarkClean(BlockNode* blk) {
+        if (blk->flags_ & kBlockDirty) {
+            blk->flags_ &= ~(kBlockDirty | kBlockData);
+            dirty_count_--;
+        }
+    }
+
+#ifdef __Fuchsia__
+    // Connects to the block device's FIFO and registers the cache buffer
+    // with it.  Leaves the fifo disabled if the device does not support it.
+    void ConnectFifo();
+
+    // Transfers one block between the device and the cache buffer.
+    mx_status_t FifoBlockTxn(uint16_t opcode, uint32_t bno, uintptr_t buffer_offset);
+
+    static int FlusherThread(void* arg);
+#endif
+
     mxtl::RefPtr<BlockNode> Get(uint32_t bno, uint32_t mode);
 
     using HashTableBucket = mxtl::DoublyLinkedList<mxtl::RefPtr<BlockNode>, BlockNode::TypeHashTraits>;
@@ -278,8 +492,41 @@ private:
     int fd_;
     uint32_t blockmax_;
     uint32_t blocksize_;
+    uint32_t cache_blocks_; // Staging blocks start after these
+    uint32_t buffer_blocks_;
+    uintptr_t buffer_;
+    uint32_t dirty_count_;
+    uint32_t jnl_block_;
+    uint32_t jnl_blocks_;
+    uint32_t updates_active_;
+    bool commit_pending_; // Set when a commit was put off by an update
+    struct DiscardRange {
+        uint32_t start;
+        uint32_t count;
+    };
+    DiscardRange discards_[kMinfsMaxDiscards];
+    size_t discard_count_;
+    bool discard_enabled_; // Cleared if the device turns out not to support it
+#ifdef __Fuchsia__
+    mx_handle_t buffer_vmo_;
+    fifo_client_t* fifo_client_;
+    txnid_t txnid_;
+    vmoid_t buffer_vmoid_;
+
+    // Held across all cache state and FIFO traffic, which the flusher
+    // thread shares with the dispatcher thread.
+    mxtl::Mutex lock_;
+    cnd_t flusher_wake_;
+    bool flusher_running_;
+    bool flusher_stop_;
+    thrd_t flusher_thread_;
+#endif
 };
 
+#ifdef __Fuchsia__
+using BlockTxn = block_client::BlockTxn<Bcache, kMinfsBlockSize>;
+#endif
+
 void* GetBlock(const RawBitmap& bitmap, uint32_t blkno);
 void* GetBitBlock(const RawBitmap& bitmap, uint32_t* blkno_out, uint32_t bitno);
 
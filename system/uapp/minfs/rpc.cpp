@@ -26,6 +26,9 @@
 mtx_t vfs_lock = MTX_INIT;
 mxio_dispatcher_t* vfs_dispatcher;
 
+// The cache of the one filesystem this process serves
+static minfs::Bcache* the_block_cache;
+
 namespace minfs {
 
 mx_status_t VnodeMinfs::GetHandles(uint32_t flags, mx_handle_t* hnds,
@@ -46,6 +49,7 @@ mx_handle_t vfs_rpc_server(VnodeMinfs* vn) {
     if ((ios = (vfs_iostate_t*)calloc(1, sizeof(vfs_iostate_t))) == nullptr)
         return ERR_NO_MEMORY;
     ios->vn = vn;
+    the_block_cache = vn->fs_->bc_;
 
     if ((r = mxio_dispatcher_create(&vfs_dispatcher, mxrio_handler)) < 0) {
         free(ios);
@@ -78,8 +82,13 @@ mx_handle_t vfs_rpc_server(VnodeMinfs* vn) {
 
 } // namespace minfs
 
+// Each message is one update as far as the journal is concerned
 mx_status_t vfs_handler(mxrio_msg_t* msg, mx_handle_t rh, void* cookie) {
-    return vfs_handler_generic(msg, rh, cookie);
+    minfs::Bcache* bc = the_block_cache;
+    bc->BeginUpdate();
+    mx_status_t status = vfs_handler_generic(msg, rh, cookie);
+    bc->EndUpdate();
+    return status;
 }
 
 constexpr const char kFsName[] = "minfs";
@@ -19,12 +19,16 @@ MODULE_SRCS += \
 
 # minfs implementation
 MODULE_SRCS += \
+    $(LOCAL_DIR)/dir-index.cpp \
+    $(LOCAL_DIR)/extents.cpp \
     $(LOCAL_DIR)/minfs.cpp \
     $(LOCAL_DIR)/minfs-ops.cpp \
     $(LOCAL_DIR)/minfs-check.cpp \
 
 MODULE_STATIC_LIBS := \
     ulib/fs \
+    ulib/block-client \
+    ulib/sync \
 
 MODULE_LIBS := \
     ulib/bitmap \
@@ -51,6 +55,8 @@ MODULE_SRCS := \
     $(LOCAL_DIR)/test.cpp \
     $(LOCAL_DIR)/host.cpp \
     $(LOCAL_DIR)/bcache.cpp \
+    $(LOCAL_DIR)/dir-index.cpp \
+    $(LOCAL_DIR)/extents.cpp \
     $(LOCAL_DIR)/minfs.cpp \
     $(LOCAL_DIR)/minfs-ops.cpp \
     $(LOCAL_DIR)/minfs-check.cpp \
@@ -0,0 +1,516 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <ddk/device.h>
+#include <ddk/driver.h>
+#include <ddk/binding.h>
+#include <ddk/iotxn.h>
+#include <ddk/protocol/block.h>
+
+#include <magenta/process.h>
+#include <magenta/syscalls.h>
+#include <magenta/types.h>
+#include <magenta/listnode.h>
+#include <sys/param.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+
+// This block device keeps the most recently read blocks of the underlying
+// block device in memory, and serves reads of them from there. Writes go
+// straight through to the underlying device, dropping any cached copy of the
+// blocks they cover.
+//
+// Reads large enough to replace more than half the cache are not cached, so
+// that scanning a large file or the whole device does not throw out the blocks
+// that are read over and over again.
+
+#define DEFAULT_CACHE_SIZE (8 * 1024 * 1024)
+
+typedef struct cache_block {
+    list_node_t hash_node;
+    list_node_t lru_node;
+    uint64_t blkno;
+    bool valid;
+    void* data;
+} cache_block_t;
+
+typedef struct cache_device {
+    mx_device_t device;
+    uint64_t blksize;
+    block_callbacks_t* cb;
+
+    mtx_t lock;
+    mx_handle_t vmo;
+    uintptr_t mapped_addr;
+    cache_block_t* blocks;
+    size_t block_count;
+    list_node_t* buckets;
+    size_t bucket_mask;
+    // Cached blocks, most recently used first, then unused blocks
+    list_node_t lru;
+    // Bumped as each write is issued and completed, so a read can tell whether
+    // its data may already be stale
+    uint64_t write_gen;
+    uint32_t writes_pending;
+    block_cache_stats_t stats;
+} cache_device_t;
+
+// Kept in the extra space of the iotxns sent to the underlying device
+typedef struct cache_txn {
+    cache_device_t* cdev;
+    // The request this was cloned from, or NULL if it came from the block
+    // FIFO server, which gets |cookie| back instead
+    iotxn_t* txn;
+    void* cookie;
+    uint64_t gen;
+    bool fill;
+} cache_txn_t;
+
+#define get_cache_device(dev) containerof(dev, cache_device_t, device)
+
+static list_node_t* bucket_for(cache_device_t* cdev, uint64_t blkno) {
+    return &cdev->buckets[blkno & cdev->bucket_mask];
+}
+
+static cache_block_t* cache_lookup_locked(cache_device_t* cdev, uint64_t blkno) {
+    cache_block_t* block;
+    list_for_every_entry(bucket_for(cdev, blkno), block, cache_block_t, hash_node) {
+        if (block->blkno == blkno) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void cache_drop_locked(cache_device_t* cdev, cache_block_t* block) {
+    list_delete(&block->hash_node);
+    list_delete(&block->lru_node);
+    list_add_tail(&cdev->lru, &block->lru_node);
+    block->valid = false;
+}
+
+static void cache_invalidate_locked(cache_device_t* cdev, uint64_t blkno, uint64_t count) {
+    if (count > cdev->block_count) {
+        for (size_t i = 0; i < cdev->block_count; i++) {
+            cache_block_t* block = &cdev->blocks[i];
+            if (block->valid && block->blkno - blkno < count) {
+                cache_drop_locked(cdev, block);
+                cdev->stats.invalidations++;
+            }
+        }
+        return;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        cache_block_t* block = cache_lookup_locked(cdev, blkno + i);
+        if (block) {
+            cache_drop_locked(cdev, block);
+            cdev->stats.invalidations++;
+        }
+    }
+}
+
+// Copies |count| blocks from |blkno| out of the cache, to |txn| or, if it is
+// NULL, to |vmo| at |vmo_offset|, if they are all cached.
+static bool cache_read_locked(cache_device_t* cdev, uint64_t blkno, uint64_t count,
+                              iotxn_t* txn, mx_handle_t vmo, uint64_t vmo_offset) {
+    if (count == 0 || count > cdev->block_count) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        if (cache_lookup_locked(cdev, blkno + i) == NULL) {
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        cache_block_t* block = cache_lookup_locked(cdev, blkno + i);
+        if (txn) {
+            txn->ops->copyto(txn, block->data, cdev->blksize, i * cdev->blksize);
+        } else {
+            size_t actual;
+            if (mx_vmo_write(vmo, block->data, vmo_offset + i * cdev->blksize,
+                             cdev->blksize, &actual) != NO_ERROR) {
+                return false;
+            }
+        }
+        list_delete(&block->lru_node);
+        list_add_head(&cdev->lru, &block->lru_node);
+    }
+    cdev->stats.hits += count;
+    return true;
+}
+
+// Copies |count| blocks from |blkno| into the cache from |txn|.
+static void cache_fill_locked(cache_device_t* cdev, uint64_t blkno, uint64_t count,
+                              iotxn_t* txn) {
+    for (uint64_t i = 0; i < count; i++) {
+        cache_block_t* block = cache_lookup_locked(cdev, blkno + i);
+        if (block == NULL) {
+            block = list_peek_tail_type(&cdev->lru, cache_block_t, lru_node);
+            if (block->valid) {
+                list_delete(&block->hash_node);
+                cdev->stats.evictions++;
+            }
+            block->blkno = blkno + i;
+            block->valid = true;
+            list_add_head(bucket_for(cdev, block->blkno), &block->hash_node);
+            cdev->stats.fills++;
+        }
+        txn->ops->copyfrom(txn, block->data, cdev->blksize, i * cdev->blksize);
+        list_delete(&block->lru_node);
+        list_add_head(&cdev->lru, &block->lru_node);
+    }
+}
+
+// Replaces the cache with an empty one of |size| bytes.
+static mx_status_t cache_resize(cache_device_t* cdev, uint64_t size) {
+    size_t block_count = size / cdev->blksize;
+    size = block_count * cdev->blksize;
+    size_t bucket_count = 1;
+    while (bucket_count < block_count) {
+        bucket_count <<= 1;
+    }
+
+    mx_handle_t vmo = MX_HANDLE_INVALID;
+    uintptr_t mapped_addr = 0;
+    cache_block_t* blocks = NULL;
+    list_node_t* buckets = NULL;
+    mx_status_t status = ERR_NO_MEMORY;
+    if (size > 0) {
+        if ((status = mx_vmo_create(size, 0, &vmo)) != NO_ERROR) {
+            goto fail;
+        }
+        if ((status = mx_vmar_map(mx_vmar_root_self(), 0, vmo, 0, size,
+                                  MX_VM_FLAG_PERM_READ | MX_VM_FLAG_PERM_WRITE,
+                                  &mapped_addr)) != NO_ERROR) {
+            goto fail;
+        }
+    }
+    if ((blocks = calloc(MAX(block_count, 1), sizeof(cache_block_t))) == NULL ||
+        (buckets = calloc(bucket_count, sizeof(list_node_t))) == NULL) {
+        status = ERR_NO_MEMORY;
+        goto fail;
+    }
+    for (size_t i = 0; i < bucket_count; i++) {
+        list_initialize(&buckets[i]);
+    }
+
+    mtx_lock(&cdev->lock);
+    mx_handle_t old_vmo = cdev->vmo;
+    uintptr_t old_addr = cdev->mapped_addr;
+    uint64_t old_size = cdev->block_count * cdev->blksize;
+    cache_block_t* old_blocks = cdev->blocks;
+    list_node_t* old_buckets = cdev->buckets;
+
+    cdev->vmo = vmo;
+    cdev->mapped_addr = mapped_addr;
+    cdev->blocks = blocks;
+    cdev->block_count = block_count;
+    cdev->buckets = buckets;
+    cdev->bucket_mask = bucket_count - 1;
+    list_initialize(&cdev->lru);
+    for (size_t i = 0; i < block_count; i++) {
+        blocks[i].data = (void*)(mapped_addr + i * cdev->blksize);
+        list_add_tail(&cdev->lru, &blocks[i].lru_node);
+    }
+    cdev->stats.size = size;
+    mtx_unlock(&cdev->lock);
+
+    vmo = old_vmo;
+    mapped_addr = old_addr;
+    size = old_size;
+    blocks = old_blocks;
+    buckets = old_buckets;
+    status = NO_ERROR;
+fail:
+    if (mapped_addr) {
+        mx_vmar_unmap(mx_vmar_root_self(), mapped_addr, size);
+    }
+    if (vmo != MX_HANDLE_INVALID) {
+        mx_handle_close(vmo);
+    }
+    free(blocks);
+    free(buckets);
+    return status;
+}
+
+static void cache_complete(iotxn_t* ptxn, void* cookie) {
+    cache_txn_t* ctxn = iotxn_to(ptxn, cache_txn_t);
+    cache_device_t* cdev = ctxn->cdev;
+    iotxn_t* txn = ctxn->txn;
+    mx_status_t status = ptxn->status;
+    mx_off_t actual = ptxn->actual;
+
+    mtx_lock(&cdev->lock);
+    // The cache may have been resized (or switched off) since the read was
+    // queued, so whether it still fits is checked again
+    uint64_t count = ptxn->length / cdev->blksize;
+    if (ptxn->opcode != IOTXN_OP_READ) {
+        cdev->writes_pending--;
+        cdev->write_gen++;
+    } else if (ctxn->fill && status == NO_ERROR && actual == ptxn->length &&
+               ctxn->gen == cdev->write_gen && count > 0 && count * 2 <= cdev->block_count) {
+        // A cloned iotxn loses its buffer once it completes, but it shared it
+        // with the original, which has not
+        cache_fill_locked(cdev, ptxn->offset / cdev->blksize, count, txn ? txn : ptxn);
+    }
+    mtx_unlock(&cdev->lock);
+
+    ptxn->ops->release(ptxn);
+    if (txn) {
+        txn->ops->complete(txn, status, actual);
+    } else {
+        cdev->cb->complete(cookie, status);
+    }
+}
+
+// Accounts for |ptxn| in the cache, and sends it to the underlying device.
+static void cache_queue(cache_device_t* cdev, iotxn_t* ptxn) {
+    cache_txn_t* ctxn = iotxn_to(ptxn, cache_txn_t);
+    uint64_t blksize = cdev->blksize;
+    bool aligned = ptxn->offset % blksize == 0 && ptxn->length % blksize == 0;
+    uint64_t blkno = ptxn->offset / blksize;
+    uint64_t count = (ptxn->offset + ptxn->length + blksize - 1) / blksize - blkno;
+
+    mtx_lock(&cdev->lock);
+    if (ptxn->opcode != IOTXN_OP_READ) {
+        // Writes and trims both change what the blocks hold
+        cache_invalidate_locked(cdev, blkno, count);
+        cdev->writes_pending++;
+        cdev->write_gen++;
+    } else if (aligned) {
+        cdev->stats.misses += count;
+        ctxn->gen = cdev->write_gen;
+        // Don't let one large read replace most of the cache, nor cache data
+        // that a write in progress may be changing
+        ctxn->fill = cdev->writes_pending == 0 && count * 2 <= cdev->block_count;
+    }
+    mtx_unlock(&cdev->lock);
+
+    ptxn->complete_cb = cache_complete;
+    iotxn_queue(cdev->device.parent, ptxn);
+}
+
+// implement block protocol:
+
+static void cache_fifo_set_callbacks(mx_device_t* dev, block_callbacks_t* cb) {
+    cache_device_t* cdev = get_cache_device(dev);
+    cdev->cb = cb;
+}
+
+static void cache_fifo_queue(mx_device_t* dev, uint32_t opcode, mx_handle_t vmo, uint64_t length,
+                             uint64_t vmo_offset, uint64_t dev_offset, void* cookie) {
+    cache_device_t* cdev = get_cache_device(dev);
+
+    if (opcode == IOTXN_OP_READ && dev_offset % cdev->blksize == 0 &&
+        length % cdev->blksize == 0) {
+        mtx_lock(&cdev->lock);
+        bool hit = cache_read_locked(cdev, dev_offset / cdev->blksize, length / cdev->blksize,
+                                     NULL, vmo, vmo_offset);
+        mtx_unlock(&cdev->lock);
+        if (hit) {
+            cdev->cb->complete(cookie, NO_ERROR);
+            return;
+        }
+    }
+
+    mx_status_t status;
+    iotxn_t* ptxn;
+    if ((status = iotxn_alloc_vmo(&ptxn, vmo, length, vmo_offset,
+                                  sizeof(cache_txn_t))) != NO_ERROR) {
+        cdev->cb->complete(cookie, status);
+        return;
+    }
+    ptxn->opcode = opcode;
+    ptxn->offset = dev_offset;
+    ptxn->length = length;
+    ptxn->cookie = cookie;
+    cache_txn_t* ctxn = iotxn_to(ptxn, cache_txn_t);
+    ctxn->cdev = cdev;
+    cache_queue(cdev, ptxn);
+}
+
+static void cache_fifo_read(mx_device_t* dev, mx_handle_t vmo, uint64_t length,
+                            uint64_t vmo_offset, uint64_t dev_offset, void* cookie) {
+    cache_fifo_queue(dev, IOTXN_OP_READ, vmo, length, vmo_offset, dev_offset, cookie);
+}
+
+static void cache_fifo_write(mx_device_t* dev, mx_handle_t vmo, uint64_t length,
+                             uint64_t vmo_offset, uint64_t dev_offset, void* cookie) {
+    cache_fifo_queue(dev, IOTXN_OP_WRITE, vmo, length, vmo_offset, dev_offset, cookie);
+}
+
+static void cache_fifo_trim(mx_device_t* dev, uint64_t length, uint64_t dev_offset,
+                            void* cookie) {
+    cache_device_t* cdev = get_cache_device(dev);
+
+    mx_status_t status;
+    iotxn_t* ptxn;
+    if ((status = iotxn_alloc(&ptxn, 0, 0, sizeof(cache_txn_t))) != NO_ERROR) {
+        cdev->cb->complete(cookie, status);
+        return;
+    }
+    ptxn->opcode = IOTXN_OP_TRIM;
+    ptxn->offset = dev_offset;
+    ptxn->length = length;
+    ptxn->cookie = cookie;
+    cache_txn_t* ctxn = iotxn_to(ptxn, cache_txn_t);
+    ctxn->cdev = cdev;
+    cache_queue(cdev, ptxn);
+}
+
+static block_ops_t cache_block_ops = {
+    .set_callbacks = cache_fifo_set_callbacks,
+    .read = cache_fifo_read,
+    .write = cache_fifo_write,
+    .trim = cache_fifo_trim,
+};
+
+// implement device protocol:
+
+static ssize_t cache_ioctl(mx_device_t* dev, uint32_t op, const void* cmd,
+                           size_t cmdlen, void* reply, size_t max) {
+    cache_device_t* cdev = get_cache_device(dev);
+
+    switch (op) {
+    case IOCTL_BLOCK_CACHE_CONFIG: {
+        const block_cache_config_t* config = cmd;
+        if (cmdlen != sizeof(*config)) return ERR_INVALID_ARGS;
+        return cache_resize(cdev, config->size);
+    }
+    case IOCTL_BLOCK_CACHE_GET_STATS: {
+        block_cache_stats_t* stats = reply;
+        if (max < sizeof(*stats)) return ERR_BUFFER_TOO_SMALL;
+        mtx_lock(&cdev->lock);
+        memcpy(stats, &cdev->stats, sizeof(*stats));
+        mtx_unlock(&cdev->lock);
+        return sizeof(*stats);
+    }
+    // The block device above serves the FIFOs; the underlying device's
+    // server would go around the cache
+    case IOCTL_BLOCK_GET_FIFOS:
+    case IOCTL_BLOCK_ADD_FIFO:
+    case IOCTL_BLOCK_ATTACH_VMO:
+    case IOCTL_BLOCK_ALLOC_TXN:
+    case IOCTL_BLOCK_FREE_TXN:
+    case IOCTL_BLOCK_FIFO_CLOSE:
+    case IOCTL_BLOCK_GET_STATS:
+        return ERR_NOT_SUPPORTED;
+    default: {
+        mx_device_t* parent = dev->parent;
+        return parent->ops->ioctl(parent, op, cmd, cmdlen, reply, max);
+    }
+    }
+}
+
+static void cache_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
+    cache_device_t* cdev = get_cache_device(dev);
+
+    if (txn->opcode != IOTXN_OP_READ && txn->opcode != IOTXN_OP_WRITE &&
+        txn->opcode != IOTXN_OP_TRIM) {
+        iotxn_queue(dev->parent, txn);
+        return;
+    }
+    if (txn->opcode == IOTXN_OP_READ && txn->offset % cdev->blksize == 0 &&
+        txn->length % cdev->blksize == 0) {
+        mtx_lock(&cdev->lock);
+        bool hit = cache_read_locked(cdev, txn->offset / cdev->blksize,
+                                     txn->length / cdev->blksize, txn, MX_HANDLE_INVALID, 0);
+        mtx_unlock(&cdev->lock);
+        if (hit) {
+            txn->ops->complete(txn, NO_ERROR, txn->length);
+            return;
+        }
+    }
+
+    iotxn_t* ptxn;
+    mx_status_t status = txn->ops->clone(txn, &ptxn, sizeof(cache_txn_t));
+    if (status != NO_ERROR) {
+        txn->ops->complete(txn, status, 0);
+        return;
+    }
+    cache_txn_t* ctxn = iotxn_to(ptxn, cache_txn_t);
+    ctxn->cdev = cdev;
+    ctxn->txn = txn;
+    cache_queue(cdev, ptxn);
+}
+
+static mx_off_t cache_getsize(mx_device_t* dev) {
+    mx_device_t* parent = dev->parent;
+    return parent->ops->get_size(parent);
+}
+
+static void cache_unbind(mx_device_t* dev) {
+    device_remove(dev);
+}
+
+static mx_status_t cache_release(mx_device_t* dev) {
+    cache_device_t* cdev = get_cache_device(dev);
+    if (cdev->mapped_addr) {
+        mx_vmar_unmap(mx_vmar_root_self(), cdev->mapped_addr, cdev->block_count * cdev->blksize);
+    }
+    if (cdev->vmo != MX_HANDLE_INVALID) {
+        mx_handle_close(cdev->vmo);
+    }
+    free(cdev->blocks);
+    free(cdev->buckets);
+    free(cdev);
+    return NO_ERROR;
+}
+
+static mx_protocol_device_t cache_proto = {
+    .ioctl = cache_ioctl,
+    .iotxn_queue = cache_iotxn_queue,
+    .get_size = cache_getsize,
+    .unbind = cache_unbind,
+    .release = cache_release,
+};
+
+static mx_status_t cache_bind(mx_driver_t* drv, mx_device_t* dev, void** cookie) {
+    cache_device_t* cdev = calloc(1, sizeof(cache_device_t));
+    if (!cdev) {
+        return ERR_NO_MEMORY;
+    }
+    mtx_init(&cdev->lock, mtx_plain);
+    cdev->vmo = MX_HANDLE_INVALID;
+    ssize_t rc = dev->ops->ioctl(dev, IOCTL_BLOCK_GET_BLOCKSIZE, NULL, 0,
+                                 &cdev->blksize, sizeof(cdev->blksize));
+    if (rc < 0) {
+        free(cdev);
+        return (mx_status_t)rc;
+    }
+    if (cdev->blksize == 0) {
+        free(cdev);
+        return ERR_NOT_SUPPORTED;
+    }
+    mx_status_t status;
+    if ((status = cache_resize(cdev, DEFAULT_CACHE_SIZE)) != NO_ERROR) {
+        free(cdev);
+        return status;
+    }
+
+    // The generic block driver binds over this device to serve its FIFOs
+    device_init(&cdev->device, drv, "cache", &cache_proto);
+    cdev->device.protocol_id = MX_PROTOCOL_BLOCK_CORE;
+    cdev->device.protocol_ops = &cache_block_ops;
+    if ((status = device_add(&cdev->device, dev)) != NO_ERROR) {
+        cache_release(&cdev->device);
+        return status;
+    }
+    return NO_ERROR;
+}
+
+mx_driver_t _driver_block_cache = {
+    .ops = {
+        .bind = cache_bind,
+    },
+};
+
+MAGENTA_DRIVER_BEGIN(_driver_block_cache, "block-cache", "magenta", "0.1", 2)
+    BI_ABORT_IF_AUTOBIND,
+    BI_MATCH_IF(EQ, BIND_PROTOCOL, MX_PROTOCOL_BLOCK),
+MAGENTA_DRIVER_END(_driver_block_cache)
@@ -37,7 +37,7 @@ typedef struct blkdev {
 static int blockserver_thread(void* arg) {
     blkdev_t* bdev = (blkdev_t*)arg;
     BlockServer* bs = bdev->bs;
-    blockserver_serve(bs, bdev->device.parent, bdev->blockops);
+    blockserver_serve(bs);
 
     mtx_lock(&bdev->lock);
     bdev->bs = NULL;
@@ -63,7 +63,8 @@ static ssize_t blkdev_get_fifos(blkdev_t* bdev, void* out_buf, size_t out_len) {
     }
 
     BlockServer* bs;
-    if ((status = blockserver_create(out_buf, &bs)) != NO_ERROR) {
+    if ((status = blockserver_create(bdev->device.parent, bdev->blockops,
+                                     out_buf, &bs)) != NO_ERROR) {
         goto done;
     }
 
@@ -83,6 +84,29 @@ done:
     return status;
 }
 
+static ssize_t blkdev_add_fifo(blkdev_t* bdev, void* out_buf, size_t out_len) {
+    if (out_len < sizeof(block_fifo_info_t)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    mx_status_t status;
+    mtx_lock(&bdev->lock);
+    if (bdev->bs == NULL) {
+        status = ERR_BAD_STATE;
+        goto done;
+    }
+
+    block_fifo_info_t* info = out_buf;
+    if ((status = blockserver_add_queue(bdev->bs, &info->fifo, &info->index)) != NO_ERROR) {
+        goto done;
+    }
+
+    status = sizeof(block_fifo_info_t);
+done:
+    mtx_unlock(&bdev->lock);
+    return status;
+}
+
 static ssize_t blkdev_attach_vmo(blkdev_t* bdev,
                                  const void* in_buf, size_t in_len,
                                  void* out_buf, size_t out_len) {
@@ -111,10 +135,12 @@ done:
 static ssize_t blkdev_alloc_txn(blkdev_t* bdev,
                                 const void* in_buf, size_t in_len,
                                 void* out_buf, size_t out_len) {
-    if ((in_len != 0) || (out_len < sizeof(txnid_t))) {
+    if (((in_len != 0) && (in_len != sizeof(uint32_t))) || (out_len < sizeof(txnid_t))) {
         return ERR_INVALID_ARGS;
     }
 
+    // Without a FIFO index, the txn is for the first FIFO.
+    uint32_t queue = (in_len != 0) ? *(const uint32_t*)in_buf : 0;
     mx_status_t status;
     mtx_lock(&bdev->lock);
     if (bdev->bs == NULL) {
@@ -122,7 +148,7 @@ static ssize_t blkdev_alloc_txn(blkdev_t* bdev,
         goto done;
     }
 
-    if ((status = blockserver_allocate_txn(bdev->bs, out_buf)) != NO_ERROR) {
+    if ((status = blockserver_allocate_txn(bdev->bs, queue, out_buf)) != NO_ERROR) {
         goto done;
     }
 
@@ -154,6 +180,51 @@ done:
     return status;
 }
 
+static ssize_t blkdev_get_stats(blkdev_t* bdev, void* out_buf, size_t out_len) {
+    if (out_len < sizeof(block_stats_t)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    mx_status_t status;
+    mtx_lock(&bdev->lock);
+    if (bdev->bs == NULL) {
+        status = ERR_BAD_STATE;
+        goto done;
+    }
+
+    blockserver_get_stats(bdev->bs, out_buf);
+    status = sizeof(block_stats_t);
+done:
+    mtx_unlock(&bdev->lock);
+    return status;
+}
+
+static ssize_t blkdev_get_latency(blkdev_t* bdev, void* out_buf, size_t out_len) {
+    if (out_len < sizeof(block_latency_t)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    mx_status_t status;
+    mtx_lock(&bdev->lock);
+    if (bdev->bs == NULL) {
+        status = ERR_BAD_STATE;
+        goto done;
+    }
+
+    blockserver_get_latency(bdev->bs, out_buf);
+    status = sizeof(block_latency_t);
+done:
+    mtx_unlock(&bdev->lock);
+    return status;
+}
+
+static ssize_t blkdev_set_trace(const void* in_buf, size_t in_len) {
+    if (in_len != sizeof(uint32_t)) {
+        return ERR_INVALID_ARGS;
+    }
+    return block_trace_enable(*(const uint32_t*)in_buf != 0);
+}
+
 static ssize_t blkdev_fifo_close(blkdev_t* bdev) {
     mtx_lock(&bdev->lock);
     if (bdev->bs != NULL) {
@@ -179,6 +250,8 @@ static ssize_t blkdev_ioctl(mx_device_t* dev, uint32_t op, const void* cmd,
     switch (op) {
     case IOCTL_BLOCK_GET_FIFOS:
         return blkdev_get_fifos(blkdev, reply, max);
+    case IOCTL_BLOCK_ADD_FIFO:
+        return blkdev_add_fifo(blkdev, reply, max);
     case IOCTL_BLOCK_ATTACH_VMO:
         return blkdev_attach_vmo(blkdev, cmd, cmdlen, reply, max);
     case IOCTL_BLOCK_ALLOC_TXN:
@@ -187,6 +260,12 @@ static ssize_t blkdev_ioctl(mx_device_t* dev, uint32_t op, const void* cmd,
         return blkdev_free_txn(blkdev, cmd, cmdlen, reply, max);
     case IOCTL_BLOCK_FIFO_CLOSE:
         return blkdev_fifo_close(blkdev);
+    case IOCTL_BLOCK_GET_STATS:
+        return blkdev_get_stats(blkdev, reply, max);
+    case IOCTL_BLOCK_GET_LATENCY:
+        return blkdev_get_latency(blkdev, reply, max);
+    case IOCTL_BLOCK_SET_TRACE:
+        return blkdev_set_trace(cmd, cmdlen);
     default: {
         mx_device_t* parent = dev->parent;
         return parent->ops->ioctl(parent, op, cmd, cmdlen, reply, max);
@@ -195,6 +274,7 @@ static ssize_t blkdev_ioctl(mx_device_t* dev, uint32_t op, const void* cmd,
 }
 
 static void blkdev_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
+    block_trace(BLOCK_TRACE_QUEUE, txn, txn->opcode);
     mx_device_t* parent = dev->parent;
     parent->ops->iotxn_queue(parent, txn);
 }
@@ -11,12 +11,16 @@
 #include <magenta/device/block.h>
 #include <magenta/new.h>
 #include <magenta/syscalls.h>
+#include <mxtl/algorithm.h>
 #include <mxtl/auto_lock.h>
 #include <mxtl/limits.h>
 #include <mxtl/ref_ptr.h>
 
 #include "server.h"
 
+// Merging stops short of building operations larger than this.
+constexpr uint64_t kMaxMergeLength = 1 << 20;
+
 static mx_status_t do_read(mx_handle_t fifo, block_fifo_request_t* requests, uint32_t* count) {
     mx_status_t status;
     while (true) {
@@ -82,9 +86,9 @@ fail:
     return ERR_IO;
 }
 
-void BlockTransaction::Complete(mx_status_t status) {
+void BlockTransaction::Complete(mx_status_t status, uint32_t count) {
     mxtl::AutoLock lock(&lock_);
-    response_.count++;
+    response_.count += count;
     MX_DEBUG_ASSERT(response_.count <= goal_);
 
     if ((status != NO_ERROR) && (response_.status == NO_ERROR)) {
@@ -167,11 +171,192 @@ mx_status_t BlockServer::AttachVmo(mx_handle_t vmo, vmoid_t* out) {
     return NO_ERROR;
 }
 
-mx_status_t BlockServer::AllocateTxn(txnid_t* out) {
+mxtl::RefPtr<IoBuffer> BlockServer::FindVmo(vmoid_t vmoid) {
+    mxtl::AutoLock server_lock(&server_lock_);
+    auto iobuf = tree_.find(vmoid);
+    if (!iobuf.IsValid()) {
+        return nullptr;
+    }
+    return iobuf.CopyPointer();
+}
+
+void BlockServer::CloseVmo(vmoid_t vmoid) {
+    mxtl::AutoLock server_lock(&server_lock_);
+    // Another FIFO may have closed it first.
+    tree_.erase(vmoid);
+}
+
+mx_status_t BlockServer::AllocateTxn(uint32_t queue, txnid_t* out) {
+    mxtl::AutoLock server_lock(&server_lock_);
+    if (queue >= queue_count_) {
+        return ERR_INVALID_ARGS;
+    }
+    return queues_[queue]->AllocateTxn(out);
+}
+
+void BlockServer::FreeTxn(txnid_t txnid) {
+    mxtl::AutoLock server_lock(&server_lock_);
+    uint32_t queue = txnid / MAX_TXN_COUNT;
+    if (queue >= queue_count_) {
+        return;
+    }
+    queues_[queue]->FreeTxn(txnid);
+}
+
+void BlockServer::GetStats(block_stats_t* out) {
+    memset(out, 0, sizeof(*out));
+    mxtl::AutoLock server_lock(&server_lock_);
+    for (uint32_t i = 0; i < queue_count_; i++) {
+        queues_[i]->AddStats(out);
+    }
+}
+
+void BlockServer::GetLatency(block_latency_t* out) {
+    memset(out, 0, sizeof(*out));
+    mxtl::AutoLock server_lock(&server_lock_);
+    for (uint32_t i = 0; i < queue_count_; i++) {
+        queues_[i]->AddLatency(out);
+    }
+}
+
+void blockserver_fifo_complete(void* cookie, mx_status_t status);
+
+static block_callbacks_t cb = {
+    blockserver_fifo_complete,
+};
+
+mx_status_t BlockServer::Create(mx_device_t* dev, block_ops_t* ops, mx_handle_t* fifo_out,
+                                BlockServer** out) {
+    AllocChecker ac;
+    BlockServer* bs = new (&ac) BlockServer(dev, ops);
+    if (!ac.check()) {
+        return ERR_NO_MEMORY;
+    }
+
+    mxtl::unique_ptr<BlockQueue> queue(new (&ac) BlockQueue(bs, 0));
+    if (!ac.check()) {
+        delete bs;
+        return ERR_NO_MEMORY;
+    }
+    mx_status_t status;
+    if ((status = queue->Create(fifo_out)) != NO_ERROR) {
+        delete bs;
+        return status;
+    }
+    bs->queues_[0] = mxtl::move(queue);
+    bs->queue_count_ = 1;
+
+    ops->set_callbacks(dev, &cb);
+    *out = bs;
+    return NO_ERROR;
+}
+
+static int QueueThread(void* arg) {
+    BlockQueue* queue = static_cast<BlockQueue*>(arg);
+    return queue->Serve();
+}
+
+mx_status_t BlockServer::AddQueue(mx_handle_t* fifo_out, uint32_t* index_out) {
     mxtl::AutoLock server_lock(&server_lock_);
+    if (shutdown_) {
+        return ERR_BAD_STATE;
+    } else if (queue_count_ >= max_queues_) {
+        return ERR_NO_RESOURCES;
+    }
+
+    uint32_t index = queue_count_;
+    AllocChecker ac;
+    mxtl::unique_ptr<BlockQueue> queue(new (&ac) BlockQueue(this, index));
+    if (!ac.check()) {
+        return ERR_NO_MEMORY;
+    }
+    mx_handle_t fifo;
+    mx_status_t status;
+    if ((status = queue->Create(&fifo)) != NO_ERROR) {
+        return status;
+    }
+    if (thrd_create(&threads_[index], QueueThread, queue.get()) != thrd_success) {
+        mx_handle_close(fifo);
+        return ERR_NO_MEMORY;
+    }
+    queues_[index] = mxtl::move(queue);
+    queue_count_++;
+
+    *fifo_out = fifo;
+    *index_out = index;
+    return NO_ERROR;
+}
+
+mx_status_t BlockServer::Serve() {
+    mx_status_t status = queues_[0]->Serve();
+
+    uint32_t count;
+    {
+        mxtl::AutoLock server_lock(&server_lock_);
+        shutdown_ = true;
+        count = queue_count_;
+        for (uint32_t i = 1; i < count; i++) {
+            queues_[i]->ShutDown();
+        }
+    }
+    for (uint32_t i = 1; i < count; i++) {
+        thrd_join(threads_[i], nullptr);
+    }
+    return status;
+}
+
+static uint32_t QueueLimit(mx_device_t* dev, block_ops_t* ops) {
+    uint32_t count = (ops->get_queue_count != nullptr) ? ops->get_queue_count(dev) : 1;
+    return mxtl::clamp<uint32_t>(count, 1, MAX_FIFO_COUNT);
+}
+
+BlockServer::BlockServer(mx_device_t* dev, block_ops_t* ops) :
+    dev_(dev), ops_(ops), max_queues_(QueueLimit(dev, ops)), last_id(0), queue_count_(0),
+    shutdown_(false) {}
+
+BlockServer::~BlockServer() {
+    ShutDown();
+}
+
+void BlockServer::ShutDown() {
+    mxtl::AutoLock server_lock(&server_lock_);
+    shutdown_ = true;
+    for (uint32_t i = 0; i < queue_count_; i++) {
+        queues_[i]->ShutDown();
+    }
+}
+
+BlockQueue::BlockQueue(BlockServer* server, uint32_t index) :
+    server_(server), index_(index), fifo_(MX_HANDLE_INVALID), queue_count_(0), head_(0) {
+    memset(&stats_, 0, sizeof(stats_));
+    memset(&latency_, 0, sizeof(latency_));
+    cnd_init(&idle_cond_);
+}
+
+BlockQueue::~BlockQueue() {
+    ShutDown();
+    cnd_destroy(&idle_cond_);
+}
+
+mx_status_t BlockQueue::Create(mx_handle_t* fifo_out) {
+    mxtl::AutoLock lock(&lock_);
+    return mx_fifo_create(BLOCK_FIFO_MAX_DEPTH, BLOCK_FIFO_ESIZE, 0, fifo_out, &fifo_);
+}
+
+void BlockQueue::ShutDown() {
+    mxtl::AutoLock lock(&lock_);
+    if (fifo_ != MX_HANDLE_INVALID) {
+        mx_handle_close(fifo_);
+    }
+    fifo_ = MX_HANDLE_INVALID;
+}
+
+mx_status_t BlockQueue::AllocateTxn(txnid_t* out) {
+    mxtl::AutoLock lock(&lock_);
     for (size_t i = 0; i < countof(txns_); i++) {
         if (txns_[i] == nullptr) {
-            txnid_t txnid = static_cast<txnid_t>(i);
+            // The FIFO is encoded in the txnid, so it cannot be used on any other.
+            txnid_t txnid = static_cast<txnid_t>(index_ * MAX_TXN_COUNT + i);
             AllocChecker ac;
             txns_[i] = mxtl::AdoptRef(new (&ac) BlockTransaction(fifo_, txnid));
             if (!ac.check()) {
@@ -184,77 +369,326 @@ mx_status_t BlockServer::AllocateTxn(txnid_t* out) {
     return ERR_NO_RESOURCES;
 }
 
-void BlockServer::FreeTxn(txnid_t txnid) {
-    mxtl::AutoLock server_lock(&server_lock_);
-    if (txnid >= countof(txns_)) {
+void BlockQueue::FreeTxn(txnid_t txnid) {
+    mxtl::AutoLock lock(&lock_);
+    if (txnid / MAX_TXN_COUNT != index_) {
         return;
     }
-    txns_[txnid] = nullptr;
+    txns_[txnid % MAX_TXN_COUNT] = nullptr;
 }
 
-mx_status_t BlockServer::Create(mx_handle_t* fifo_out, BlockServer** out) {
+mxtl::RefPtr<BlockTransaction> BlockQueue::GetTxn(txnid_t txnid) {
+    mxtl::AutoLock lock(&lock_);
+    if (txnid / MAX_TXN_COUNT != index_) {
+        return nullptr;
+    }
+    return txns_[txnid % MAX_TXN_COUNT];
+}
+
+static void CompleteMsg(block_msg_t* msg, mx_status_t status) {
+    // Since iobuf is a RefPtr, it lives at least as long as the txn,
+    // and is not discarded underneath the block device driver.
+    msg->iobuf = nullptr;
+    msg->vec_iobufs.reset();
+    msg->vec_ops.reset();
+    // Once the txn responds, the msg may be reused, so take everything
+    // we need out of it first.
+    mxtl::RefPtr<BlockTransaction> txn = mxtl::move(msg->txn);
+    txn->Complete(status, msg->count);
+}
+
+void blockserver_fifo_complete(void* cookie, mx_status_t status) {
+    block_op_t* op = static_cast<block_op_t*>(cookie);
+    block_msg_t* msg = op->msg;
+    block_trace(BLOCK_TRACE_COMPLETE, msg, status);
+    // Account for the operation before the client can hear about it.
+    msg->queue->Completed(op);
+    if ((status != NO_ERROR) && (msg->pending.load() > 1)) {
+        // Other ranges of a vectored request are still outstanding, so the
+        // txn cannot have moved on yet; record the failure for them to report.
+        msg->txn->Complete(status, 0);
+    }
+    if (msg->pending.fetch_sub(1) > 1) {
+        return;
+    }
+    CompleteMsg(msg, status);
+}
+
+bool BlockQueue::ConflictsWithQueue(uint16_t opcode, uint64_t length,
+                                    uint64_t dev_offset) const {
+    for (size_t i = 0; i < queue_count_; i++) {
+        const block_request_t* r = &queue_[i];
+        if ((opcode == BLOCKIO_READ) && (r->opcode == BLOCKIO_READ)) {
+            continue;
+        }
+        if ((dev_offset < r->dev_offset + r->length) && (r->dev_offset < dev_offset + length)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BlockQueue::Queue(block_op_t* op, IoBuffer* iobuf, uint16_t opcode, uint64_t length,
+                       uint64_t vmo_offset, uint64_t dev_offset) {
+    MX_DEBUG_ASSERT(queue_count_ < countof(queue_));
+    block_request_t* r = &queue_[queue_count_++];
+    r->msg = op->msg;
+    r->op = op;
+    r->iobuf = iobuf;
+    r->opcode = opcode;
+    r->length = length;
+    r->vmo_offset = vmo_offset;
+    r->dev_offset = dev_offset;
+}
+
+mx_status_t BlockQueue::QueueVectored(mx_device_t* dev, block_ops_t* ops, block_msg_t* msg,
+                                      uint16_t opcode, IoBuffer* table,
+                                      const block_fifo_request_t& request) {
+    if ((request.length == 0) || (request.length > BLOCK_FIFO_MAX_VECS)) {
+        return ERR_INVALID_ARGS;
+    }
+    size_t count = request.length;
+    block_fifo_vec_t vecs[BLOCK_FIFO_MAX_VECS];
+    size_t actual;
+    mx_status_t status = mx_vmo_read(table->io_vmo_, vecs, request.vmo_offset,
+                                     count * sizeof(vecs[0]), &actual);
+    if (status != NO_ERROR) {
+        return status;
+    } else if (actual != count * sizeof(vecs[0])) {
+        return ERR_INVALID_ARGS;
+    }
+
+    // Every range is checked before any is issued.
     AllocChecker ac;
-    BlockServer* bs = new (&ac) BlockServer();
+    mxtl::Array<mxtl::RefPtr<IoBuffer>> iobufs(new (&ac) mxtl::RefPtr<IoBuffer>[count], count);
     if (!ac.check()) {
         return ERR_NO_MEMORY;
     }
-
-    mx_status_t status;
-    if ((status = mx_fifo_create(BLOCK_FIFO_MAX_DEPTH, BLOCK_FIFO_ESIZE, 0,
-                                 fifo_out, &bs->fifo_)) != NO_ERROR) {
-        delete bs;
-        return status;
+    mxtl::Array<block_op_t> vec_ops(new (&ac) block_op_t[count], count);
+    if (!ac.check()) {
+        return ERR_NO_MEMORY;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if ((i > 0) && (vecs[i].vmoid == vecs[i - 1].vmoid)) {
+            iobufs[i] = iobufs[i - 1];
+        } else if ((iobufs[i] = server_->FindVmo(vecs[i].vmoid)) == nullptr) {
+            return ERR_IO;
+        }
+        if ((status = iobufs[i]->ValidateVmoHack(vecs[i].length,
+                                                 vecs[i].vmo_offset)) != NO_ERROR) {
+            return status;
+        }
     }
 
-    *out = bs;
+    msg->vec_iobufs = mxtl::move(iobufs);
+    msg->vec_ops = mxtl::move(vec_ops);
+    msg->pending.store(static_cast<uint32_t>(count));
+    for (size_t i = 0; i < count; i++) {
+        if ((queue_count_ == countof(queue_)) ||
+            ConflictsWithQueue(opcode, vecs[i].length, vecs[i].dev_offset)) {
+            Dispatch(dev, ops);
+        }
+        msg->vec_ops[i].msg = msg;
+        Queue(&msg->vec_ops[i], msg->vec_iobufs[i].get(), opcode, vecs[i].length,
+              vecs[i].vmo_offset, vecs[i].dev_offset);
+    }
     return NO_ERROR;
 }
 
-void blockserver_fifo_complete(void* cookie, mx_status_t status) {
-    block_msg_t* msg = static_cast<block_msg_t*>(cookie);
-    // Since iobuf is a RefPtr, it lives at least as long as the txn,
-    // and is not discarded underneath the block device driver.
-    msg->iobuf = nullptr;
-    msg->txn->Complete(status);
-    msg->txn = nullptr;
+// Orders requests by device offset, starting from |head| and wrapping around
+// to the start of the device.
+static bool IssueBefore(const block_request_t& a, const block_request_t& b, uint64_t head) {
+    bool a_wraps = a.dev_offset < head;
+    bool b_wraps = b.dev_offset < head;
+    if (a_wraps != b_wraps) {
+        return b_wraps;
+    }
+    return a.dev_offset < b.dev_offset;
 }
 
-static block_callbacks_t cb = {
-    blockserver_fifo_complete,
-};
+void BlockQueue::Dispatch(mx_device_t* dev, block_ops_t* ops) {
+    if (queue_count_ == 0) {
+        return;
+    }
 
-mx_status_t BlockServer::Serve(mx_device_t* dev, block_ops_t* ops) {
+    // Batches are small, and often nearly sorted already. Insertion sort is
+    // also stable, so requests for the same offset keep their FIFO order.
+    for (size_t i = 1; i < queue_count_; i++) {
+        block_request_t r = queue_[i];
+        size_t j = i;
+        for (; j > 0 && IssueBefore(r, queue_[j - 1], head_); j--) {
+            queue_[j] = queue_[j - 1];
+        }
+        queue_[j] = r;
+    }
 
-    ops->set_callbacks(dev, &cb);
+    // Merge runs of contiguous requests which can be issued as one. A range of
+    // a vectored request only absorbs others; it is only merged away into its
+    // own neighbours, since its message is shared with the rest of the request.
+    size_t count = 0;
+    uint64_t merged = 0;
+    for (size_t i = 0; i < queue_count_; i++) {
+        block_request_t* next = &queue_[i];
+        block_request_t* last = (count > 0) ? &queue_[count - 1] : nullptr;
+        if ((last != nullptr) && (last->opcode == next->opcode) &&
+            (last->msg->txn == next->msg->txn) && (last->iobuf == next->iobuf) &&
+            ((last->msg == next->msg) || !next->msg->vec_iobufs) &&
+            (last->dev_offset + last->length == next->dev_offset) &&
+            (last->vmo_offset + last->length == next->vmo_offset) &&
+            (last->length + next->length <= kMaxMergeLength)) {
+            last->length += next->length;
+            if (last->msg == next->msg) {
+                last->msg->pending.fetch_sub(1);
+            } else {
+                last->msg->count += next->msg->count;
+                if (next->msg->queued < last->msg->queued) {
+                    last->msg->queued = next->msg->queued;
+                }
+                next->msg->iobuf = nullptr;
+                next->msg->txn = nullptr;
+            }
+            merged++;
+            continue;
+        }
+        queue_[count++] = *next;
+    }
+
+    {
+        mxtl::AutoLock lock(&stats_lock_);
+        stats_.merged += merged;
+        stats_.ops += count;
+        stats_.queue_depth += static_cast<uint32_t>(count);
+        if (stats_.queue_depth > stats_.max_queue_depth) {
+            stats_.max_queue_depth = stats_.queue_depth;
+        }
+    }
+
+    queue_count_ = 0;
+    mx_time_t now = mx_time_get(MX_CLOCK_MONOTONIC);
+    for (size_t i = 0; i < count; i++) {
+        block_request_t* r = &queue_[i];
+        head_ = r->dev_offset + r->length;
+        r->op->issued = now;
+        block_trace(BLOCK_TRACE_QUEUE, r->msg, r->opcode);
+        switch (r->opcode) {
+        case BLOCKIO_READ:
+            ops->read(dev, r->iobuf->io_vmo_, r->length, r->vmo_offset, r->dev_offset, r->op);
+            break;
+        case BLOCKIO_WRITE:
+            ops->write(dev, r->iobuf->io_vmo_, r->length, r->vmo_offset, r->dev_offset, r->op);
+            break;
+        case BLOCKIO_TRIM:
+            ops->trim(dev, r->length, r->dev_offset, r->op);
+            break;
+        }
+    }
+}
+
+// Which of the BLOCK_LATENCY_BUCKETS log2 buckets |latency| is counted in.
+static size_t LatencyBucket(mx_time_t latency) {
+    uint64_t us = latency / MX_USEC(1);
+    if (us == 0) {
+        return 0;
+    }
+    return mxtl::min<size_t>(64 - __builtin_clzll(us), BLOCK_LATENCY_BUCKETS - 1);
+}
+
+static void AddHist(block_latency_hist_t* out, const block_latency_hist_t& hist) {
+    for (size_t i = 0; i < BLOCK_LATENCY_BUCKETS; i++) {
+        out->queued[i] += hist.queued[i];
+        out->device[i] += hist.device[i];
+    }
+}
+
+void BlockQueue::Completed(const block_op_t* op) {
+    const block_msg_t* msg = op->msg;
+    mx_time_t now = mx_time_get(MX_CLOCK_MONOTONIC);
+    mx_time_t latency = now - msg->queued;
+    size_t queued_bucket = LatencyBucket(op->issued - msg->queued);
+    size_t device_bucket = LatencyBucket(now - op->issued);
+    mxtl::AutoLock lock(&stats_lock_);
+    block_latency_hist_t* hist = (msg->opcode == BLOCKIO_READ) ? &latency_.read :
+                                 (msg->opcode == BLOCKIO_WRITE) ? &latency_.write :
+                                 &latency_.trim;
+    hist->queued[queued_bucket]++;
+    hist->device[device_bucket]++;
+    MX_DEBUG_ASSERT(stats_.queue_depth > 0);
+    stats_.queue_depth--;
+    stats_.completed++;
+    stats_.total_latency += latency;
+    if (latency > stats_.max_latency) {
+        stats_.max_latency = latency;
+    }
+    if (stats_.queue_depth == 0) {
+        cnd_broadcast(&idle_cond_);
+    }
+}
+
+void BlockQueue::Drain() {
+    mxtl::AutoLock lock(&stats_lock_);
+    while (stats_.queue_depth > 0) {
+        cnd_wait(&idle_cond_, stats_lock_.GetInternal());
+    }
+}
+
+void BlockQueue::AddStats(block_stats_t* out) {
+    mxtl::AutoLock lock(&stats_lock_);
+    out->requests += stats_.requests;
+    out->merged += stats_.merged;
+    out->ops += stats_.ops;
+    out->completed += stats_.completed;
+    out->queue_depth += stats_.queue_depth;
+    out->max_queue_depth = mxtl::max(out->max_queue_depth, stats_.max_queue_depth);
+    out->total_latency += stats_.total_latency;
+    out->max_latency = mxtl::max(out->max_latency, stats_.max_latency);
+}
+
+void BlockQueue::AddLatency(block_latency_t* out) {
+    mxtl::AutoLock lock(&stats_lock_);
+    AddHist(&out->read, latency_.read);
+    AddHist(&out->write, latency_.write);
+    AddHist(&out->trim, latency_.trim);
+}
+
+mx_status_t BlockQueue::Serve() {
+    mx_device_t* dev = server_->dev_;
+    block_ops_t* ops = server_->ops_;
 
     mx_status_t status;
     block_fifo_request_t requests[BLOCK_FIFO_MAX_DEPTH];
     uint32_t count;
     mx_handle_t fifo;
     {
-        mxtl::AutoLock server_lock(&server_lock_);
+        mxtl::AutoLock lock(&lock_);
         fifo = fifo_;
     }
     while (true) {
         if ((status = do_read(fifo, &requests[0], &count)) != NO_ERROR) {
+            // Completions refer back to the queue, so it cannot be torn down
+            // while the device still holds any of its operations.
+            Drain();
             return status;
         }
 
+        mx_time_t now = mx_time_get(MX_CLOCK_MONOTONIC);
+        uint64_t received = 0;
         for (size_t i = 0; i < count; i++) {
             bool wants_reply = requests[i].opcode & BLOCKIO_TXN_END;
             txnid_t txnid = requests[i].txnid;
             vmoid_t vmoid = requests[i].vmoid;
+            uint16_t opcode = static_cast<uint16_t>(requests[i].opcode & BLOCKIO_OP_MASK);
 
-            mxtl::AutoLock server_lock(&server_lock_);
-            auto iobuf = tree_.find(vmoid);
-            if (!iobuf.IsValid()) {
+            // Trims do not touch memory, so they need not name a vmo.
+            mxtl::RefPtr<IoBuffer> iobuf;
+            if ((opcode != BLOCKIO_TRIM) && (iobuf = server_->FindVmo(vmoid)) == nullptr) {
                 // Operation which is not accessing a valid vmo
                 if (wants_reply) {
                     OutOfBandErrorRespond(fifo, ERR_IO, txnid);
                 }
                 continue;
             }
-            if (txnid >= MAX_TXN_COUNT || txns_[txnid] == nullptr) {
+            mxtl::RefPtr<BlockTransaction> txn = GetTxn(txnid);
+            if (txn == nullptr) {
                 // Operation which is not accessing a valid txn
                 if (wants_reply) {
                     OutOfBandErrorRespond(fifo, ERR_IO, txnid);
@@ -262,42 +696,105 @@ mx_status_t BlockServer::Serve(mx_device_t* dev, block_ops_t* ops) {
                 continue;
             }
 
-            switch (requests[i].opcode & BLOCKIO_OP_MASK) {
+            switch (opcode) {
             case BLOCKIO_READ:
             case BLOCKIO_WRITE: {
                 block_msg_t* msg;
-                status = txns_[txnid]->Enqueue(wants_reply, &msg);
+                status = txn->Enqueue(wants_reply, &msg);
                 if (status != NO_ERROR) {
                     break;
                 }
-                msg->txn = txns_[txnid];
-                msg->iobuf = iobuf.CopyPointer();
+                msg->txn = txn;
+                msg->iobuf = iobuf;
+                msg->queue = this;
+                msg->opcode = opcode;
+                msg->queued = now;
+                msg->count = 1;
+                msg->pending.store(1);
+                block_trace(BLOCK_TRACE_FIFO, msg, opcode);
 
                 // Hack to ensure that the vmo is valid.
                 // In the future, this code will be responsible for pinning VMO pages,
                 // and the completion will be responsible for un-pinning those same pages.
                 status = iobuf->ValidateVmoHack(requests[i].length, requests[i].vmo_offset);
                 if (status != NO_ERROR) {
-                    cb.complete(msg, status);
+                    CompleteMsg(msg, status);
                     break;
                 }
 
-                if ((requests[i].opcode & BLOCKIO_OP_MASK) == BLOCKIO_READ) {
-                    ops->read(dev, iobuf->io_vmo_, requests[i].length,
-                              requests[i].vmo_offset, requests[i].dev_offset, msg);
-                } else {
-                    ops->write(dev, iobuf->io_vmo_, requests[i].length,
-                               requests[i].vmo_offset, requests[i].dev_offset, msg);
+                if ((queue_count_ == countof(queue_)) ||
+                    ConflictsWithQueue(opcode, requests[i].length, requests[i].dev_offset)) {
+                    Dispatch(dev, ops);
                 }
+                msg->op.msg = msg;
+                Queue(&msg->op, iobuf.get(), opcode, requests[i].length, requests[i].vmo_offset,
+                      requests[i].dev_offset);
+                received++;
+                break;
+            }
+            case BLOCKIO_READV:
+            case BLOCKIO_WRITEV: {
+                block_msg_t* msg;
+                status = txn->Enqueue(wants_reply, &msg);
+                if (status != NO_ERROR) {
+                    break;
+                }
+                uint16_t op = (opcode == BLOCKIO_READV) ? BLOCKIO_READ : BLOCKIO_WRITE;
+                msg->txn = txn;
+                msg->queue = this;
+                msg->opcode = op;
+                msg->queued = now;
+                msg->count = 1;
+                block_trace(BLOCK_TRACE_FIFO, msg, opcode);
+
+                status = QueueVectored(dev, ops, msg, op, iobuf.get(), requests[i]);
+                if (status != NO_ERROR) {
+                    CompleteMsg(msg, status);
+                    break;
+                }
+                received++;
+                break;
+            }
+            case BLOCKIO_TRIM: {
+                block_msg_t* msg;
+                status = txn->Enqueue(wants_reply, &msg);
+                if (status != NO_ERROR) {
+                    break;
+                }
+                msg->txn = txn;
+                msg->queue = this;
+                msg->opcode = opcode;
+                msg->queued = now;
+                msg->count = 1;
+                msg->pending.store(1);
+                block_trace(BLOCK_TRACE_FIFO, msg, opcode);
+
+                if (ops->trim == nullptr) {
+                    CompleteMsg(msg, ERR_NOT_SUPPORTED);
+                    break;
+                }
+
+                // A trim overlapping any queued request waits for it, and
+                // contiguous trims merge like writes: their "vmo offset" is
+                // their device offset.
+                if ((queue_count_ == countof(queue_)) ||
+                    ConflictsWithQueue(opcode, requests[i].length, requests[i].dev_offset)) {
+                    Dispatch(dev, ops);
+                }
+                msg->op.msg = msg;
+                Queue(&msg->op, nullptr, opcode, requests[i].length, requests[i].dev_offset,
+                      requests[i].dev_offset);
+                received++;
                 break;
             }
             case BLOCKIO_SYNC: {
+                Dispatch(dev, ops);
                 // TODO(smklein): It might be more useful to have this on a per-vmo basis
                 fprintf(stderr, "Warning: BLOCKIO_SYNC is currently unimplemented\n");
                 break;
             }
             case BLOCKIO_CLOSE_VMO: {
-                tree_.erase(*iobuf);
+                server_->CloseVmo(vmoid);
                 if (wants_reply) {
                     OutOfBandErrorRespond(fifo, NO_ERROR, txnid);
                 }
@@ -309,25 +806,19 @@ mx_status_t BlockServer::Serve(mx_device_t* dev, block_ops_t* ops) {
             }
             }
         }
-    }
-}
 
-BlockServer::BlockServer() : fifo_(MX_HANDLE_INVALID), last_id(0) {}
-BlockServer::~BlockServer() {
-    ShutDown();
-}
-
-void BlockServer::ShutDown() {
-    mxtl::AutoLock server_lock(&server_lock_);
-    if (fifo_ != MX_HANDLE_INVALID) {
-        mx_handle_close(fifo_);
+        {
+            mxtl::AutoLock lock(&stats_lock_);
+            stats_.requests += received;
+        }
+        Dispatch(dev, ops);
     }
-    fifo_ = MX_HANDLE_INVALID;
 }
 
 // C declarations
-mx_status_t blockserver_create(mx_handle_t* fifo_out, BlockServer** out) {
-    return BlockServer::Create(fifo_out, out);
+mx_status_t blockserver_create(mx_device_t* dev, block_ops_t* ops, mx_handle_t* fifo_out,
+                               BlockServer** out) {
+    return BlockServer::Create(dev, ops, fifo_out, out);
 }
 void blockserver_shutdown(BlockServer* bs) {
     bs->ShutDown();
@@ -335,15 +826,24 @@ void blockserver_shutdown(BlockServer* bs) {
 void blockserver_free(BlockServer* bs) {
     delete bs;
 }
-mx_status_t blockserver_serve(BlockServer* bs, mx_device_t* dev, block_ops_t* ops) {
-    return bs->Serve(dev, ops);
+mx_status_t blockserver_serve(BlockServer* bs) {
+    return bs->Serve();
+}
+mx_status_t blockserver_add_queue(BlockServer* bs, mx_handle_t* fifo_out, uint32_t* index_out) {
+    return bs->AddQueue(fifo_out, index_out);
 }
 mx_status_t blockserver_attach_vmo(BlockServer* bs, mx_handle_t vmo, vmoid_t* out) {
     return bs->AttachVmo(vmo, out);
 }
-mx_status_t blockserver_allocate_txn(BlockServer* bs, txnid_t* out) {
-    return bs->AllocateTxn(out);
+mx_status_t blockserver_allocate_txn(BlockServer* bs, uint32_t queue, txnid_t* out) {
+    return bs->AllocateTxn(queue, out);
 }
 void blockserver_free_txn(BlockServer* bs, txnid_t txnid) {
     return bs->FreeTxn(txnid);
 }
+void blockserver_get_stats(BlockServer* bs, block_stats_t* out) {
+    bs->GetStats(out);
+}
+void blockserver_get_latency(BlockServer* bs, block_latency_t* out) {
+    bs->GetLatency(out);
+}
@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <threads.h>
 
 #include <ddk/protocol/block.h>
 #include <magenta/device/block.h>
@@ -14,6 +15,8 @@
 
 #ifdef __cplusplus
 
+#include <mxtl/array.h>
+#include <mxtl/atomic.h>
 #include <mxtl/intrusive_wavl_tree.h>
 #include <mxtl/mutex.h>
 #include <mxtl/ref_counted.h>
@@ -35,7 +38,7 @@ public:
     ~IoBuffer();
 
 private:
-    friend class BlockServer;
+    friend class BlockQueue;
     friend struct TypeWAVLTraits;
     DISALLOW_COPY_ASSIGN_AND_MOVE(IoBuffer);
 
@@ -45,12 +48,46 @@ private:
 
 constexpr uint32_t kTxnFlagRespond = 0x00000001; // Should a reponse be sent when we hit goal?
 
+class BlockQueue;
+class BlockServer;
 class BlockTransaction;
 
+typedef struct block_msg block_msg_t;
+
+// An operation issued to the block device, which hands it back as the cookie
+// of its completion.
 typedef struct {
+    block_msg_t* msg;
+    mx_time_t issued; // When it was issued to the device
+} block_op_t;
+
+struct block_msg {
     mxtl::RefPtr<BlockTransaction> txn;
     mxtl::RefPtr<IoBuffer> iobuf;
-} block_msg_t;
+    // For a vectored request, the buffer of each of its ranges instead.
+    mxtl::Array<mxtl::RefPtr<IoBuffer>> vec_iobufs;
+    // The operation issued for the request, or for a vectored one, the
+    // operation of each of its ranges.
+    block_op_t op;
+    mxtl::Array<block_op_t> vec_ops;
+    BlockQueue* queue;
+    uint16_t opcode;  // BLOCKIO_READ, BLOCKIO_WRITE or BLOCKIO_TRIM, for its statistics
+    mx_time_t queued; // When the (earliest) request was taken off the FIFO
+    uint32_t count;   // How many FIFO requests this message completes
+    mxtl::atomic<uint32_t> pending; // Operations issued for it which have not completed
+};
+
+// A read, write or trim which has been taken off the FIFO, but not yet issued to the
+// block device. Each range of a vectored request is queued separately.
+typedef struct {
+    block_msg_t* msg;
+    block_op_t* op;  // Part of |msg|
+    IoBuffer* iobuf; // Kept alive by |msg|
+    uint16_t opcode;
+    uint64_t length;
+    uint64_t vmo_offset;
+    uint64_t dev_offset;
+} block_request_t;
 
 class BlockTransaction : public mxtl::RefCounted<BlockTransaction> {
 public:
@@ -63,8 +100,8 @@ public:
     // received before the transaction is identified as successful.
     mx_status_t Enqueue(bool do_respond, block_msg_t** msg_out);
 
-    // Called once the transaction has completed successfully.
-    void Complete(mx_status_t status);
+    // Called once |count| of the enqueued messages have completed.
+    void Complete(mx_status_t status, uint32_t count);
 
     txnid_t GetTxnid() const;
 private:
@@ -81,31 +118,118 @@ private:
     uint32_t goal_; // How many ops does the block device need to complete?
 };
 
+// A single FIFO, the txns which may be used on it, and the requests taken off
+// it which have not yet been issued to the block device.
+class BlockQueue {
+public:
+    BlockQueue(BlockServer* server, uint32_t index);
+    ~BlockQueue();
+
+    mx_status_t Create(mx_handle_t* fifo_out);
+
+    // Serves the FIFO using the current thread, until it is closed or shut down.
+    mx_status_t Serve();
+    mx_status_t AllocateTxn(txnid_t* out);
+    void FreeTxn(txnid_t txnid);
+
+    // Adds the statistics for this queue to |out|.
+    void AddStats(block_stats_t* out);
+    void AddLatency(block_latency_t* out);
+
+    // Called by the block device when an operation issued by Dispatch completes.
+    void Completed(const block_op_t* op);
+
+    void ShutDown();
+
+private:
+    DISALLOW_COPY_ASSIGN_AND_MOVE(BlockQueue);
+
+    mxtl::RefPtr<BlockTransaction> GetTxn(txnid_t txnid);
+
+    // Reads and writes are not issued to the device as they arrive. Each batch
+    // read off the FIFO is queued, sorted by device offset continuing the sweep
+    // from wherever the last batch left off, and contiguous requests against the
+    // same txn and vmoid are merged before being issued. Nothing waits for more
+    // than one batch, and requests which overlap with a queued write (or writes
+    // which overlap with a queued read) flush the queue first, so that they are
+    // issued in FIFO order. Nothing waits for issued operations to complete,
+    // though, and the device may complete them in any order; as before, a
+    // client which depends on an earlier request waits for its txn first.
+    bool ConflictsWithQueue(uint16_t opcode, uint64_t length, uint64_t dev_offset) const;
+    void Queue(block_op_t* op, IoBuffer* iobuf, uint16_t opcode, uint64_t length,
+               uint64_t vmo_offset, uint64_t dev_offset);
+    // Reads the descriptor table of a BLOCKIO_READV or BLOCKIO_WRITEV request
+    // from |table|, and queues each of its ranges as an |opcode| operation.
+    mx_status_t QueueVectored(mx_device_t* dev, block_ops_t* ops, block_msg_t* msg,
+                              uint16_t opcode, IoBuffer* table,
+                              const block_fifo_request_t& request);
+    void Dispatch(mx_device_t* dev, block_ops_t* ops);
+
+    // Waits for every operation issued to the device to complete.
+    void Drain();
+
+    BlockServer* const server_;
+    const uint32_t index_;
+
+    mxtl::Mutex lock_;
+    mx_handle_t fifo_;
+    mxtl::RefPtr<BlockTransaction> txns_[MAX_TXN_COUNT];
+
+    // Only touched by the serving thread.
+    block_request_t queue_[BLOCK_FIFO_MAX_DEPTH];
+    size_t queue_count_;
+    uint64_t head_; // Device offset just past the last issued operation
+
+    mxtl::Mutex stats_lock_;
+    cnd_t idle_cond_ = {}; // Signalled when the last outstanding operation completes
+    block_stats_t stats_;
+    block_latency_t latency_;
+};
+
 class BlockServer {
 public:
-    // Creates a new BlockServer
-    static mx_status_t Create(mx_handle_t* fifo_out, BlockServer** out);
+    // Creates a new BlockServer, with a single FIFO
+    static mx_status_t Create(mx_device_t* dev, block_ops_t* ops, mx_handle_t* fifo_out,
+                              BlockServer** out);
+
+    // Serves the first FIFO using the current thread. Once that stops, so do
+    // any others which were added.
+    mx_status_t Serve();
+
+    // Adds another FIFO, served by a new thread.
+    mx_status_t AddQueue(mx_handle_t* fifo_out, uint32_t* index_out);
 
-    // Starts the BlockServer using the current thread
-    mx_status_t Serve(mx_device_t* dev, block_ops_t* ops);
     mx_status_t AttachVmo(mx_handle_t vmo, vmoid_t* out);
-    mx_status_t AllocateTxn(txnid_t* out);
+    mx_status_t AllocateTxn(uint32_t queue, txnid_t* out);
     void FreeTxn(txnid_t txnid);
+    void GetStats(block_stats_t* out);
+    void GetLatency(block_latency_t* out);
 
     void ShutDown();
 
     ~BlockServer();
 private:
     DISALLOW_COPY_ASSIGN_AND_MOVE(BlockServer);
-    BlockServer();
+    friend class BlockQueue;
+    BlockServer(mx_device_t* dev, block_ops_t* ops);
 
     mx_status_t FindVmoIDLocked(vmoid_t* out);
+    mxtl::RefPtr<IoBuffer> FindVmo(vmoid_t vmoid);
+    void CloseVmo(vmoid_t vmoid);
+
+    mx_device_t* const dev_;
+    block_ops_t* const ops_;
+    const uint32_t max_queues_;
 
     mxtl::Mutex server_lock_;
-    mx_handle_t fifo_;
     mxtl::WAVLTree<vmoid_t, mxtl::RefPtr<IoBuffer>> tree_;
-    mxtl::RefPtr<BlockTransaction> txns_[MAX_TXN_COUNT];
     vmoid_t last_id;
+
+    // Queues are only ever added, and live as long as the server.
+    mxtl::unique_ptr<BlockQueue> queues_[MAX_FIFO_COUNT];
+    thrd_t threads_[MAX_FIFO_COUNT]; // The first queue is served by the caller of Serve
+    uint32_t queue_count_;
+    bool shutdown_;
 };
 
 #else
@@ -118,7 +242,8 @@ typedef struct BlockServer BlockServer;
 __BEGIN_CDECLS
 
 // Allocate a new blockserver + FIFO combo
-mx_status_t blockserver_create(mx_handle_t* fifo_out, BlockServer** out);
+mx_status_t blockserver_create(mx_device_t* dev, block_ops_t* ops, mx_handle_t* fifo_out,
+                               BlockServer** out);
 
 // Shut down the blockserver. It will stop serving requests.
 void blockserver_shutdown(BlockServer* bs);
@@ -127,13 +252,20 @@ void blockserver_shutdown(BlockServer* bs);
 void blockserver_free(BlockServer* bs);
 
 // Use the current thread to block on incoming FIFO requests.
-mx_status_t blockserver_serve(BlockServer* bs, mx_device_t* dev, block_ops_t* ops);
+mx_status_t blockserver_serve(BlockServer* bs);
+
+// Add another FIFO to the blockserver, with a thread of its own
+mx_status_t blockserver_add_queue(BlockServer* bs, mx_handle_t* fifo_out, uint32_t* index_out);
 
 // Attach an IO buffer to the Block Server
 mx_status_t blockserver_attach_vmo(BlockServer* bs, mx_handle_t vmo, vmoid_t* out);
 
 // Allocate & Free a txn
-mx_status_t blockserver_allocate_txn(BlockServer* bs, txnid_t* out);
+mx_status_t blockserver_allocate_txn(BlockServer* bs, uint32_t queue, txnid_t* out);
 void blockserver_free_txn(BlockServer* bs, txnid_t txnid);
 
+// Read the scheduling statistics of the blockserver
+void blockserver_get_stats(BlockServer* bs, block_stats_t* out);
+void blockserver_get_latency(BlockServer* bs, block_latency_t* out);
+
 __END_CDECLS
@@ -100,10 +100,44 @@ static void ramdisk_fifo_write(mx_device_t* dev, mx_handle_t vmo, uint64_t lengt
     rdev->cb->complete(cookie, status);
 }
 
+// Pages wholly inside the range are handed back to the system, and the parts
+// of any it only partly covers are zeroed, so all of it reads back as zeroes.
+static mx_status_t ramdisk_trim(ramdisk_device_t* rdev, uint64_t offset, uint64_t length) {
+    uint64_t end = offset + length;
+    uint64_t page_start = (offset + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+    uint64_t page_end = end & ~((uint64_t)PAGE_SIZE - 1);
+    if (page_start >= page_end) {
+        memset((void*)rdev->mapped_addr + offset, 0, length);
+        return NO_ERROR;
+    }
+    memset((void*)rdev->mapped_addr + offset, 0, page_start - offset);
+    memset((void*)rdev->mapped_addr + page_end, 0, end - page_end);
+    return mx_vmo_op_range(rdev->vmo, MX_VMO_OP_DECOMMIT, page_start, page_end - page_start,
+                           NULL, 0);
+}
+
+static void ramdisk_fifo_trim(mx_device_t* dev, uint64_t length, uint64_t dev_offset,
+                              void* cookie) {
+    ramdisk_device_t* rdev = get_ramdisk(dev);
+    mx_off_t len = length;
+    mx_status_t status = constrain_args(rdev, &dev_offset, &len);
+    if (status == NO_ERROR) {
+        status = ramdisk_trim(rdev, dev_offset, len);
+    }
+    rdev->cb->complete(cookie, status);
+}
+
+static uint32_t ramdisk_fifo_get_queue_count(mx_device_t* dev) {
+    // Requests are copied on the caller's thread, so they scale with CPUs.
+    return mx_system_get_num_cpus();
+}
+
 static block_ops_t ramdisk_block_ops = {
     .set_callbacks = ramdisk_fifo_set_callbacks,
     .read = ramdisk_fifo_read,
     .write = ramdisk_fifo_write,
+    .get_queue_count = ramdisk_fifo_get_queue_count,
+    .trim = ramdisk_fifo_trim,
 };
 
 // implement device protocol:
@@ -142,6 +176,9 @@ static ssize_t ramdisk_ioctl(mx_device_t* dev, uint32_t op, const void* cmd,
     }
 }
 
+// Like FIFO requests, iotxns are served on the caller's thread. For txns
+// from iotxn_alloc_vmo(), copyto() and copyfrom() move the data straight
+// between the caller's VMO and the ramdisk.
 static void ramdisk_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
     ramdisk_device_t* ramdev = get_ramdisk(dev);
 
@@ -162,6 +199,11 @@ static void ramdisk_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
             txn->ops->complete(txn, NO_ERROR, txn->length);
             return;
         }
+        case IOTXN_OP_TRIM: {
+            status = ramdisk_trim(ramdev, txn->offset, txn->length);
+            txn->ops->complete(txn, status, (status == NO_ERROR) ? txn->length : 0);
+            return;
+        }
         default: {
             txn->ops->complete(txn, ERR_INVALID_ARGS, 0);
             return;
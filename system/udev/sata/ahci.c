@@ -6,10 +6,13 @@
 #include <ddk/device.h>
 #include <ddk/driver.h>
 #include <ddk/io-buffer.h>
+#include <ddk/protocol/block.h>
 #include <ddk/protocol/pci.h>
 
 #include <assert.h>
 #include <hexdump/hexdump.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <magenta/listnode.h>
 #include <magenta/syscalls.h>
 #include <magenta/types.h>
@@ -70,10 +73,13 @@ typedef struct ahci_port {
     ahci_cl_t* cl;
     ahci_fis_t* fis;
     ahci_ct_t* ct[AHCI_MAX_COMMANDS];
+    uint64_t* dsm[AHCI_MAX_COMMANDS]; // TRIM ranges sent by DATA SET MANAGEMENT
+    mx_paddr_t dsm_phys[AHCI_MAX_COMMANDS];
 
     mtx_t lock;
 
     uint32_t running; // bitmask of running commands
+    uint32_t queued; // bitmask of running commands that are NCQ
     iotxn_t* commands[AHCI_MAX_COMMANDS]; // commands in flight
 
     list_node_t txn_list;
@@ -189,10 +195,6 @@ static void ahci_port_reset(ahci_port_t* port) {
     ahci_write(&port->regs->serr, ahci_read(&port->regs->serr));
 }
 
-static bool ahci_port_cmd_busy(ahci_port_t* port, int slot) {
-    return ((ahci_read(&port->regs->sact) | ahci_read(&port->regs->ci)) & (1 << slot)) || (port->commands[slot] != NULL) || (port->running & (1 << slot));
-}
-
 static bool cmd_is_read(uint8_t cmd) {
     if (cmd == SATA_CMD_READ_DMA ||
         cmd == SATA_CMD_READ_DMA_EXT ||
@@ -206,7 +208,8 @@ static bool cmd_is_read(uint8_t cmd) {
 static bool cmd_is_write(uint8_t cmd) {
     if (cmd == SATA_CMD_WRITE_DMA ||
         cmd == SATA_CMD_WRITE_DMA_EXT ||
-        cmd == SATA_CMD_WRITE_FPDMA_QUEUED) {
+        cmd == SATA_CMD_WRITE_FPDMA_QUEUED ||
+        cmd == SATA_CMD_DATA_SET_MANAGEMENT) {
         return true;
     } else {
         return false;
@@ -217,62 +220,155 @@ static bool cmd_is_queued(uint8_t cmd) {
     return (cmd == SATA_CMD_READ_FPDMA_QUEUED) || (cmd == SATA_CMD_WRITE_FPDMA_QUEUED);
 }
 
-static void ahci_port_complete_txn(ahci_device_t* dev, ahci_port_t* port, mx_status_t status) {
+// Completes every command on the port the device has finished with, and
+// returns whether there were any.
+static bool ahci_port_complete_txns(ahci_port_t* port, mx_status_t status) {
+    list_node_t done = LIST_INITIAL_VALUE(done);
+    mtx_lock(&port->lock);
+    // NCQ commands are done once their sact bit clears, the others once their
+    // ci bit does
+    uint32_t busy = ahci_read(&port->regs->sact) | ahci_read(&port->regs->ci);
+    uint32_t finished = port->running & ~busy;
+    // clear state before calling the complete() hooks
+    port->running &= ~finished;
+    port->queued &= ~finished;
+    for (uint32_t bits = finished; bits; bits &= bits - 1) {
+        int slot = __builtin_ctz(bits);
+        list_add_tail(&done, &port->commands[slot]->node);
+        port->commands[slot] = NULL;
+    }
+
+    // resume the port if paused for sync and no outstanding transactions
+    if ((port->flags & AHCI_PORT_FLAG_SYNC_PAUSED) && !port->running) {
+        port->flags &= ~AHCI_PORT_FLAG_SYNC_PAUSED;
+    }
+    mtx_unlock(&port->lock);
+
     iotxn_t* txn;
-    uint32_t sact = ahci_read(&port->regs->sact);
-    for (int i = 0; i < AHCI_MAX_COMMANDS; i++) {
-        txn = port->commands[i];
-        if (txn == NULL) {
-            continue;
-        }
-        if (!(sact & (1 << i))) {
-            mtx_lock(&port->lock);
-            // clear state before calling the complete() hook
-            port->running &= ~(1 << i);
-            port->commands[i] = NULL;
+    while ((txn = list_remove_head_type(&done, iotxn_t, node)) != NULL) {
+        block_trace(BLOCK_TRACE_COMPLETE, txn, status);
+        txn->ops->complete(txn, status, txn->length);
+    }
+    return finished != 0;
+}
 
-            // resume the port if paused for sync and no outstanding transactions
-            if ((port->flags & AHCI_PORT_FLAG_SYNC_PAUSED) && !port->running) {
-                port->flags &= ~AHCI_PORT_FLAG_SYNC_PAUSED;
-            }
-            mtx_unlock(&port->lock);
+// Recovers the port after a taskfile error, failing with |status| every
+// command the device had not finished with, and returns whether any commands
+// completed. Stopping the port clears ci and sact (v1.3.1, 6.2.2.1), so no
+// command still running would ever complete on its own.
+static bool ahci_port_recover(ahci_port_t* port, mx_status_t status) {
+    // anything finished before the error went through
+    bool completed = ahci_port_complete_txns(port, NO_ERROR);
 
-            txn->ops->complete(txn, status, txn->length);
+    list_node_t failed = LIST_INITIAL_VALUE(failed);
+    mtx_lock(&port->lock);
+    ahci_port_reset(port);
+    for (uint32_t bits = port->running; bits; bits &= bits - 1) {
+        int slot = __builtin_ctz(bits);
+        list_add_tail(&failed, &port->commands[slot]->node);
+        port->commands[slot] = NULL;
+    }
+    port->running = 0;
+    port->queued = 0;
+    port->flags &= ~AHCI_PORT_FLAG_SYNC_PAUSED;
+    mtx_unlock(&port->lock);
+
+    iotxn_t* txn;
+    while ((txn = list_remove_head_type(&failed, iotxn_t, node)) != NULL) {
+        block_trace(BLOCK_TRACE_COMPLETE, txn, status);
+        txn->ops->complete(txn, status, 0);
+        completed = true;
+    }
+    return completed;
+}
+
+// Fills the PRDT of |slot| straight from the pages of the txn's buffer, one
+// entry per physically contiguous run, so VMO-backed txns need no bounce.
+static mx_status_t ahci_port_build_prdt(ahci_port_t* port, int slot, iotxn_t* txn, uint16_t* prdtl) {
+    ahci_prd_t* prd = (ahci_prd_t*)((void*)port->ct[slot] + sizeof(ahci_ct_t));
+    mx_paddr_t pages[AHCI_LOOKUP_PAGES];
+    mx_paddr_t next = 0; // the address just past the last entry
+    size_t prd_len = 0; // the length of the last entry
+    int count = 0;
+    for (size_t offset = 0; offset < txn->length; ) {
+        // a lookup of this many bytes can touch at most countof(pages) pages
+        size_t chunk = MIN(txn->length - offset, (countof(pages) - 1) * PAGE_SIZE);
+        mx_status_t status = txn->ops->physmap_pages(txn, offset, chunk, pages, countof(pages));
+        if (status != NO_ERROR) {
+            return status;
+        }
+        for (size_t i = 0; chunk > 0; i++) {
+            mx_paddr_t addr = pages[i];
+            size_t len = MIN(chunk, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+            if (count > 0 && addr == next && prd_len + len <= AHCI_PRD_MAX_SIZE) {
+                prd_len += len;
+            } else {
+                if (count == AHCI_MAX_PRDS) {
+                    return ERR_BUFFER_TOO_SMALL;
+                }
+                prd_len = len;
+                prd[count].dba = LO32(addr);
+                prd[count].dbau = HI32(addr);
+                count++;
+            }
+            prd[count - 1].dbc = (uint32_t)((prd_len - 1) & 0x3fffff); // 0-based byte count
+            next = addr + len;
+            offset += len;
+            chunk -= len;
         }
     }
-    // hit the worker thread to do the next txn
-    completion_signal(&dev->worker_completion);
+    *prdtl = (uint16_t)count;
+    return NO_ERROR;
+}
+
+// Fills the DATA SET MANAGEMENT block of |slot| with the TRIM ranges covering
+// the txn's blocks, and points its PRDT at it. Larger trims are split up by
+// the sata device before they get here.
+static mx_status_t ahci_port_build_dsm(ahci_port_t* port, int slot, sata_pdata_t* pdata, uint16_t* prdtl) {
+    if (pdata->trim_count > (uint64_t)AHCI_DSM_RANGES * AHCI_DSM_RANGE_MAX) {
+        return ERR_INVALID_ARGS;
+    }
+    // each range is a 48-bit lba and a 16-bit count; unused ones are zero
+    uint64_t* ranges = port->dsm[slot];
+    memset(ranges, 0, AHCI_DSM_RANGES * sizeof(uint64_t));
+    uint64_t lba = pdata->lba;
+    uint64_t remaining = pdata->trim_count;
+    for (int i = 0; remaining > 0; i++) {
+        uint64_t count = MIN(remaining, AHCI_DSM_RANGE_MAX);
+        ranges[i] = (lba & 0xffffffffffffull) | (count << 48);
+        lba += count;
+        remaining -= count;
+    }
+    ahci_prd_t* prd = (ahci_prd_t*)((void*)port->ct[slot] + sizeof(ahci_ct_t));
+    prd->dba = LO32(port->dsm_phys[slot]);
+    prd->dbau = HI32(port->dsm_phys[slot]);
+    prd->dbc = AHCI_DSM_RANGES * sizeof(uint64_t) - 1; // 0-based byte count
+    *prdtl = 1;
+    return NO_ERROR;
 }
 
 static mx_status_t ahci_do_txn(ahci_device_t* dev, ahci_port_t* port, int slot, iotxn_t* txn) {
     assert(slot < AHCI_MAX_COMMANDS);
-    assert(!ahci_port_cmd_busy(port, slot));
+    assert(!(port->running & (1u << slot)));
 
     sata_pdata_t* pdata = sata_iotxn_pdata(txn);
-    if ((cmd_is_read(pdata->cmd) || cmd_is_write(pdata->cmd)) && pdata->count == 0) {
-        // Empty reads and writes complete immediately, and are not actually
-        // transmitted to the underlying device.
-        // resume the port if paused for sync and no outstanding transactions
-        if ((port->flags & AHCI_PORT_FLAG_SYNC_PAUSED) && !port->running) {
-            port->flags &= ~AHCI_PORT_FLAG_SYNC_PAUSED;
+    uint16_t prdtl = 0;
+    if (pdata->cmd == SATA_CMD_DATA_SET_MANAGEMENT) {
+        // the txn has no buffer; the ranges are the data
+        mx_status_t status = ahci_port_build_dsm(port, slot, pdata, &prdtl);
+        if (status != NO_ERROR) {
+            xprintf("ahci.%d: cannot trim %" PRIu64 " blocks\n", port->nr, pdata->trim_count);
+            return status;
         }
-        txn->ops->complete(txn, NO_ERROR, txn->length);
-        completion_signal(&dev->worker_completion);
-        return NO_ERROR;
-    }
-
-    mx_paddr_t phys;
-    txn->ops->physmap(txn, &phys);
-
-    if (dev->cap & AHCI_CAP_NCQ) {
-        if (pdata->cmd == SATA_CMD_READ_DMA_EXT) {
-            pdata->cmd = SATA_CMD_READ_FPDMA_QUEUED;
-        } else if (pdata->cmd == SATA_CMD_WRITE_DMA_EXT) {
-            pdata->cmd = SATA_CMD_WRITE_FPDMA_QUEUED;
+    } else if (txn->length > 0) {
+        mx_status_t status = ahci_port_build_prdt(port, slot, txn, &prdtl);
+        if (status != NO_ERROR) {
+            xprintf("ahci.%d: cannot map txn for dma (%d)\n", port->nr, status);
+            return status;
         }
     }
 
-    //xprintf("ahci.%d: do_txn slot=%d cmd=0x%x device=0x%x lba=0x%lx count=%u phys=0x%lx data_sz=0x%lx offset=0x%lx\n", port->nr, slot, pdata->cmd, pdata->device, pdata->lba, pdata->count, phys, txn->length, txn->offset);
+    //xprintf("ahci.%d: do_txn slot=%d cmd=0x%x device=0x%x lba=0x%lx count=%u prdtl=%u data_sz=0x%lx offset=0x%lx\n", port->nr, slot, pdata->cmd, pdata->device, pdata->lba, pdata->count, prdtl, txn->length, txn->offset);
 
     // build the command
     ahci_cl_t* cl = port->cl + slot;
@@ -280,7 +376,7 @@ static mx_status_t ahci_do_txn(ahci_device_t* dev, ahci_port_t* port, int slot,
     cl->prdtl_flags_cfl = 0;
     cl->cfl = 5; // 20 bytes
     cl->w = cmd_is_write(pdata->cmd) ? 1 : 0;
-    cl->prdtl = txn->length / AHCI_PRD_MAX_SIZE + 1;
+    cl->prdtl = prdtl;
     cl->prdbc = 0;
     memset(port->ct[slot], 0, sizeof(ahci_ct_t));
 
@@ -312,28 +408,22 @@ static mx_status_t ahci_do_txn(ahci_device_t* dev, ahci_port_t* port, int slot,
         cfis[11] = (pdata->count >> 8) & 0xff;
         cfis[12] = (slot << 3) & 0xff; // tag
         cfis[13] = 0; // normal priority
+    } else if (pdata->cmd == SATA_CMD_DATA_SET_MANAGEMENT) {
+        cfis[3] = 1; // TRIM
+        cfis[12] = pdata->count & 0xff; // 512-byte blocks of ranges
+        cfis[13] = (pdata->count >> 8) & 0xff;
     }
 
-    ahci_prd_t* prd = NULL;
-    uint64_t length = txn->length;
-    for (int i = 0; i < cl->prdtl; i++) {
-        prd = (ahci_prd_t*)((void*)port->ct[slot] + sizeof(ahci_ct_t)) + i;
-        prd->dba = LO32(phys);
-        prd->dbau = HI32(phys);
-        prd->dbc = ((length - 1) & 0x3fffff); // 0-based byte count
-
-        phys += AHCI_PRD_MAX_SIZE;
-        length -= AHCI_PRD_MAX_SIZE;
-    }
-
-    port->running |= (1 << slot);
+    port->running |= (1u << slot);
     port->commands[slot] = txn;
 
-    // start command
+    // start command; writing 0 bits to sact and ci has no effect
+    block_trace(BLOCK_TRACE_SUBMIT, txn, txn->opcode);
     if (cmd_is_queued(pdata->cmd)) {
-        ahci_write(&port->regs->sact, ahci_read(&port->regs->sact) | (1 << slot));
+        port->queued |= (1u << slot);
+        ahci_write(&port->regs->sact, 1u << slot);
     }
-    ahci_write(&port->regs->ci, ahci_read(&port->regs->ci) | (1 << slot));
+    ahci_write(&port->regs->ci, 1u << slot);
 
     // set the watchdog
     // TODO: general timeout mechanism
@@ -349,9 +439,11 @@ static mx_status_t ahci_port_initialize(ahci_port_t* port) {
         return ERR_UNAVAILABLE;
     }
 
-    // allocate memory for the command list, FIS receive area, command table and PRDT
+    // allocate memory for the command list, FIS receive area, command table, PRDT
+    // and TRIM ranges
     size_t mem_sz = sizeof(ahci_fis_t) + sizeof(ahci_cl_t) * AHCI_MAX_COMMANDS
-                    + (sizeof(ahci_ct_t) + sizeof(ahci_prd_t) * AHCI_MAX_PRDS) * AHCI_MAX_COMMANDS;
+                    + (sizeof(ahci_ct_t) + sizeof(ahci_prd_t) * AHCI_MAX_PRDS) * AHCI_MAX_COMMANDS
+                    + sizeof(uint64_t) * AHCI_DSM_RANGES * AHCI_MAX_COMMANDS;
     mx_status_t status = io_buffer_init(&port->buffer, mem_sz, IO_BUFFER_RW);
     if (status < 0) {
         xprintf("ahci.%d: error %d allocating dma memory\n", port->nr, status);
@@ -364,6 +456,7 @@ static mx_status_t ahci_port_initialize(ahci_port_t* port) {
     // order is command list (1024-byte aligned)
     //          FIS receive area (256-byte aligned)
     //          command table + PRDT (127-byte aligned)
+    //          TRIM ranges (2-byte aligned)
     memset(mem, 0, mem_sz);
 
     // command list
@@ -389,6 +482,14 @@ static mx_status_t ahci_port_initialize(ahci_port_t* port) {
         mem += sizeof(ahci_ct_t) + sizeof(ahci_prd_t) * AHCI_MAX_PRDS;
     }
 
+    // TRIM ranges
+    for (int i = 0; i < AHCI_MAX_COMMANDS; i++) {
+        port->dsm_phys[i] = mem_phys;
+        mem_phys += sizeof(uint64_t) * AHCI_DSM_RANGES;
+        port->dsm[i] = mem;
+        mem += sizeof(uint64_t) * AHCI_DSM_RANGES;
+    }
+
     // clear port interrupts
     ahci_write(&port->regs->is, ahci_read(&port->regs->is));
 
@@ -458,6 +559,68 @@ void ahci_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
 
 // worker thread (for iotxn queue):
 
+// Keeps issuing the port's queued txns until it runs out of them or of free
+// command slots.  Txns that finish without reaching the device are moved to
+// |done|, to be completed once the port lock is dropped.
+static void ahci_port_issue_txns(ahci_device_t* dev, ahci_port_t* port, list_node_t* done) {
+    // slots the hardware still holds (e.g. after a watchdog timeout) are not free
+    uint32_t busy = port->running | ahci_read(&port->regs->sact) | ahci_read(&port->regs->ci);
+    iotxn_t* txn;
+    while (!(port->flags & AHCI_PORT_FLAG_SYNC_PAUSED) &&
+           (txn = list_peek_head_type(&port->txn_list, iotxn_t, node)) != NULL) {
+        // if IOTXN_SYNC_BEFORE, pause the port if there are transactions in flight
+        if ((txn->flags & IOTXN_SYNC_BEFORE) && port->running) {
+            port->flags |= AHCI_PORT_FLAG_SYNC_PAUSED;
+            return;
+        }
+
+        sata_pdata_t* pdata = sata_iotxn_pdata(txn);
+        if ((cmd_is_read(pdata->cmd) || cmd_is_write(pdata->cmd)) && pdata->count == 0) {
+            // Empty reads and writes complete immediately, and are not actually
+            // transmitted to the underlying device.
+            list_delete(&txn->node);
+            txn->status = NO_ERROR;
+            list_add_tail(done, &txn->node);
+            continue;
+        }
+
+        if (dev->cap & AHCI_CAP_NCQ) {
+            if (pdata->cmd == SATA_CMD_READ_DMA_EXT) {
+                pdata->cmd = SATA_CMD_READ_FPDMA_QUEUED;
+            } else if (pdata->cmd == SATA_CMD_WRITE_DMA_EXT) {
+                pdata->cmd = SATA_CMD_WRITE_FPDMA_QUEUED;
+            }
+        }
+
+        // NCQ and non-NCQ commands cannot be in flight at the same time
+        if (cmd_is_queued(pdata->cmd) ? (port->running & ~port->queued) : port->queued) {
+            return;
+        }
+
+        // find a free command tag
+        int max = MIN(pdata->max_cmd, (int)((dev->cap >> 8) & 0x1f));
+        uint32_t free = ~busy & (uint32_t)((2ull << max) - 1);
+        if (!free) {
+            return;
+        }
+        int slot = __builtin_ctz(free);
+
+        // run the command
+        list_delete(&txn->node);
+        mx_status_t status = ahci_do_txn(dev, port, slot, txn);
+        if (status != NO_ERROR) {
+            txn->status = status;
+            list_add_tail(done, &txn->node);
+            continue;
+        }
+        busy |= (1u << slot);
+        // if IOTXN_SYNC_AFTER, pause the port until this command is complete
+        if (txn->flags & IOTXN_SYNC_AFTER) {
+            port->flags |= AHCI_PORT_FLAG_SYNC_PAUSED;
+        }
+    }
+}
+
 static int ahci_worker_thread(void* arg) {
     ahci_device_t* dev = (ahci_device_t*)arg;
     ahci_port_t* port;
@@ -466,45 +629,17 @@ static int ahci_worker_thread(void* arg) {
         // iterate all the ports and run commands
         for (int i = 0; i < AHCI_MAX_PORTS; i++) {
             port = &dev->ports[i];
-            mtx_lock(&port->lock);
             if (!(port->flags & (AHCI_PORT_FLAG_IMPLEMENTED | AHCI_PORT_FLAG_PRESENT))) {
-                goto next;
-            }
-            if (port->flags & AHCI_PORT_FLAG_SYNC_PAUSED) {
-                goto next;
-            }
-
-            txn = list_peek_head_type(&port->txn_list, iotxn_t, node);
-            if (!txn) {
-                goto next;
-            }
-
-            // if IOTXN_SYNC_BEFORE, pause the port if there are transactions in flight
-            if ((txn->flags & IOTXN_SYNC_BEFORE) && port->running) {
-                port->flags |= AHCI_PORT_FLAG_SYNC_PAUSED;
-                goto next;
-            }
-
-            // find a free command tag
-            sata_pdata_t* pdata = sata_iotxn_pdata(txn);
-            int max = MIN(pdata->max_cmd, (int)((dev->cap >> 8) & 0x1f));
-            int i = 0;
-            for (i = 0; i <= max; i++) {
-                if (!ahci_port_cmd_busy(port, i)) break;
-            }
-            if (i > max) {
-                goto next;
+                continue;
             }
+            list_node_t done = LIST_INITIAL_VALUE(done);
+            mtx_lock(&port->lock);
+            ahci_port_issue_txns(dev, port, &done);
+            mtx_unlock(&port->lock);
 
-            list_delete(&txn->node);
-            // if IOTXN_SYNC_AFTER, pause the port until this command is complete
-            if (txn->flags & IOTXN_SYNC_AFTER) {
-                port->flags |= AHCI_PORT_FLAG_SYNC_PAUSED;
+            while ((txn = list_remove_head_type(&done, iotxn_t, node)) != NULL) {
+                txn->ops->complete(txn, txn->status, txn->status == NO_ERROR ? txn->length : 0);
             }
-            // run the command
-            ahci_do_txn(dev, port, i, txn);
-next:
-            mtx_unlock(&port->lock);
         }
         // wait here until more commands are queued, or a port becomes idle
         completion_wait(&dev->worker_completion, MX_TIME_INFINITE);
@@ -535,10 +670,12 @@ static int ahci_watchdog_thread(void* arg) {
                     if (pdata->timeout < now) {
                         // time out
                         printf("ahci: txn time out on port %d\n", port->nr);
-                        iotxn_t* txn = port->commands[i];
-                        port->running &= ~(1 << i);
-                        port->commands[i] = NULL;
+                        iotxn_t* txn = port->commands[j];
+                        port->running &= ~(1u << j);
+                        port->queued &= ~(1u << j);
+                        port->commands[j] = NULL;
                         mtx_unlock(&port->lock);
+                        block_trace(BLOCK_TRACE_COMPLETE, txn, ERR_TIMED_OUT);
                         txn->ops->complete(txn, ERR_TIMED_OUT, 0);
                         mtx_lock(&port->lock);
                     }
@@ -556,29 +693,28 @@ static int ahci_watchdog_thread(void* arg) {
 
 // irq handler:
 
-static void ahci_port_irq(ahci_device_t* dev, int nr) {
+// Returns whether any commands completed.
+static bool ahci_port_irq(ahci_device_t* dev, int nr) {
     ahci_port_t* port = &dev->ports[nr];
     // clear interrupt
     uint32_t is = ahci_read(&port->regs->is);
     ahci_write(&port->regs->is, is);
 
-    if (is & AHCI_PORT_INT_DHR) { // RFIS received
-        ahci_port_complete_txn(dev, port, NO_ERROR);
-    }
-    if (is & AHCI_PORT_INT_PS) { // PSFIS rcv
-        ahci_port_complete_txn(dev, port, NO_ERROR);
-    }
-    if (is & AHCI_PORT_INT_SDB) { // SDBFIS
-        ahci_port_complete_txn(dev, port, NO_ERROR);
+    bool completed = false;
+    // RFIS, PSFIS or SDBFIS received: one pass completes every command
+    // finished so far, however many FISes announced them
+    if (is & (AHCI_PORT_INT_DHR | AHCI_PORT_INT_PS | AHCI_PORT_INT_SDB)) {
+        completed = ahci_port_complete_txns(port, NO_ERROR);
     }
     if (is & AHCI_PORT_INT_PRC) { // PhyRdy change
         uint32_t serr = ahci_read(&port->regs->serr);
         ahci_write(&port->regs->serr, serr & ~0x1);
     }
     if (is & AHCI_PORT_INT_TFE) { // taskfile error
-        xprintf("tfe error\n");
-        ahci_port_complete_txn(dev, port, ERR_INTERNAL);
+        xprintf("ahci.%d: taskfile error, tfd %#x\n", port->nr, ahci_read(&port->regs->tfd));
+        completed |= ahci_port_recover(port, ERR_IO);
     }
+    return completed;
 }
 
 static int ahci_irq_thread(void* arg) {
@@ -598,12 +734,17 @@ static int ahci_irq_thread(void* arg) {
         // handle interrupt for each port
         uint32_t is = ahci_read(&dev->regs->is);
         ahci_write(&dev->regs->is, is);
+        bool completed = false;
         for (int i = 0; is && i < AHCI_MAX_PORTS; i++) {
             if (is & 0x1) {
-                ahci_port_irq(dev, i);
+                completed |= ahci_port_irq(dev, i);
             }
             is >>= 1;
         }
+        // hit the worker thread once to refill all the freed command slots
+        if (completed) {
+            completion_signal(&dev->worker_completion);
+        }
 
         // unmask hba interrupts
         ghc = ahci_read(&dev->regs->ghc);
@@ -10,7 +10,10 @@
 
 #define AHCI_MAX_PORTS    32
 #define AHCI_MAX_COMMANDS 32
-#define AHCI_MAX_PRDS     128 // just a random choice, hardware max is 64k-1
+#define AHCI_MAX_PRDS     512 // 2mb of scattered pages, hardware max is 64k-1
+#define AHCI_LOOKUP_PAGES 64 // pages looked up at a time when building a PRDT
+#define AHCI_DSM_RANGES   64 // TRIM ranges in one 512-byte DATA SET MANAGEMENT block
+#define AHCI_DSM_RANGE_MAX 0xffff // blocks in one TRIM range
 
 #define AHCI_PRD_MAX_SIZE 0x400000 // 4mb
 
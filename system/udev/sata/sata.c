@@ -36,6 +36,7 @@
 
 #define SATA_FLAG_DMA   (1 << 0)
 #define SATA_FLAG_LBA48 (1 << 1)
+#define SATA_FLAG_TRIM  (1 << 2)
 
 typedef struct sata_device {
     mx_device_t device;
@@ -130,7 +131,7 @@ static mx_status_t sata_device_identify(sata_device_t* dev, mx_device_t* control
     } else {
         xprintf(" PIO");
     }
-    dev->max_cmd = *(devinfo + SATA_DEVINFO_QUEUE_DEPTH);
+    dev->max_cmd = *(devinfo + SATA_DEVINFO_QUEUE_DEPTH) & 0x1f; // the other bits are reserved
     xprintf(" %d commands\n", dev->max_cmd + 1);
     if (cap & (1 << 9)) {
         dev->sector_sz = 512; // default
@@ -145,7 +146,12 @@ static mx_status_t sata_device_identify(sata_device_t* dev, mx_device_t* control
             dev->capacity = sata_devinfo_u32(devinfo, SATA_DEVINFO_LBA_CAPACITY) * dev->sector_sz;
             xprintf("  LBA");
         }
-        xprintf(" %" PRIu64 " sectors, size=%zu\n", dev->capacity, dev->sector_sz);
+        xprintf(" %" PRIu64 " sectors, size=%zu", dev->capacity, dev->sector_sz);
+        if (*(devinfo + SATA_DEVINFO_DSM) & (1 << 0)) {
+            flags |= SATA_FLAG_TRIM;
+            xprintf(" TRIM");
+        }
+        xprintf("\n");
     } else {
         xprintf("  CHS unsupported!\n");
     }
@@ -158,6 +164,46 @@ static mx_status_t sata_device_identify(sata_device_t* dev, mx_device_t* control
 
 static mx_protocol_device_t sata_device_proto;
 
+// blocks covered by the ranges of one DATA SET MANAGEMENT command
+#define SATA_TRIM_MAX_BLOCKS ((uint64_t)AHCI_DSM_RANGES * AHCI_DSM_RANGE_MAX)
+
+static void sata_iotxn_queue(mx_device_t* dev, iotxn_t* txn);
+
+// A trim too large for one command is carried out by a chain of them, each
+// queued once the one before has completed; |cookie| is the original txn.
+static void sata_trim_part_complete(iotxn_t* part, void* cookie) {
+    iotxn_t* txn = cookie;
+    sata_device_t* device;
+    memcpy(&device, part->extra, sizeof(sata_device_t*));
+
+    uint64_t done = part->offset + part->length - txn->offset;
+    if ((part->status != NO_ERROR) || (done == txn->length)) {
+        mx_status_t status = part->status;
+        part->ops->release(part);
+        txn->ops->complete(txn, status, status == NO_ERROR ? txn->length : 0);
+        return;
+    }
+    part->offset += part->length;
+    part->length = MIN(txn->length - done, SATA_TRIM_MAX_BLOCKS * device->sector_sz);
+    sata_iotxn_queue(&device->device, part);
+}
+
+static void sata_trim_split(sata_device_t* device, iotxn_t* txn) {
+    iotxn_t* part;
+    mx_status_t status = iotxn_alloc(&part, 0, 0, sizeof(sata_device_t*));
+    if (status != NO_ERROR) {
+        txn->ops->complete(txn, status, 0);
+        return;
+    }
+    part->opcode = IOTXN_OP_TRIM;
+    part->offset = txn->offset;
+    part->length = SATA_TRIM_MAX_BLOCKS * device->sector_sz;
+    part->complete_cb = sata_trim_part_complete;
+    part->cookie = txn;
+    memcpy(part->extra, &device, sizeof(sata_device_t*));
+    sata_iotxn_queue(&device->device, part);
+}
+
 static void sata_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
     sata_device_t* device = get_sata_device(dev);
 
@@ -177,10 +223,40 @@ static void sata_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
     txn->length = MIN(txn->length, device->capacity - txn->offset);
 
     sata_pdata_t* pdata = sata_iotxn_pdata(txn);
-    pdata->cmd = txn->opcode == IOTXN_OP_READ ? SATA_CMD_READ_DMA_EXT : SATA_CMD_WRITE_DMA_EXT;
+    switch (txn->opcode) {
+    case IOTXN_OP_READ:
+        pdata->cmd = SATA_CMD_READ_DMA_EXT;
+        break;
+    case IOTXN_OP_WRITE:
+        pdata->cmd = SATA_CMD_WRITE_DMA_EXT;
+        break;
+    case IOTXN_OP_TRIM:
+        if (!(device->flags & SATA_FLAG_TRIM)) {
+            txn->ops->complete(txn, ERR_NOT_SUPPORTED, 0);
+            return;
+        }
+        if (txn->length == 0) {
+            txn->ops->complete(txn, NO_ERROR, 0);
+            return;
+        }
+        if (txn->length / device->sector_sz > SATA_TRIM_MAX_BLOCKS) {
+            sata_trim_split(device, txn);
+            return;
+        }
+        // the blocks are described by a single 512-byte block of ranges
+        pdata->cmd = SATA_CMD_DATA_SET_MANAGEMENT;
+        pdata->count = 1;
+        pdata->trim_count = txn->length / device->sector_sz;
+        break;
+    default:
+        txn->ops->complete(txn, ERR_INVALID_ARGS, 0);
+        return;
+    }
     pdata->device = 0x40;
     pdata->lba = txn->offset / device->sector_sz;
-    pdata->count = txn->length / device->sector_sz;
+    if (pdata->cmd != SATA_CMD_DATA_SET_MANAGEMENT) {
+        pdata->count = txn->length / device->sector_sz;
+    }
     pdata->max_cmd = device->max_cmd;
     pdata->port = device->port;
 
@@ -309,10 +385,32 @@ static void sata_fifo_write(mx_device_t* dev, mx_handle_t vmo, uint64_t length,
     sata_iotxn_queue(dev, txn);
 }
 
+static void sata_fifo_trim(mx_device_t* dev, uint64_t length, uint64_t dev_offset,
+                           void* cookie) {
+    sata_device_t* device = get_sata_device(dev);
+
+    mx_status_t status;
+    iotxn_t* txn;
+    if ((status = iotxn_alloc(&txn, 0, 0, sizeof(sata_device_t*))) != NO_ERROR) {
+        device->callbacks->complete(cookie, status);
+        return;
+    }
+
+    txn->opcode = IOTXN_OP_TRIM;
+    txn->offset = dev_offset;
+    txn->length = length;
+    txn->complete_cb = sata_fifo_complete;
+    txn->cookie = cookie;
+    memcpy(txn->extra, &device, sizeof(sata_device_t*));
+
+    sata_iotxn_queue(dev, txn);
+}
+
 static block_ops_t sata_block_ops = {
     .set_callbacks = sata_fifo_set_callbacks,
     .read = sata_fifo_read,
     .write = sata_fifo_write,
+    .trim = sata_fifo_trim,
 };
 
 mx_status_t sata_bind(mx_device_t* dev, int port) {
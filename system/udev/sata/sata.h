@@ -7,6 +7,7 @@
 #include "ahci.h"
 
 #define SATA_CMD_IDENTIFY_DEVICE      0xec
+#define SATA_CMD_DATA_SET_MANAGEMENT  0x06
 #define SATA_CMD_READ_DMA             0xc8
 #define SATA_CMD_READ_DMA_EXT         0x25
 #define SATA_CMD_READ_FPDMA_QUEUED    0x60
@@ -27,6 +28,7 @@
 #define SATA_DEVINFO_LBA_CAPACITY_2      100
 #define SATA_DEVINFO_SECTOR_SIZE         106
 #define SATA_DEVINFO_LOGICAL_SECTOR_SIZE 117
+#define SATA_DEVINFO_DSM                 169
 
 #define SATA_DEVINFO_SERIAL_LEN   20
 #define SATA_DEVINFO_FW_REV_LEN   8
@@ -36,6 +38,7 @@ typedef struct sata_pdata {
     mx_time_t timeout; // for ahci driver watchdog
     uint64_t lba;   // in blocks
     uint16_t count; // in blocks
+    uint64_t trim_count; // in blocks, for DATA SET MANAGEMENT
     uint8_t cmd;
     uint8_t device;
     int max_cmd;
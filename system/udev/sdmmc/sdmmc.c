@@ -165,6 +165,9 @@ static void sdmmc_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
                 cmd = SDMMC_WRITE_BLOCK;
             }
             break;
+        case IOTXN_OP_TRIM:
+            txn->ops->complete(txn, ERR_NOT_SUPPORTED, 0);
+            return;
         default:
             // Invalid opcode?
             txn->ops->complete(txn, ERR_INVALID_ARGS, 0);
@@ -712,6 +712,8 @@ static void ums_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
         status = ums_read(dev, txn);
     }else if (txn->opcode == IOTXN_OP_WRITE) {
         status = ums_write(dev, txn);
+    } else if (txn->opcode == IOTXN_OP_TRIM) {
+        status = ERR_NOT_SUPPORTED;
     } else {
         status = ERR_INVALID_ARGS;
     }
@@ -8,6 +8,7 @@
 #include <hexdump/hexdump.h>
 #include <inttypes.h>
 #include <magenta/compiler.h>
+#include <magenta/new.h>
 #include <mxtl/auto_lock.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -29,14 +30,19 @@
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_DISCARD  (1<<13)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
+
+#define VIRTIO_F_INDIRECT_DESC  (1u<<VIRTIO_RING_F_INDIRECT_DESC)
+#define VIRTIO_F_EVENT_IDX      (1u<<VIRTIO_RING_F_EVENT_IDX)
 // clang-format on
 
 namespace virtio {
@@ -52,12 +58,20 @@ void BlockDevice::virtio_block_iotxn_queue(mx_device_t* dev, iotxn_t* txn) {
     switch (txn->opcode) {
     case IOTXN_OP_READ: {
         LTRACEF("READ offset %#" PRIx64 " length %#" PRIx64 "\n", txn->offset, txn->length);
-        bd->QueueReadWriteTxn(txn);
+        bd->QueueTxn(txn);
         break;
     }
     case IOTXN_OP_WRITE:
         LTRACEF("WRITE offset %#" PRIx64 " length %#" PRIx64 "\n", txn->offset, txn->length);
-        bd->QueueReadWriteTxn(txn);
+        bd->QueueTxn(txn);
+        break;
+    case IOTXN_OP_TRIM:
+        LTRACEF("TRIM offset %#" PRIx64 " length %#" PRIx64 "\n", txn->offset, txn->length);
+        if (!bd->discard_) {
+            txn->ops->complete(txn, ERR_NOT_SUPPORTED, 0);
+            break;
+        }
+        bd->QueueTxn(txn);
         break;
     default:
         txn->ops->complete(txn, -1, 0);
@@ -132,32 +146,86 @@ mx_status_t BlockDevice::Init() {
     // ack and set the driver status bit
     StatusAcknowledgeDriver();
 
-    // XXX check features bits and ack/nak them
+    // ack the features we use
+    uint32_t features = ReadDeviceFeatures();
+    LTRACEF("device features %#x\n", features);
+    features &= VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE |
+                VIRTIO_BLK_F_DISCARD | VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX;
+    WriteDriverFeatures(features);
+
+    indirect_ = (features & VIRTIO_F_INDIRECT_DESC) != 0;
+    discard_ = (features & VIRTIO_BLK_F_DISCARD) != 0;
+    vring_.SetEventIndex((features & VIRTIO_F_EVENT_IDX) != 0);
+
+    // a buffer is split into segments of at most size_max bytes, and a
+    // request takes no more than seg_max of them
+    seg_size_ = UINT32_MAX;
+    if ((features & VIRTIO_BLK_F_SIZE_MAX) && config_.size_max > 0)
+        seg_size_ = config_.size_max;
+
+    // legacy devices only take the ring size they ask for
+    ring_size_ = GetRingSize(0);
+    LTRACEF("ring size %u\n", ring_size_);
+    if (ring_size_ < 3) {
+        VIRTIO_ERROR("ring size %u is too small\n", ring_size_);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    max_segs_ = indirect_ ? kMaxIndirect - 2 : ring_size_ - 2u;
+    if ((features & VIRTIO_BLK_F_SEG_MAX) && config_.seg_max > 0)
+        max_segs_ = MIN(max_segs_, config_.seg_max);
 
     // allocate the main vring
-    auto err = vring_.Init(0, 128); // 128 matches legacy pci
+    auto err = vring_.Init(0, ring_size_);
     if (err < 0) {
         VIRTIO_ERROR("failed to allocate vring\n");
         return err;
     }
 
-    // allocate a queue of block requests
-    size_t size = sizeof(virtio_blk_req) * blk_req_count + sizeof(uint8_t) * blk_req_count;
+    // allocate the indirect tables, block requests, discard ranges and
+    // responses for each descriptor in the ring
+    size_t indirect_size = indirect_ ? sizeof(vring_desc) * kMaxIndirect * ring_size_ : 0;
+    size_t size = indirect_size + (sizeof(virtio_blk_req) + sizeof(virtio_blk_discard) +
+                                   sizeof(uint8_t)) * ring_size_;
 
-    mx_status_t r = map_contiguous_memory(size, (uintptr_t*)&blk_req_, &blk_req_pa_);
+    uintptr_t va;
+    mx_paddr_t pa;
+    mx_status_t r = map_contiguous_memory(size, &va, &pa);
     if (r < 0) {
         VIRTIO_ERROR("cannot alloc blk_req buffers %d\n", r);
         return r;
     }
 
+    blk_indirect_pa_ = pa;
+    blk_indirect_ = (vring_desc*)va;
+
+    blk_req_pa_ = pa + indirect_size;
+    blk_req_ = (virtio_blk_req*)(va + indirect_size);
+
     LTRACEF("allocated blk request at %p, physical address %#" PRIxPTR "\n", blk_req_, blk_req_pa_);
 
-    // responses are 32 words at the end of the allocated block
-    blk_res_pa_ = blk_req_pa_ + sizeof(virtio_blk_req) * blk_req_count;
-    blk_res_ = (uint8_t*)((uintptr_t)blk_req_ + sizeof(virtio_blk_req) * blk_req_count);
+    blk_discard_pa_ = blk_req_pa_ + sizeof(virtio_blk_req) * ring_size_;
+    blk_discard_ = (virtio_blk_discard*)((uintptr_t)blk_req_ + sizeof(virtio_blk_req) * ring_size_);
+
+    // responses are a byte each at the end of the allocated block
+    blk_res_pa_ = blk_discard_pa_ + sizeof(virtio_blk_discard) * ring_size_;
+    blk_res_ = (uint8_t*)((uintptr_t)blk_discard_ + sizeof(virtio_blk_discard) * ring_size_);
 
     LTRACEF("allocated blk responses at %p, physical address %#" PRIxPTR "\n", blk_res_, blk_res_pa_);
 
+    AllocChecker ac;
+    blk_txn_.reset(new (&ac) iotxn_t*[ring_size_]());
+    if (!ac.check()) {
+        VIRTIO_ERROR("cannot alloc iotxn table\n");
+        return ERR_NO_MEMORY;
+    }
+
+    segs_.reset(new (&ac) blk_seg[max_segs_]);
+    if (!ac.check()) {
+        VIRTIO_ERROR("cannot alloc segment table\n");
+        return ERR_NO_MEMORY;
+    }
+
     // start the interrupt thread
     StartIrqThread();
 
@@ -186,58 +254,97 @@ void BlockDevice::IrqRingUpdate() {
 
     // parse our descriptor chain, add back to the free queue
     auto free_chain = [this](vring_used_elem* used_elem) {
-        uint32_t i = (uint16_t)used_elem->id;
-        struct vring_desc* desc = vring_.DescFromIndex((uint16_t)i);
-        auto head_desc = desc; // save the first element
-        for (;;) {
-            int next;
+        uint16_t i = (uint16_t)used_elem->id;
 
 #if LOCAL_TRACE > 0
-            virtio_dump_desc(desc);
+        virtio_dump_desc(vring_.DescFromIndex(i));
 #endif
 
-            if (desc->flags & VRING_DESC_F_NEXT) {
-                next = desc->next;
-            } else {
-                /* end of chain */
-                next = -1;
-            }
+        vring_.FreeDescChain(i);
 
-            vring_.FreeDesc((uint16_t)i);
-
-            if (next < 0)
-                break;
-            i = next;
-            desc = vring_.DescFromIndex((uint16_t)i);
+        // the head of the chain tells us which txn this completes
+        iotxn_t* txn = blk_txn_[i];
+        blk_txn_[i] = nullptr;
+        if (!txn) {
+            TRACEF("no txn for descriptor %u\n", i);
+            return;
         }
 
-        // search our pending txn list to see if this completes it
-        iotxn_t* txn;
-        list_for_every_entry (&iotxn_list, txn, iotxn_t, node) {
-            if (txn->context == head_desc) {
-                LTRACEF("completes txn %p\n", txn);
-                list_delete(&txn->node);
-                txn->ops->complete(txn, NO_ERROR, txn->length);
-                break;
-            }
+        LTRACEF("completes txn %p, status %u\n", txn, blk_res_[i]);
+        mx_status_t status;
+        switch (blk_res_[i]) {
+        case VIRTIO_BLK_S_OK:
+            status = NO_ERROR;
+            break;
+        case VIRTIO_BLK_S_UNSUPP:
+            status = ERR_NOT_SUPPORTED;
+            break;
+        default:
+            status = ERR_IO;
+            break;
         }
+        block_trace(BLOCK_TRACE_COMPLETE, txn, status);
+        txn->ops->complete(txn, status, (status == NO_ERROR) ? txn->length : 0);
     };
 
     // tell the ring to find free chains and hand it back to our lambda
     vring_.IrqRingUpdate(free_chain);
+
+    // and fill the room they leave
+    IssueTxnsLocked();
 }
 
 void BlockDevice::IrqConfigChange() {
     LTRACE_ENTRY;
 }
 
-void BlockDevice::QueueReadWriteTxn(iotxn_t* txn) {
+size_t BlockDevice::SegCount(mx_off_t length) const {
+    return (length + seg_size_ - 1) / seg_size_;
+}
+
+mx_status_t BlockDevice::BuildSegs(iotxn_t* txn, size_t* count) {
+    mx_paddr_t pages[kLookupPages];
+    mx_paddr_t next = 0;
+    size_t n = 0;
+
+    for (mx_off_t offset = 0; offset < txn->length;) {
+        size_t chunk = (size_t)MIN(txn->length - offset, (countof(pages) - 1) * PAGE_SIZE);
+        mx_status_t status = txn->ops->physmap_pages(txn, (size_t)offset, chunk,
+                                                     pages, countof(pages));
+        if (status != NO_ERROR)
+            return status;
+
+        for (size_t p = 0; chunk > 0; p++) {
+            mx_paddr_t addr = pages[p];
+            size_t len = MIN(chunk, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+
+            // grow the last segment if this page follows on from it, or
+            // start a new one
+            if (n > 0 && addr == next && segs_[n - 1].len + len <= seg_size_) {
+                segs_[n - 1].len += (uint32_t)len;
+            } else {
+                if (n == max_segs_)
+                    return ERR_BUFFER_TOO_SMALL;
+                segs_[n].addr = addr;
+                segs_[n].len = (uint32_t)len;
+                n++;
+            }
+
+            next = addr + len;
+            offset += len;
+            chunk -= len;
+        }
+    }
+
+    *count = n;
+    return NO_ERROR;
+}
+
+void BlockDevice::QueueTxn(iotxn_t* txn) {
     LTRACEF("txn %p\n", txn);
 
     mxtl::AutoLock lock(&lock_);
 
-    bool write = (txn->opcode == IOTXN_OP_WRITE);
-
     // offset must be aligned to block size
     if (txn->offset % config_.blk_size) {
         TRACEF("offset %#" PRIx64 " is not aligned to sector size %u!\n", txn->offset, config_.blk_size);
@@ -246,70 +353,133 @@ void BlockDevice::QueueReadWriteTxn(iotxn_t* txn) {
     }
 
     // constrain to device capacity
-    txn->length = MIN(txn->length, GetSize() - txn->offset);
-
-    // allocate and start filling out a block request
-    auto index = alloc_blk_req();
-    LTRACEF("request index %u\n", index);
-    auto req = &blk_req_[index];
-    req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    req->ioprio = 0;
-    req->sector = txn->offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %" PRIu64 "\n",
-            req->type, req->ioprio, req->sector);
-
-    /* put together a transfer */
-    uint16_t i;
-    auto desc = vring_.AllocDescChain(3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
-
-    /* point the iotxn at this head descriptor */
-    txn->context = desc;
-
-    /* set up the descriptor pointing to the head */
-    desc->addr = blk_req_pa_ + index * sizeof(virtio_blk_req);
-    desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
-
-#if LOCAL_TRACE > 0
-    virtio_dump_desc(desc);
-#endif
-
-    /* set up the descriptor pointing to the buffer */
-    desc = vring_.DescFromIndex(desc->next);
+    txn->length = (txn->offset < GetSize()) ? MIN(txn->length, GetSize() - txn->offset) : 0;
+    if (txn->length == 0) {
+        txn->ops->complete(txn, NO_ERROR, 0);
+        return;
+    }
 
-    mx_paddr_t pa;
-    txn->ops->physmap(txn, &pa);
+    if (txn->opcode == IOTXN_OP_TRIM) {
+        // a discard carries a single range, of a whole number of sectors
+        if (txn->length / 512 > UINT32_MAX) {
+            TRACEF("length %#" PRIx64 " is too long to discard!\n", txn->length);
+            txn->ops->complete(txn, ERR_INVALID_ARGS, 0);
+            return;
+        }
+    } else if (SegCount(txn->length) > max_segs_) {
+        TRACEF("length %#" PRIx64 " takes more than %zu segments!\n", txn->length, max_segs_);
+        txn->ops->complete(txn, ERR_INVALID_ARGS, 0);
+        return;
+    }
 
-    desc->addr = (uint64_t)pa;
-    desc->len = (uint32_t)txn->length;
+    // save the iotxn in a list until there is room for it in the ring
+    list_add_tail(&iotxn_list, &txn->node);
+    IssueTxnsLocked();
+}
 
-    if (!write)
-        desc->flags |= VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
+void BlockDevice::IssueTxnsLocked() {
+    bool submitted = false;
+
+    iotxn_t* txn;
+    while ((txn = list_peek_head_type(&iotxn_list, iotxn_t, node)) != nullptr) {
+        bool write = (txn->opcode == IOTXN_OP_WRITE);
+        bool discard = (txn->opcode == IOTXN_OP_TRIM);
+
+        // the request, the segments of the buffer (or the range to discard),
+        // and the response
+        size_t nsegs = 1;
+        if (!discard) {
+            mx_status_t status = BuildSegs(txn, &nsegs);
+            if (status != NO_ERROR) {
+                TRACEF("cannot map txn %p length %#" PRIx64 ": %d\n", txn, txn->length, status);
+                list_delete(&txn->node);
+                txn->ops->complete(txn, status, 0);
+                continue;
+            }
+        }
+        size_t count = nsegs + 2;
+
+        /* put together a transfer, in an indirect table if the device takes them */
+        uint16_t i;
+        auto desc = vring_.AllocDescChain(indirect_ ? 1 : (uint16_t)count, &i);
+        if (!desc) {
+            LTRACEF("ring full\n");
+            break;
+        }
+        LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+
+        list_delete(&txn->node);
+        blk_txn_[i] = txn;
+
+        auto req = &blk_req_[i];
+        req->type = discard ? VIRTIO_BLK_T_DISCARD : write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        req->ioprio = 0;
+        req->sector = txn->offset / 512;
+        LTRACEF("blk_req type %u ioprio %u sector %" PRIu64 "\n",
+                req->type, req->ioprio, req->sector);
+
+        if (indirect_) {
+            desc->addr = blk_indirect_pa_ + i * kMaxIndirect * sizeof(vring_desc);
+            desc->len = (uint32_t)(count * sizeof(vring_desc));
+            desc->flags = VRING_DESC_F_INDIRECT;
+            desc = &blk_indirect_[i * kMaxIndirect];
+        }
 
-#if LOCAL_TRACE > 0
-    virtio_dump_desc(desc);
-#endif
+        if (discard) {
+            auto range = &blk_discard_[i];
+            range->sector = req->sector;
+            range->num_sectors = (uint32_t)(txn->length / 512);
+            range->flags = 0;
+        }
 
-    /* set up the descriptor pointing to the response */
-    desc = vring_.DescFromIndex(desc->next);
-    desc->addr = blk_res_pa_ + index;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
+        for (size_t n = 0; n < count; n++) {
+            if (n == 0) {
+                /* set up the descriptor pointing to the request */
+                desc->addr = blk_req_pa_ + i * sizeof(virtio_blk_req);
+                desc->len = sizeof(virtio_blk_req);
+                desc->flags = 0;
+            } else if (n == count - 1) {
+                /* set up the descriptor pointing to the response */
+                desc->addr = blk_res_pa_ + i;
+                desc->len = 1;
+                desc->flags = VRING_DESC_F_WRITE;
+            } else if (discard) {
+                /* set up the descriptor pointing to the range to discard */
+                desc->addr = blk_discard_pa_ + i * sizeof(virtio_blk_discard);
+                desc->len = sizeof(virtio_blk_discard);
+                desc->flags = 0;
+            } else {
+                /* set up a descriptor pointing to a segment of the buffer,
+                 * marked write-only if it is a block read */
+                desc->addr = segs_[n - 1].addr;
+                desc->len = segs_[n - 1].len;
+                desc->flags = write ? 0 : VRING_DESC_F_WRITE;
+            }
 
 #if LOCAL_TRACE > 0
-    virtio_dump_desc(desc);
+            virtio_dump_desc(desc);
 #endif
 
-    // save the iotxn in a list
-    list_add_tail(&iotxn_list, &txn->node);
+            if (n == count - 1)
+                break;
+            desc->flags |= VRING_DESC_F_NEXT;
+            if (indirect_) {
+                desc->next = (uint16_t)(n + 1);
+                desc = &blk_indirect_[i * kMaxIndirect + n + 1];
+            } else {
+                desc = vring_.DescFromIndex(desc->next);
+            }
+        }
 
-    /* submit the transfer */
-    vring_.SubmitChain(i);
+        /* submit the transfer */
+        block_trace(BLOCK_TRACE_SUBMIT, txn, txn->opcode);
+        vring_.SubmitChain(i);
+        submitted = true;
+    }
 
-    /* kick it off */
-    vring_.Kick();
+    /* kick them all off at once */
+    if (submitted)
+        vring_.Kick();
 }
 
 } // namespace virtio
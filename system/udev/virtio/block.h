@@ -7,6 +7,7 @@
 #include "ring.h"
 
 #include <magenta/compiler.h>
+#include <mxtl/unique_ptr.h>
 #include <stdlib.h>
 
 namespace virtio {
@@ -34,7 +35,17 @@ private:
     static ssize_t virtio_block_ioctl(mx_device_t* dev, uint32_t op, const void* in_buf, size_t in_len,
                                       void* out_buf, size_t out_len);
 
-    void QueueReadWriteTxn(iotxn_t* txn);
+    void QueueTxn(iotxn_t* txn);
+
+    // how many segments a transfer of |length| bytes is split into, at least
+    size_t SegCount(mx_off_t length) const;
+
+    // fill in segs_ with the physically contiguous runs of |txn|'s buffer,
+    // each at most seg_size_ bytes, and return how many there are in |count|
+    mx_status_t BuildSegs(iotxn_t* txn, size_t* count);
+
+    // start as many of the waiting iotxns as there is room for in the ring
+    void IssueTxnsLocked();
 
     // the main virtio ring
     Ring vring_ = {this};
@@ -58,28 +69,52 @@ private:
         uint64_t sector;
     } __PACKED;
 
-    // a queue of block request/responses
-    static const size_t blk_req_count = 32;
+    // the payload of a VIRTIO_BLK_T_DISCARD request
+    struct virtio_blk_discard {
+        uint64_t sector;
+        uint32_t num_sectors;
+        uint32_t flags;
+    } __PACKED;
 
+    // the most descriptors in the indirect table of one request: the request
+    // header, the data segments and the status byte
+    static const size_t kMaxIndirect = 16;
+
+    // pages of an iotxn's buffer looked up at a time when building segments
+    static const size_t kLookupPages = 64;
+
+    uint16_t ring_size_ = 0;
+    bool indirect_ = false;
+    bool discard_ = false;
+    size_t max_segs_ = 0;
+    uint32_t seg_size_ = 0;
+
+    // block requests, discard ranges, response bytes and indirect descriptor
+    // tables, one of each per ring descriptor, used by the request whose chain
+    // starts there
     mx_paddr_t blk_req_pa_ = 0;
     virtio_blk_req* blk_req_ = nullptr;
 
+    mx_paddr_t blk_discard_pa_ = 0;
+    virtio_blk_discard* blk_discard_ = nullptr;
+
     mx_paddr_t blk_res_pa_ = 0;
     uint8_t* blk_res_ = nullptr;
 
-    uint32_t blk_req_bitmap_ = 0;
+    mx_paddr_t blk_indirect_pa_ = 0;
+    vring_desc* blk_indirect_ = nullptr;
 
-    unsigned int alloc_blk_req() {
-        unsigned int i = 31 - __builtin_clz(blk_req_bitmap_);
-        blk_req_bitmap_ |= (1 << i);
-        return i;
-    }
+    // the data segments of the request being put together
+    struct blk_seg {
+        mx_paddr_t addr;
+        uint32_t len;
+    };
+    mxtl::unique_ptr<blk_seg[]> segs_;
 
-    void free_blk_req(unsigned int i) {
-        blk_req_bitmap_ &= ~(1 << i);
-    }
+    // iotxns in flight, by the head descriptor of their chain
+    mxtl::unique_ptr<iotxn_t*[]> blk_txn_;
 
-    // pending iotxns
+    // iotxns waiting for room in the ring
     list_node iotxn_list = LIST_INITIAL_VALUE(iotxn_list);
 };
 
@@ -35,6 +35,7 @@ public:
     virtual void IrqConfigChange() {}
 
     // used by Ring class to manipulate config registers
+    uint16_t GetRingSize(uint16_t index);
     void SetRing(uint16_t index, uint16_t count, mx_paddr_t pa_desc, mx_paddr_t pa_avail, mx_paddr_t pa_used);
     void RingKick(uint16_t ring_index);
 
@@ -44,6 +45,10 @@ protected:
     void WriteConfigBar(uint16_t offset, uint8_t val);
     mx_status_t CopyDeviceConfig(void* _buf, size_t len);
 
+    // feature bits 0-31, which hold all the ones we know of
+    uint32_t ReadDeviceFeatures();
+    void WriteDriverFeatures(uint32_t features);
+
     void Reset();
     void StatusAcknowledgeDriver();
     void StatusDriverOK();
@@ -149,13 +149,27 @@ void Ring::SubmitChain(uint16_t desc_index) {
     struct vring_avail* avail = ring_.avail;
 
     avail->ring[avail->idx & ring_.num_mask] = desc_index;
-    //mb();
-    avail->idx++;
+    __atomic_store_n(&avail->idx, (uint16_t)(avail->idx + 1), __ATOMIC_RELEASE);
 }
 
 void Ring::Kick() {
     LTRACE_ENTRY;
 
+    // the device must see the new avail->idx before we look at whether it
+    // wants to be told about it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    uint16_t new_idx = ring_.avail->idx;
+    uint16_t old_idx = kicked_idx_;
+    kicked_idx_ = new_idx;
+
+    if (event_index_) {
+        if (!vring_need_event(vring_avail_event(&ring_), new_idx, old_idx))
+            return;
+    } else if (ring_.used->flags & VRING_USED_F_NO_NOTIFY) {
+        return;
+    }
+
     device_->RingKick(index_);
 }
 
@@ -20,6 +20,10 @@ public:
 
     mx_status_t Init(uint16_t index, uint16_t count);
 
+    // Use the used and avail event indices (VIRTIO_RING_F_EVENT_IDX) rather
+    // than the ring flags to hold off interrupts and kicks
+    void SetEventIndex(bool enable) { event_index_ = enable; }
+
     void FreeDesc(uint16_t desc_index);
     void FreeDescChain(uint16_t chain_head);
     uint16_t AllocDesc();
@@ -43,6 +47,10 @@ private:
 
     uint16_t index_ = 0;
 
+    bool event_index_ = false;
+    // avail->idx as of the last Kick()
+    uint16_t kicked_idx_ = 0;
+
     vring ring_ = {};
 };
 
@@ -52,18 +60,28 @@ inline void Ring::IrqRingUpdate(T free_chain) {
     //TRACEF("used flags 0x%hhx idx 0x%hhx last_used %u\n",
     //        ring_.used->flags, ring_.used->idx, ring_.last_used);
 
-    // find a new free chain of descriptors
-    unsigned int cur_idx = ring_.used->idx;
-    for (unsigned int i = ring_.last_used; i != (cur_idx & ring_.num_mask); i = (i + 1) & ring_.num_mask) {
-        //TRACEF("looking at idx %u\n", i);
+    for (;;) {
+        // find a new free chain of descriptors
+        uint16_t cur_idx = __atomic_load_n(&ring_.used->idx, __ATOMIC_ACQUIRE);
+        for (; ring_.last_used != cur_idx; ring_.last_used++) {
+            //TRACEF("looking at idx %u\n", ring_.last_used);
+
+            struct vring_used_elem* used_elem = &ring_.used->ring[ring_.last_used & ring_.num_mask];
+            //TRACEF("used chain id %u, len %u\n", used_elem->id, used_elem->len);
 
-        struct vring_used_elem* used_elem = &ring_.used->ring[i];
-        //TRACEF("used chain id %u, len %u\n", used_elem->id, used_elem->len);
+            // free the chain
+            free_chain(used_elem);
+        }
 
-        // free the chain
-        free_chain(used_elem);
+        if (!event_index_)
+            break;
 
-        ring_.last_used = ((ring_.last_used + 1) & ring_.num_mask) & 0xffff;
+        // ask for an interrupt when the next chain is used, then look again in
+        // case the device used it before it saw the request
+        vring_used_event(&ring_) = ring_.last_used;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring_.used->idx, __ATOMIC_ACQUIRE) == ring_.last_used)
+            break;
     }
 }
 
@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +19,7 @@
 #include <magenta/cpp.h>
 #include <magenta/device/block.h>
 #include <magenta/syscalls.h>
+#include <mxtl/algorithm.h>
 #include <mxtl/array.h>
 #include <mxtl/unique_ptr.h>
 #include <unittest/unittest.h>
@@ -825,6 +827,206 @@ bool blkdev_test_fifo_bad_client_bad_vmo(void) {
     END_TEST;
 }
 
+typedef struct {
+    fifo_client_t* client;
+    txnid_t txnid;
+    vmoid_t vmoid;
+    uint64_t blk_size;
+    uint64_t blk_count;
+    uint32_t seed;
+} iops_thread_arg_t;
+
+const size_t kIopsPerThread = 10000;
+
+// Reads single blocks from all over the device, one at a time.
+int iops_thread(void* arg) {
+    iops_thread_arg_t* a = static_cast<iops_thread_arg_t*>(arg);
+    uint32_t seed = a->seed;
+    for (size_t i = 0; i < kIopsPerThread; i++) {
+        seed = seed * 1103515245 + 12345;
+        block_fifo_request_t request;
+        request.txnid      = a->txnid;
+        request.vmoid      = a->vmoid;
+        request.opcode     = BLOCKIO_READ;
+        request.length     = a->blk_size;
+        request.vmo_offset = 0;
+        request.dev_offset = (seed % a->blk_count) * a->blk_size;
+        if (block_fifo_txn(a->client, &request, 1) != NO_ERROR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reports how read IOPS scale with the number of FIFOs the device serves.
+bool blkdev_test_fifo_queue_scaling(void) {
+    BEGIN_TEST;
+    uint64_t blk_size, blk_count;
+    int fd = get_testdev(&blk_size, &blk_count);
+
+    mx_handle_t fifos[MAX_FIFO_COUNT];
+    ssize_t expected = sizeof(mx_handle_t);
+    ASSERT_EQ(ioctl_block_get_fifos(fd, &fifos[0]), expected, "Failed to get FIFO");
+    uint32_t queues = 1;
+    block_fifo_info_t info;
+    expected = sizeof(info);
+    while ((queues < MAX_FIFO_COUNT) && (ioctl_block_add_fifo(fd, &info) == expected)) {
+        ASSERT_EQ(info.index, queues, "FIFOs should be numbered in order");
+        fifos[queues++] = info.fifo;
+    }
+
+    test_vmo_object_t obj;
+    ASSERT_TRUE(create_vmo_helper(fd, &obj, blk_size), "");
+
+    fifo_client_t* clients[MAX_FIFO_COUNT];
+    iops_thread_arg_t args[MAX_FIFO_COUNT];
+    for (uint32_t i = 0; i < queues; i++) {
+        ASSERT_EQ(block_fifo_create_client(fifos[i], &clients[i]), NO_ERROR, "");
+        args[i].client = clients[i];
+        expected = sizeof(txnid_t);
+        ASSERT_EQ(ioctl_block_alloc_fifo_txn(fd, &i, &args[i].txnid), expected,
+                  "Failed to allocate txn");
+        args[i].vmoid = obj.vmoid;
+        args[i].blk_size = blk_size;
+        args[i].blk_count = blk_count;
+        args[i].seed = i;
+    }
+
+    // Double the number of FIFOs in use each round, finishing with all of them
+    for (uint32_t n = 1;; n = mxtl::min(n * 2, queues)) {
+        thrd_t threads[MAX_FIFO_COUNT];
+        mx_time_t start = mx_time_get(MX_CLOCK_MONOTONIC);
+        for (uint32_t i = 0; i < n; i++) {
+            ASSERT_EQ(thrd_create(&threads[i], iops_thread, &args[i]), thrd_success, "");
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            int res;
+            ASSERT_EQ(thrd_join(threads[i], &res), thrd_success, "");
+            ASSERT_EQ(res, 0, "");
+        }
+        mx_time_t elapsed = mx_time_get(MX_CLOCK_MONOTONIC) - start;
+        uint64_t ops = static_cast<uint64_t>(kIopsPerThread) * n;
+        printf("\n\t%u FIFO(s): %" PRIu64 " IOPS", n,
+               (ops * MX_SEC(1)) / (elapsed ? elapsed : 1));
+        if (n == queues) {
+            break;
+        }
+    }
+    printf("\n");
+
+    ASSERT_TRUE(close_vmo_helper(clients[0], &obj, args[0].txnid), "");
+    for (uint32_t i = 0; i < queues; i++) {
+        block_fifo_release_client(clients[i]);
+    }
+    ASSERT_EQ(ioctl_block_fifo_close(fd), NO_ERROR, "Failed to close fifo");
+    close(fd);
+    END_TEST;
+}
+
+const size_t kThroughputBytes = 16 * 1024 * 1024;
+
+// Moves |total| bytes |xfer| at a time between the start of the device and
+// |vmoid|, one request at a time, and returns how long it took.
+bool fifo_throughput_helper(fifo_client_t* client, txnid_t txnid, vmoid_t vmoid, uint16_t opcode,
+                            size_t xfer, size_t total, mx_time_t* elapsed) {
+    mx_time_t start = mx_time_get(MX_CLOCK_MONOTONIC);
+    for (size_t off = 0; off < total; off += xfer) {
+        block_fifo_request_t request;
+        request.txnid      = txnid;
+        request.vmoid      = vmoid;
+        request.opcode     = opcode;
+        request.length     = xfer;
+        request.vmo_offset = 0;
+        request.dev_offset = off;
+        ASSERT_EQ(block_fifo_txn(client, &request, 1), NO_ERROR, "");
+    }
+    *elapsed = mx_time_get(MX_CLOCK_MONOTONIC) - start;
+    return true;
+}
+
+// The same, through read() and write() on the device.
+bool rw_throughput_helper(int fd, uint8_t* buf, bool write_op, size_t xfer, size_t total,
+                          mx_time_t* elapsed) {
+    ASSERT_EQ(lseek(fd, 0, SEEK_SET), 0, "");
+    mx_time_t start = mx_time_get(MX_CLOCK_MONOTONIC);
+    for (size_t off = 0; off < total; off += xfer) {
+        ssize_t rc = write_op ? write(fd, buf, xfer) : read(fd, buf, xfer);
+        ASSERT_EQ(rc, static_cast<ssize_t>(xfer), "");
+    }
+    *elapsed = mx_time_get(MX_CLOCK_MONOTONIC) - start;
+    return true;
+}
+
+uint64_t mb_per_sec(size_t bytes, mx_time_t elapsed) {
+    return (static_cast<uint64_t>(bytes) * MX_SEC(1)) / (elapsed ? elapsed : 1) / (1024 * 1024);
+}
+
+// Reports sequential read and write throughput at a range of transfer sizes,
+// both over the FIFO and through read()/write().
+bool blkdev_test_throughput(void) {
+    BEGIN_TEST;
+    uint64_t blk_size, blk_count;
+    int fd = get_testdev(&blk_size, &blk_count);
+    const size_t dev_size = blk_size * blk_count;
+
+    const size_t kMaxXfer = 1024 * 1024;
+    mx_handle_t vmo;
+    ASSERT_EQ(mx_vmo_create(kMaxXfer, 0, &vmo), NO_ERROR, "Failed to create vmo");
+    mx_handle_t xfer_vmo;
+    ASSERT_EQ(mx_handle_duplicate(vmo, MX_RIGHT_SAME_RIGHTS, &xfer_vmo), NO_ERROR,
+              "Failed to duplicate vmo");
+    vmoid_t vmoid;
+    ssize_t expected = sizeof(vmoid_t);
+    ASSERT_EQ(ioctl_block_attach_vmo(fd, &xfer_vmo, &vmoid), expected, "Failed to attach vmo");
+    AllocChecker ac;
+    mxtl::unique_ptr<uint8_t[]> buf(new (&ac) uint8_t[kMaxXfer]);
+    ASSERT_TRUE(ac.check(), "");
+    fill_random(buf.get(), kMaxXfer);
+    size_t actual;
+    ASSERT_EQ(mx_vmo_write(vmo, buf.get(), 0, kMaxXfer, &actual), NO_ERROR, "");
+
+    mx_handle_t fifo;
+    expected = sizeof(fifo);
+    ASSERT_EQ(ioctl_block_get_fifos(fd, &fifo), expected, "Failed to get FIFO");
+    txnid_t txnid;
+    expected = sizeof(txnid);
+    ASSERT_EQ(ioctl_block_alloc_txn(fd, &txnid), expected, "Failed to allocate txn");
+    fifo_client_t* client;
+    ASSERT_EQ(block_fifo_create_client(fifo, &client), NO_ERROR, "");
+
+    printf("\n\t%8s %12s %12s %12s %12s (MB/s)", "size", "fifo write", "fifo read", "write()",
+           "read()");
+    for (size_t xfer = mxtl::max(static_cast<size_t>(blk_size), static_cast<size_t>(4096));
+         xfer <= kMaxXfer; xfer *= 4) {
+        size_t total = mxtl::min(kThroughputBytes, dev_size - dev_size % xfer);
+        if (xfer % blk_size || total == 0) {
+            continue;
+        }
+        mx_time_t fifo_w, fifo_r, rw_w, rw_r;
+        ASSERT_TRUE(fifo_throughput_helper(client, txnid, vmoid, BLOCKIO_WRITE, xfer, total,
+                                           &fifo_w), "");
+        ASSERT_TRUE(fifo_throughput_helper(client, txnid, vmoid, BLOCKIO_READ, xfer, total,
+                                           &fifo_r), "");
+        ASSERT_TRUE(rw_throughput_helper(fd, buf.get(), true, xfer, total, &rw_w), "");
+        ASSERT_TRUE(rw_throughput_helper(fd, buf.get(), false, xfer, total, &rw_r), "");
+        printf("\n\t%8zu %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64, xfer,
+               mb_per_sec(total, fifo_w), mb_per_sec(total, fifo_r),
+               mb_per_sec(total, rw_w), mb_per_sec(total, rw_r));
+    }
+    printf("\n");
+
+    block_fifo_request_t request;
+    request.txnid = txnid;
+    request.vmoid = vmoid;
+    request.opcode = BLOCKIO_CLOSE_VMO;
+    ASSERT_EQ(block_fifo_txn(client, &request, 1), NO_ERROR, "");
+    ASSERT_EQ(mx_handle_close(vmo), NO_ERROR, "");
+    block_fifo_release_client(client);
+    ASSERT_EQ(ioctl_block_fifo_close(fd), NO_ERROR, "Failed to close fifo");
+    close(fd);
+    END_TEST;
+}
+
 BEGIN_TEST_CASE(blkdev_tests)
 RUN_TEST(blkdev_test_simple)
 RUN_TEST(blkdev_test_bad_requests)
@@ -843,6 +1045,8 @@ RUN_TEST(blkdev_test_fifo_bad_client_vmoid)
 RUN_TEST(blkdev_test_fifo_bad_client_txnid)
 RUN_TEST(blkdev_test_fifo_bad_client_unaligned_request)
 RUN_TEST(blkdev_test_fifo_bad_client_bad_vmo)
+RUN_TEST_LARGE(blkdev_test_fifo_queue_scaling)
+RUN_TEST_LARGE(blkdev_test_throughput)
 END_TEST_CASE(blkdev_tests)
 
 } // namespace tests
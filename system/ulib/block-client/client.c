@@ -66,11 +66,19 @@ typedef struct block_completion {
     mx_status_t status;
 } block_completion_t;
 
+// A client talks to a single FIFO, whose txnids are MAX_TXN_COUNT apart
+// from those of the device's other FIFOs, so only their slot within the
+// FIFO indexes |txns|.
 typedef struct fifo_client {
     mx_handle_t fifo;
     block_completion_t txns[MAX_TXN_COUNT];
 } fifo_client_t;
 
+static block_completion_t* txn_completion(fifo_client_t* client, txnid_t txnid) {
+    assert(txnid < MAX_FIFO_COUNT * MAX_TXN_COUNT);
+    return &client->txns[txnid % MAX_TXN_COUNT];
+}
+
 mx_status_t block_fifo_create_client(mx_handle_t fifo, fifo_client_t** out) {
     fifo_client_t* client = calloc(sizeof(fifo_client_t), 1);
     if (client == NULL) {
@@ -98,9 +106,9 @@ mx_status_t block_fifo_txn(fifo_client_t* client, block_fifo_request_t* requests
     }
 
     txnid_t txnid = requests[0].txnid;
-    assert(txnid < MAX_TXN_COUNT);
-    completion_reset(&client->txns[txnid].completion);
-    client->txns[txnid].status = ERR_IO;
+    block_completion_t* txn = txn_completion(client, txnid);
+    completion_reset(&txn->completion);
+    txn->status = ERR_IO;
 
     mx_status_t status;
     for (size_t i = 0; i < count; i++) {
@@ -120,12 +128,12 @@ mx_status_t block_fifo_txn(fifo_client_t* client, block_fifo_request_t* requests
     }
 
     // Wake up someone who is waiting (it might be ourselves)
-    txnid_t response_txnid = response.txnid;
-    client->txns[response_txnid].status = response.status;
-    completion_signal(&client->txns[response_txnid].completion);
+    block_completion_t* response_txn = txn_completion(client, response.txnid);
+    response_txn->status = response.status;
+    completion_signal(&response_txn->completion);
 
     // Wait for someone to signal us
-    completion_wait(&client->txns[txnid].completion, MX_TIME_INFINITE);
+    completion_wait(&txn->completion, MX_TIME_INFINITE);
 
-    return client->txns[txnid].status;
+    return txn->status;
 }
@@ -0,0 +1,81 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <magenta/compiler.h>
+#include <magenta/device/block.h>
+#include <magenta/types.h>
+#include <mxtl/macros.h>
+
+namespace block_client {
+
+// Collects block transfers between registered VMOs and the device, merging
+// requests that are contiguous both in a VMO and on disk, and sends them
+// MAX_TXN_MESSAGES at a time through TxnHandler::Txn(), which fills in the
+// txnid. Flush() must be called to issue whatever is still pending.
+template <typename TxnHandler, uint64_t kBlockSize>
+class BlockTxn {
+public:
+    DISALLOW_COPY_ASSIGN_AND_MOVE(BlockTxn);
+    BlockTxn(TxnHandler* handler, uint16_t opcode) :
+        handler_(handler), opcode_(opcode), count_(0) {}
+    ~BlockTxn() {
+        assert(count_ == 0);
+    }
+
+    // Transfers 'nblocks' blocks between block 'vmo_bno' of the VMO
+    // registered as 'vmoid' and block 'dev_bno' of the device.
+    mx_status_t Enqueue(vmoid_t vmoid, uint64_t vmo_bno, uint64_t dev_bno, uint64_t nblocks) {
+        uint64_t vmo_offset = vmo_bno * kBlockSize;
+        uint64_t dev_offset = dev_bno * kBlockSize;
+        uint64_t length = nblocks * kBlockSize;
+
+        if (count_ > 0) {
+            block_fifo_request_t* last = &requests_[count_ - 1];
+            if ((last->vmoid == vmoid) &&
+                (last->vmo_offset + last->length == vmo_offset) &&
+                (last->dev_offset + last->length == dev_offset)) {
+                last->length += length;
+                return NO_ERROR;
+            }
+        }
+
+        if (count_ == countof(requests_)) {
+            mx_status_t status;
+            if ((status = Flush()) != NO_ERROR) {
+                return status;
+            }
+        }
+
+        block_fifo_request_t* request = &requests_[count_++];
+        request->vmoid = vmoid;
+        request->opcode = opcode_;
+        request->length = length;
+        request->vmo_offset = vmo_offset;
+        request->dev_offset = dev_offset;
+        return NO_ERROR;
+    }
+
+    mx_status_t Flush() {
+        if (count_ == 0) {
+            return NO_ERROR;
+        }
+        mx_status_t status = handler_->Txn(requests_, count_);
+        count_ = 0;
+        return status;
+    }
+
+private:
+    TxnHandler* handler_;
+    uint16_t opcode_;
+    size_t count_;
+    block_fifo_request_t requests_[MAX_TXN_MESSAGES];
+};
+
+} // namespace block_client
@@ -36,6 +36,15 @@ mx_status_t io_buffer_init_vmo(io_buffer_t* buffer, mx_handle_t vmo_handle,
 
 mx_status_t io_buffer_cache_op(io_buffer_t* buffer, const uint32_t op,
                                const mx_off_t offset, const size_t size);
+
+// Commits the |size| bytes of the buffer at |offset| and looks up the physical
+// pages backing them, for devices that scatter/gather rather than needing one
+// contiguous run. pages[0] is the address of the byte at |offset| itself and
+// each later entry the start of the next page; |page_count| must cover every
+// page the range touches.
+mx_status_t io_buffer_physmap_range(io_buffer_t* buffer, mx_off_t offset, size_t size,
+                                    mx_paddr_t* pages, size_t page_count);
+
 // Releases an io_buffer
 void io_buffer_release(io_buffer_t* buffer);
 
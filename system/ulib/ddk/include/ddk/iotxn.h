@@ -9,6 +9,9 @@
 #include <magenta/listnode.h>
 #include <ddk/driver.h>
 
+// for ssize_t:
+#include <unistd.h>
+
 __BEGIN_CDECLS;
 
 typedef struct iotxn iotxn_t;
@@ -35,6 +38,10 @@ typedef struct iotxn_ops iotxn_ops_t;
 // opcodes
 #define IOTXN_OP_READ      1
 #define IOTXN_OP_WRITE     2
+// The |length| bytes at |offset| no longer hold data the requestor needs; the
+// txn has no buffer. Drivers which cannot discard complete it with
+// ERR_NOT_SUPPORTED.
+#define IOTXN_OP_TRIM      3
 
 // cache maintenance ops
 #define IOTXN_CACHE_INVALIDATE        MX_VMO_OP_CACHE_INVALIDATE
@@ -102,10 +109,33 @@ struct iotxn {
 #define iotxn_pdata(txn, type) ((type*) (txn)->protocol_data)
 
 
+// iotxn_alloc() flags
+//
+// The requestor reads back no more of the payload than the processor fills
+// in, and writes all of what it asks to be written, so a recycled buffer
+// need not be cleared first.
+#define IOTXN_ALLOC_NOZERO (1 << 16)
+
 // create a new iotxn with payload space of data_size
 // and extra storage space of extra_size
+//
+// iotxns are recycled through pools of power-of-two buffer sizes, with a
+// small cache for each thread in front of them. Unless IOTXN_ALLOC_NOZERO is
+// passed, the first data_size bytes of a recycled buffer are cleared.
 mx_status_t iotxn_alloc(iotxn_t** out, uint32_t flags, size_t data_size, size_t extra_size);
 
+typedef struct iotxn_pool_stats {
+    uint64_t allocs;       // calls to iotxn_alloc()
+    uint64_t cache_hits;   // of which were served from a thread's cache
+    uint64_t pool_hits;    // or from a shared pool
+    uint64_t frees;        // iotxns freed as too large, or their pool full
+    uint64_t pooled;       // iotxns now waiting in the shared pools
+    uint64_t pooled_bytes; // and the size of their buffers
+} iotxn_pool_stats_t;
+
+// reports how well iotxn_alloc() is recycling iotxns
+void iotxn_pool_get_stats(iotxn_pool_stats_t* stats);
+
 // creates a new iotxn based on a provided VMO buffer, offset and size
 // this duplicates the provided vmo_handle
 mx_status_t iotxn_alloc_vmo(iotxn_t** out, mx_handle_t vmo_handle, size_t data_size,
@@ -129,13 +159,15 @@ struct iotxn_ops {
     void (*complete)(iotxn_t* txn, mx_status_t status, mx_off_t actual);
 
 
-    // copyfrom() copies data from the iotxn's data buffer
+    // copyfrom() copies data from the iotxn's data buffer, returning the
+    // number of bytes copied or a negative error.
     // Out of range operations are ignored.
-    void (*copyfrom)(iotxn_t* txn, void* data, size_t length, size_t offset);
+    ssize_t (*copyfrom)(iotxn_t* txn, void* data, size_t length, size_t offset);
 
-    // copyto() copies data into an iotxn's data buffer.
+    // copyto() copies data into an iotxn's data buffer, returning the
+    // number of bytes copied or a negative error.
     // Out of range operations are ignored.
-    void (*copyto)(iotxn_t* txn, const void* data, size_t length, size_t offset);
+    ssize_t (*copyto)(iotxn_t* txn, const void* data, size_t length, size_t offset);
 
     // physmap() returns the physical start address of a buffer containing
     // the iotxn's buffer data (on WRITE ops) or a buffer that will be
@@ -143,6 +175,15 @@ struct iotxn_ops {
     // be the buffer itself, or a temporary, depending on conditions.
     void (*physmap)(iotxn_t* txn, mx_paddr_t* addr);
 
+    // physmap_pages() looks up the physical pages holding |length| bytes of
+    // the iotxn's data from |offset|, for devices that can scatter/gather
+    // and so need no contiguous temporary.  pages[0] is the address of the
+    // byte at |offset|, each later entry the start of the next page, and
+    // |page_count| must cover every page the range touches, which is at most
+    // length / PAGE_SIZE + 2.
+    mx_status_t (*physmap_pages)(iotxn_t* txn, size_t offset, size_t length,
+                                 mx_paddr_t* pages, size_t page_count);
+
     // mmap() returns a void* pointing at the data in the iotxn's buffer.
     // This may have to do an expensive memory map operation or copy data
     // to a local buffer.  copyfrom(), copyto(), or physmap() are almost
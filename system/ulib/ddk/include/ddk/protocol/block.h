@@ -6,6 +6,9 @@
 
 #include <ddk/driver.h>
 #include <magenta/device/block.h>
+#include <stdbool.h>
+
+__BEGIN_CDECLS
 
 typedef struct block_callbacks {
     void (*complete)(void* cookie, mx_status_t status);
@@ -21,4 +24,29 @@ typedef struct block_ops {
     // Write from the VMO to the block device
     void (*write)(mx_device_t* dev, mx_handle_t vmo, uint64_t length, uint64_t vmo_offset,
                   uint64_t dev_offset, void* cookie);
+    // Optional: how many threads may usefully call read and write at once
+    // (for example, one per hardware queue). If null, only one will.
+    uint32_t (*get_queue_count)(mx_device_t* dev);
+    // Optional: discard the contents of a range of the block device. If null,
+    // BLOCKIO_TRIM requests fail with ERR_NOT_SUPPORTED.
+    void (*trim)(mx_device_t* dev, uint64_t length, uint64_t dev_offset, void* cookie);
 } block_ops_t;
+
+// ktrace probes along the block I/O path, so that time spent queued can be
+// told apart from time spent in the device. Each event records a 32-bit id
+// for the operation, taken from whatever pointer names it at that layer (the
+// cookie of a FIFO operation, or the iotxn), and its opcode or status.
+typedef enum {
+    BLOCK_TRACE_FIFO,     // "block_fifo": request taken off a FIFO; opcode
+    BLOCK_TRACE_QUEUE,    // "block_queue": operation queued to the driver; opcode
+    BLOCK_TRACE_SUBMIT,   // "block_submit": operation handed to the hardware; opcode
+    BLOCK_TRACE_COMPLETE, // "block_complete": operation completed; status
+    BLOCK_TRACE_COUNT,
+} block_trace_point_t;
+
+// Probes are only written between a call to block_trace_enable(true) and
+// one to block_trace_enable(false), so they cost next to nothing otherwise.
+mx_status_t block_trace_enable(bool enable);
+void block_trace(block_trace_point_t point, const void* id, uint32_t arg);
+
+__END_CDECLS
@@ -90,3 +90,30 @@ mx_status_t io_buffer_cache_op(io_buffer_t* buffer, const uint32_t op,
                                const mx_off_t offset, const size_t size) {
     return mx_vmo_op_range(buffer->vmo_handle, op, offset, size, NULL, 0);
 }
+
+mx_status_t io_buffer_physmap_range(io_buffer_t* buffer, mx_off_t offset, size_t size,
+                                    mx_paddr_t* pages, size_t page_count) {
+    if (size == 0) {
+        return ERR_INVALID_ARGS;
+    }
+    offset += buffer->offset;
+    mx_off_t start = offset & ~(mx_off_t)(PAGE_SIZE - 1);
+    mx_off_t end = (offset + size + PAGE_SIZE - 1) & ~(mx_off_t)(PAGE_SIZE - 1);
+    if ((end - start) / PAGE_SIZE > page_count) {
+        return ERR_BUFFER_TOO_SMALL;
+    }
+
+    // LOOKUP only reports pages that are already committed
+    mx_status_t status = mx_vmo_op_range(buffer->vmo_handle, MX_VMO_OP_COMMIT, start, end - start,
+                                         NULL, 0);
+    if (status != NO_ERROR) {
+        return status;
+    }
+    status = mx_vmo_op_range(buffer->vmo_handle, MX_VMO_OP_LOOKUP, start, end - start, pages,
+                             page_count * sizeof(mx_paddr_t));
+    if (status != NO_ERROR) {
+        return status;
+    }
+    pages[0] += offset - start;
+    return NO_ERROR;
+}
@@ -28,6 +28,26 @@
 #define IOTXN_FLAG_CLONE (1 << 0)
 #define IOTXN_FLAG_FREE  (1 << 1)   // for double-free checking
 #define IOTXN_FLAG_DEAD  (1 << 2)   // buffer is no longer valid
+#define IOTXN_FLAG_VMO   (1 << 3)   // buffer maps a VMO from iotxn_alloc_vmo()
+
+// iotxns from iotxn_alloc() are kept for reuse in pools by buffer size. Pool
+// 0 holds those without a buffer, and pool n > 0 those of POOL_MIN_SIZE << (n - 1)
+// bytes. Larger buffers are allocated to size and freed on release.
+#define POOL_MIN_SIZE   PAGE_SIZE
+#define POOL_MAX_SIZE   (1024 * 1024)
+#define POOL_COUNT      10
+#define POOL_NONE       POOL_COUNT
+
+// Each pool holds at most POOL_MAX_BYTES of buffers, or POOL_MIN_DEPTH
+// iotxns, whichever is more. The rest are freed on release.
+#define POOL_MAX_BYTES  (4 * 1024 * 1024)
+#define POOL_MIN_DEPTH  4
+
+// Every thread keeps up to CACHE_DEPTH iotxns of each size up to
+// CACHE_MAX_SIZE for itself, which it allocates and releases without
+// taking any lock.
+#define CACHE_MAX_SIZE  (64 * 1024)
+#define CACHE_DEPTH     4
 
 typedef struct iotxn_priv iotxn_priv_t;
 
@@ -42,6 +62,9 @@ struct iotxn_priv {
     // extra data, at the end of this ioxtn_t structure
     size_t extra_size;
 
+    // pool this iotxn is returned to, or POOL_NONE
+    unsigned pool;
+
     // number of times we have been cloned
     int clone_count;
     // the iotxn we were cloned from
@@ -55,11 +78,147 @@ struct iotxn_priv {
 // This assert will fail if we attempt to access the buffer of a cloned txn after it has been completed
 #define ASSERT_BUFFER_VALID(priv) MX_DEBUG_ASSERT(!(priv->flags & IOTXN_FLAG_DEAD))
 
-static list_node_t free_list = LIST_INITIAL_VALUE(free_list);
+typedef struct iotxn_pool {
+    mtx_t lock;
+    list_node_t free_list;
+    size_t count;
+} iotxn_pool_t;
+
+typedef struct iotxn_cache {
+    iotxn_priv_t* txns[POOL_COUNT][CACHE_DEPTH];
+    size_t count[POOL_COUNT];
+} iotxn_cache_t;
+
+static iotxn_pool_t pools[POOL_COUNT];
+static once_flag pools_once = ONCE_FLAG_INIT;
+static tss_t cache_key; // iotxn_cache_t* of the current thread
+
+static atomic_uint_fast64_t stat_allocs;
+static atomic_uint_fast64_t stat_cache_hits;
+static atomic_uint_fast64_t stat_pool_hits;
+static atomic_uint_fast64_t stat_frees;
+
 static list_node_t clone_list = LIST_INITIAL_VALUE(clone_list); // free list for clones
-static mtx_t free_list_mutex = MTX_INIT;
 static mtx_t clone_list_mutex = MTX_INIT;
 
+static size_t pool_buffer_size(unsigned pool) {
+    return (pool == 0) ? 0 : (size_t)POOL_MIN_SIZE << (pool - 1);
+}
+
+static unsigned pool_for_size(size_t data_size) {
+    if (data_size > POOL_MAX_SIZE) {
+        return POOL_NONE;
+    }
+    unsigned pool = 0;
+    while (pool_buffer_size(pool) < data_size) {
+        pool++;
+    }
+    return pool;
+}
+
+static size_t pool_depth(unsigned pool) {
+    size_t depth = POOL_MAX_BYTES / MAX(pool_buffer_size(pool), POOL_MIN_SIZE);
+    return MAX(depth, POOL_MIN_DEPTH);
+}
+
+static void iotxn_free(iotxn_priv_t* priv) {
+    atomic_fetch_add_explicit(&stat_frees, 1, memory_order_relaxed);
+    io_buffer_release(&priv->buffer);
+    free(priv);
+}
+
+static iotxn_priv_t* pool_get(unsigned pool_index, size_t extra_size) {
+    iotxn_pool_t* pool = &pools[pool_index];
+    iotxn_priv_t* priv;
+    mtx_lock(&pool->lock);
+    list_for_every_entry (&pool->free_list, priv, iotxn_priv_t, txn.node) {
+        if (priv->extra_size >= extra_size) {
+            list_delete(&priv->txn.node);
+            pool->count--;
+            mtx_unlock(&pool->lock);
+            return priv;
+        }
+    }
+    mtx_unlock(&pool->lock);
+    return NULL;
+}
+
+static void pool_put(iotxn_priv_t* priv) {
+    iotxn_pool_t* pool = &pools[priv->pool];
+    mtx_lock(&pool->lock);
+    if (pool->count < pool_depth(priv->pool)) {
+        // most recently used first, while its buffer may still be cached
+        list_add_head(&pool->free_list, &priv->txn.node);
+        pool->count++;
+        priv = NULL;
+    }
+    mtx_unlock(&pool->lock);
+    if (priv) {
+        iotxn_free(priv);
+    }
+}
+
+// returns the thread's iotxns to the pools when it exits
+static void cache_destroy(void* arg) {
+    iotxn_cache_t* cache = arg;
+    for (unsigned pool = 0; pool < POOL_COUNT; pool++) {
+        for (size_t i = 0; i < cache->count[pool]; i++) {
+            pool_put(cache->txns[pool][i]);
+        }
+    }
+    free(cache);
+}
+
+static void pools_init(void) {
+    for (unsigned pool = 0; pool < POOL_COUNT; pool++) {
+        mtx_init(&pools[pool].lock, mtx_plain);
+        list_initialize(&pools[pool].free_list);
+    }
+    tss_create(&cache_key, cache_destroy);
+}
+
+static iotxn_cache_t* get_cache(void) {
+    iotxn_cache_t* cache = tss_get(cache_key);
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(iotxn_cache_t));
+        if (cache != NULL && tss_set(cache_key, cache) != thrd_success) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+static iotxn_priv_t* cache_get(unsigned pool, size_t extra_size) {
+    if (pool_buffer_size(pool) > CACHE_MAX_SIZE) {
+        return NULL;
+    }
+    iotxn_cache_t* cache = get_cache();
+    if (cache == NULL) {
+        return NULL;
+    }
+    for (size_t i = cache->count[pool]; i-- > 0;) {
+        iotxn_priv_t* priv = cache->txns[pool][i];
+        if (priv->extra_size >= extra_size) {
+            cache->txns[pool][i] = cache->txns[pool][--cache->count[pool]];
+            return priv;
+        }
+    }
+    return NULL;
+}
+
+static bool cache_put(iotxn_priv_t* priv) {
+    if (pool_buffer_size(priv->pool) > CACHE_MAX_SIZE) {
+        return false;
+    }
+    iotxn_cache_t* cache = get_cache();
+    if (cache == NULL || cache->count[priv->pool] == CACHE_DEPTH) {
+        return false;
+    }
+    cache->txns[priv->pool][cache->count[priv->pool]++] = priv;
+    return true;
+}
+
 static void iotxn_complete(iotxn_t* txn, mx_status_t status, mx_off_t actual) {
     iotxn_priv_t* priv = get_priv(txn);
     if (priv->orig_txn) {
@@ -80,18 +239,40 @@ static void iotxn_complete(iotxn_t* txn, mx_status_t status, mx_off_t actual) {
     }
 }
 
-static void iotxn_copyfrom(iotxn_t* txn, void* data, size_t length, size_t offset) {
+static ssize_t iotxn_copyfrom(iotxn_t* txn, void* data, size_t length, size_t offset) {
     iotxn_priv_t* priv = get_priv(txn);
-    size_t count = MIN(length, priv->data_size - offset);
     ASSERT_BUFFER_VALID(priv);
+    if (offset >= priv->data_size) {
+        return 0;
+    }
+    size_t count = MIN(length, priv->data_size - offset);
+    if (priv->flags & IOTXN_FLAG_VMO) {
+        // the mapping is fresh, so copying through it would fault in every
+        // page, where the kernel can read the VMO directly
+        size_t actual;
+        mx_status_t status = mx_vmo_read(priv->buffer.vmo_handle, data,
+                                         priv->buffer.offset + offset, count, &actual);
+        return (status == NO_ERROR) ? (ssize_t)actual : status;
+    }
     memcpy(data, io_buffer_virt(&priv->buffer) + offset, count);
+    return count;
 }
 
-static void iotxn_copyto(iotxn_t* txn, const void* data, size_t length, size_t offset) {
+static ssize_t iotxn_copyto(iotxn_t* txn, const void* data, size_t length, size_t offset) {
     iotxn_priv_t* priv = get_priv(txn);
-    size_t count = MIN(length, priv->data_size - offset);
     ASSERT_BUFFER_VALID(priv);
+    if (offset >= priv->data_size) {
+        return 0;
+    }
+    size_t count = MIN(length, priv->data_size - offset);
+    if (priv->flags & IOTXN_FLAG_VMO) {
+        size_t actual;
+        mx_status_t status = mx_vmo_write(priv->buffer.vmo_handle, data,
+                                          priv->buffer.offset + offset, count, &actual);
+        return (status == NO_ERROR) ? (ssize_t)actual : status;
+    }
     memcpy(io_buffer_virt(&priv->buffer) + offset, data, count);
+    return count;
 }
 
 static void iotxn_physmap(iotxn_t* txn, mx_paddr_t* addr) {
@@ -100,6 +281,16 @@ static void iotxn_physmap(iotxn_t* txn, mx_paddr_t* addr) {
     *addr = io_buffer_phys(&priv->buffer);
 }
 
+static mx_status_t iotxn_physmap_pages(iotxn_t* txn, size_t offset, size_t length,
+                                       mx_paddr_t* pages, size_t page_count) {
+    iotxn_priv_t* priv = get_priv(txn);
+    ASSERT_BUFFER_VALID(priv);
+    if (offset + length > priv->data_size) {
+        return ERR_INVALID_ARGS;
+    }
+    return io_buffer_physmap_range(&priv->buffer, offset, length, pages, page_count);
+}
+
 static void iotxn_mmap(iotxn_t* txn, void** data) {
     iotxn_priv_t* priv = get_priv(txn);
     ASSERT_BUFFER_VALID(priv);
@@ -157,14 +348,16 @@ static void iotxn_release(iotxn_t* txn) {
         mtx_lock(&clone_list_mutex);
         list_add_tail(&clone_list, &txn->node);
         priv->flags |= IOTXN_FLAG_FREE;
+        priv->flags &= ~(IOTXN_FLAG_DEAD | IOTXN_FLAG_VMO);
         mtx_unlock(&clone_list_mutex);
     } else {
-        mtx_lock(&free_list_mutex);
-        list_add_tail(&free_list, &txn->node);
-        priv->flags |= IOTXN_FLAG_FREE;
-        mtx_unlock(&free_list_mutex);
+        priv->flags = IOTXN_FLAG_FREE;
+        if (priv->pool == POOL_NONE) {
+            iotxn_free(priv);
+        } else if (!cache_put(priv)) {
+            pool_put(priv);
+        }
     }
-    priv->flags &= ~IOTXN_FLAG_DEAD;
 }
 
 static mx_status_t iotxn_clone(iotxn_t* txn, iotxn_t** out, size_t extra_size) {
@@ -177,6 +370,7 @@ static mx_status_t iotxn_clone(iotxn_t* txn, iotxn_t** out, size_t extra_size) {
     // that the clone will be completed before the source txn.
     memcpy(&cpriv->buffer, &priv->buffer, sizeof(cpriv->buffer));
     cpriv->data_size = priv->data_size;
+    cpriv->flags |= priv->flags & IOTXN_FLAG_VMO;
     memcpy(&cpriv->txn, txn, sizeof(iotxn_t));
     cpriv->txn.complete_cb = NULL; // clear the complete cb
 
@@ -198,6 +392,7 @@ static iotxn_ops_t ops = {
     .copyfrom = iotxn_copyfrom,
     .copyto = iotxn_copyto,
     .physmap = iotxn_physmap,
+    .physmap_pages = iotxn_physmap_pages,
     .mmap = iotxn_mmap,
     .clone = iotxn_clone,
     .release = iotxn_release,
@@ -206,35 +401,37 @@ static iotxn_ops_t ops = {
 
 mx_status_t iotxn_alloc(iotxn_t** out, uint32_t flags, size_t data_size, size_t extra_size) {
     xprintf("iotxn_alloc: flags=0x%x data_size=0x%zx extra_size=0x%zx\n", flags, data_size, extra_size);
-    iotxn_t* txn = NULL;
-    iotxn_priv_t* priv = NULL;
-    // look in free list first for something that fits
-    bool found = false;
+    call_once(&pools_once, pools_init);
+    atomic_fetch_add_explicit(&stat_allocs, 1, memory_order_relaxed);
 
-    mtx_lock(&free_list_mutex);
-    list_for_every_entry (&free_list, txn, iotxn_t, node) {
-        priv = get_priv(txn);
-        if (priv->buffer.size >= data_size && priv->extra_size >= extra_size) {
-            found = true;
-            break;
+    unsigned pool = pool_for_size(data_size);
+    iotxn_priv_t* priv = NULL;
+    if (pool != POOL_NONE) {
+        if ((priv = cache_get(pool, extra_size)) != NULL) {
+            atomic_fetch_add_explicit(&stat_cache_hits, 1, memory_order_relaxed);
+        } else if ((priv = pool_get(pool, extra_size)) != NULL) {
+            atomic_fetch_add_explicit(&stat_pool_hits, 1, memory_order_relaxed);
         }
     }
-    // found one that fits, skip allocation
+
+    bool found = (priv != NULL);
     if (found) {
-        list_delete(&txn->node);
-        memset(&txn, 0, sizeof(iotxn_t));
-        memset(io_buffer_virt(&priv->buffer), 0, priv->buffer.size);
-        priv->flags &= ~IOTXN_FLAG_FREE;
-        mtx_unlock(&free_list_mutex);
+        // only what the caller asked for is cleared
+        memset(&priv->txn, 0, sizeof(iotxn_t));
+        memset(priv->txn.extra, 0, extra_size);
+        if (!(flags & IOTXN_ALLOC_NOZERO) && data_size > 0) {
+            memset(io_buffer_virt(&priv->buffer), 0, data_size);
+        }
+        priv->flags = 0;
         goto out;
     }
-    mtx_unlock(&free_list_mutex);
 
     // didn't find one that fits, allocate a new one
     priv = calloc(1, sizeof(iotxn_priv_t) + extra_size);
     if (!priv) return ERR_NO_MEMORY;
     if (data_size > 0) {
-        mx_status_t status = io_buffer_init(&priv->buffer, data_size, IO_BUFFER_RW);
+        size_t buffer_size = (pool == POOL_NONE) ? data_size : pool_buffer_size(pool);
+        mx_status_t status = io_buffer_init(&priv->buffer, buffer_size, IO_BUFFER_RW);
         if (status != NO_ERROR) {
             free(priv);
             return status;
@@ -243,6 +440,7 @@ mx_status_t iotxn_alloc(iotxn_t** out, uint32_t flags, size_t data_size, size_t
 
     // layout is iotxn_priv_t | extra_size
     priv->extra_size = extra_size;
+    priv->pool = pool;
 out:
     priv->data_size = data_size;
     priv->txn.ops = &ops;
@@ -251,12 +449,29 @@ out:
     return NO_ERROR;
 }
 
+void iotxn_pool_get_stats(iotxn_pool_stats_t* stats) {
+    call_once(&pools_once, pools_init);
+    stats->allocs = atomic_load_explicit(&stat_allocs, memory_order_relaxed);
+    stats->cache_hits = atomic_load_explicit(&stat_cache_hits, memory_order_relaxed);
+    stats->pool_hits = atomic_load_explicit(&stat_pool_hits, memory_order_relaxed);
+    stats->frees = atomic_load_explicit(&stat_frees, memory_order_relaxed);
+    stats->pooled = 0;
+    stats->pooled_bytes = 0;
+    for (unsigned pool = 0; pool < POOL_COUNT; pool++) {
+        mtx_lock(&pools[pool].lock);
+        stats->pooled += pools[pool].count;
+        stats->pooled_bytes += pools[pool].count * pool_buffer_size(pool);
+        mtx_unlock(&pools[pool].lock);
+    }
+}
+
 mx_status_t iotxn_alloc_vmo(iotxn_t** out, mx_handle_t vmo_handle, size_t data_size,
                             mx_off_t data_offset, size_t extra_size) {
     iotxn_priv_t* priv = iotxn_get_clone(extra_size);
     if (!priv) return ERR_NO_MEMORY;
 
     io_buffer_init_vmo(&priv->buffer, vmo_handle, data_offset, IO_BUFFER_RW);
+    priv->flags |= IOTXN_FLAG_VMO;
     priv->data_size = data_size;
 
     priv->txn.ops = &ops;
@@ -0,0 +1,46 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <ddk/protocol/block.h>
+
+#include <magenta/compiler.h>
+#include <magenta/ktrace.h>
+#include <magenta/syscalls.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// The kernel reads a whole name's worth of bytes, whatever its length.
+static const char probe_names[BLOCK_TRACE_COUNT][MX_MAX_NAME_LEN] = {
+    [BLOCK_TRACE_FIFO] = "block_fifo",
+    [BLOCK_TRACE_QUEUE] = "block_queue",
+    [BLOCK_TRACE_SUBMIT] = "block_submit",
+    [BLOCK_TRACE_COMPLETE] = "block_complete",
+};
+
+// Every driver in a driver host shares this library, and so these.
+static uint32_t probe_ids[BLOCK_TRACE_COUNT];
+static atomic_bool trace_enabled;
+
+__EXPORT mx_status_t block_trace_enable(bool enable) {
+    if (enable) {
+        // Registering a name again returns the id it already has.
+        for (int i = 0; i < BLOCK_TRACE_COUNT; i++) {
+            mx_status_t status = mx_ktrace_control(get_root_resource(), KTRACE_ACTION_NEW_PROBE,
+                                                   0, (void*)probe_names[i]);
+            if (status < 0) {
+                return status;
+            }
+            probe_ids[i] = (uint32_t)status;
+        }
+    }
+    atomic_store(&trace_enabled, enable);
+    return NO_ERROR;
+}
+
+__EXPORT void block_trace(block_trace_point_t point, const void* id, uint32_t arg) {
+    if (!atomic_load_explicit(&trace_enabled, memory_order_acquire)) {
+        return;
+    }
+    mx_ktrace_write(get_root_resource(), probe_ids[point], (uint32_t)(uintptr_t)id, arg);
+}
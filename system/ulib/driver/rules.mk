@@ -15,6 +15,10 @@ MODULE_SO_NAME := driver
 
 MODULE_COMPILEFLAGS := -fvisibility=hidden
 
-MODULE_SRCS := $(LOCAL_DIR)/driver-api.c
+MODULE_SRCS := \
+    $(LOCAL_DIR)/block-trace.c \
+    $(LOCAL_DIR)/driver-api.c \
+
+MODULE_LIBS := ulib/magenta
 
 include make/module.mk
@@ -12,10 +12,125 @@
 #include <magenta/assert.h>
 #include <magenta/errors.h>
 #include <magenta/new.h>
+#include <mxtl/algorithm.h>
 #include <mxtl/unique_ptr.h>
 
+#include "sha256.h"
+
 namespace merkle {
 
+constexpr size_t Digest::kMaxLanes;
+
+#ifndef USE_LIBCRYPTO
+namespace {
+
+static_assert(Digest::kMaxLanes == sha256::kMaxLanes, "lane counts must match");
+static_assert(sizeof(clSHA256_CTX::state) == sha256::kStateWords * sizeof(uint32_t),
+              "unexpected cryptolib state");
+
+// Compresses |blocks| whole blocks at |data| into |ctx|, with the CPU's SHA-256
+// instructions if it has them and cryptolib's transform otherwise.
+void Compress(clSHA256_CTX* ctx, const uint8_t* data, size_t blocks) {
+    sha256::BlocksFn blocks_fn = sha256::GetBlocksFn();
+    if (blocks_fn) {
+        blocks_fn(ctx->state, data, blocks);
+        return;
+    }
+    for (; blocks != 0; --blocks, data += sha256::kBlockSize) {
+        if (data != ctx->buf) {
+            memcpy(ctx->buf, data, sha256::kBlockSize);
+        }
+        ctx->f->_transform(ctx);
+    }
+}
+
+// Writes the final padding block(s) for a message of |total| bytes, of which
+// the last |used| are already at |buf|, and returns how many blocks that makes.
+size_t Pad(uint8_t* buf, size_t used, uint64_t total) {
+    buf[used++] = 0x80;
+    size_t blocks = (used + sizeof(uint64_t) > sha256::kBlockSize) ? 2 : 1;
+    size_t end = blocks * sha256::kBlockSize;
+    memset(buf + used, 0, end - used);
+    uint64_t bits = total * 8;
+    for (size_t i = 0; i < sizeof(bits); ++i) {
+        buf[end - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+    }
+    return blocks;
+}
+
+void StoreState(const uint32_t* state, uint8_t* out) {
+    for (size_t i = 0; i < sha256::kStateWords; ++i) {
+        out[i * 4 + 0] = static_cast<uint8_t>(state[i] >> 24);
+        out[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+        out[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+        out[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+    }
+}
+
+// Hashes up to |lanes| messages of the form described by Digest::HashMany in
+// one pass.  The prefix and the first part of each message, and then its end
+// and padding, are gathered into blocks of their own; the whole blocks in
+// between are read in place.
+void HashLanes(sha256::LanesFn lanes_fn, size_t lanes, const uint64_t* prefixes,
+               const void* const* bufs, size_t len, size_t count, uint8_t* out) {
+    constexpr size_t kPrefixLen = sizeof(uint64_t);
+    constexpr size_t kHeadLen = sha256::kBlockSize - kPrefixLen;
+    size_t head_len = (len >= kHeadLen) ? kHeadLen : 0;
+    size_t middle = (len - head_len) / sha256::kBlockSize;
+    if (head_len == 0) {
+        middle = 0;
+    }
+    size_t rest = len - head_len - middle * sha256::kBlockSize;
+
+    clSHA256_CTX initial;
+    clSHA256_init(&initial);
+    uint32_t states[sha256::kMaxLanes][sha256::kStateWords];
+    uint8_t head[sha256::kMaxLanes][sha256::kBlockSize];
+    uint8_t tail[sha256::kMaxLanes][2 * sha256::kBlockSize];
+    const uint8_t* data[sha256::kMaxLanes];
+    size_t tail_blocks = 0;
+    for (size_t i = 0; i < lanes; ++i) {
+        // Spare lanes repeat the first message, and their results are dropped
+        size_t src = (i < count) ? i : 0;
+        const uint8_t* bytes = static_cast<const uint8_t*>(bufs[src]);
+        memcpy(states[i], initial.state, sizeof(states[i]));
+        size_t used = 0;
+        if (head_len != 0) {
+            memcpy(head[i], &prefixes[src], kPrefixLen);
+            memcpy(head[i] + kPrefixLen, bytes, head_len);
+        } else {
+            memcpy(tail[i], &prefixes[src], kPrefixLen);
+            used = kPrefixLen;
+        }
+        memcpy(tail[i] + used, bytes + head_len + middle * sha256::kBlockSize, rest);
+        tail_blocks = Pad(tail[i], used + rest, kPrefixLen + len);
+    }
+
+    if (head_len != 0) {
+        for (size_t i = 0; i < lanes; ++i) {
+            data[i] = head[i];
+        }
+        lanes_fn(states, data, 1);
+    }
+    if (middle != 0) {
+        for (size_t i = 0; i < lanes; ++i) {
+            data[i] = static_cast<const uint8_t*>(bufs[(i < count) ? i : 0]) + head_len;
+        }
+        lanes_fn(states, data, middle);
+    }
+    for (size_t i = 0; i < lanes; ++i) {
+        data[i] = tail[i];
+    }
+    lanes_fn(states, data, tail_blocks);
+
+    for (size_t i = 0; i < count; ++i) {
+        StoreState(states[i], out + i * Digest::kLength);
+    }
+}
+
+} // namespace
+#endif // USE_LIBCRYPTO
+
 Digest::Digest(const Digest& other) {
     ref_count_ = 0;
     *this = other;
@@ -60,7 +175,28 @@ void Digest::Update(const void* buf, size_t len) {
 #ifdef USE_LIBCRYPTO
     SHA256_Update(&ctx_, buf, len);
 #else
-    clHASH_update(&ctx_, buf, static_cast<int>(len));
+    // cryptolib buffers its input a byte at a time, so whole blocks are passed
+    // to the transform directly instead.
+    if (len == 0) {
+        return;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(buf);
+    size_t used = static_cast<size_t>(ctx_.count % sha256::kBlockSize);
+    ctx_.count += len;
+    if (used != 0) {
+        size_t n = mxtl::min(len, sha256::kBlockSize - used);
+        memcpy(ctx_.buf + used, bytes, n);
+        bytes += n;
+        len -= n;
+        if (used + n != sha256::kBlockSize) {
+            return;
+        }
+        Compress(&ctx_, ctx_.buf, 1);
+    }
+    size_t blocks = len / sha256::kBlockSize;
+    Compress(&ctx_, bytes, blocks);
+    bytes += blocks * sha256::kBlockSize;
+    memcpy(ctx_.buf, bytes, len % sha256::kBlockSize);
 #endif // USE_LIBCRYPTO
 }
 
@@ -69,7 +205,12 @@ const uint8_t* Digest::Final() {
 #ifdef USE_LIBCRYPTO
     SHA256_Final(bytes_, &ctx_);
 #else
-    memcpy(bytes_, clHASH_final(&ctx_), kLength);
+    // The padding may need a second block, which |ctx_.buf| has no room for.
+    uint8_t buf[2 * sha256::kBlockSize];
+    size_t used = static_cast<size_t>(ctx_.count % sha256::kBlockSize);
+    memcpy(buf, ctx_.buf, used);
+    Compress(&ctx_, buf, Pad(buf, used, ctx_.count));
+    StoreState(ctx_.state, bytes_);
 #endif // USE_LIBCRYPTO
     return bytes_;
 }
@@ -80,6 +221,30 @@ const uint8_t* Digest::Hash(const void* buf, size_t len) {
     return Final();
 }
 
+void Digest::HashMany(const uint64_t* prefixes, const void* const* bufs,
+                      size_t len, size_t count, uint8_t* out) {
+#ifndef USE_LIBCRYPTO
+    size_t lanes = 0;
+    sha256::LanesFn lanes_fn = sha256::GetLanesFn(&lanes);
+    // A lone message is quicker to hash by itself than with spare lanes
+    while (lanes_fn && count > 1) {
+        size_t n = mxtl::min(count, lanes);
+        HashLanes(lanes_fn, lanes, prefixes, bufs, len, n, out);
+        prefixes += n;
+        bufs += n;
+        count -= n;
+        out += n * kLength;
+    }
+#endif // USE_LIBCRYPTO
+    Digest digest;
+    for (size_t i = 0; i < count; ++i) {
+        digest.Init();
+        digest.Update(&prefixes[i], sizeof(prefixes[i]));
+        digest.Update(bufs[i], len);
+        memcpy(out + i * kLength, digest.Final(), kLength);
+    }
+}
+
 mx_status_t Digest::Parse(const char* hex, size_t len) {
     MX_DEBUG_ASSERT(ref_count_ == 0);
     if (len < sizeof(bytes_) * 2) {
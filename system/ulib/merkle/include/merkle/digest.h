@@ -35,6 +35,9 @@ public:
     static constexpr size_t kLength = clSHA256_DIGEST_SIZE;
 #endif // USE_LIBCRYPTO
 
+    // The most messages |HashMany| hashes at once.
+    static constexpr size_t kMaxLanes = 8;
+
     Digest() : ctx_{}, bytes_{0}, ref_count_(0) {}
     explicit Digest(const Digest& other);
     explicit Digest(const uint8_t* other);
@@ -65,6 +68,15 @@ public:
     // calling |Final|.
     const uint8_t* Hash(const void* data, size_t len);
 
+    // Hashes |count| independent messages and writes their digests one after
+    // another to |out|, which must have room for |count| * |kLength| bytes.
+    // Message |i| is the 8 bytes of |prefixes[i]| followed by the |len| bytes
+    // at |bufs[i]|, which is how Merkle tree nodes are formed.  Where the CPU
+    // allows, up to |kMaxLanes| messages are hashed at once, so callers with
+    // many nodes to hash should pass them in groups of at least that many.
+    static void HashMany(const uint64_t* prefixes, const void* const* bufs,
+                         size_t len, size_t count, uint8_t* out);
+
     // Converts a |hex| string to binary and stores it in this->data.  The
     // string must contain at least |kLength| * 2 valid hex characters.
     mx_status_t Parse(const char* hex, size_t len);
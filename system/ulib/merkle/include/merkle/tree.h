@@ -103,10 +103,18 @@ public:
     mx_status_t Create(const void* data, size_t data_len, void* tree,
                        size_t tree_len, Digest* digest);
 
+    // Does the same as |Create|, with identical results, but splits the nodes
+    // of each level of the tree among up to |num_threads| threads, including
+    // the calling one.  Small trees are simply built by |Create|.
+    mx_status_t CreateParallel(const void* data, size_t data_len, void* tree,
+                               size_t tree_len, Digest* digest,
+                               size_t num_threads);
+
     // Sets the range of addresses within the tree that will need to be read to
     // fulfill a corresponding call to Verify. |offset| and |length| must
     // describe a range wholly within |data_len|. If the ranges fail to be set
-    // due to low memory, this will return ERR_NO_MEMORY.
+    // due to low memory, this will return ERR_NO_MEMORY.  This does not need
+    // the tree itself, so it may be called before any of it has been read.
     mx_status_t SetRanges(size_t data_len, uint64_t offset, size_t length);
 
     // Checks the integrity of a the region of data given by the offset and
@@ -130,6 +138,11 @@ private:
     // read.
     void HashNode(const void* data);
 
+    // Hashes the |count| whole nodes starting at |bytes|, which hold the tree
+    // or data from |offset_| on, and writes their digests to |hashes|.  At most
+    // |Digest::kMaxLanes| nodes may be passed at once.
+    void HashNodes(const uint8_t* bytes, size_t count, uint8_t* hashes);
+
     // Hashes |length| bytes of |data| that makes up the leaves of the Merkle
     // tree and writes the digests to |tree|.
     mx_status_t HashData(const void* data, size_t length, void* tree);
@@ -12,6 +12,12 @@ MODULE_SRCS += \
     $(LOCAL_DIR)/digest.cpp \
     $(LOCAL_DIR)/tree.cpp
 
+ifeq ($(ARCH),arm64)
+MODULE_SRCS += $(LOCAL_DIR)/sha256-arm64.cpp
+else ifeq ($(ARCH),x86)
+MODULE_SRCS += $(LOCAL_DIR)/sha256-x86-64.cpp
+endif
+
 MODULE_SO_NAME := merkle
 MODULE_LIBS := ulib/mxcpp ulib/mxtl ulib/c
 
@@ -0,0 +1,86 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sha256.h"
+
+// Host tools build this along with sha256-x86-64.cpp, whatever the host is.
+#ifdef __aarch64__
+
+#ifdef __ARM_FEATURE_CRYPTO
+#include <arm_neon.h>
+#endif // __ARM_FEATURE_CRYPTO
+
+namespace merkle {
+namespace sha256 {
+
+// Userspace has no way yet to ask the kernel which optional instructions the
+// CPU implements, so the crypto extensions are only used when the build
+// targets them.
+#ifdef __ARM_FEATURE_CRYPTO
+
+namespace {
+
+const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+void CryptoExtBlocks(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(&state[0]);
+    uint32x4_t efgh = vld1q_u32(&state[4]);
+
+    for (; blocks != 0; --blocks, data += kBlockSize) {
+        uint32x4_t abcd_save = abcd;
+        uint32x4_t efgh_save = efgh;
+        uint32x4_t w[4];
+        for (size_t i = 0; i < 4; ++i) {
+            w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+        }
+        for (size_t j = 0; j < 16; ++j) {
+            uint32x4_t msg = vaddq_u32(w[j % 4], vld1q_u32(&kRoundConstants[j * 4]));
+            if (j < 12) {
+                // W[j+4] from W[j] through W[j+3], four words at a time
+                w[j % 4] = vsha256su1q_u32(vsha256su0q_u32(w[j % 4], w[(j + 1) % 4]),
+                                           w[(j + 2) % 4], w[(j + 3) % 4]);
+            }
+            uint32x4_t abcd_prev = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, msg);
+            efgh = vsha256h2q_u32(efgh, abcd_prev, msg);
+        }
+        abcd = vaddq_u32(abcd, abcd_save);
+        efgh = vaddq_u32(efgh, efgh_save);
+    }
+
+    vst1q_u32(&state[0], abcd);
+    vst1q_u32(&state[4], efgh);
+}
+
+} // namespace
+
+BlocksFn GetBlocksFn() {
+    return CryptoExtBlocks;
+}
+
+#else
+
+BlocksFn GetBlocksFn() {
+    return nullptr;
+}
+
+#endif // __ARM_FEATURE_CRYPTO
+
+LanesFn GetLanesFn(size_t* lanes) {
+    return nullptr;
+}
+
+} // namespace sha256
+} // namespace merkle
+
+#endif // __aarch64__
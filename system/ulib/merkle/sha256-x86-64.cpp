@@ -0,0 +1,246 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sha256.h"
+
+// Host tools build this along with sha256-arm64.cpp, whatever the host is.
+#ifdef __x86_64__
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include <mxtl/atomic.h>
+
+namespace merkle {
+namespace sha256 {
+
+namespace {
+
+alignas(32) const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// CPU features, probed once.  Negative until then.
+enum : int {
+    kFeatureShaNi = 1 << 0,
+    kFeatureAvx2 = 1 << 1,
+};
+mxtl::atomic<int> g_features(-1);
+
+int GetFeatures() {
+    int features = g_features.load(mxtl::memory_order_relaxed);
+    if (features >= 0) {
+        return features;
+    }
+    features = 0;
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        bool sse41 = (ecx & bit_SSE4_1) != 0;
+        bool avx = (ecx & bit_AVX) != 0 && (ecx & bit_OSXSAVE) != 0;
+        if (avx) {
+            // The OS must also save the YMM registers across context switches
+            uint32_t xcr0_lo, xcr0_hi;
+            __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+            avx = (xcr0_lo & 0x6) == 0x6;
+        }
+        if (__get_cpuid_max(0, nullptr) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if (sse41 && (ebx & (1u << 29)) != 0) {
+                features |= kFeatureShaNi;
+            }
+            if (avx && (ebx & bit_AVX2) != 0) {
+                features |= kFeatureAvx2;
+            }
+        }
+    }
+    g_features.store(features, mxtl::memory_order_relaxed);
+    return features;
+}
+
+// SHA extensions ////////////////////////////////////////////////////////////
+
+// The SHA-NI round instructions keep the state as {A, B, E, F} and
+// {C, D, G, H} rather than in its natural order.
+__attribute__((target("sha,sse4.1")))
+void ShaNiBlocks(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i kByteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i*>(&state[0])), 0xB1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i*>(&state[4])), 0x1B);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    for (; blocks != 0; --blocks, data += kBlockSize) {
+        __m128i abef_save = abef;
+        __m128i cdgh_save = cdgh;
+        __m128i w[4];
+        for (size_t i = 0; i < 4; ++i) {
+            w[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16));
+            w[i] = _mm_shuffle_epi8(w[i], kByteSwap);
+        }
+        for (size_t j = 0; j < 16; ++j) {
+            if (j >= 4) {
+                // W[j] from W[j-4], W[j-3], W[j-2] and W[j-1], four words at a time
+                __m128i next = _mm_sha256msg1_epu32(w[j % 4], w[(j + 1) % 4]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(j + 3) % 4], w[(j + 2) % 4], 4));
+                w[j % 4] = _mm_sha256msg2_epu32(next, w[(j + 3) % 4]);
+            }
+            __m128i msg = _mm_add_epi32(
+                w[j % 4], _mm_load_si128(reinterpret_cast<const __m128i*>(&kRoundConstants[j * 4])));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+// AVX2 multi-buffer /////////////////////////////////////////////////////////
+
+// Each 256-bit vector holds the same word of eight different messages.
+constexpr size_t kAvx2Lanes = 8;
+static_assert(kAvx2Lanes <= kMaxLanes, "too many lanes");
+
+__attribute__((target("avx2")))
+inline __m256i Ror(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+// Transposes eight rows of eight words, so that row[i] holds word i of each
+// of the original rows.
+__attribute__((target("avx2")))
+inline void Transpose(__m256i* row) {
+    __m256i t0 = _mm256_unpacklo_epi32(row[0], row[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(row[0], row[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(row[2], row[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(row[2], row[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(row[4], row[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(row[4], row[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(row[6], row[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(row[6], row[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    row[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    row[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    row[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    row[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    row[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    row[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    row[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    row[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2")))
+void Avx2Lanes(uint32_t (*states)[kStateWords], const uint8_t* const* data, size_t blocks) {
+    const __m256i kByteSwap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                                0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m256i s[kStateWords];
+    for (size_t i = 0; i < kAvx2Lanes; ++i) {
+        s[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(states[i]));
+    }
+    Transpose(s);
+
+    for (size_t off = 0; off < blocks * kBlockSize; off += kBlockSize) {
+        __m256i w[16];
+        for (size_t half = 0; half < 2; ++half) {
+            __m256i* rows = &w[half * 8];
+            for (size_t i = 0; i < kAvx2Lanes; ++i) {
+                rows[i] = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(data[i] + off + half * 32));
+            }
+            Transpose(rows);
+            for (size_t i = 0; i < 8; ++i) {
+                rows[i] = _mm256_shuffle_epi8(rows[i], kByteSwap);
+            }
+        }
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+        __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+        for (size_t t = 0; t < 64; ++t) {
+            __m256i wt;
+            if (t < 16) {
+                wt = w[t];
+            } else {
+                __m256i w15 = w[(t - 15) % 16];
+                __m256i w2 = w[(t - 2) % 16];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Ror(w15, 7), Ror(w15, 18)),
+                                              _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Ror(w2, 17), Ror(w2, 19)),
+                                              _mm256_srli_epi32(w2, 10));
+                wt = _mm256_add_epi32(_mm256_add_epi32(w[t % 16], s0),
+                                      _mm256_add_epi32(w[(t - 7) % 16], s1));
+                w[t % 16] = wt;
+            }
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Ror(e, 6), Ror(e, 11)), Ror(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1),
+                                          _mm256_add_epi32(ch, _mm256_add_epi32(
+                                              wt, _mm256_set1_epi32(
+                                                      static_cast<int>(kRoundConstants[t])))));
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Ror(a, 2), Ror(a, 13)), Ror(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                                          _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi32(t1, _mm256_add_epi32(s0, maj));
+        }
+        s[0] = _mm256_add_epi32(s[0], a);
+        s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c);
+        s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e);
+        s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g);
+        s[7] = _mm256_add_epi32(s[7], h);
+    }
+
+    Transpose(s);
+    for (size_t i = 0; i < kAvx2Lanes; ++i) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(states[i]), s[i]);
+    }
+}
+
+} // namespace
+
+BlocksFn GetBlocksFn() {
+    return (GetFeatures() & kFeatureShaNi) ? ShaNiBlocks : nullptr;
+}
+
+LanesFn GetLanesFn(size_t* lanes) {
+    // A single SHA-NI stream keeps up with eight AVX2 lanes without having to
+    // gather messages together first.
+    int features = GetFeatures();
+    if ((features & kFeatureShaNi) || !(features & kFeatureAvx2)) {
+        return nullptr;
+    }
+    *lanes = kAvx2Lanes;
+    return Avx2Lanes;
+}
+
+} // namespace sha256
+} // namespace merkle
+
+#endif // __x86_64__
@@ -0,0 +1,41 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Architecture specific SHA-256 block functions used by merkle::Digest in place
+// of cryptolib's portable code, when the CPU supports them.  Each architecture
+// provides its own sha256-$(ARCH).cpp.
+
+namespace merkle {
+namespace sha256 {
+
+constexpr size_t kBlockSize = 64;
+constexpr size_t kStateWords = 8;
+
+// The most messages a |LanesFn| ever hashes at once.
+constexpr size_t kMaxLanes = 8;
+
+// Compresses |blocks| consecutive blocks at |data| into |state|.
+using BlocksFn = void (*)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+// Compresses |blocks| consecutive blocks at each of |data[0..lanes)| into the
+// corresponding, independent, |states[0..lanes)|.
+using LanesFn = void (*)(uint32_t (*states)[kStateWords], const uint8_t* const* data,
+                         size_t blocks);
+
+// Returns the single message block function for this CPU, or null if it has
+// nothing faster than cryptolib.
+BlocksFn GetBlocksFn();
+
+// Returns the multiple message block function for this CPU and sets |lanes| to
+// the number of messages it takes, or returns null if hashing messages one at
+// a time with |GetBlocksFn| is at least as fast.
+LanesFn GetLanesFn(size_t* lanes);
+
+} // namespace sha256
+} // namespace merkle
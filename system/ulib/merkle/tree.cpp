@@ -4,11 +4,13 @@
 
 #include <merkle/tree.h>
 
+#include <pthread.h>
 #include <string.h>
 
 #include <magenta/errors.h>
 #include <magenta/new.h>
 #include <mxtl/algorithm.h>
+#include <mxtl/atomic.h>
 #include <mxtl/unique_ptr.h>
 
 namespace merkle {
@@ -17,6 +19,96 @@ constexpr size_t Tree::kNodeSize;
 const size_t kDigestsPerNode = Tree::kNodeSize / Digest::kLength;
 const size_t kMaxFailures = kDigestsPerNode;
 
+namespace {
+
+// Threads building a tree together take its nodes in groups this large.
+const size_t kNodesPerTask = Digest::kMaxLanes;
+
+// Levels with fewer nodes than this aren't worth starting threads for.
+const size_t kMinParallelNodes = 4 * kNodesPerTask;
+
+// One level of a Merkle tree, and how far hashing it has got.
+struct LevelJob {
+    // The level's nodes, i.e. the data or the level below it.
+    const uint8_t* nodes;
+    size_t len;
+    // The offset of |nodes| in the data or tree, and the level, which are
+    // hashed into each node's digest.
+    uint64_t base;
+    uint64_t level;
+    // Where the digests go.
+    uint8_t* hashes;
+    // The index of the next node no thread has taken yet.
+    mxtl::atomic<size_t> next;
+};
+
+// Hashes groups of nodes from |job| until there are none left.
+void HashLevel(LevelJob* job) {
+    const size_t kNodeSize = Tree::kNodeSize;
+    size_t count = mxtl::roundup(job->len, kNodeSize) / kNodeSize;
+    uint64_t prefixes[Digest::kMaxLanes];
+    const void* bufs[Digest::kMaxLanes];
+    size_t first;
+    while ((first = job->next.fetch_add(kNodesPerTask)) < count) {
+        size_t n = mxtl::min(count - first, kNodesPerTask);
+        // The last node of the data may be short, and is hashed by itself.
+        size_t last_len = job->len - (first + n - 1) * kNodeSize;
+        size_t whole = (last_len < kNodeSize) ? n - 1 : n;
+        for (size_t i = 0; i < whole; ++i) {
+            uint64_t off = (first + i) * kNodeSize;
+            prefixes[i] = (job->base + off) | job->level;
+            bufs[i] = job->nodes + off;
+        }
+        Digest::HashMany(prefixes, bufs, kNodeSize, whole,
+                         job->hashes + first * Digest::kLength);
+        if (whole != n) {
+            uint64_t off = (first + whole) * kNodeSize;
+            uint64_t locality = (job->base + off) | job->level;
+            Digest digest;
+            digest.Init();
+            digest.Update(&locality, sizeof(locality));
+            digest.Update(job->nodes + off, last_len);
+            memcpy(job->hashes + (first + whole) * Digest::kLength, digest.Final(),
+                   Digest::kLength);
+        }
+    }
+}
+
+void* HashLevelThread(void* arg) {
+    HashLevel(static_cast<LevelJob*>(arg));
+    return nullptr;
+}
+
+// Hashes every node of |job| on up to |num_threads| threads, including this
+// one.  If threads can't be started, the ones that are do the work.
+void HashLevelOnThreads(LevelJob* job, size_t num_threads) {
+    size_t count = mxtl::roundup(job->len, Tree::kNodeSize) / Tree::kNodeSize;
+    size_t tasks = mxtl::roundup(count, kNodesPerTask) / kNodesPerTask;
+    size_t helpers = 0;
+    if (count >= kMinParallelNodes) {
+        helpers = mxtl::min(num_threads, tasks) - 1;
+    }
+    AllocChecker ac;
+    mxtl::unique_ptr<pthread_t[]> threads;
+    if (helpers != 0) {
+        threads.reset(new (&ac) pthread_t[helpers]);
+        if (!ac.check()) {
+            helpers = 0;
+        }
+    }
+    size_t started = 0;
+    while (started < helpers &&
+           pthread_create(&threads[started], nullptr, HashLevelThread, job) == 0) {
+        ++started;
+    }
+    HashLevel(job);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], nullptr);
+    }
+}
+
+} // namespace
+
 Tree::~Tree() {}
 
 // Public methods
@@ -92,6 +184,16 @@ mx_status_t Tree::CreateFinal(void* tree, Digest* digest) {
     uint8_t* end =
         static_cast<uint8_t*>(tree) + offsets_[offsets_.size() - 1] + kNodeSize;
     while (level_ < offsets_.size()) {
+        size_t count = static_cast<size_t>((offsets_[level_] - offset_) / kNodeSize);
+        count = mxtl::min(count, Digest::kMaxLanes);
+        if (count > 1) {
+            HashNodes(static_cast<uint8_t*>(tree) + offset_, count, hash);
+            hash += count * Digest::kLength;
+            if (offset_ == offsets_[level_]) {
+                ++level_;
+            }
+            continue;
+        }
         HashNode(tree);
         mx_status_t rc = digest_.CopyTo(hash, end - hash);
         if (rc != NO_ERROR) {
@@ -124,7 +226,53 @@ mx_status_t Tree::Create(const void* data, size_t data_len, void* tree,
     return NO_ERROR;
 }
 
+mx_status_t Tree::CreateParallel(const void* data, size_t data_len, void* tree,
+                                 size_t tree_len, Digest* digest,
+                                 size_t num_threads) {
+    if (num_threads < 2 || data_len < kMinParallelNodes * kNodeSize) {
+        return Create(data, data_len, tree, tree_len, digest);
+    }
+    if (!data || !digest) {
+        return ERR_INVALID_ARGS;
+    }
+    mx_status_t rc = CreateInit(data_len, tree, tree_len);
+    if (rc != NO_ERROR) {
+        return rc;
+    }
+
+    // Each level can only be started once the one below it is complete.
+    uint8_t* nodes = static_cast<uint8_t*>(tree);
+    LevelJob job;
+    job.nodes = static_cast<const uint8_t*>(data);
+    job.len = data_len;
+    job.base = 0;
+    job.level = 0;
+    job.hashes = nodes;
+    job.next.store(0);
+    HashLevelOnThreads(&job, num_threads);
+    for (level_ = 1; level_ < offsets_.size(); ++level_) {
+        job.nodes = nodes + offsets_[level_ - 1];
+        job.len = static_cast<size_t>(offsets_[level_] - offsets_[level_ - 1]);
+        job.base = offsets_[level_ - 1];
+        job.level = level_;
+        job.hashes = nodes + offsets_[level_];
+        job.next.store(0);
+        HashLevelOnThreads(&job, num_threads);
+    }
+
+    // The root is the single node at the top.
+    offset_ = offsets_[level_ - 1];
+    HashNode(tree);
+    *digest = digest_;
+    return NO_ERROR;
+}
+
 mx_status_t Tree::SetRanges(size_t data_len, uint64_t offset, size_t length) {
+    // The shape of the tree follows from |data_len| alone.
+    mx_status_t rc = SetLengths(data_len, GetTreeLength(data_len));
+    if (rc != NO_ERROR) {
+        return rc;
+    }
     uint64_t finish = offset + length;
     if (finish < offset || finish > data_len) {
         return ERR_INVALID_ARGS;
@@ -197,6 +345,25 @@ mx_status_t Tree::Verify(const void* data, size_t data_len, const void* tree,
                           (offset_ - offsets_[level_ - 1]) / kDigestsPerNode;
         }
         while (offset_ < finish) {
+            size_t count = static_cast<size_t>((finish - offset_) / kNodeSize);
+            count = mxtl::min(count, Digest::kMaxLanes);
+            if (count > 1) {
+                uint8_t digests[Digest::kMaxLanes * Digest::kLength];
+                uint64_t start = offset_;
+                HashNodes(static_cast<const uint8_t*>(level_ == 0 ? data : tree) + start,
+                          count, digests);
+                for (size_t i = 0; i < count; ++i) {
+                    if (memcmp(digests + i * Digest::kLength, hashes + hash_offset,
+                               Digest::kLength) != 0) {
+                        // Failures are recorded by the offset just past the node
+                        offset_ = start + (i + 1) * kNodeSize;
+                        AddFailure();
+                    }
+                    hash_offset += Digest::kLength;
+                }
+                offset_ = start + count * kNodeSize;
+                continue;
+            }
             HashNode(level_ == 0 ? data : tree);
             if (digest_ != hashes + hash_offset) {
                 AddFailure();
@@ -248,6 +415,18 @@ mx_status_t Tree::SetLengths(size_t data_len, size_t tree_len) {
     return NO_ERROR;
 }
 
+void Tree::HashNodes(const uint8_t* bytes, size_t count, uint8_t* hashes) {
+    MX_DEBUG_ASSERT(count <= Digest::kMaxLanes);
+    uint64_t prefixes[Digest::kMaxLanes];
+    const void* bufs[Digest::kMaxLanes];
+    for (size_t i = 0; i < count; ++i) {
+        prefixes[i] = static_cast<uint64_t>(offset_ | level_);
+        bufs[i] = bytes + i * kNodeSize;
+        offset_ += kNodeSize;
+    }
+    Digest::HashMany(prefixes, bufs, kNodeSize, count, hashes);
+}
+
 void Tree::HashNode(const void* data) {
     const uint8_t* bytes = static_cast<const uint8_t*>(data) + offset_;
     digest_.Init();
@@ -270,6 +449,16 @@ mx_status_t Tree::HashData(const void* data, size_t length, void* tree) {
     hashes += (offset_ / kNodeSize) * Digest::kLength;
     end += offsets_.size() > 1 ? offsets_[1] : kNodeSize;
     while (length > 0) {
+        if (hashes && offset_ % kNodeSize == 0 && length >= 2 * kNodeSize) {
+            // Runs of whole nodes are hashed several at a time
+            size_t count = mxtl::min(length / kNodeSize, Digest::kMaxLanes);
+            MX_DEBUG_ASSERT(hashes + count * Digest::kLength <= end);
+            HashNodes(bytes, count, hashes);
+            bytes += count * kNodeSize;
+            length -= count * kNodeSize;
+            hashes += count * Digest::kLength;
+            continue;
+        }
         if (offset_ % kNodeSize == 0) {
             digest_.Init();
             uint64_t locality = static_cast<uint64_t>(offset_ | level_);
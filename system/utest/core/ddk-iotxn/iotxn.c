@@ -0,0 +1,199 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <ddk/driver.h>
+#include <ddk/iotxn.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+
+#include <magenta/syscalls.h>
+#include <unittest/unittest.h>
+
+// iotxn buffers are contiguous VMOs, which take the root resource to create.
+extern mx_handle_t root_resource;
+
+mx_handle_t get_root_resource(void) {
+    return root_resource;
+}
+
+static bool all_bytes(iotxn_t* txn, size_t len, uint8_t value) {
+    uint8_t buf[256];
+    for (size_t off = 0; off < len; off += sizeof(buf)) {
+        size_t n = (len - off < sizeof(buf)) ? len - off : sizeof(buf);
+        txn->ops->copyfrom(txn, buf, n, off);
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i] != value) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void fill(iotxn_t* txn, size_t len, uint8_t value) {
+    uint8_t buf[256];
+    memset(buf, value, sizeof(buf));
+    for (size_t off = 0; off < len; off += sizeof(buf)) {
+        txn->ops->copyto(txn, buf, sizeof(buf), off);
+    }
+}
+
+static bool iotxn_reuse_test(void) {
+    BEGIN_TEST;
+    ASSERT_NEQ(root_resource, MX_HANDLE_INVALID, "no root resource handle");
+
+    iotxn_t* txn;
+    ASSERT_EQ(iotxn_alloc(&txn, 0, 5000, 16), NO_ERROR, "");
+    fill(txn, 5000, 0xa5);
+    memset(txn->extra, 0x5a, 16);
+    txn->ops->release(txn);
+
+    iotxn_pool_stats_t before, after;
+    iotxn_pool_get_stats(&before);
+
+    // a request of the same size class on the same thread gets the same
+    // iotxn back, cleared
+    iotxn_t* again;
+    ASSERT_EQ(iotxn_alloc(&again, 0, 6000, 8), NO_ERROR, "");
+    iotxn_pool_get_stats(&after);
+    EXPECT_EQ(again, txn, "iotxn was not reused");
+    EXPECT_EQ(after.cache_hits - before.cache_hits, 1u, "");
+    EXPECT_TRUE(all_bytes(again, 6000, 0), "buffer not cleared");
+    for (size_t i = 0; i < 8; i++) {
+        EXPECT_EQ(again->extra[i], 0u, "extra data not cleared");
+    }
+    EXPECT_EQ(again->length, 0u, "");
+    again->ops->release(again);
+
+    // unless it is to be overwritten
+    ASSERT_EQ(iotxn_alloc(&txn, 0, 5000, 0), NO_ERROR, "");
+    fill(txn, 5000, 0xa5);
+    txn->ops->release(txn);
+    ASSERT_EQ(iotxn_alloc(&again, IOTXN_ALLOC_NOZERO, 5000, 0), NO_ERROR, "");
+    EXPECT_EQ(again, txn, "iotxn was not reused");
+    EXPECT_TRUE(all_bytes(again, 5000, 0xa5), "buffer was cleared");
+    again->ops->release(again);
+    END_TEST;
+}
+
+static bool iotxn_size_class_test(void) {
+    BEGIN_TEST;
+    ASSERT_NEQ(root_resource, MX_HANDLE_INVALID, "no root resource handle");
+
+    // a large buffer is never handed to a small request
+    iotxn_t* large;
+    ASSERT_EQ(iotxn_alloc(&large, 0, 512 * 1024, 0), NO_ERROR, "");
+    large->ops->release(large);
+    iotxn_t* small;
+    ASSERT_EQ(iotxn_alloc(&small, 0, 512, 0), NO_ERROR, "");
+    EXPECT_NEQ(small, large, "");
+    small->ops->release(small);
+
+    // and one too large for any pool is freed when released
+    iotxn_pool_stats_t before, after;
+    iotxn_pool_get_stats(&before);
+    ASSERT_EQ(iotxn_alloc(&large, 0, 1024 * 1024 + 1, 0), NO_ERROR, "");
+    large->ops->release(large);
+    iotxn_pool_get_stats(&after);
+    EXPECT_EQ(after.frees - before.frees, 1u, "");
+    END_TEST;
+}
+
+#define THREAD_TXNS 3
+
+static int alloc_and_exit(void* arg) {
+    iotxn_t* txns[THREAD_TXNS];
+    for (size_t i = 0; i < THREAD_TXNS; i++) {
+        if (iotxn_alloc(&txns[i], 0, 0, 0) != NO_ERROR) {
+            return -1;
+        }
+    }
+    iotxn_pool_get_stats(arg);
+    for (size_t i = 0; i < THREAD_TXNS; i++) {
+        txns[i]->ops->release(txns[i]);
+    }
+    return 0;
+}
+
+static bool iotxn_thread_exit_test(void) {
+    BEGIN_TEST;
+    // A thread's cache goes back to the shared pools when it exits
+    iotxn_pool_stats_t before, after;
+    thrd_t thread;
+    ASSERT_EQ(thrd_create(&thread, alloc_and_exit, &before), thrd_success, "");
+    int rc;
+    ASSERT_EQ(thrd_join(thread, &rc), thrd_success, "");
+    ASSERT_EQ(rc, 0, "");
+    iotxn_pool_get_stats(&after);
+    EXPECT_EQ(after.pooled - before.pooled, (uint64_t)THREAD_TXNS, "");
+    END_TEST;
+}
+
+#define BENCH_ROUNDS 10000
+#define BENCH_THREADS 4
+
+typedef struct {
+    size_t size;
+    uint32_t flags;
+} bench_args_t;
+
+static int bench_thread(void* arg) {
+    bench_args_t* args = arg;
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        iotxn_t* txn;
+        if (iotxn_alloc(&txn, args->flags, args->size, 0) != NO_ERROR) {
+            return -1;
+        }
+        txn->ops->release(txn);
+    }
+    return 0;
+}
+
+static bool bench(size_t size, uint32_t flags, int nthreads) {
+    BEGIN_HELPER;
+    bench_args_t args = { .size = size, .flags = flags };
+    thrd_t threads[BENCH_THREADS];
+    mx_time_t start = mx_time_get(MX_CLOCK_MONOTONIC);
+    for (int i = 0; i < nthreads; i++) {
+        ASSERT_EQ(thrd_create(&threads[i], bench_thread, &args), thrd_success, "");
+    }
+    for (int i = 0; i < nthreads; i++) {
+        int rc;
+        ASSERT_EQ(thrd_join(threads[i], &rc), thrd_success, "");
+        ASSERT_EQ(rc, 0, "");
+    }
+    mx_time_t elapsed = mx_time_get(MX_CLOCK_MONOTONIC) - start;
+    uint64_t ops = (uint64_t)BENCH_ROUNDS * nthreads;
+    printf("\n\t%zu bytes%s, %d thread(s): %" PRIu64 " allocs/s",
+           size, (flags & IOTXN_ALLOC_NOZERO) ? " (no zeroing)" : "", nthreads,
+           (ops * MX_SEC(1)) / (elapsed ? elapsed : 1));
+    END_HELPER;
+}
+
+static bool iotxn_alloc_benchmark(void) {
+    BEGIN_TEST;
+    ASSERT_NEQ(root_resource, MX_HANDLE_INVALID, "no root resource handle");
+    static const size_t sizes[] = { 512, 8192, 65536 };
+    for (size_t i = 0; i < countof(sizes); i++) {
+        ASSERT_TRUE(bench(sizes[i], 0, 1), "");
+        ASSERT_TRUE(bench(sizes[i], IOTXN_ALLOC_NOZERO, 1), "");
+        ASSERT_TRUE(bench(sizes[i], IOTXN_ALLOC_NOZERO, BENCH_THREADS), "");
+    }
+    iotxn_pool_stats_t stats;
+    iotxn_pool_get_stats(&stats);
+    printf("\n\t%" PRIu64 " allocs, %" PRIu64 " from thread caches, %" PRIu64 " from pools,"
+           " %" PRIu64 " pooled (%" PRIu64 " bytes)\n", stats.allocs, stats.cache_hits,
+           stats.pool_hits, stats.pooled, stats.pooled_bytes);
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(ddk_iotxn_tests)
+RUN_TEST(iotxn_reuse_test)
+RUN_TEST(iotxn_size_class_test)
+RUN_TEST(iotxn_thread_exit_test)
+RUN_TEST(iotxn_alloc_benchmark)
+END_TEST_CASE(ddk_iotxn_tests)
@@ -19,6 +19,7 @@ typedef struct fs_info {
     bool can_be_mounted;
     bool can_mount_sub_filesystems;
     bool supports_hardlinks;
+    bool supports_huge_files; // Files may grow to several GB
 } fs_info_t;
 
 // Path to mounted filesystem currently being tested
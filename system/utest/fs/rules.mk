@@ -26,6 +26,7 @@ MODULE_SRCS := \
     $(LOCAL_DIR)/test-rw-workers.c \
     $(LOCAL_DIR)/test-rename.c \
     $(LOCAL_DIR)/test-random-op.c \
+    $(LOCAL_DIR)/test-sequential-read.c \
     $(LOCAL_DIR)/test-sync.c \
     $(LOCAL_DIR)/test-truncate.c \
     $(LOCAL_DIR)/test-unlink.c \
@@ -0,0 +1,95 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <magenta/syscalls.h>
+
+#include "filesystems.h"
+#include "misc.h"
+
+#define FILE_SIZE (16 * 1024 * 1024)
+#define BUF_SIZE 8192
+
+// Every word of the file holds its own offset, so misplaced blocks show up
+static void fill_buffer(uint32_t* buf, size_t off) {
+    for (size_t i = 0; i < BUF_SIZE / sizeof(uint32_t); i++) {
+        buf[i] = (uint32_t)(off + i * sizeof(uint32_t));
+    }
+}
+
+static bool check_buffer(const uint32_t* buf, size_t off) {
+    for (size_t i = 0; i < BUF_SIZE / sizeof(uint32_t); i++) {
+        if (buf[i] != (uint32_t)(off + i * sizeof(uint32_t))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void print_rate(const char* what, mx_time_t start) {
+    mx_time_t elapsed = mx_time_get(MX_CLOCK_MONOTONIC) - start;
+    fprintf(stderr, "%s: %d MB in %llu us (%llu MB/s)\n", what, FILE_SIZE / (1024 * 1024),
+            (unsigned long long)(elapsed / 1000),
+            (unsigned long long)((FILE_SIZE * 1000000000ULL) / (elapsed ? elapsed : 1) /
+                                 (1024 * 1024)));
+}
+
+bool test_sequential_read(void) {
+    BEGIN_TEST;
+
+    uint32_t* buf = malloc(BUF_SIZE);
+    ASSERT_NONNULL(buf, "");
+
+    int fd = open("::seqfile", O_CREAT | O_RDWR, 0644);
+    ASSERT_GT(fd, 0, "");
+    for (size_t off = 0; off < FILE_SIZE; off += BUF_SIZE) {
+        fill_buffer(buf, off);
+        ASSERT_STREAM_ALL(write, fd, buf, BUF_SIZE);
+    }
+    ASSERT_EQ(close(fd), 0, "");
+
+    // Start from cold caches where the filesystem allows it
+    if (test_info->can_be_mounted) {
+        ASSERT_TRUE(check_remount(), "Could not remount filesystem");
+    }
+
+    fd = open("::seqfile", O_RDONLY, 0644);
+    ASSERT_GT(fd, 0, "");
+    mx_time_t start = mx_time_get(MX_CLOCK_MONOTONIC);
+    for (size_t off = 0; off < FILE_SIZE; off += BUF_SIZE) {
+        ASSERT_STREAM_ALL(read, fd, buf, BUF_SIZE);
+        ASSERT_TRUE(check_buffer(buf, off), "Sequential read returned bad data");
+    }
+    print_rate("sequential read", start);
+    ASSERT_EQ(close(fd), 0, "");
+
+    if (test_info->can_be_mounted) {
+        ASSERT_TRUE(check_remount(), "Could not remount filesystem");
+    }
+
+    // Walking the file backwards defeats readahead
+    fd = open("::seqfile", O_RDONLY, 0644);
+    ASSERT_GT(fd, 0, "");
+    start = mx_time_get(MX_CLOCK_MONOTONIC);
+    for (size_t off = FILE_SIZE; off > 0; off -= BUF_SIZE) {
+        ASSERT_EQ(pread(fd, buf, BUF_SIZE, off - BUF_SIZE), BUF_SIZE, "");
+        ASSERT_TRUE(check_buffer(buf, off - BUF_SIZE), "Backwards read returned bad data");
+    }
+    print_rate("backwards read", start);
+    ASSERT_EQ(close(fd), 0, "");
+
+    ASSERT_EQ(unlink("::seqfile"), 0, "");
+    free(buf);
+    END_TEST;
+}
+
+RUN_FOR_ALL_FILESYSTEMS(sequential_read_tests,
+    RUN_TEST_LARGE(test_sequential_read)
+)
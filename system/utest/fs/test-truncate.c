@@ -162,7 +162,44 @@ bool test_truncate_large(void) {
     END_TEST;
 }
 
+// Test that a sparse file may grow past the reach of block pointers, which
+// used to cap minfs files at 512MB
+bool test_truncate_sparse_huge(void) {
+    if (!test_info->supports_huge_files) {
+        return true;
+    }
+    BEGIN_TEST;
+
+    const char* filename = "::alpha";
+    const off_t far = 3LL * 1024 * 1024 * 1024;
+    const char* str = "Hello, World!\n";
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(fd, 0, "");
+    ASSERT_EQ(pwrite(fd, str, strlen(str), far), (ssize_t)strlen(str), "");
+
+    struct stat st;
+    ASSERT_EQ(fstat(fd, &st), 0, "");
+    ASSERT_EQ(st.st_size, far + (off_t)strlen(str), "");
+    char buf[32];
+    ASSERT_EQ(pread(fd, buf, strlen(str), far), (ssize_t)strlen(str), "");
+    ASSERT_EQ(memcmp(buf, str, strlen(str)), 0, "");
+    // The hole in between reads as zeroes
+    ASSERT_EQ(pread(fd, buf, sizeof(buf), far / 2), (ssize_t)sizeof(buf), "");
+    for (size_t n = 0; n < sizeof(buf); n++) {
+        ASSERT_EQ(buf[n], 0, "");
+    }
+
+    ASSERT_EQ(ftruncate(fd, far / 2), 0, "");
+    ASSERT_EQ(fstat(fd, &st), 0, "");
+    ASSERT_EQ(st.st_size, far / 2, "");
+    ASSERT_EQ(close(fd), 0, "");
+    ASSERT_EQ(unlink(filename), 0, "");
+
+    END_TEST;
+}
+
 RUN_FOR_ALL_FILESYSTEMS(truncate_tests,
     RUN_TEST_MEDIUM(test_truncate_small)
     RUN_TEST_LARGE(test_truncate_large)
+    RUN_TEST_MEDIUM(test_truncate_sparse_huge)
 )
@@ -0,0 +1,128 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <merkle/digest.h>
+#include <merkle/tree.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <magenta/new.h>
+#include <magenta/status.h>
+#include <magenta/syscalls.h>
+#include <mxtl/unique_ptr.h>
+#include <unittest/unittest.h>
+
+// These benchmarks report how quickly ulib/merkle hashes data and builds and
+// checks trees.  They only fail if the library itself does.
+
+namespace {
+
+using merkle::Digest;
+using merkle::Tree;
+
+const size_t kDataLen = 16 * 1024 * 1024;
+const int kRounds = 4;
+
+void PrintRate(const char* what, mx_time_t elapsed) {
+    uint64_t bytes = static_cast<uint64_t>(kDataLen) * kRounds;
+    printf("\n\t%s: %" PRIu64 " MB/s", what,
+           (bytes * MX_SEC(1)) / (elapsed ? elapsed : 1) / (1024 * 1024));
+}
+
+template <typename T>
+mx_time_t TimeIt(T func) {
+    mx_time_t start = mx_time_get(MX_CLOCK_MONOTONIC);
+    for (int i = 0; i < kRounds; ++i) {
+        func();
+    }
+    return mx_time_get(MX_CLOCK_MONOTONIC) - start;
+}
+
+mxtl::unique_ptr<uint8_t[]> AllocRandom(size_t len) {
+    AllocChecker ac;
+    mxtl::unique_ptr<uint8_t[]> buf(new (&ac) uint8_t[len]);
+    if (!ac.check()) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = static_cast<uint8_t>(rand());
+    }
+    return buf;
+}
+
+bool BenchmarkDigest(void) {
+    BEGIN_TEST;
+    mxtl::unique_ptr<uint8_t[]> data = AllocRandom(kDataLen);
+    ASSERT_NONNULL(data.get(), "Out of memory");
+    Digest digest;
+    PrintRate("Digest::Hash", TimeIt([&]() { digest.Hash(data.get(), kDataLen); }));
+    END_TEST;
+}
+
+bool BenchmarkHashMany(void) {
+    BEGIN_TEST;
+    mxtl::unique_ptr<uint8_t[]> data = AllocRandom(kDataLen);
+    ASSERT_NONNULL(data.get(), "Out of memory");
+    uint64_t prefixes[Digest::kMaxLanes];
+    const void* bufs[Digest::kMaxLanes];
+    uint8_t out[Digest::kMaxLanes * Digest::kLength];
+    mx_time_t elapsed = TimeIt([&]() {
+        for (size_t off = 0; off < kDataLen; off += Digest::kMaxLanes * Tree::kNodeSize) {
+            for (size_t i = 0; i < Digest::kMaxLanes; ++i) {
+                prefixes[i] = off + i * Tree::kNodeSize;
+                bufs[i] = &data[prefixes[i]];
+            }
+            Digest::HashMany(prefixes, bufs, Tree::kNodeSize, Digest::kMaxLanes, out);
+        }
+    });
+    PrintRate("Digest::HashMany", elapsed);
+    END_TEST;
+}
+
+bool BenchmarkTree(void) {
+    BEGIN_TEST;
+    mxtl::unique_ptr<uint8_t[]> data = AllocRandom(kDataLen);
+    ASSERT_NONNULL(data.get(), "Out of memory");
+    size_t tree_len = Tree::GetTreeLength(kDataLen);
+    AllocChecker ac;
+    mxtl::unique_ptr<uint8_t[]> tree(new (&ac) uint8_t[tree_len]);
+    ASSERT_TRUE(ac.check(), "Out of memory");
+    Tree mt;
+    Digest digest;
+    mx_status_t rc = NO_ERROR;
+    mx_time_t elapsed = TimeIt([&]() {
+        if (rc == NO_ERROR) {
+            rc = mt.Create(data.get(), kDataLen, tree.get(), tree_len, &digest);
+        }
+    });
+    ASSERT_EQ(rc, NO_ERROR, mx_status_get_string(rc));
+    PrintRate("Tree::Create", elapsed);
+    size_t num_cpus = mx_system_get_num_cpus();
+    elapsed = TimeIt([&]() {
+        if (rc == NO_ERROR) {
+            rc = mt.CreateParallel(data.get(), kDataLen, tree.get(), tree_len, &digest,
+                                   num_cpus);
+        }
+    });
+    ASSERT_EQ(rc, NO_ERROR, mx_status_get_string(rc));
+    PrintRate("Tree::CreateParallel", elapsed);
+    elapsed = TimeIt([&]() {
+        if (rc == NO_ERROR) {
+            rc = mt.Verify(data.get(), kDataLen, tree.get(), tree_len, 0, kDataLen, digest);
+        }
+    });
+    ASSERT_EQ(rc, NO_ERROR, mx_status_get_string(rc));
+    PrintRate("Tree::Verify", elapsed);
+    END_TEST;
+}
+
+} // namespace
+
+BEGIN_TEST_CASE(MerkleBenchmarks)
+RUN_TEST_LARGE(BenchmarkDigest)
+RUN_TEST_LARGE(BenchmarkHashMany)
+RUN_TEST_LARGE(BenchmarkTree)
+END_TEST_CASE(MerkleBenchmarks)
@@ -81,6 +81,40 @@ bool DigestSplit(void) {
     END_TEST;
 }
 
+bool DigestHashMany(void) {
+    BEGIN_TEST;
+    // Lengths either side of where the prefixed message fills blocks
+    const size_t kLengths[] = {0, 1, 55, 56, 57, 63, 64, 119, 120, 121, 8192};
+    const size_t kCount = Digest::kMaxLanes + 1;
+    static uint8_t data[kCount][8192];
+    for (size_t i = 0; i < kCount; ++i) {
+        for (size_t j = 0; j < sizeof(data[i]); ++j) {
+            data[i][j] = static_cast<uint8_t>(rand());
+        }
+    }
+    uint64_t prefixes[kCount];
+    const void* bufs[kCount];
+    for (size_t i = 0; i < kCount; ++i) {
+        prefixes[i] = i * 8192;
+        bufs[i] = data[i];
+    }
+    uint8_t actual[kCount * Digest::kLength];
+    Digest expected;
+    for (size_t len : kLengths) {
+        for (size_t count = 1; count <= kCount; ++count) {
+            Digest::HashMany(prefixes, bufs, len, count, actual);
+            for (size_t i = 0; i < count; ++i) {
+                expected.Init();
+                expected.Update(&prefixes[i], sizeof(prefixes[i]));
+                expected.Update(bufs[i], len);
+                expected.Final();
+                ASSERT_TRUE(expected == actual + i * Digest::kLength, __FUNCTION__);
+            }
+        }
+    }
+    END_TEST;
+}
+
 bool DigestCWrappers(void) {
     BEGIN_TEST;
     uint8_t buf[Digest::kLength];
@@ -134,6 +168,7 @@ RUN_TEST(DigestStrings)
 RUN_TEST(DigestZero)
 RUN_TEST(DigestSelf)
 RUN_TEST(DigestSplit)
+RUN_TEST(DigestHashMany)
 RUN_TEST(DigestCWrappers)
 RUN_TEST(DigestEquality)
 END_TEST_CASE(MerkleDigestTests)
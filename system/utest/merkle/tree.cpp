@@ -312,6 +312,35 @@ bool Create(void) {
     END_TEST;
 }
 
+bool CreateParallel(void) {
+    BEGIN_TEST;
+    const size_t kLengths[] = {kSmall, kLarge, kUnaligned, sizeof(gData)};
+    const size_t kThreads[] = {1, 2, 3, 8};
+    static uint8_t tree[1 << 20];
+    for (size_t i = 0; i < sizeof(gData); ++i) {
+        gData[i] = static_cast<uint8_t>(rand());
+    }
+    Tree merkleTree;
+    Digest expected;
+    for (size_t len : kLengths) {
+        gDataLen = len;
+        gTreeLen = merkleTree.GetTreeLength(gDataLen);
+        ASSERT_LE(gTreeLen, sizeof(tree), "Tree too large for test");
+        mx_status_t rc =
+            merkleTree.Create(gData, gDataLen, gTree, gTreeLen, &expected);
+        ASSERT_EQ(rc, NO_ERROR, mx_status_get_string(rc));
+        for (size_t threads : kThreads) {
+            memset(tree, 0xff, gTreeLen);
+            rc = merkleTree.CreateParallel(gData, gDataLen, tree, gTreeLen,
+                                           &gDigest, threads);
+            ASSERT_EQ(rc, NO_ERROR, mx_status_get_string(rc));
+            ASSERT_TRUE(gDigest == expected, "Incorrect root digest");
+            ASSERT_EQ(memcmp(tree, gTree, gTreeLen), 0, "Incorrect tree");
+        }
+    }
+    END_TEST;
+}
+
 bool CreateCWrappers(void) {
     BEGIN_TEST;
     InitZeroData(kSmall);
@@ -517,6 +546,21 @@ bool SetRangesUnalignedLength(void) {
     END_TEST;
 }
 
+bool SetRangesBeforeCreate(void) {
+    BEGIN_TEST;
+    Tree merkleTree;
+    InitZeroData(kLarge);
+    mx_status_t rc = merkleTree.SetRanges(gDataLen, gOffset, gLength);
+    ASSERT_EQ(rc, NO_ERROR, mx_status_get_string(rc));
+    const auto& ranges = merkleTree.ranges();
+    ASSERT_EQ(ranges.size(), 2, "number of ranges");
+    ASSERT_EQ(ranges[0].offset, 0, "offset 0");
+    ASSERT_EQ(ranges[0].length, kNodeSize, "length 0");
+    ASSERT_EQ(ranges[1].offset, kNodeSize * 2, "offset 1");
+    ASSERT_EQ(ranges[1].length, kNodeSize, "length 1");
+    END_TEST;
+}
+
 bool SetRangesOutOfBounds(void) {
     BEGIN_TEST;
     Tree merkleTree;
@@ -990,6 +1034,7 @@ RUN_TEST(CreateFinalWithoutTree)
 RUN_TEST(CreateFinalMissingDigest)
 RUN_TEST(CreateFinalIncompleteData)
 RUN_TEST(Create)
+RUN_TEST(CreateParallel)
 RUN_TEST(CreateCWrappers)
 RUN_TEST(CreateByteByByte)
 RUN_TEST(CreateWithoutData)
@@ -1003,6 +1048,7 @@ RUN_TEST(SetRangesEmpty)
 RUN_TEST(SetRangesFull)
 RUN_TEST(SetRangesUnalignedOffset)
 RUN_TEST(SetRangesUnalignedLength)
+RUN_TEST(SetRangesBeforeCreate)
 RUN_TEST(SetRangesOutOfBounds)
 RUN_TEST(Verify)
 RUN_TEST(VerifyCWrapper)
@@ -17,6 +17,7 @@
 #include <block-client/client.h>
 #include <magenta/cpp.h>
 #include <magenta/device/block.h>
+#include <magenta/device/device.h>
 #include <magenta/device/ramdisk.h>
 #include <magenta/syscalls.h>
 #include <mxtl/array.h>
@@ -145,6 +146,72 @@ bool ramdisk_test_multiple(void) {
     END_TEST;
 }
 
+bool ramdisk_test_cache(void) {
+    uint8_t buf[PAGE_SIZE * 2];
+    uint8_t out[PAGE_SIZE * 2];
+
+    BEGIN_TEST;
+    const char* name = "ramdisk-test-cache";
+    int fd = get_ramdisk(name, PAGE_SIZE, 512);
+    const char* driver = "block-cache";
+    ASSERT_EQ(ioctl_device_bind(fd, driver, strlen(driver)), NO_ERROR, "");
+    // Same as in get_ramdisk (MG-468)
+    usleep(100000);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/block/cache/block", RAMCTL_PATH, name);
+    int cfd = open(path, O_RDWR);
+    ASSERT_GE(cfd, 0, "Could not open cached device");
+
+    memset(buf, 'a', sizeof(buf));
+    ASSERT_EQ(write(cfd, buf, sizeof(buf)), (ssize_t) sizeof(buf), "");
+
+    // The first read goes to the ramdisk, and the second comes from the
+    // cache. Anything else reading the device, like the block watcher
+    // probing its first block, bumps the counts too, so only check that
+    // they grow.
+    block_cache_stats_t before, after;
+    ASSERT_EQ(ioctl_block_cache_get_stats(cfd, &before), (ssize_t) sizeof(before), "");
+    ASSERT_EQ(lseek(cfd, 0, SEEK_SET), 0, "");
+    ASSERT_EQ(read(cfd, out, sizeof(out)), (ssize_t) sizeof(out), "");
+    ASSERT_EQ(memcmp(out, buf, sizeof(out)), 0, "");
+    ASSERT_EQ(ioctl_block_cache_get_stats(cfd, &after), (ssize_t) sizeof(after), "");
+    ASSERT_GT(after.misses, before.misses, "");
+
+    before = after;
+    memset(out, 0, sizeof(out));
+    ASSERT_EQ(lseek(cfd, 0, SEEK_SET), 0, "");
+    ASSERT_EQ(read(cfd, out, sizeof(out)), (ssize_t) sizeof(out), "");
+    ASSERT_EQ(memcmp(out, buf, sizeof(out)), 0, "");
+    ASSERT_EQ(ioctl_block_cache_get_stats(cfd, &after), (ssize_t) sizeof(after), "");
+    ASSERT_GE(after.hits, before.hits + 2, "");
+
+    // Writes replace what was cached
+    before = after;
+    memset(buf + PAGE_SIZE, 'b', PAGE_SIZE);
+    ASSERT_EQ(lseek(cfd, 0, SEEK_SET), 0, "");
+    ASSERT_EQ(write(cfd, buf, sizeof(buf)), (ssize_t) sizeof(buf), "");
+    ASSERT_EQ(lseek(cfd, 0, SEEK_SET), 0, "");
+    ASSERT_EQ(read(cfd, out, sizeof(out)), (ssize_t) sizeof(out), "");
+    ASSERT_EQ(memcmp(out, buf, sizeof(out)), 0, "");
+    ASSERT_EQ(ioctl_block_cache_get_stats(cfd, &after), (ssize_t) sizeof(after), "");
+    ASSERT_GT(after.invalidations, before.invalidations, "");
+
+    // As does the underlying device, once the cache is emptied
+    block_cache_config_t config;
+    config.size = 0;
+    ASSERT_EQ(ioctl_block_cache_config(cfd, &config), NO_ERROR, "");
+    ASSERT_EQ(lseek(cfd, 0, SEEK_SET), 0, "");
+    ASSERT_EQ(read(cfd, out, sizeof(out)), (ssize_t) sizeof(out), "");
+    ASSERT_EQ(memcmp(out, buf, sizeof(out)), 0, "");
+    ASSERT_EQ(ioctl_block_cache_get_stats(cfd, &after), (ssize_t) sizeof(after), "");
+    ASSERT_EQ(after.size, 0u, "");
+
+    ASSERT_EQ(close(cfd), 0, "");
+    ASSERT_GE(ioctl_ramdisk_unlink(fd), 0, "Could not unlink ramdisk device");
+    close(fd);
+    END_TEST;
+}
+
 bool ramdisk_test_fifo_no_op(void) {
     // Get a FIFO connection to a ramdisk and immediately close it
     BEGIN_TEST;
@@ -383,6 +450,287 @@ bool ramdisk_test_fifo_multiple_vmo(void) {
     END_TEST;
 }
 
+bool ramdisk_test_fifo_scheduling(void) {
+    BEGIN_TEST;
+    const size_t kBlockSize = 512;
+    int fd = get_ramdisk("ramdisk-test-fifo", kBlockSize, 1 << 18);
+    mx_handle_t fifo;
+    ssize_t expected = sizeof(fifo);
+    block_stats_t stats;
+    ASSERT_EQ(ioctl_block_get_stats(fd, &stats), ERR_BAD_STATE, "No FIFO server yet");
+    ASSERT_EQ(ioctl_block_get_fifos(fd, &fifo), expected, "Failed to get FIFO");
+    txnid_t txnid;
+    expected = sizeof(txnid);
+    ASSERT_EQ(ioctl_block_alloc_txn(fd, &txnid), expected, "Failed to allocate txn");
+    fifo_client_t* client;
+    ASSERT_EQ(block_fifo_create_client(fifo, &client), NO_ERROR, "");
+
+    test_vmo_object_t obj;
+    ASSERT_TRUE(create_vmo_helper(fd, &obj, kBlockSize), "");
+
+    // Write the vmo one block at a time, backwards, so the server has to
+    // reorder the requests before it can merge them.
+    size_t blocks = obj.vmo_size / kBlockSize;
+    AllocChecker ac;
+    mxtl::Array<block_fifo_request_t> requests(new (&ac) block_fifo_request_t[blocks], blocks);
+    ASSERT_TRUE(ac.check(), "");
+    for (size_t b = 0; b < blocks; b++) {
+        size_t block = blocks - 1 - b;
+        requests[b].txnid      = txnid;
+        requests[b].vmoid      = obj.vmoid;
+        requests[b].opcode     = BLOCKIO_WRITE;
+        requests[b].length     = static_cast<uint32_t>(kBlockSize);
+        requests[b].vmo_offset = block * kBlockSize;
+        requests[b].dev_offset = block * kBlockSize;
+    }
+    ASSERT_EQ(block_fifo_txn(client, &requests[0], requests.size()), NO_ERROR, "");
+    ASSERT_TRUE(read_striped_vmo_helper(client, &obj, 0, 1, txnid, kBlockSize), "");
+
+    expected = sizeof(stats);
+    ASSERT_EQ(ioctl_block_get_stats(fd, &stats), expected, "Failed to get stats");
+    EXPECT_EQ(stats.requests, 2 * blocks, "");
+    EXPECT_EQ(stats.ops + stats.merged, stats.requests, "");
+    EXPECT_EQ(stats.completed, stats.ops, "");
+    EXPECT_EQ(stats.queue_depth, 0u, "");
+    EXPECT_GE(stats.max_queue_depth, 1u, "");
+
+    // Every completed operation lands in one bucket of each histogram
+    block_latency_t latency;
+    expected = sizeof(latency);
+    ASSERT_EQ(ioctl_block_get_latency(fd, &latency), expected, "Failed to get latency");
+    uint64_t queued = 0, device = 0, trimmed = 0;
+    for (size_t i = 0; i < BLOCK_LATENCY_BUCKETS; i++) {
+        queued += latency.read.queued[i] + latency.write.queued[i];
+        device += latency.read.device[i] + latency.write.device[i];
+        trimmed += latency.trim.device[i];
+    }
+    EXPECT_EQ(queued, stats.completed, "");
+    EXPECT_EQ(device, stats.completed, "");
+    EXPECT_EQ(trimmed, 0u, "");
+
+    ASSERT_TRUE(close_vmo_helper(client, &obj, txnid), "");
+    block_fifo_release_client(client);
+    ASSERT_GE(ioctl_ramdisk_unlink(fd), 0, "Could not unlink ramdisk device");
+    ASSERT_EQ(close(fd), 0, "");
+    END_TEST;
+}
+
+bool ramdisk_test_fifo_vectored(void) {
+    BEGIN_TEST;
+    const size_t kBlockSize = 512;
+    int fd = get_ramdisk("ramdisk-test-fifo", kBlockSize, 1 << 18);
+    mx_handle_t fifo;
+    ssize_t expected = sizeof(fifo);
+    ASSERT_EQ(ioctl_block_get_fifos(fd, &fifo), expected, "Failed to get FIFO");
+    txnid_t txnid;
+    expected = sizeof(txnid);
+    ASSERT_EQ(ioctl_block_alloc_txn(fd, &txnid), expected, "Failed to allocate txn");
+    fifo_client_t* client;
+    ASSERT_EQ(block_fifo_create_client(fifo, &client), NO_ERROR, "");
+
+    test_vmo_object_t objs[2];
+    for (size_t i = 0; i < countof(objs); i++) {
+        ASSERT_TRUE(create_vmo_helper(fd, &objs[i], kBlockSize), "");
+    }
+    test_vmo_object_t table;
+    table.vmo_size = PAGE_SIZE;
+    ASSERT_EQ(mx_vmo_create(table.vmo_size, 0, &table.vmo), NO_ERROR, "");
+    mx_handle_t xfer_vmo;
+    ASSERT_EQ(mx_handle_duplicate(table.vmo, MX_RIGHT_SAME_RIGHTS, &xfer_vmo), NO_ERROR, "");
+    expected = sizeof(vmoid_t);
+    ASSERT_EQ(ioctl_block_attach_vmo(fd, &xfer_vmo, &table.vmoid), expected,
+              "Failed to attach vmo");
+
+    // Scatter every block of both VMOs across the disk, in a single request
+    block_fifo_vec_t vecs[10];
+    size_t count = 0;
+    for (size_t i = 0; i < countof(objs); i++) {
+        for (size_t b = 0; b < objs[i].vmo_size / kBlockSize; b++) {
+            vecs[count].vmoid      = objs[i].vmoid;
+            vecs[count].length     = kBlockSize;
+            vecs[count].vmo_offset = b * kBlockSize;
+            vecs[count].dev_offset = (i * 1000 + b * 3) * kBlockSize;
+            count++;
+        }
+    }
+    size_t actual;
+    ASSERT_EQ(mx_vmo_write(table.vmo, vecs, 0, count * sizeof(vecs[0]), &actual), NO_ERROR, "");
+
+    block_fifo_request_t request;
+    request.txnid      = txnid;
+    request.vmoid      = table.vmoid;
+    request.opcode     = BLOCKIO_WRITEV;
+    request.length     = count;
+    request.vmo_offset = 0;
+    request.dev_offset = 0;
+    ASSERT_EQ(block_fifo_txn(client, &request, 1), NO_ERROR, "");
+
+    // Gather it all back into emptied VMOs
+    AllocChecker ac;
+    mxtl::unique_ptr<uint8_t[]> out(new (&ac) uint8_t[objs[0].vmo_size + objs[1].vmo_size]());
+    ASSERT_TRUE(ac.check(), "");
+    for (size_t i = 0; i < countof(objs); i++) {
+        ASSERT_EQ(mx_vmo_write(objs[i].vmo, out.get(), 0, objs[i].vmo_size, &actual), NO_ERROR,
+                  "");
+    }
+    request.opcode = BLOCKIO_READV;
+    ASSERT_EQ(block_fifo_txn(client, &request, 1), NO_ERROR, "");
+    for (size_t i = 0; i < countof(objs); i++) {
+        ASSERT_EQ(mx_vmo_read(objs[i].vmo, out.get(), 0, objs[i].vmo_size, &actual), NO_ERROR,
+                  "");
+        ASSERT_EQ(memcmp(objs[i].buf.get(), out.get(), objs[i].vmo_size), 0,
+                  "Read data not equal to written data");
+    }
+
+    // One bad range fails the whole request
+    vecs[count - 1].vmoid = static_cast<vmoid_t>(objs[1].vmoid + 5);
+    ASSERT_EQ(mx_vmo_write(table.vmo, vecs, 0, count * sizeof(vecs[0]), &actual), NO_ERROR, "");
+    ASSERT_EQ(block_fifo_txn(client, &request, 1), ERR_IO, "");
+    request.length = BLOCK_FIFO_MAX_VECS + 1;
+    ASSERT_EQ(block_fifo_txn(client, &request, 1), ERR_INVALID_ARGS, "");
+
+    for (size_t i = 0; i < countof(objs); i++) {
+        ASSERT_TRUE(close_vmo_helper(client, &objs[i], txnid), "");
+    }
+    ASSERT_TRUE(close_vmo_helper(client, &table, txnid), "");
+    block_fifo_release_client(client);
+    ASSERT_GE(ioctl_ramdisk_unlink(fd), 0, "Could not unlink ramdisk device");
+    ASSERT_EQ(close(fd), 0, "");
+    END_TEST;
+}
+
+bool ramdisk_test_fifo_trim(void) {
+    BEGIN_TEST;
+    const size_t kBlockSize = 512;
+    int fd = get_ramdisk("ramdisk-test-fifo", kBlockSize, 1 << 18);
+    mx_handle_t fifo;
+    ssize_t expected = sizeof(fifo);
+    ASSERT_EQ(ioctl_block_get_fifos(fd, &fifo), expected, "Failed to get FIFO");
+    txnid_t txnid;
+    expected = sizeof(txnid);
+    ASSERT_EQ(ioctl_block_alloc_txn(fd, &txnid), expected, "Failed to allocate txn");
+    fifo_client_t* client;
+    ASSERT_EQ(block_fifo_create_client(fifo, &client), NO_ERROR, "");
+
+    // Large enough that a trim can cover whole pages of the ramdisk
+    test_vmo_object_t obj;
+    obj.vmo_size = 4 * PAGE_SIZE;
+    ASSERT_EQ(mx_vmo_create(obj.vmo_size, 0, &obj.vmo), NO_ERROR, "");
+    AllocChecker ac;
+    obj.buf.reset(new (&ac) uint8_t[obj.vmo_size]);
+    ASSERT_TRUE(ac.check(), "");
+    fill_random(obj.buf.get(), obj.vmo_size);
+    size_t actual;
+    ASSERT_EQ(mx_vmo_write(obj.vmo, obj.buf.get(), 0, obj.vmo_size, &actual), NO_ERROR, "");
+    mx_handle_t xfer_vmo;
+    ASSERT_EQ(mx_handle_duplicate(obj.vmo, MX_RIGHT_SAME_RIGHTS, &xfer_vmo), NO_ERROR, "");
+    expected = sizeof(vmoid_t);
+    ASSERT_EQ(ioctl_block_attach_vmo(fd, &xfer_vmo, &obj.vmoid), expected,
+              "Failed to attach vmo");
+
+    block_fifo_request_t request;
+    request.txnid      = txnid;
+    request.vmoid      = obj.vmoid;
+    request.opcode     = BLOCKIO_WRITE;
+    request.length     = static_cast<uint32_t>(obj.vmo_size);
+    request.vmo_offset = 0;
+    request.dev_offset = 0;
+    ASSERT_EQ(block_fifo_txn(client, &request, 1), NO_ERROR, "");
+
+    // Trim from partway through the first page to partway through the last
+    const size_t kTrimStart = 3 * kBlockSize;
+    const size_t kTrimEnd = obj.vmo_size - 5 * kBlockSize;
+    block_fifo_request_t trim;
+    trim.txnid      = txnid;
+    trim.vmoid      = 0; // Ignored
+    trim.opcode     = BLOCKIO_TRIM;
+    trim.length     = static_cast<uint32_t>(kTrimEnd - kTrimStart);
+    trim.vmo_offset = 0;
+    trim.dev_offset = kTrimStart;
+    ASSERT_EQ(block_fifo_txn(client, &trim, 1), NO_ERROR, "");
+    trim.length = 100;
+    ASSERT_EQ(block_fifo_txn(client, &trim, 1), ERR_INVALID_ARGS, "Unaligned trim");
+
+    // Trimmed blocks read back as zeros; the rest is untouched
+    mxtl::unique_ptr<uint8_t[]> out(new (&ac) uint8_t[obj.vmo_size]());
+    ASSERT_TRUE(ac.check(), "");
+    ASSERT_EQ(mx_vmo_write(obj.vmo, out.get(), 0, obj.vmo_size, &actual), NO_ERROR, "");
+    request.opcode = BLOCKIO_READ;
+    ASSERT_EQ(block_fifo_txn(client, &request, 1), NO_ERROR, "");
+    ASSERT_EQ(mx_vmo_read(obj.vmo, out.get(), 0, obj.vmo_size, &actual), NO_ERROR, "");
+    memset(&obj.buf[kTrimStart], 0, kTrimEnd - kTrimStart);
+    ASSERT_EQ(memcmp(obj.buf.get(), out.get(), obj.vmo_size), 0,
+              "Read data not equal to expected data");
+
+    ASSERT_TRUE(close_vmo_helper(client, &obj, txnid), "");
+    block_fifo_release_client(client);
+    ASSERT_GE(ioctl_ramdisk_unlink(fd), 0, "Could not unlink ramdisk device");
+    ASSERT_EQ(close(fd), 0, "");
+    END_TEST;
+}
+
+// Uses a second FIFO alongside the first, |fifo|.
+bool multiple_fifos_helper(int fd, mx_handle_t fifo, size_t kBlockSize) {
+    block_fifo_info_t info;
+    ssize_t expected = sizeof(info);
+    ASSERT_EQ(ioctl_block_add_fifo(fd, &info), expected, "Failed to add FIFO");
+    ASSERT_EQ(info.index, 1u, "");
+
+    txnid_t txnids[2];
+    expected = sizeof(txnid_t);
+    ASSERT_EQ(ioctl_block_alloc_txn(fd, &txnids[0]), expected, "Failed to allocate txn");
+    ASSERT_EQ(ioctl_block_alloc_fifo_txn(fd, &info.index, &txnids[1]), expected,
+              "Failed to allocate txn");
+    uint32_t bad_index = info.index + 1;
+    ASSERT_EQ(ioctl_block_alloc_fifo_txn(fd, &bad_index, &txnids[1]), ERR_INVALID_ARGS, "");
+    fifo_client_t* clients[2];
+    ASSERT_EQ(block_fifo_create_client(fifo, &clients[0]), NO_ERROR, "");
+    ASSERT_EQ(block_fifo_create_client(info.fifo, &clients[1]), NO_ERROR, "");
+
+    // VMOs may be used on either FIFO, but txns only on their own
+    test_vmo_object_t obj;
+    ASSERT_TRUE(create_vmo_helper(fd, &obj, kBlockSize), "");
+    ASSERT_TRUE(write_striped_vmo_helper(clients[1], &obj, 0, 1, txnids[1], kBlockSize), "");
+    ASSERT_TRUE(read_striped_vmo_helper(clients[0], &obj, 0, 1, txnids[0], kBlockSize), "");
+    block_fifo_request_t request;
+    request.txnid      = txnids[1];
+    request.vmoid      = obj.vmoid;
+    request.opcode     = BLOCKIO_READ;
+    request.length     = static_cast<uint32_t>(kBlockSize);
+    request.vmo_offset = 0;
+    request.dev_offset = 0;
+    ASSERT_EQ(block_fifo_txn(clients[0], &request, 1), ERR_IO, "Txn used on the wrong FIFO");
+    ASSERT_TRUE(close_vmo_helper(clients[0], &obj, txnids[0]), "");
+
+    block_fifo_release_client(clients[0]);
+    block_fifo_release_client(clients[1]);
+    return true;
+}
+
+bool ramdisk_test_fifo_multiple_fifos(void) {
+    BEGIN_TEST;
+    const size_t kBlockSize = 512;
+    int fd = get_ramdisk("ramdisk-test-fifo", kBlockSize, 1 << 18);
+    block_fifo_info_t info;
+    ASSERT_EQ(ioctl_block_add_fifo(fd, &info), ERR_BAD_STATE, "No FIFO server yet");
+    mx_handle_t fifo;
+    ssize_t expected = sizeof(fifo);
+    ASSERT_EQ(ioctl_block_get_fifos(fd, &fifo), expected, "Failed to get FIFO");
+    if (mx_system_get_num_cpus() == 1) {
+        // The ramdisk serves one FIFO per CPU
+        ASSERT_EQ(ioctl_block_add_fifo(fd, &info), ERR_NO_RESOURCES, "");
+    } else {
+        ASSERT_TRUE(multiple_fifos_helper(fd, fifo, kBlockSize), "");
+    }
+
+    // Closing the first FIFO stops the whole server
+    ASSERT_EQ(ioctl_block_fifo_close(fd), NO_ERROR, "Failed to close fifo");
+    ASSERT_EQ(ioctl_block_add_fifo(fd, &info), ERR_BAD_STATE, "");
+    ASSERT_GE(ioctl_ramdisk_unlink(fd), 0, "Could not unlink ramdisk device");
+    ASSERT_EQ(close(fd), 0, "");
+    END_TEST;
+}
+
 typedef struct {
     test_vmo_object_t* obj;
     size_t i;
@@ -840,9 +1188,14 @@ BEGIN_TEST_CASE(ramdisk_tests)
 RUN_TEST(ramdisk_test_simple)
 RUN_TEST(ramdisk_test_bad_requests)
 RUN_TEST(ramdisk_test_multiple)
+RUN_TEST(ramdisk_test_cache)
 RUN_TEST(ramdisk_test_fifo_no_op)
 RUN_TEST(ramdisk_test_fifo_basic)
 RUN_TEST(ramdisk_test_fifo_multiple_vmo)
+RUN_TEST(ramdisk_test_fifo_scheduling)
+RUN_TEST(ramdisk_test_fifo_vectored)
+RUN_TEST(ramdisk_test_fifo_trim)
+RUN_TEST(ramdisk_test_fifo_multiple_fifos)
 RUN_TEST(ramdisk_test_fifo_multiple_vmo_multithreaded)
 // TODO(smklein): Test ops across different vmos
 RUN_TEST(ramdisk_test_fifo_unclean_shutdown)